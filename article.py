@@ -25,6 +25,7 @@
 """
 
 from typing import (
+    Iterable,
     Iterator,
     Mapping,
     Optional,
@@ -39,11 +40,14 @@ from typing import (
 
 import json
 import uuid
+import logging
+import hashlib
 from datetime import datetime, timezone
 from collections import defaultdict
 
 from sqlalchemy.orm.query import Query as SqlQuery
-from sqlalchemy.sql.expression import func
+from sqlalchemy.sql.expression import func, tuple_
+from sqlalchemy.dialects.postgresql import insert as pg_insert
 
 from tokenizer import __version__ as tokenizer_version
 from tokenizer import correct_spaces
@@ -55,12 +59,22 @@ from reynir.incparser import IncrementalParser
 from reynir.simpletree import SimpleTree
 
 from db import Session, SessionContext, DataError, desc
-from db.models import Article as ArticleRow, Word, Root
+from db.models import (
+    Article as ArticleRow,
+    ArticleTopic,
+    Root,
+    SentenceParse,
+    Topic,
+    Word,
+)
+from db.rollups import KIND_ARTICLES, day_of, mark_dirty
 
+from compact import decode_tokens, is_compact, load_tokens
 from fetcher import Fetcher
 from tree import Tree
-from tree.util import TreeUtility, WordTuple, PgsList
+from tree.util import TreeUtility, ParseBudget, WordTuple, PgsList
 from settings import Settings, NoIndexWords
+from metrics import timed
 
 
 if TYPE_CHECKING:
@@ -72,12 +86,25 @@ if TYPE_CHECKING:
 # minutes to parse
 MAX_SENTENCE_TOKENS = 90
 
+# Maximum number of rows in each multi-row insert into the words table
+_WORD_INSERT_BATCH = 1000
+
 
 def _now() -> datetime:
     """Return the current time in UTC"""
     return datetime.now(timezone.utc)
 
 
+def _fingerprint(version: str, tokens: Iterable[Tok]) -> str:
+    """Return a fingerprint of a sentence's token sequence for
+    the given parser version, as a hex digest"""
+    h = hashlib.md5(version.encode("utf-8"))
+    for t in tokens:
+        s = "\x1f{0}\x1e{1}\x1e{2!r}".format(t.kind, t.txt, t.val)
+        h.update(s.encode("utf-8"))
+    return h.hexdigest()
+
+
 class Article:
 
     """An Article represents a new article typically scraped from a web site,
@@ -181,15 +208,21 @@ class Article:
 
     @classmethod
     def _init_from_scrape(
-        cls, url: Optional[str], enclosing_session: Optional[Session] = None
+        cls,
+        url: Optional[str],
+        enclosing_session: Optional[Session] = None,
+        html_doc: Optional[str] = None,
     ) -> Optional["Article"]:
-        """Scrape an article from its URL"""
+        """Scrape an article from its URL, or from its already fetched HTML"""
         if url is None:
             return None
         a = cls(url=url)
         with SessionContext(enclosing_session) as session:
             # Obtain a helper corresponding to the URL
-            html, metadata, helper = Fetcher.fetch_url_html(url, session)
+            if html_doc is None:
+                html, metadata, helper = Fetcher.fetch_url_html(url, session)
+            else:
+                html, metadata, helper = Fetcher.parse_html(url, html_doc, session)
             if html is None:
                 return a
             a._html = html
@@ -222,12 +255,16 @@ class Article:
 
     @classmethod
     def scrape_from_url(
-        cls, url: str, enclosing_session: Optional[Session] = None
+        cls,
+        url: str,
+        enclosing_session: Optional[Session] = None,
+        html_doc: Optional[str] = None,
     ) -> Optional["Article"]:
-        """Force fetch of an article, given its URL"""
+        """Force fetch of an article, given its URL. If its HTML has
+        already been fetched, it can be passed in html_doc."""
         with SessionContext(enclosing_session) as session:
             ar = session.query(ArticleRow).filter(ArticleRow.url == url).one_or_none()
-            a = cls._init_from_scrape(url, session)
+            a = cls._init_from_scrape(url, session, html_doc)
             if a is not None and ar is not None:
                 # This article already existed in the database,
                 # so note its UUID
@@ -255,7 +292,7 @@ class Article:
         """A generator yielding all person names in an article token stream"""
         if self._raw_tokens is None and self._tokens:
             # Lazy generation of the raw tokens from the JSON rep
-            self._raw_tokens = json.loads(self._tokens)
+            self._raw_tokens = load_tokens(self._tokens)
         if self._raw_tokens:
             for p in self._raw_tokens:
                 for sent in p:
@@ -268,7 +305,7 @@ class Article:
         """A generator for entity names from an article token stream"""
         if self._raw_tokens is None and self._tokens:
             # Lazy generation of the raw tokens from the JSON rep
-            self._raw_tokens = json.loads(self._tokens)
+            self._raw_tokens = load_tokens(self._tokens)
         if self._raw_tokens:
             for p in self._raw_tokens:
                 for sent in p:
@@ -281,7 +318,7 @@ class Article:
         """A generator for text from an article token stream"""
         if self._raw_tokens is None and self._tokens:
             # Lazy generation of the raw tokens from the JSON rep
-            self._raw_tokens = json.loads(self._tokens)
+            self._raw_tokens = load_tokens(self._tokens)
         if self._raw_tokens:
             for p in self._raw_tokens:
                 has_sent = False
@@ -302,6 +339,16 @@ class Article:
         s = " ".join(self.gen_text())
         return "\n".join(correct_spaces(p) for p in s.split("\n"))
 
+    def topics(self, session: Session) -> List[Dict[str, str]]:
+        """Return the names and identifiers of the topics of this article,
+        fetched in a single query"""
+        q = (
+            session.query(Topic.name, Topic.identifier)
+            .join(ArticleTopic, ArticleTopic.topic_id == Topic.id)
+            .filter(ArticleTopic.article_id == self._uuid)
+        )
+        return [dict(name=name, id=identifier) for name, identifier in q]
+
     def create_register(
         self, session: Session, all_names: bool = False
     ) -> "RegisterType":
@@ -321,13 +368,10 @@ class Article:
             add_entity_to_register(name, register, session, all_names=all_names)
         return register
 
-    def _store_words(self, session: Session) -> None:
-        """Store word stems"""
-        assert session is not None
-        # Delete previously stored words for this article
-        w = cast(Any, Word).table()
-        session.execute(w.delete().where(Word.article_id == self._uuid))
-        # Index the words by storing them in the words table
+    def _indexable_words(self) -> Dict[Tuple[str, str], int]:
+        """Return the word stems of the article to be stored in the
+        words table, with their counts, indexed by (stem, cat)"""
+        result: Dict[Tuple[str, str], int] = dict()
         if self._words:
             for word, cnt in self._words.items():
                 if word.cat not in NoIndexWords.CATEGORIES_TO_INDEX:
@@ -340,9 +384,99 @@ class Article:
                     # Shield the database from too long words
                     continue
                 # Interesting word: let's index it
-                w = Word(article_id=self._uuid, stem=word.stem, cat=word.cat, cnt=cnt)
-                session.add(w)
+                result[(word.stem, word.cat)] = cnt
+        return result
+
+    def _store_words(self, session: Session, new: bool = False) -> None:
+        """Store word stems. If the article is new, there are no previously
+        stored words; otherwise the stored words are compared with the
+        current ones, and only the differences are written."""
+        assert session is not None
+        w = cast(Any, Word).table()
+        words = self._indexable_words()
+        if new:
+            existing: Dict[Tuple[str, str], int] = dict()
+            # Make sure the article row is in place for the foreign key
+            session.flush()
+        else:
+            existing = {
+                (stem, cat): cnt
+                for stem, cat, cnt in session.query(
+                    Word.stem, Word.cat, Word.cnt
+                ).filter(Word.article_id == self._uuid)
+            }
+        # Delete previously stored words that no longer occur in the article
+        obsolete = [key for key in existing if key not in words]
+        if len(obsolete) == len(existing) and obsolete:
+            session.execute(w.delete().where(w.c.article_id == self._uuid))
+        elif obsolete:
+            session.execute(
+                w.delete().where(
+                    (w.c.article_id == self._uuid)
+                    & tuple_(w.c.stem, w.c.cat).in_(obsolete)
+                )
+            )
+        # Insert new words and update changed counts, in multi-row statements
+        changed = [
+            dict(article_id=self._uuid, stem=stem, cat=cat, cnt=cnt)
+            for (stem, cat), cnt in words.items()
+            if existing.get((stem, cat)) != cnt
+        ]
+        for ix in range(0, len(changed), _WORD_INSERT_BATCH):
+            stmt = pg_insert(w).values(changed[ix : ix + _WORD_INSERT_BATCH])
+            if existing:
+                stmt = stmt.on_conflict_do_update(
+                    constraint="words_pkey", set_=dict(cnt=stmt.excluded.cnt)
+                )
+            session.execute(stmt)
+
+    @staticmethod
+    def _cached_parses(
+        session: Session, fingerprints: Iterable[str]
+    ) -> Dict[str, SentenceParse]:
+        """Look up cached sentence parses by fingerprint, in one query"""
+        fps = list(set(fingerprints))
+        if not fps:
+            return dict()
+        q = session.query(SentenceParse).filter(SentenceParse.fingerprint.in_(fps))
+        return {sp.fingerprint: sp for sp in q}
 
+    @staticmethod
+    def _new_parse(
+        fingerprint: str,
+        version: str,
+        tree: str,
+        token_dicts: List[TokenDict],
+        words: Dict[WordTuple, int],
+        ambiguity: Optional[float],
+    ) -> SentenceParse:
+        """Create a sentence parse cache entry"""
+        return SentenceParse(
+            fingerprint=fingerprint,
+            parser_version=version,
+            tree=tree,
+            tokens=json.dumps(token_dicts, separators=(",", ":"), ensure_ascii=False),
+            words=json.dumps(
+                [[wt.stem, wt.cat, cnt] for wt, cnt in words.items()],
+                ensure_ascii=False,
+            ),
+            ambiguity=ambiguity,
+            timestamp=_now(),
+        )
+
+    @classmethod
+    def prune_sentence_cache(cls, enclosing_session: Optional[Session] = None) -> int:
+        """Delete cached sentence parses from other parser or tokenizer
+        versions than the current one, returning the number deleted"""
+        version = "{0}/{1}".format(cls.parser_version(), tokenizer_version)
+        with SessionContext(enclosing_session, commit=True) as session:
+            return (
+                session.query(SentenceParse)
+                .filter(SentenceParse.parser_version != version)
+                .delete(synchronize_session=False)
+            )
+
+    @timed("article_parse")
     def _parse(
         self, enclosing_session: Optional[Session] = None, verbose: bool = False
     ) -> None:
@@ -361,6 +495,7 @@ class Article:
 
             bp = self.get_parser()
             ip = IncrementalParser(bp, toklist, verbose=verbose)
+            version = "{0}/{1}".format(bp.version, tokenizer_version)
 
             # List of paragraphs containing a list of sentences containing
             # token lists for sentences in string dump format
@@ -375,10 +510,31 @@ class Article:
             words: Dict[WordTuple, int] = defaultdict(int)
             num_sent = 0
 
-            for p in ip.paragraphs():
+            # Collect the sentences by paragraph, and look up the cached
+            # parses of those that have been parsed before with the same
+            # tokens and parser version, e.g. in a republished article
+            paragraphs = [list(p.sentences()) for p in ip.paragraphs()]
+            cache: Dict[str, SentenceParse] = dict()
+            fingerprints: Dict[int, str] = dict()
+            if Settings.SENTENCE_CACHE:
+                for sent in (sent for p in paragraphs for sent in p):
+                    if len(sent) <= MAX_SENTENCE_TOKENS:
+                        fingerprints[id(sent)] = _fingerprint(version, sent.tokens)
+                cache = self._cached_parses(session, fingerprints.values())
+            new_parses: Dict[str, SentenceParse] = dict()
+            budget = ParseBudget()
+
+            # Statistics of the sentences taken from the cache,
+            # and the number of tokens in the freshly parsed sentences
+            num_cached = num_cached_tokens = num_cached_parsed = 0
+            cached_parsed_tokens = 0
+            cached_ambiguity = 0.0
+            parsed_tokens = 0
+
+            for p in paragraphs:
                 pgs.append([])
 
-                for sent in p.sentences():
+                for sent in p:
                     num_sent += 1
                     num_tokens = len(sent)
 
@@ -387,12 +543,38 @@ class Article:
                     # minutes to process
                     if Settings.DEBUG:
                         print(f"#{num_sent:03} ({num_tokens:3}) {sent.text}")
-                    if num_tokens <= MAX_SENTENCE_TOKENS and sent.parse():
+                    fp = fingerprints.get(id(sent))
+                    cached = cache.get(fp) if fp else None
+                    if cached is not None:
+                        # Reuse the cached parse of an identical sentence
+                        trees[num_sent] = cached.tree
+                        token_dicts = json.loads(cached.tokens)
+                        for stem, cat, cnt in json.loads(cached.words):
+                            words[WordTuple(stem=stem, cat=cat)] += cnt
+                        num_cached += 1
+                        num_cached_tokens += num_tokens
+                        if not cached.tree.startswith("E"):
+                            num_cached_parsed += 1
+                            cached_parsed_tokens += num_tokens
+                            cached_ambiguity += (cached.ambiguity or 1.0) * num_tokens
+                    elif num_tokens <= MAX_SENTENCE_TOKENS and not budget.admits(
+                        sent.tokens
+                    ):
+                        # Over the parse budget: record the sentence
+                        # with a distinct code, and no error token
+                        token_dicts = TreeUtility.dump_tokens(
+                            sent.tokens, None, error_index=num_tokens
+                        )
+                        trees[num_sent] = "{0}{1}".format(ParseBudget.CODE, num_tokens)
+                    elif num_tokens <= MAX_SENTENCE_TOKENS and budget.parse(sent):
                         assert sent.tree is not None
                         # Obtain a text representation of the parse tree
+                        sent_words: Dict[WordTuple, int] = defaultdict(int)
                         token_dicts = TreeUtility.dump_tokens(
-                            sent.tokens, sent.tree, words=words
+                            sent.tokens, sent.tree, words=sent_words
                         )
+                        for wt, cnt in sent_words.items():
+                            words[wt] += cnt
                         # Create a verbose text representation of
                         # the highest scoring parse tree
                         tree = ParseForestDumper.dump_forest(
@@ -403,6 +585,25 @@ class Article:
                         trees[num_sent] = "\n".join(
                             ["C{0}".format(sent.score), "L{0}".format(num_tokens), tree]
                         )
+                        if fp:
+                            # ip.ambiguity is the token-weighted mean of the
+                            # ambiguity factors of the parsed sentences, so we
+                            # can obtain the factor of this one from its change
+                            before = ip.ambiguity * parsed_tokens
+                            parsed_tokens += num_tokens
+                            ambiguity = (
+                                ip.ambiguity * parsed_tokens - before
+                            ) / num_tokens
+                            cache[fp] = new_parses[fp] = self._new_parse(
+                                fp,
+                                version,
+                                trees[num_sent],
+                                token_dicts,
+                                sent_words,
+                                ambiguity,
+                            )
+                        else:
+                            parsed_tokens += num_tokens
                     else:
                         # Error, sentence too long or no parse:
                         # add an error index entry for this sentence
@@ -416,17 +617,58 @@ class Article:
                             sent.tokens, None, error_index=eix
                         )
                         trees[num_sent] = "E{0}".format(eix)
+                        if fp:
+                            cache[fp] = new_parses[fp] = self._new_parse(
+                                fp, version, trees[num_sent], token_dicts, {}, None
+                            )
 
                     pgs[-1].append(token_dicts)
 
+            if new_parses:
+                # Add the new sentence parses to the cache, in fingerprint
+                # order, so that concurrent inserts by parsing processes
+                # take their row locks in the same order and can't deadlock
+                session.execute(
+                    pg_insert(SentenceParse.table())
+                    .values(
+                        [
+                            dict(
+                                fingerprint=sp.fingerprint,
+                                parser_version=sp.parser_version,
+                                tree=sp.tree,
+                                tokens=sp.tokens,
+                                words=sp.words,
+                                ambiguity=sp.ambiguity,
+                                timestamp=sp.timestamp,
+                            )
+                            for sp in sorted(
+                                new_parses.values(), key=lambda sp: sp.fingerprint
+                            )
+                        ]
+                    )
+                    .on_conflict_do_nothing(index_elements=["fingerprint"])
+                )
+
             # parse_time = ip.parse_time
+            if budget.num_skipped or budget.num_overtime:
+                logging.info(
+                    "Article {0}: {1} sentences over parse budget, "
+                    "{2} over parse time budget".format(
+                        self._url, budget.num_skipped, budget.num_overtime
+                    )
+                )
 
             self._parsed = _now()
-            self._parser_version = "{0}/{1}".format(bp.version, tokenizer_version)
-            self._num_tokens = ip.num_tokens
-            self._num_sentences = ip.num_sentences
-            self._num_parsed = ip.num_parsed
-            self._ambiguity = ip.ambiguity
+            self._parser_version = version
+            self._num_tokens = ip.num_tokens + num_cached_tokens
+            self._num_sentences = ip.num_sentences + num_cached
+            self._num_parsed = ip.num_parsed + num_cached_parsed
+            if cached_parsed_tokens:
+                self._ambiguity = (
+                    ip.ambiguity * parsed_tokens + cached_ambiguity
+                ) / (parsed_tokens + cached_parsed_tokens)
+            else:
+                self._ambiguity = ip.ambiguity
 
             # Make one big JSON string for the paragraphs, sentences and tokens
             self._raw_tokens = pgs or []
@@ -441,6 +683,7 @@ class Article:
                 "S{0}\n{1}\n".format(key, val) for key, val in trees.items()
             )
 
+    @timed("article_store")
     def store(self, enclosing_session: Optional[Session] = None) -> bool:
         """Store an article in the database, inserting it or updating"""
         with SessionContext(enclosing_session, commit=True) as session:
@@ -472,11 +715,19 @@ class Article:
                 )
                 # Delete any existing rows with the same URL
                 ar_table = cast(Any, ArticleRow).table()
-                session.execute(ar_table.delete().where(ArticleRow.url == self._url))
+                deleted = session.execute(
+                    ar_table.delete()
+                    .where(ArticleRow.url == self._url)
+                    .returning(ArticleRow.timestamp)
+                )
+                # The daily rollups of both the old and the new rows change
+                days = [day_of(ts) for (ts,) in deleted]
+                days.append(day_of(self._timestamp))
+                mark_dirty(session, KIND_ARTICLES, days)
                 # Add the new row with a fresh UUID
                 session.add(ar)
                 # Store the word stems occurring in the article
-                self._store_words(session)
+                self._store_words(session, new=True)
                 # Offload the new data from Python to PostgreSQL
                 session.flush()
                 return True
@@ -495,6 +746,17 @@ class Article:
             # UUID is immutable
             assert self._url
             ar.url = self._url
+            if (ar.root_id, ar.timestamp, ar.num_sentences, ar.num_parsed) != (
+                self._root_id,
+                self._timestamp,
+                self._num_sentences,
+                self._num_parsed,
+            ):
+                mark_dirty(
+                    session,
+                    KIND_ARTICLES,
+                    [day_of(ar.timestamp), day_of(self._timestamp)],
+                )
             ar.root_id = self._root_id
             ar.heading = self._heading
             ar.author = self._author
@@ -611,6 +873,10 @@ class Article:
 
     @property
     def tokens(self) -> Optional[str]:
+        """The tokens of the article in JSON string format"""
+        if is_compact(self._tokens):
+            assert self._tokens is not None
+            return decode_tokens(self._tokens)
         return self._tokens
 
     @property
@@ -618,7 +884,7 @@ class Article:
         """Count the tokens in the article and cache the result"""
         if self._num_tokens is None:
             if self._raw_tokens is None and self._tokens:
-                self._raw_tokens = json.loads(self._tokens)
+                self._raw_tokens = load_tokens(self._tokens)
             cnt = 0
             if self._raw_tokens:
                 for p in self._raw_tokens:
@@ -629,11 +895,31 @@ class Article:
 
     @staticmethod
     def token_stream(
-        limit: Optional[int] = None, skip_errors: bool = True
+        limit: Optional[int] = None,
+        skip_errors: bool = True,
+        *,
+        workers: Optional[int] = None,
+        ordered: bool = True,
+        checkpoint: Optional[str] = None,
     ) -> Iterator[Optional[TokenDict]]:
         """Generator of a token stream consisting of `limit` sentences
         (or less) from the most recently parsed articles. After
-        each sentence, None is yielded."""
+        each sentence, None is yielded. If workers (by default the
+        corpus_workers setting) is positive, or a checkpoint file is
+        given, the articles are read in parallel; see corpus.py."""
+        if workers is None:
+            workers = Settings.CORPUS_WORKERS
+        if workers > 0 or checkpoint:
+            from corpus import CorpusReader
+
+            reader = CorpusReader(
+                workers, ordered=ordered, skip_errors=skip_errors, checkpoint=checkpoint
+            )
+            for sent in reader.sentences(limit):
+                yield from sent
+                yield None  # End-of-sentence marker
+            return
+
         with SessionContext(commit=True, read_only=True) as session:
             q: SqlQuery[ArticleRow] = (
                 session.query(ArticleRow.url, ArticleRow.parsed, ArticleRow.tokens)
@@ -647,7 +933,7 @@ class Article:
                 assert a is not None
                 if not a.tokens:
                     continue
-                doc = cast(PgsList, json.loads(a.tokens))
+                doc = cast(PgsList, load_tokens(a.tokens))
                 for pg in doc:
                     for sent in pg:
                         if not sent:
@@ -669,10 +955,27 @@ class Article:
         limit: Optional[int] = None,
         skip: Optional[int] = None,
         skip_errors: bool = True,
+        *,
+        workers: Optional[int] = None,
+        ordered: bool = True,
+        checkpoint: Optional[str] = None,
     ) -> Iterator[List[TokenDict]]:
         """Generator of a sentence stream consisting of `limit`
         sentences (or less) from the most recently parsed articles.
-        Each sentence is a list of token dicts."""
+        Each sentence is a list of token dicts. If workers (by default
+        the corpus_workers setting) is positive, or a checkpoint file
+        is given, the articles are read in parallel; see corpus.py."""
+        if workers is None:
+            workers = Settings.CORPUS_WORKERS
+        if workers > 0 or checkpoint:
+            from corpus import CorpusReader
+
+            reader = CorpusReader(
+                workers, ordered=ordered, skip_errors=skip_errors, checkpoint=checkpoint
+            )
+            yield from reader.sentences(limit, skip)
+            return
+
         with SessionContext(commit=True, read_only=True) as session:
             q: SqlQuery[ArticleRow] = (
                 session.query(ArticleRow.url, ArticleRow.parsed, ArticleRow.tokens)
@@ -687,7 +990,7 @@ class Article:
                 assert a is not None
                 if not a.tokens:
                     continue
-                doc = cast(PgsList, json.loads(a.tokens))
+                doc = cast(PgsList, load_tokens(a.tokens))
                 for pg in doc:
                     for sent in pg:
                         if not sent:
@@ -0,0 +1,423 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Compact article storage module
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements a compact encoding of the parse trees and
+    token lists of articles, as stored in the tree and tokens columns
+    of the articles table.
+
+    All strings in an article (terminals, nonterminals, categories,
+    token texts and so on) are interned in a table and referred to by
+    varint indices. Each sentence is encoded as a separate record, located
+    through a directory at the start of the data, so that a reader can
+    decode a single sentence without decoding the rest of the article.
+    The data is then compressed with zlib as a whole and, since the columns
+    are text, armored in base64 after a prefix that identifies the encoding
+    and its version, followed by the length of the plain text value, so
+    that the database can estimate the size of an article without
+    decoding it. Values without the prefix are plain text, as stored
+    before the encoding was introduced, and are passed through unchanged.
+
+    Token lists are decoded directly to Python data structures by
+    load_tokens(), which readers of the tokens column use for both
+    encodings, rather than to JSON text that would then be parsed again.
+
+"""
+
+from typing import Any, Dict, List, Optional, Tuple
+
+import base64
+import json
+import struct
+import zlib
+
+
+# Prefix of compact values, including the encoding version. It is followed
+# by the length of the plain text value and a colon, then the data.
+PREFIX = "~c1:"
+
+# Kinds of compact values
+KIND_TREE = b"T"
+KIND_TOKENS = b"K"
+
+# Record codes for tree lines
+_LINE_EMPTY = 0
+_LINE_RAW = 1
+
+# Type tags for token values
+_TAG_NONE = 0
+_TAG_FALSE = 1
+_TAG_TRUE = 2
+_TAG_INT = 3
+_TAG_FLOAT = 4
+_TAG_STR = 5
+_TAG_LIST = 6
+_TAG_DICT = 7
+
+_DOUBLE = struct.Struct("<d")
+
+
+def is_compact(value: Optional[str]) -> bool:
+    """Return True if the column value is in the compact encoding"""
+    return value is not None and value.startswith(PREFIX)
+
+
+def plain_length(value: str) -> int:
+    """Return the length of the plain text value that a column value
+    encodes, without decoding it"""
+    if value.startswith(PREFIX):
+        return int(value[len(PREFIX) : value.index(":", len(PREFIX))])
+    return len(value)
+
+
+class _Writer:
+
+    """Accumulates the string table, directory and records of a value"""
+
+    def __init__(self, kind: bytes) -> None:
+        self.kind = kind
+        self.strings: Dict[str, int] = dict()
+        self.directory = bytearray()
+        self.records = bytearray()
+
+    def intern(self, s: str) -> int:
+        ix = self.strings.get(s)
+        if ix is None:
+            ix = self.strings[s] = len(self.strings)
+        return ix
+
+    @staticmethod
+    def varint(b: bytearray, n: int) -> None:
+        """Append an unsigned varint to the buffer"""
+        while n > 0x7F:
+            b.append((n & 0x7F) | 0x80)
+            n >>= 7
+        b.append(n)
+
+    @classmethod
+    def zigzag(cls, b: bytearray, n: int) -> None:
+        """Append a signed varint to the buffer"""
+        cls.varint(b, (n << 1) if n >= 0 else ((-n << 1) - 1))
+
+    def finish(self, plain_length: int) -> str:
+        """Return the armored, compressed value of a plain text
+        value of the given length"""
+        header = bytearray(self.kind)
+        encoded = [s.encode("utf-8") for s in self.strings]
+        self.varint(header, len(encoded))
+        for e in encoded:
+            self.varint(header, len(e))
+        data = b"".join((header, *encoded, self.directory, self.records))
+        armored = base64.b64encode(zlib.compress(data)).decode("ascii")
+        return f"{PREFIX}{plain_length}:{armored}"
+
+
+class _Reader:
+
+    """Decodes the header of a compact value, giving access to its strings,
+    which are decoded on demand, and its records"""
+
+    def __init__(self, value: str, kind: bytes) -> None:
+        assert is_compact(value)
+        start = value.index(":", len(PREFIX)) + 1
+        self.data = zlib.decompress(base64.b64decode(value[start:]))
+        if self.data[0:1] != kind:
+            raise ValueError("Compact value is of the wrong kind")
+        self.pos = 1
+        n = self.varint()
+        lengths = [self.varint() for _ in range(n)]
+        self._offsets: List[int] = []
+        for length in lengths:
+            self._offsets.append(self.pos)
+            self.pos += length
+        self._offsets.append(self.pos)
+        self._strings: Dict[int, str] = dict()
+
+    def varint(self) -> int:
+        """Read an unsigned varint"""
+        data = self.data
+        n = shift = 0
+        while True:
+            b = data[self.pos]
+            self.pos += 1
+            n |= (b & 0x7F) << shift
+            if b < 0x80:
+                return n
+            shift += 7
+
+    def zigzag(self) -> int:
+        """Read a signed varint"""
+        n = self.varint()
+        return (n >> 1) if not n & 1 else -((n + 1) >> 1)
+
+    def string(self, ix: int) -> str:
+        s = self._strings.get(ix)
+        if s is None:
+            s = self._strings[ix] = self.data[
+                self._offsets[ix] : self._offsets[ix + 1]
+            ].decode("utf-8")
+        return s
+
+
+# Parse trees
+
+
+def _encode_line(w: _Writer, b: bytearray, line: str) -> None:
+    if not line:
+        b.append(_LINE_EMPTY)
+        return
+    code, sep, rest = line.partition(" ")
+    n: Optional[int] = None
+    if code:
+        # Lines that start with a space have no code
+        try:
+            n = int(code[1:])
+        except ValueError:
+            pass
+    op = code[0:1]
+    if n is None or str(n) != code[1:] or not ("A" <= op <= "Z"):
+        # Not a regular line: store it verbatim
+        b.append(_LINE_RAW)
+        w.varint(b, w.intern(line))
+        return
+    b.append(ord(op))
+    w.zigzag(b, n)
+    if not sep:
+        w.varint(b, 0)
+    else:
+        # The fields are interned separately, and joined
+        # by spaces again when decoded
+        fields = rest.split(" ")
+        w.varint(b, len(fields))
+        for f in fields:
+            w.varint(b, w.intern(f))
+
+
+def _decode_line(r: _Reader) -> str:
+    op = r.data[r.pos]
+    r.pos += 1
+    if op == _LINE_EMPTY:
+        return ""
+    if op == _LINE_RAW:
+        return r.string(r.varint())
+    code = chr(op) + str(r.zigzag())
+    nfields = r.varint()
+    if not nfields:
+        return code
+    return code + " " + " ".join(r.string(r.varint()) for _ in range(nfields))
+
+
+def encode_tree(txt: str) -> str:
+    """Encode a tree in the text format stored by the scraper.
+    The lines before the first sentence, if any, and each sentence
+    (from its S line up to the next one) are stored as records."""
+    w = _Writer(KIND_TREE)
+    blocks: List[Tuple[int, List[str]]] = [(0, [])]
+    for line in txt.split("\n"):
+        if line.startswith("S"):
+            try:
+                blocks.append((int(line[1:]), []))
+            except ValueError:
+                pass
+        blocks[-1][1].append(line)
+    w.varint(w.directory, len(blocks) - 1)
+    for ix, (n, lines) in enumerate(blocks):
+        b = bytearray()
+        w.varint(b, len(lines))
+        for line in lines:
+            _encode_line(w, b, line)
+        if ix > 0:
+            w.zigzag(w.directory, n)
+        w.varint(w.directory, len(b))
+        w.records += b
+    return w.finish(len(txt))
+
+
+def _tree_directory(r: _Reader) -> List[Tuple[int, int, int]]:
+    """Return a list of (sentence index, record offset, record length)
+    tuples, with the lines before the first sentence having index -1"""
+    n = r.varint()
+    entries: List[Tuple[int, int]] = [(-1, r.varint())]
+    for _ in range(n):
+        ix = r.zigzag()
+        entries.append((ix, r.varint()))
+    result: List[Tuple[int, int, int]] = []
+    pos = r.pos
+    for ix, length in entries:
+        result.append((ix, pos, length))
+        pos += length
+    return result
+
+
+def _decode_block(r: _Reader, pos: int) -> List[str]:
+    r.pos = pos
+    return [_decode_line(r) for _ in range(r.varint())]
+
+
+def decode_tree(value: str) -> str:
+    """Decode a compact tree value to the text format"""
+    r = _Reader(value, KIND_TREE)
+    lines: List[str] = []
+    for _, pos, _ in _tree_directory(r):
+        lines.extend(_decode_block(r, pos))
+    return "\n".join(lines)
+
+
+def decode_tree_sentence(value: str, n: int) -> Optional[str]:
+    """Decode a single sentence, having index n, of a compact tree value
+    to the text format, or return None if there is no such sentence"""
+    r = _Reader(value, KIND_TREE)
+    for ix, pos, _ in _tree_directory(r):
+        if ix == n:
+            lines = _decode_block(r, pos)
+            if lines and not lines[-1]:
+                # Final line break of the tree
+                lines.pop()
+            return "\n".join(lines) + "\n"
+    return None
+
+
+# Token lists
+
+
+def _encode_value(w: _Writer, b: bytearray, v: Any) -> None:
+    if v is None:
+        b.append(_TAG_NONE)
+    elif v is True:
+        b.append(_TAG_TRUE)
+    elif v is False:
+        b.append(_TAG_FALSE)
+    elif isinstance(v, int):
+        b.append(_TAG_INT)
+        w.zigzag(b, v)
+    elif isinstance(v, float):
+        b.append(_TAG_FLOAT)
+        b += _DOUBLE.pack(v)
+    elif isinstance(v, str):
+        b.append(_TAG_STR)
+        w.varint(b, w.intern(v))
+    elif isinstance(v, (list, tuple)):
+        b.append(_TAG_LIST)
+        w.varint(b, len(v))
+        for item in v:
+            _encode_value(w, b, item)
+    elif isinstance(v, dict):
+        b.append(_TAG_DICT)
+        w.varint(b, len(v))
+        for key, item in v.items():
+            w.varint(b, w.intern(key))
+            _encode_value(w, b, item)
+    else:
+        raise TypeError("Unable to encode value of type {0}".format(type(v)))
+
+
+def _decode_value(r: _Reader) -> Any:
+    tag = r.data[r.pos]
+    r.pos += 1
+    if tag == _TAG_STR:
+        return r.string(r.varint())
+    if tag == _TAG_DICT:
+        return {r.string(r.varint()): _decode_value(r) for _ in range(r.varint())}
+    if tag == _TAG_LIST:
+        return [_decode_value(r) for _ in range(r.varint())]
+    if tag == _TAG_INT:
+        return r.zigzag()
+    if tag == _TAG_FLOAT:
+        pos = r.pos
+        r.pos += _DOUBLE.size
+        return _DOUBLE.unpack_from(r.data, pos)[0]
+    if tag == _TAG_NONE:
+        return None
+    if tag == _TAG_TRUE:
+        return True
+    if tag == _TAG_FALSE:
+        return False
+    raise ValueError("Invalid tag {0} in compact value".format(tag))
+
+
+def encode_tokens(txt: str) -> str:
+    """Encode a token list in the JSON format stored by the scraper,
+    i.e. a list of paragraphs containing lists of sentences
+    containing lists of token dicts"""
+    w = _Writer(KIND_TOKENS)
+    pgs = json.loads(txt)
+    w.varint(w.directory, len(pgs))
+    for pg in pgs:
+        w.varint(w.directory, len(pg))
+    for pg in pgs:
+        for sent in pg:
+            b = bytearray()
+            _encode_value(w, b, sent)
+            w.varint(w.directory, len(b))
+            w.records += b
+    return w.finish(len(txt))
+
+
+def _token_directory(r: _Reader) -> List[List[int]]:
+    """Return the record offsets of the sentences of each paragraph"""
+    counts = [r.varint() for _ in range(r.varint())]
+    lengths = [[r.varint() for _ in range(c)] for c in counts]
+    pos = r.pos
+    result: List[List[int]] = []
+    for pg in lengths:
+        offsets: List[int] = []
+        for length in pg:
+            offsets.append(pos)
+            pos += length
+        result.append(offsets)
+    return result
+
+
+def decode_tokens_list(value: str) -> List[List[List[Dict[str, Any]]]]:
+    """Decode a compact token list value to a list of paragraphs
+    containing lists of sentences containing lists of token dicts"""
+    r = _Reader(value, KIND_TOKENS)
+    offsets = _token_directory(r)
+    # The records follow the directory consecutively, in order
+    return [[_decode_value(r) for _ in pg] for pg in offsets]
+
+
+def load_tokens(value: str) -> List[List[List[Dict[str, Any]]]]:
+    """Return the paragraphs of an article's token list, as stored in
+    the tokens column in either encoding, i.e. lists of sentences
+    containing lists of token dicts"""
+    if is_compact(value):
+        return decode_tokens_list(value)
+    return json.loads(value)
+
+
+def decode_tokens(value: str) -> str:
+    """Decode a compact token list value to the JSON format"""
+    return json.dumps(
+        decode_tokens_list(value), separators=(",", ":"), ensure_ascii=False
+    )
+
+
+def decode_token_sentence(
+    value: str, pg: int, sent: int
+) -> Optional[List[Dict[str, Any]]]:
+    """Decode the token dicts of a single sentence, by paragraph and
+    sentence index (both 0-based), or return None if not found"""
+    r = _Reader(value, KIND_TOKENS)
+    offsets = _token_directory(r)
+    if not (0 <= pg < len(offsets) and 0 <= sent < len(offsets[pg])):
+        return None
+    r.pos = offsets[pg][sent]
+    return _decode_value(r)
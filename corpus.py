@@ -0,0 +1,270 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Parallel corpus reader
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements a parallel, streaming reader of the sentences
+    of parsed articles, for corpus tools that make passes over the whole
+    articles table. It is used by Article.sentence_stream() and
+    Article.token_stream() when they are given a number of workers.
+
+    The articles are divided into batches of consecutive articles in the
+    order of the serial streams, i.e. most recently parsed first, by their
+    (parsed, id) keys. Worker processes fetch the token lists of a batch,
+    decode them and send back its sentences, which the reader yields either
+    in order, giving the same stream as the serial reader, or in the order
+    in which the batches are finished. Only a few batches per worker are
+    in progress at a time, so a slow consumer does not fill up memory.
+
+    The reader can store its progress in a checkpoint file, in which case
+    a pass that is interrupted continues after the last sentence consumed
+    when it is started again with the same file. The batches are fixed
+    when the pass starts, and stored in the file along with the batches
+    that have been consumed. If the process is killed, rather than the
+    stream being closed, the sentences of the batch being consumed at
+    the time are yielded again.
+
+"""
+
+from typing import Any, Dict, Iterator, List, Optional, Set, Tuple, cast
+
+import json
+import multiprocessing as mp
+import os
+import queue
+from datetime import datetime
+
+from reynir.bintokenizer import TokenDict
+
+import compact
+from db import SessionContext
+
+
+# A sentence is a list of token dicts
+Sentence = List[TokenDict]
+# The (parsed, id) key of an article
+ArticleKey = Tuple[datetime, str]
+# A batch task: (index, upper key, lower key, skip_errors)
+BatchTask = Tuple[int, Optional[ArticleKey], Optional[ArticleKey], bool]
+
+# Select the key of every n-th article, in stream order,
+# as the upper bounds of the batches
+_BOUNDS = """
+    select parsed, id from (
+        select parsed, id, row_number() over (order by parsed desc, id desc) as rn
+        from articles where tokens is not null and parsed is not null
+    ) as t
+    where rn % :n = 1
+    order by rn
+    """
+
+
+def decode_sentences(tokens: str, skip_errors: bool) -> List[Sentence]:
+    """Return the non-empty sentences of an article's token list, as stored
+    in the tokens column, optionally leaving out sentences with errors"""
+    doc = compact.load_tokens(tokens)
+    return [
+        sent
+        for pg in doc
+        for sent in pg
+        if sent and not (skip_errors and any("err" in t for t in sent))
+    ]
+
+
+def read_batch(task: BatchTask) -> Tuple[int, List[Sentence]]:
+    """Fetch and decode the sentences of the articles whose keys are at most
+    the upper key (if given) and greater than the lower key (if given).
+    This runs in a worker process."""
+    ix, upper, lower, skip_errors = task
+    where = ["tokens is not null", "parsed is not null"]
+    params: Dict[str, Any] = dict()
+    # The comparisons of parsed alone allow the index on it to be used
+    if upper is not None:
+        where.append("parsed <= :up and (parsed, id) <= (:up, cast(:up_id as uuid))")
+        params.update(up=upper[0], up_id=upper[1])
+    if lower is not None:
+        where.append("parsed >= :lo and (parsed, id) > (:lo, cast(:lo_id as uuid))")
+        params.update(lo=lower[0], lo_id=lower[1])
+    sql = "select tokens from articles where {0} order by parsed desc, id desc"
+    with SessionContext(read_only=True) as session:
+        rows = cast(Any, session).execute(sql.format(" and ".join(where)), params)
+        tokens = [r[0] for r in rows]
+    return ix, [sent for t in tokens if t for sent in decode_sentences(t, skip_errors)]
+
+
+def _init_worker() -> None:
+    # Open new database connections rather than using the parent's
+    SessionContext.after_fork()
+
+
+class CorpusReader:
+
+    """Reads the sentences of parsed articles in parallel worker processes"""
+
+    # Number of articles in each batch
+    BATCH_SIZE = 200
+    # Number of batches in progress, or waiting to be consumed, per worker
+    BATCHES_PER_WORKER = 2
+
+    def __init__(
+        self,
+        workers: int,
+        *,
+        ordered: bool = True,
+        skip_errors: bool = True,
+        checkpoint: Optional[str] = None,
+        batch_size: Optional[int] = None,
+    ) -> None:
+        self._workers = max(1, workers)
+        self._ordered = ordered
+        self._skip_errors = skip_errors
+        self._checkpoint = checkpoint
+        self._batch_size = batch_size or self.BATCH_SIZE
+
+    def _bounds(self) -> List[ArticleKey]:
+        """Return the upper bounds of the batches, in stream order"""
+        with SessionContext(read_only=True) as session:
+            rows = cast(Any, session).execute(_BOUNDS, dict(n=self._batch_size))
+            return [(r[0], str(r[1])) for r in rows]
+
+    # The function that reads a batch in a worker process
+    _read = staticmethod(read_batch)
+
+    def _load_state(self) -> Optional[Dict[str, Any]]:
+        """Read the checkpoint file, if any"""
+        if not self._checkpoint or not os.path.exists(self._checkpoint):
+            return None
+        with open(self._checkpoint, "r", encoding="utf-8") as f:
+            state = json.load(f)
+        if (
+            state.get("batch_size") != self._batch_size
+            or state.get("skip_errors") != self._skip_errors
+        ):
+            raise ValueError(
+                f"Checkpoint {self._checkpoint} was stored with other options"
+            )
+        return state
+
+    def _store_state(self, state: Dict[str, Any]) -> None:
+        """Write the checkpoint file, replacing the previous one atomically"""
+        if not self._checkpoint:
+            return
+        tmp = self._checkpoint + ".tmp"
+        with open(tmp, "w", encoding="utf-8") as f:
+            json.dump(state, f)
+        os.replace(tmp, self._checkpoint)
+
+    def sentences(
+        self, limit: Optional[int] = None, skip: Optional[int] = None
+    ) -> Iterator[Sentence]:
+        """Generator of a sentence stream consisting of `limit` sentences
+        (or less) from the most recently parsed articles, after skipping
+        the first `skip` sentences. When resuming from a checkpoint, the
+        sentences yielded and skipped before count towards these."""
+        state = self._load_state()
+        if state is None:
+            state = dict(
+                batch_size=self._batch_size,
+                skip_errors=self._skip_errors,
+                bounds=[[k[0].isoformat(), k[1]] for k in self._bounds()],
+                done=[],
+                partial={},
+                sentences=0,
+                skipped=0,
+            )
+            self._store_state(state)
+        bounds: List[ArticleKey] = [
+            (datetime.fromisoformat(p), i) for p, i in state["bounds"]
+        ]
+        done: Set[int] = set(state["done"])
+        # The number of sentences of a batch consumed before it was finished
+        partial: Dict[int, int] = {int(k): n for k, n in state["partial"].items()}
+        todo = [ix for ix in range(len(bounds)) if ix not in done]
+
+        def save() -> None:
+            state["done"] = sorted(done)
+            state["partial"] = {str(k): n for k, n in partial.items()}
+            self._store_state(state)
+
+        def task(ix: int) -> BatchTask:
+            # The first batch also includes articles parsed after the pass
+            # started, and the last one has no lower bound
+            upper = bounds[ix] if ix > 0 else None
+            lower = bounds[ix + 1] if ix + 1 < len(bounds) else None
+            return ix, upper, lower, self._skip_errors
+
+        results: "queue.Queue[Tuple[int, Any]]" = queue.Queue()
+        finished: Dict[int, List[Sentence]] = dict()
+        tasks = iter(todo)
+        expected = iter(todo)
+        in_flight = 0
+
+        pool = mp.get_context("fork").Pool(self._workers, initializer=_init_worker)
+        try:
+
+            def submit() -> bool:
+                ix = next(tasks, None)
+                if ix is None:
+                    return False
+                pool.apply_async(
+                    self._read,
+                    (task(ix),),
+                    callback=results.put,
+                    error_callback=lambda e: results.put((-1, e)),
+                )
+                return True
+
+            def receive() -> Tuple[int, List[Sentence]]:
+                ix, batch = results.get()
+                if ix < 0:
+                    # A worker raised an exception
+                    raise batch
+                return ix, batch
+
+            while in_flight < self._workers * self.BATCHES_PER_WORKER and submit():
+                in_flight += 1
+            while in_flight:
+                if limit is not None and state["sentences"] >= limit:
+                    return
+                if self._ordered:
+                    ix = next(expected)
+                    while ix not in finished:
+                        k, batch = receive()
+                        finished[k] = batch
+                    batch = finished.pop(ix)
+                else:
+                    ix, batch = receive()
+                in_flight -= 1
+                if submit():
+                    in_flight += 1
+                for n in range(partial.get(ix, 0), len(batch)):
+                    if limit is not None and state["sentences"] >= limit:
+                        return
+                    partial[ix] = n + 1
+                    if skip is not None and state["skipped"] < skip:
+                        state["skipped"] += 1
+                        continue
+                    state["sentences"] += 1
+                    yield batch[n]
+                partial.pop(ix, None)
+                done.add(ix)
+                save()
+        finally:
+            pool.terminate()
+            save()
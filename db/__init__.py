@@ -77,11 +77,19 @@ class GreynirDB:
             Type[Session], sessionmaker(bind=self._engine)
         )
 
+    # Indexes that have been added to existing tables, which create_all()
+    # leaves unchanged, so that they are also created in existing databases
+    _ADDED_INDEXES = (
+        "create index if not exists ix_entities_timestamp on entities (timestamp)",
+    )
+
     def create_tables(self) -> None:
-        """Create all missing tables in the database"""
+        """Create all missing tables, and added indexes, in the database"""
         from .models import Base
 
         Base.metadata.create_all(self._engine)  # type: ignore
+        for sql in self._ADDED_INDEXES:
+            self.execute(sql)
 
     def execute(self, sql: str, **kwargs: Any) -> CursorResult:
         """Execute raw SQL directly on the engine"""
@@ -92,6 +100,12 @@ class GreynirDB:
         """Returns a freshly created Session instance from the sessionmaker"""
         return self._Session()
 
+    def dispose(self, close: bool = True) -> None:
+        """Discard the pooled connections of the engine, closing them
+        unless close is False, as in a forked child process whose parent
+        is still using them"""
+        self._engine.dispose(close=close)
+
 
 T = TypeVar("T")
 
@@ -124,6 +138,13 @@ class SessionContext:
         """Clean up the reference to the singleton GreynirDB instance"""
         cls._db = None
 
+    @classmethod
+    def after_fork(cls) -> None:
+        """Make a forked child process open its own database connections,
+        leaving those inherited from its parent process alone"""
+        if cls._db is not None:
+            cls._db.dispose(close=False)
+
     def __init__(
         self,
         session: Optional[Session] = None,
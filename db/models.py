@@ -26,9 +26,10 @@
 from __future__ import annotations
 
 from db import Session
+from settings import Settings
 from typing import Any, Optional, cast
 
-from datetime import datetime, timezone
+from datetime import date, datetime, timezone
 from sqlalchemy import text
 from sqlalchemy.ext.declarative import declarative_base
 from sqlalchemy.orm import relationship, backref
@@ -39,6 +40,7 @@ from sqlalchemy import (
     Float,
     Sequence,
     Boolean,
+    Date,
     DateTime,  # type: ignore # Imported for re-export
     UniqueConstraint,
     Index,
@@ -76,6 +78,62 @@ class DateTimeUtc(types.TypeDecorator):  # type: ignore
         return value.astimezone(timezone.utc)
 
 
+class CompactText(types.TypeDecorator):  # type: ignore
+
+    """A text column holding an article's parse trees or token lists,
+    which may be stored in the compact encoding of the compact module.
+    Compact trees are decoded transparently when read. Token lists are
+    returned as stored, in either encoding, since their readers decode
+    them straight to Python data via compact.load_tokens(). New values
+    are encoded if the compact_storage setting is enabled."""
+
+    impl = types.String
+    cache_ok = True
+
+    # The compact module, imported on first use, or False if unavailable
+    _compact: Any = None
+
+    def __init__(self, kind: str) -> None:
+        super().__init__()
+        assert kind in ("tree", "tokens")
+        self.kind = kind
+
+    @classmethod
+    def compact(cls) -> Any:
+        """Return the compact module, or None if it can't be imported.
+        The programs in the vectors subdirectory use the db package via
+        a symbolic link, without compact.py or the compact_storage
+        setting; they get compact values as stored."""
+        if cls._compact is None:
+            try:
+                import compact
+
+                cls._compact = compact
+            except ImportError:
+                cls._compact = False
+        return cls._compact or None
+
+    def process_bind_param(self, value: Optional[str], dialect: Any) -> Optional[str]:
+        if not value or not getattr(Settings, "COMPACT_STORAGE", False):
+            return value
+        compact = self.compact()
+        if compact is None or compact.is_compact(value):
+            return value
+        if self.kind == "tree":
+            return compact.encode_tree(value)
+        return compact.encode_tokens(value)
+
+    def process_result_value(
+        self, value: Optional[str], dialect: Any
+    ) -> Optional[str]:
+        if self.kind == "tokens" or not value:
+            return value
+        compact = self.compact()
+        if compact is None or not compact.is_compact(value):
+            return value
+        return compact.decode_tree(value)
+
+
 # Hacks to get properly typed SQLAlchemy column definitions
 def StringColumnRequired(n: Optional[int] = None, **kwargs: Any) -> str:
     return cast(str, Column(String(n), nullable=False, **kwargs))
@@ -173,6 +231,41 @@ class Root(Base):
         )
 
 
+class RootValidator(Base):
+    """Represents the HTTP cache validators last received for a root page
+    or feed, allowing the scraper to make conditional requests"""
+
+    __tablename__ = "rootvalidators"
+
+    # The URL of the root page or feed
+    url = StringColumnRequired(primary_key=True)
+
+    # Foreign key to the root
+    root_id = cast(
+        Optional[int],
+        Column(
+            Integer,
+            ForeignKey("roots.id", onupdate="CASCADE", ondelete="CASCADE"),
+            index=True,
+            nullable=True,
+        ),
+    )
+
+    # Value of the ETag response header, if any
+    etag = StringColumn(256)
+
+    # Value of the Last-Modified response header, if any
+    last_modified = StringColumn(64)
+
+    # Timestamp of the response that the validators were received with
+    timestamp = DateTimeColumn(nullable=False)
+
+    def __repr__(self):
+        return "RootValidator(url='{0}', etag='{1}', last_modified='{2}')".format(
+            self.url, self.etag, self.last_modified
+        )
+
+
 class Article(Base):
     """Represents an article from one of the roots, to be scraped
     or having already been scraped"""
@@ -237,9 +330,10 @@ class Article(Base):
     # The HTML obtained in the last scrape
     html = StringColumn()
     # The parse tree obtained in the last parse
-    tree = StringColumn()
-    # The tokens of the article in JSON string format
-    tokens = StringColumn()
+    tree = cast(Optional[str], Column(CompactText("tree")))
+    # The tokens of the article in JSON string format or in the compact
+    # encoding; use compact.load_tokens() to read them
+    tokens = cast(Optional[str], Column(CompactText("tokens")))
     # The article topic vector as an array of floats in JSON string format
     topic_vector = StringColumn()
 
@@ -384,8 +478,9 @@ class Entity(Base):
     # Authority of this fact, 1.0 = most authoritative, 0.0 = least authoritative
     authority = FloatColumn()
 
-    # Timestamp of this entry
-    timestamp = DateTimeColumn()
+    # Timestamp of this entry, indexed for the polling of new entity
+    # names (see nertokenizer.py, and GreynirDB.create_tables())
+    timestamp = DateTimeColumn(index=True)
 
     # The back-reference to the Article parent of this Entity
     article: RelationshipProperty[Article] = relationship(
@@ -496,6 +591,40 @@ class Word(Base):
         )
 
 
+class SentenceParse(Base):
+    """Represents the cached parse of a sentence, keyed by a fingerprint
+    of its token sequence and the parser/tokenizer version"""
+
+    __tablename__ = "sentenceparses"
+
+    # Hex digest of the parser version and the sentence tokens
+    fingerprint = StringColumnRequired(32, primary_key=True)
+
+    # Version of parser/grammar/config and tokenizer
+    parser_version = StringColumnRequired(64, index=True)
+
+    # The sentence parse tree in string dump format,
+    # or an error entry (E<error index>) if no parse was found
+    tree = StringColumnRequired()
+
+    # The token dicts of the sentence in JSON string format
+    tokens = StringColumnRequired()
+
+    # The words of the sentence, as a JSON list of [stem, cat, count]
+    words = StringColumnRequired()
+
+    # The ambiguity factor of the sentence parse
+    ambiguity = FloatColumn()
+
+    # Timestamp of the parse
+    timestamp = DateTimeColumn(nullable=False)
+
+    def __repr__(self):
+        return "SentenceParse(fingerprint='{0}', parser_version='{1}')".format(
+            self.fingerprint, self.parser_version
+        )
+
+
 class Topic(Base):
     """Represents a topic for an article"""
 
@@ -813,20 +942,23 @@ class QueryLog(Base):
 
     error = Column(String(256), nullable=True)
 
+    # The columns that are copied from the queries table
+    COPIED_COLUMNS = (
+        "timestamp",
+        "interpretations",
+        "question",
+        "bquestion",
+        "answer",
+        "voice",
+        "qtype",
+        "key",
+        "error",
+    )
+
     @staticmethod
     def from_Query(q: Query) -> QueryLog:
         """Create QueryLog object from Query object."""
-        return QueryLog(
-            timestamp=q.timestamp,
-            interpretations=q.interpretations,
-            question=q.question,
-            bquestion=q.bquestion,
-            answer=q.answer,
-            voice=q.voice,
-            qtype=q.qtype,
-            key=q.key,
-            error=q.error,
-        )
+        return QueryLog(**{c: getattr(q, c) for c in QueryLog.COPIED_COLUMNS})
 
     def __repr__(self):
         return "QueryLog(question='{0}', answer='{1}')".format(
@@ -859,3 +991,142 @@ class QueryClientData(Base):
         return "QueryClientData(client_id='{0}', created='{1}', modified='{2}', key='{3}', data='{4}')".format(
             self.client_id, self.created, self.modified, self.key, self.data
         )
+
+
+class RollupDirty(Base):
+    """Represents a day whose rollups need to be recomputed,
+    because articles or queries of that day have been written"""
+
+    __tablename__ = "rollupdirty"
+
+    __table_args__ = (PrimaryKeyConstraint("kind", "day", name="rollupdirty_pkey"),)
+
+    # 'a' for the article rollups, 'q' for the query rollups
+    kind = StringColumnRequired(1)
+
+    # The day (UTC)
+    day = cast(date, Column(Date, nullable=False))
+
+    def __repr__(self):
+        return "RollupDirty(kind='{0}', day='{1}')".format(self.kind, self.day)
+
+
+class ArticleRollup(Base):
+    """Represents the article, sentence and parse counts
+    of a scraper root on a single day"""
+
+    __tablename__ = "articlerollups"
+
+    __table_args__ = (
+        PrimaryKeyConstraint("day", "root_id", name="articlerollups_pkey"),
+    )
+
+    # The day (UTC) of the article timestamps
+    day = cast(date, Column(Date, nullable=False))
+
+    # Foreign key to the root
+    root_id = cast(
+        int,
+        Column(
+            Integer,
+            ForeignKey("roots.id", onupdate="CASCADE", ondelete="CASCADE"),
+            nullable=False,
+        ),
+    )
+
+    # Number of articles
+    articles = IntegerColumnRequired()
+    # Total number of sentences in the articles
+    sentences = IntegerColumnRequired()
+    # Total number of parsed sentences
+    parsed = IntegerColumnRequired()
+
+    def __repr__(self):
+        return "ArticleRollup(day='{0}', root_id='{1}', articles='{2}')".format(
+            self.day, self.root_id, self.articles
+        )
+
+
+class QueryRollup(Base):
+    """Represents the number of logged queries, and of distinct
+    clients sending them, on a single day"""
+
+    __tablename__ = "queryrollups"
+
+    # The day (UTC) of the query timestamps
+    day = cast(date, Column(Date, primary_key=True))
+
+    queries = IntegerColumnRequired()
+    clients = IntegerColumnRequired()
+
+    def __repr__(self):
+        return "QueryRollup(day='{0}', queries='{1}', clients='{2}')".format(
+            self.day, self.queries, self.clients
+        )
+
+
+class QueryTypeRollup(Base):
+    """Represents the number of queries of a type on a single day"""
+
+    __tablename__ = "querytyperollups"
+
+    __table_args__ = (
+        PrimaryKeyConstraint("day", "qtype", name="querytyperollups_pkey"),
+    )
+
+    day = cast(date, Column(Date, nullable=False))
+    qtype = StringColumnRequired(80)
+    cnt = IntegerColumnRequired()
+
+    def __repr__(self):
+        return "QueryTypeRollup(day='{0}', qtype='{1}', cnt='{2}')".format(
+            self.day, self.qtype, self.cnt
+        )
+
+
+class QueryClientRollup(Base):
+    """Represents the number of queries from a client type
+    and version on a single day"""
+
+    __tablename__ = "queryclientrollups"
+
+    __table_args__ = (
+        PrimaryKeyConstraint(
+            "day", "client_type", "client_version", name="queryclientrollups_pkey"
+        ),
+    )
+
+    day = cast(date, Column(Date, nullable=False))
+    client_type = StringColumnRequired(80)
+    # An empty string if the client version is not known
+    client_version = StringColumnRequired(10)
+    cnt = IntegerColumnRequired()
+
+    def __repr__(self):
+        return "QueryClientRollup(day='{0}', client_type='{1}', cnt='{2}')".format(
+            self.day, self.client_type, self.cnt
+        )
+
+
+class QuestionRollup(Base):
+    """Represents the number of times a question was asked, and answered
+    or not, on a single day"""
+
+    __tablename__ = "questionrollups"
+
+    __table_args__ = (
+        PrimaryKeyConstraint("day", "answered", "qhash", name="questionrollups_pkey"),
+    )
+
+    day = cast(date, Column(Date, nullable=False))
+    answered = cast(bool, Column(Boolean, nullable=False))
+    # MD5 hex digest of the question, since questions may be too long
+    # for an index entry
+    qhash = StringColumnRequired(32)
+    question = StringColumnRequired()
+    cnt = IntegerColumnRequired()
+
+    def __repr__(self):
+        return "QuestionRollup(day='{0}', question='{1}', cnt='{2}')".format(
+            self.day, self.question, self.cnt
+        )
@@ -0,0 +1,213 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Daily rollups of article and query statistics
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module maintains the daily rollup tables that the statistics
+    pages read, instead of aggregating over the articles and queries tables.
+
+    Code that writes articles or queries marks the days it touches as dirty,
+    which is a cheap insert into the rollupdirty table. refresh_rollups()
+    claims the dirty days and recomputes their rollups from the source
+    tables, all dirty days of a kind at once, in a single transaction.
+    It is called by the scraper when it finishes, and by the statistics
+    routes before they read the rollups. If another refresh is already
+    in progress, it returns at once and the existing rollups are served.
+
+    When a rollup table is empty, e.g. after it has been created, the
+    rollups of all days in history are backfilled. This can take a long
+    time, so only the scraper does it; until then the statistics pages
+    show the days that have been marked dirty since.
+
+"""
+
+from typing import Any, Dict, Iterable, List, Optional, cast
+
+import logging
+from datetime import date, datetime, timedelta, timezone
+
+from . import Session, SessionContext
+
+
+# Kinds of rollups
+KIND_ARTICLES = "a"
+KIND_QUERIES = "q"
+
+# Advisory lock key that serializes refreshes ('GRRU')
+_REFRESH_LOCK = 0x47525255
+
+_MARK = """
+    insert into rollupdirty (kind, day) select :kind, unnest(cast(:days as date[]))
+        on conflict do nothing
+    """
+
+# Recompute the rollups of the given days, within the timestamp range
+# [:start, :end) that contains them, so that the timestamp indices are used
+_ARTICLE_ROLLUPS = [
+    """
+    delete from articlerollups where day = any(:days)
+    """,
+    """
+    insert into articlerollups (day, root_id, articles, sentences, parsed)
+        select cast(date_trunc('day', timestamp) as date) as d, root_id,
+            count(*), coalesce(sum(num_sentences), 0), coalesce(sum(num_parsed), 0)
+        from articles
+        where timestamp >= :start and timestamp < :end and root_id is not null
+            and cast(date_trunc('day', timestamp) as date) = any(:days)
+        group by d, root_id
+    """,
+]
+
+_QUERY_ROLLUPS = [
+    """
+    delete from queryrollups where day = any(:days)
+    """,
+    """
+    insert into queryrollups (day, queries, clients)
+        select cast(date_trunc('day', timestamp) as date) as d,
+            count(*), count(distinct client_id)
+        from queries
+        where timestamp >= :start and timestamp < :end
+            and cast(date_trunc('day', timestamp) as date) = any(:days)
+        group by d
+    """,
+    """
+    delete from querytyperollups where day = any(:days)
+    """,
+    """
+    insert into querytyperollups (day, qtype, cnt)
+        select cast(date_trunc('day', timestamp) as date) as d, qtype, count(*)
+        from queries
+        where timestamp >= :start and timestamp < :end and qtype is not null
+            and cast(date_trunc('day', timestamp) as date) = any(:days)
+        group by d, qtype
+    """,
+    """
+    delete from queryclientrollups where day = any(:days)
+    """,
+    """
+    insert into queryclientrollups (day, client_type, client_version, cnt)
+        select cast(date_trunc('day', timestamp) as date) as d, client_type,
+            coalesce(client_version, '') as v, count(*)
+        from queries
+        where timestamp >= :start and timestamp < :end
+            and client_type is not null and client_type != ''
+            and cast(date_trunc('day', timestamp) as date) = any(:days)
+        group by d, client_type, v
+    """,
+    """
+    delete from questionrollups where day = any(:days)
+    """,
+    """
+    insert into questionrollups (day, answered, qhash, question, cnt)
+        select cast(date_trunc('day', timestamp) as date) as d,
+            answer is not null as a, md5(question) as h, min(question), count(*)
+        from queries
+        where timestamp >= :start and timestamp < :end and question is not null
+            and cast(date_trunc('day', timestamp) as date) = any(:days)
+        group by d, a, h
+    """,
+]
+
+_ROLLUPS = {KIND_ARTICLES: _ARTICLE_ROLLUPS, KIND_QUERIES: _QUERY_ROLLUPS}
+
+# Used to backfill the rollups of all days when a rollup table is empty
+_BACKFILL = {
+    KIND_ARTICLES: (
+        "articlerollups",
+        "select distinct cast(date_trunc('day', timestamp) as date) from articles"
+        " where timestamp is not null",
+    ),
+    KIND_QUERIES: (
+        "queryrollups",
+        "select distinct cast(date_trunc('day', timestamp) as date) from queries",
+    ),
+}
+
+
+def day_of(ts: Optional[datetime]) -> Optional[date]:
+    """Return the UTC day of a timestamp, treating naive timestamps
+    as local time, as DateTimeUtc columns do when storing them"""
+    if ts is None:
+        return None
+    return ts.astimezone(timezone.utc).date()
+
+
+def mark_dirty(session: Session, kind: str, days: Iterable[Optional[date]]) -> None:
+    """Mark the rollups of the given days as needing to be recomputed"""
+    dlist = sorted(set(d for d in days if d is not None))
+    if dlist:
+        cast(Any, session).execute(_MARK, dict(kind=kind, days=dlist))
+
+
+def _recompute(session: Session, kind: str, days: List[date]) -> None:
+    """Recompute the rollups of the given kind for the given days"""
+    days.sort()
+    midnight = datetime.min.time()
+    params = dict(
+        days=days,
+        start=datetime.combine(days[0], midnight),
+        end=datetime.combine(days[-1] + timedelta(days=1), midnight),
+    )
+    for sql in _ROLLUPS[kind]:
+        cast(Any, session).execute(sql, params)
+
+
+def refresh_rollups(
+    enclosing_session: Optional[Session] = None, *, backfill: bool = False
+) -> int:
+    """Recompute the rollups of all dirty days, returning the number of
+    days recomputed. If backfill is True and a rollup table is empty, all
+    days are backfilled. If another refresh holds the lock, nothing is
+    done and 0 is returned, rather than waiting for it."""
+    with SessionContext(session=enclosing_session, commit=True) as session:
+        s = cast(Any, session)
+        # Serialize refreshes, so that two of them never recompute the same day
+        if not s.execute(
+            "select pg_try_advisory_xact_lock(:key)", dict(key=_REFRESH_LOCK)
+        ).scalar():
+            return 0
+        for kind, (table, days_sql) in _BACKFILL.items():
+            if not backfill:
+                break
+            if s.execute(f"select not exists (select 1 from {table})").scalar():
+                days = [r[0] for r in s.execute(days_sql) if r[0] is not None]
+                mark_dirty(session, kind, days)
+        dirty: Dict[str, List[date]] = dict()
+        for kind, day in s.execute("delete from rollupdirty returning kind, day"):
+            dirty.setdefault(kind, []).append(day)
+        count = 0
+        for kind, days in dirty.items():
+            if kind in _ROLLUPS:
+                _recompute(session, kind, days)
+                count += len(days)
+        if count:
+            logging.info(f"Recomputed rollups for {count} days")
+        return count
+
+
+def ensure_rollups() -> None:
+    """Refresh the rollups of the dirty days before reading them, logging
+    rather than raising errors, so that a failed refresh leaves the
+    statistics stale instead of failing the request. Empty rollup tables
+    are not backfilled here, since that may outlast the request."""
+    try:
+        refresh_rollups()
+    except Exception as e:
+        logging.warning(f"Unable to refresh rollups: {e}")
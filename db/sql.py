@@ -25,16 +25,32 @@
 
 from typing import Any, Iterable, Optional, Tuple, Union, cast
 
-from datetime import datetime
+from datetime import date, datetime, time, timedelta, timezone
 
 from . import SessionContext, Session
 
 
 ArticleListItem = Tuple[str, str, datetime, str, str]
-ChartQueryItem = Tuple[str, int, int, int]
+ChartQueryItem = Tuple[date, str, int, int, int]
 RelatedWordsItem = Tuple[str, str, int]
 BestAuthorsItem = Tuple[str, int, int, int, float]
 QueryCountItem = Tuple[int, int]
+DailyQueryCountItem = Tuple[date, int, int]
+
+
+def rollup_days(start: datetime, end: datetime) -> Tuple[date, date]:
+    """Return the first and the last (exclusive) day of the daily rollups
+    that cover the time period [start, end). A period that starts or ends
+    within a day includes the whole day."""
+    if start.tzinfo is not None:
+        start = start.astimezone(timezone.utc)
+    if end.tzinfo is not None:
+        end = end.astimezone(timezone.utc)
+    first = start.date()
+    stop = end.date()
+    if end.time() != time.min:
+        stop += timedelta(days=1)
+    return first, stop
 
 
 class _BaseQuery:
@@ -95,19 +111,26 @@ class StatsQuery(_BaseQuery):
 
 
 class ChartsQuery(_BaseQuery):
-    """Statistics on article, sentence and parse count
-    for all sources for a given time period."""
+    """Daily statistics on article, sentence and parse count
+    for all sources for a given time period, from the article rollups.
+    Days without articles from a source are omitted."""
 
     _Q = """
-        select r.description AS name,
-            count(a.id) AS cnt,
-            coalesce(sum(a.num_sentences),0) as sent,
-            coalesce(sum(a.num_parsed),0) as parsed
+        select ar.day, r.description as name,
+            sum(ar.articles) as cnt,
+            sum(ar.sentences) as sent,
+            sum(ar.parsed) as parsed
             from roots as r
-            left join articles as a on r.id = a.root_id
-            and a.timestamp >= :start and a.timestamp < :end
+            join articlerollups as ar on r.id = ar.root_id
+            and ar.day >= :first and ar.day < :stop
             where r.visible and r.scrape
-            group by name
+            group by ar.day, name
+            order by ar.day, name
+        """
+
+    _Q_SOURCES = """
+        select distinct description as name from roots
+            where visible and scrape
             order by name
         """
 
@@ -115,10 +138,43 @@ class ChartsQuery(_BaseQuery):
     def period(
         cls, start: datetime, end: datetime, enclosing_session: Optional[Session] = None
     ) -> Iterable[ChartQueryItem]:
+        first, stop = rollup_days(start, end)
         r: Iterable[ChartQueryItem] = []
         with SessionContext(session=enclosing_session, read_only=True) as session:
             r = cast(
-                Iterable[ChartQueryItem], cls().execute(session, start=start, end=end)
+                Iterable[ChartQueryItem],
+                cls().execute(session, first=first, stop=stop),
+            )
+        return r
+
+    @classmethod
+    def sources(cls, enclosing_session: Optional[Session] = None) -> Iterable[str]:
+        """Return the names of all sources included in the statistics"""
+        with SessionContext(session=enclosing_session, read_only=True) as session:
+            return [r[0] for r in cls().execute_q(session, cls._Q_SOURCES)]
+
+
+class DailyQueryCountQuery(_BaseQuery):
+    """Daily statistics on the number of queries received and the number
+    of distinct clients sending them, over a given time period, from the
+    query rollups. Days without queries are omitted."""
+
+    _Q = """
+        select day, queries, clients from queryrollups
+            where day >= :first and day < :stop
+            order by day
+        """
+
+    @classmethod
+    def period(
+        cls, start: datetime, end: datetime, enclosing_session: Optional[Session] = None
+    ) -> Iterable[DailyQueryCountItem]:
+        first, stop = rollup_days(start, end)
+        r = cast(Iterable[DailyQueryCountItem], [])
+        with SessionContext(session=enclosing_session, read_only=True) as session:
+            r = cast(
+                Iterable[DailyQueryCountItem],
+                cls().execute(session, first=first, stop=stop),
             )
         return r
 
@@ -147,20 +203,20 @@ class QueryTypesQuery(_BaseQuery):
     """Stats on the most frequent query types over a given time period."""
 
     _Q = """
-        select count(queries.id), queries.qtype from queries
-            where queries.qtype is not NULL and
-            timestamp >= :start and timestamp < :end
-            group by queries.qtype
-            order by queries.count desc
+        select sum(cnt) as count, qtype from querytyperollups
+            where day >= :first and day < :stop
+            group by qtype
+            order by count desc
         """
 
     @classmethod
     def period(
         cls, start: datetime, end: datetime, enclosing_session: Optional[Session] = None
     ) -> Iterable[Any]:
+        first, stop = rollup_days(start, end)
         g: Iterable[Any] = []
         with SessionContext(session=enclosing_session, read_only=True) as session:
-            g = cls().execute(session, start=start, end=end)
+            g = cls().execute(session, first=first, stop=stop)
         return g
 
 
@@ -169,10 +225,9 @@ class QueryClientTypeQuery(_BaseQuery):
     android 1.2.1, etc.) over a given time period."""
 
     _Q = """
-        select client_type, client_version, count(client_type) as freq
-        from queries
-        where client_type is not NULL and client_type != '' and
-        timestamp >= :start and timestamp < :end
+        select client_type, client_version, sum(cnt) as freq
+        from queryclientrollups
+        where day >= :first and day < :stop
         group by client_type, client_version
         order by client_type
         """
@@ -181,9 +236,10 @@ class QueryClientTypeQuery(_BaseQuery):
     def period(
         cls, start: datetime, end: datetime, enclosing_session: Optional[Session] = None
     ) -> Iterable[Any]:
+        first, stop = rollup_days(start, end)
         g: Iterable[Any] = []
         with SessionContext(session=enclosing_session, read_only=True) as session:
-            g = cls().execute(session, start=start, end=end)
+            g = cls().execute(session, first=first, stop=stop)
         return g
 
 
@@ -192,10 +248,10 @@ class TopUnansweredQueriesQuery(_BaseQuery):
     over a given time period."""
 
     _Q = """
-        select question, count(question) as qoccurrence from queries
-            where answer is NULL and
-            timestamp >= :start and timestamp < :end
-            group by question
+        select min(question), sum(cnt) as qoccurrence from questionrollups
+            where not answered and
+            day >= :first and day < :stop
+            group by qhash
             order by qoccurrence desc
             limit :count
         """
@@ -210,9 +266,10 @@ class TopUnansweredQueriesQuery(_BaseQuery):
         count: int = _DEFAULT_COUNT,
         enclosing_session: Optional[Session] = None,
     ) -> Iterable[Any]:
+        first, stop = rollup_days(start, end)
         g: Iterable[Any] = []
         with SessionContext(session=enclosing_session, read_only=True) as session:
-            g = cls().execute(session, start=start, end=end, count=count)
+            g = cls().execute(session, first=first, stop=stop, count=count)
         return g
 
 
@@ -221,10 +278,10 @@ class TopAnsweredQueriesQuery(_BaseQuery):
     over a given time period."""
 
     _Q = """
-        select question, count(question) as qoccurrence from queries
-            where answer is not NULL and
-            timestamp >= :start and timestamp < :end
-            group by question
+        select min(question), sum(cnt) as qoccurrence from questionrollups
+            where answered and
+            day >= :first and day < :stop
+            group by qhash
             order by qoccurrence desc
             limit :count
         """
@@ -239,9 +296,10 @@ class TopAnsweredQueriesQuery(_BaseQuery):
         count: int = _DEFAULT_COUNT,
         enclosing_session: Optional[Session] = None,
     ) -> Iterable[Any]:
+        first, stop = rollup_days(start, end)
         g: Iterable[Any] = []
         with SessionContext(session=enclosing_session, read_only=True) as session:
-            g = cls().execute(session, start=start, end=end, count=count)
+            g = cls().execute(session, first=first, stop=stop, count=count)
         return g
 
 
@@ -21,19 +21,46 @@
 
     This module contains utility classes for web page fetching and tokenization.
 
+    The FetchEngine class performs HTTP fetches concurrently on a pool of
+    I/O threads, with a keep-alive connection pool per domain and per-domain
+    politeness limits, so that network waits don't occupy CPU-bound workers.
+
 """
 
-from typing import Any, Dict, Iterator, List, Optional, Set, Tuple, cast
+from typing import (
+    Any,
+    Callable,
+    Dict,
+    Iterable,
+    Iterator,
+    List,
+    NamedTuple,
+    Optional,
+    Set,
+    Tuple,
+    TypeVar,
+    cast,
+)
 from types import ModuleType
 
 import re
 import importlib
+import hashlib
 import logging
+import threading
+import time
+from array import array
+from bisect import bisect_left
+from contextlib import contextmanager
+from concurrent.futures import FIRST_COMPLETED, Future, ThreadPoolExecutor, wait
 
 import requests
+from requests.adapters import HTTPAdapter
 import urllib.parse as urlparse
 from urllib.error import HTTPError
 
+from sqlalchemy import text
+
 from bs4 import BeautifulSoup, NavigableString, Tag  # type: ignore
 
 from reynir import tokenize, Tok
@@ -49,6 +76,24 @@ _HTML_PARSER = "html.parser"
 # The user agent string to send in headers when fetching URLs
 _USER_AGENT = "GreynirScraper (https://greynir.is)"
 
+# Second-level labels under which country code top-level domains commonly
+# register domains, as in bbc.co.uk. This is not the full public suffix
+# list, which is not available here, but covers the usual cases.
+_SECOND_LEVEL_LABELS = frozenset(
+    ("ac", "co", "com", "edu", "gov", "gv", "ltd", "net", "or", "org", "plc")
+)
+
+
+class ConditionalFetch(NamedTuple):
+    """The result of a conditional fetch of an URL: the decoded document
+    (None if not modified or error), whether the server reported it
+    as not modified, and the validators to send next time"""
+
+    doc: Optional[str]
+    not_modified: bool
+    etag: Optional[str]
+    last_modified: Optional[str]
+
 
 class Fetcher:
     """The worker class that scrapes the known roots"""
@@ -213,36 +258,92 @@ class Fetcher:
         token_stream = tokenize(text)
         return recognize_entities(token_stream, enclosing_session=enclosing_session)
 
-    @classmethod
-    def raw_fetch_url(cls, url: str) -> Optional[str]:
-        """Low-level fetch of an URL, returning a decoded string"""
-        html_doc = None
+    @staticmethod
+    def _raw_get(
+        url: str,
+        session: Optional[requests.Session] = None,
+        headers: Optional[Dict[str, str]] = None,
+    ) -> Optional[requests.Response]:
+        """Low-level HTTP GET of an URL, returning the response
+        or None if error. If a requests session is given,
+        its connection pool is used."""
         try:
             # Normal external HTTP/HTTPS fetch
-            headers = {"User-Agent": _USER_AGENT}
-            r = requests.get(url, timeout=10, headers=headers)
-            # pylint: disable=no-member
-            if r.status_code == requests.codes.ok:
-                html_doc = r.text
-            else:
-                logging.warning(f"HTTP status {r.status_code} for URL {url}")
-
+            h = {"User-Agent": _USER_AGENT}
+            if headers:
+                h.update(headers)
+            return (session or requests).get(url, timeout=10, headers=h)
         except requests.exceptions.ConnectionError as e:
             logging.error(f"ConnectionError: {e} for URL {url}")
-            html_doc = None
         except requests.exceptions.ChunkedEncodingError as e:
             logging.error(f"ChunkedEncodingError: {e} for URL {url}")
-            html_doc = None
+        except requests.exceptions.Timeout as e:
+            logging.error(f"Timeout: {e} for URL {url}")
         except HTTPError as e:
             logging.error(f"HTTPError: {e} for URL {url}")
-            html_doc = None
         except UnicodeEncodeError as e:
             logging.error(f"Exception when opening URL {url}: {e}")
-            html_doc = None
+        return None
+
+    @classmethod
+    def raw_fetch_url(
+        cls, url: str, session: Optional[requests.Session] = None
+    ) -> Optional[str]:
+        """Low-level fetch of an URL, returning a decoded string.
+        If a requests session is given, its connection pool is used."""
+        r = cls._raw_get(url, session)
+        if r is None:
+            return None
+        # pylint: disable=no-member
+        if r.status_code != requests.codes.ok:
+            logging.warning(f"HTTP status {r.status_code} for URL {url}")
+            return None
+        try:
+            return r.text
+        except UnicodeDecodeError as e:
+            logging.error(f"Exception when decoding HTML of {url}: {e}")
+            return None
+
+    @classmethod
+    def conditional_fetch_url(
+        cls,
+        url: str,
+        etag: Optional[str] = None,
+        last_modified: Optional[str] = None,
+        session: Optional[requests.Session] = None,
+    ) -> "ConditionalFetch":
+        """Fetch an URL with a conditional GET, using the validators
+        (ETag and Last-Modified values) from a previous response, if any.
+        If the server reports that the document has not been modified,
+        the result has not_modified set and no document."""
+        headers: Dict[str, str] = dict()
+        if etag:
+            headers["If-None-Match"] = etag
+        if last_modified:
+            headers["If-Modified-Since"] = last_modified
+        r = cls._raw_get(url, session, headers)
+        if r is None:
+            return ConditionalFetch(None, False, etag, last_modified)
+        # pylint: disable=no-member
+        if r.status_code == requests.codes.not_modified:
+            # Keep the old validators unless the server sent new ones
+            return ConditionalFetch(
+                None,
+                True,
+                r.headers.get("ETag", etag),
+                r.headers.get("Last-Modified", last_modified),
+            )
+        if r.status_code != requests.codes.ok:
+            logging.warning(f"HTTP status {r.status_code} for URL {url}")
+            return ConditionalFetch(None, False, etag, last_modified)
+        try:
+            doc = r.text
         except UnicodeDecodeError as e:
             logging.error(f"Exception when decoding HTML of {url}: {e}")
-            html_doc = None
-        return html_doc
+            return ConditionalFetch(None, False, etag, last_modified)
+        return ConditionalFetch(
+            doc, False, r.headers.get("ETag"), r.headers.get("Last-Modified")
+        )
 
     @classmethod
     def _get_helper(cls, root: Root) -> Optional[ModuleType]:
@@ -462,8 +563,6 @@ class Fetcher:
         """Fetch a URL using the scraping mechanism, returning
         a tuple (html, metadata, helper) or None if error"""
 
-        html_doc, metadata, helper = None, None, None
-
         with SessionContext(enclosing_session) as session:
             html_doc: Optional[str] = None
             helper = cls.helper_for(session, url)
@@ -477,13 +576,234 @@ class Fetcher:
             if not html_doc:
                 return (None, None, None)
 
+            return cls.parse_html(url, html_doc, session)
+
+    @classmethod
+    def parse_html(
+        cls, url: str, html_doc: str, enclosing_session: Optional[Session] = None
+    ) -> Tuple[Optional[str], Any, Optional[ModuleType]]:
+        """Parse already fetched HTML using the scraping mechanism,
+        returning a tuple (html, metadata, helper) or None if error"""
+
+        with SessionContext(enclosing_session) as session:
+            helper = cls.helper_for(session, url)
+
             # Parse the HTML
             soup = Fetcher.make_soup(html_doc, helper)
             if soup is None:
-                logging.warning(f"Fetcher.fetch_url_html({url}): No soup")
+                logging.warning(f"Fetcher.parse_html({url}): No soup")
                 return (None, None, None)
 
             # Obtain the metadata from the resulting soup
             metadata = cast(Any, helper).get_metadata(soup) if helper else None
 
         return (html_doc, metadata, helper)
+
+
+_T = TypeVar("_T")
+
+
+class _DomainLimit:
+    """Politeness limits for fetching from a single domain"""
+
+    def __init__(self, concurrency: int) -> None:
+        self.semaphore = threading.BoundedSemaphore(concurrency)
+        self.lock = threading.Lock()
+        # Earliest time at which the next fetch may start
+        self.next_start = 0.0
+
+
+class FetchEngine:
+    """Concurrent HTTP fetching on a pool of I/O threads. Each domain gets
+    its own keep-alive connection pool (a requests.Session), at most
+    domain_concurrency concurrent fetches, and fetches that start at least
+    domain_delay seconds apart. Use it as a context manager."""
+
+    def __init__(
+        self,
+        concurrency: int = 32,
+        domain_concurrency: int = 4,
+        domain_delay: float = 0.25,
+    ) -> None:
+        self._concurrency = max(1, concurrency)
+        self._domain_concurrency = max(1, domain_concurrency)
+        self._domain_delay = domain_delay
+        self._pool = ThreadPoolExecutor(
+            max_workers=self._concurrency, thread_name_prefix="fetch"
+        )
+        self._lock = threading.Lock()
+        self._sessions: Dict[str, requests.Session] = dict()
+        self._limits: Dict[str, _DomainLimit] = dict()
+
+    def __enter__(self) -> "FetchEngine":
+        return self
+
+    def __exit__(self, *args: Any) -> None:
+        self.close()
+
+    def close(self) -> None:
+        """Shut down the thread pool and close all connections"""
+        self._pool.shutdown(wait=True)
+        with self._lock:
+            for session in self._sessions.values():
+                session.close()
+            self._sessions.clear()
+
+    @staticmethod
+    def domain_of(url: str) -> str:
+        """Return the root domain of a URL, i.e. www.ruv.is -> ruv.is,
+        and www.bbc.co.uk -> bbc.co.uk. Registries with second-level
+        labels other than those in _SECOND_LEVEL_LABELS are not known,
+        so all sites under such a registry share a single domain."""
+        labels = (urlparse.urlsplit(url).hostname or "").split(".")
+        n = 2
+        if len(labels) > 2 and len(labels[-1]) == 2:
+            if labels[-2] in _SECOND_LEVEL_LABELS:
+                n = 3
+        return ".".join(labels[-n:])
+
+    def _domain(self, domain: str) -> Tuple[requests.Session, _DomainLimit]:
+        """Return the session and the politeness limits for a domain"""
+        with self._lock:
+            session = self._sessions.get(domain)
+            if session is None:
+                session = requests.Session()
+                session.headers["User-Agent"] = _USER_AGENT
+                adapter = HTTPAdapter(
+                    pool_connections=1, pool_maxsize=self._domain_concurrency
+                )
+                session.mount("http://", adapter)
+                session.mount("https://", adapter)
+                self._sessions[domain] = session
+                self._limits[domain] = _DomainLimit(self._domain_concurrency)
+            return session, self._limits[domain]
+
+    @contextmanager
+    def _polite(self, domain: str) -> Iterator[requests.Session]:
+        """Context manager that observes the politeness limits of a domain
+        while fetching from it, yielding the domain's requests session"""
+        session, limit = self._domain(domain)
+        with limit.semaphore:
+            if self._domain_delay > 0.0:
+                with limit.lock:
+                    now = time.monotonic()
+                    start = max(now, limit.next_start)
+                    limit.next_start = start + self._domain_delay
+                if start > now:
+                    time.sleep(start - now)
+            yield session
+
+    def fetch(
+        self,
+        url: str,
+        domain: Optional[str] = None,
+        fetch_func: Optional[Callable[[str], Optional[str]]] = None,
+    ) -> Optional[str]:
+        """Fetch a URL while observing the politeness limits of its domain,
+        returning the decoded document or None if error. If fetch_func
+        is given (typically a scrape helper's fetch_url), it is called
+        instead of a straight HTTP fetch."""
+        with self._polite(domain or self.domain_of(url)) as session:
+            if fetch_func is not None:
+                try:
+                    return fetch_func(url)
+                except Exception as e:
+                    logging.error(f"Exception when fetching URL {url}: {e!r}")
+                    return None
+            return Fetcher.raw_fetch_url(url, session)
+
+    def fetch_conditional(
+        self,
+        url: str,
+        domain: Optional[str] = None,
+        etag: Optional[str] = None,
+        last_modified: Optional[str] = None,
+    ) -> ConditionalFetch:
+        """Do a conditional fetch of a URL (see Fetcher.conditional_fetch_url)
+        while observing the politeness limits of its domain"""
+        with self._polite(domain or self.domain_of(url)) as session:
+            return Fetcher.conditional_fetch_url(url, etag, last_modified, session)
+
+    def submit(self, func: Callable[..., _T], *args: Any) -> "Future[_T]":
+        """Run a function, typically one that calls fetch(), on the I/O pool"""
+        return self._pool.submit(func, *args)
+
+    def fetch_all(
+        self,
+        items: Iterable[_T],
+        fetch_item: Callable[[_T], Optional[str]],
+    ) -> Iterator[Tuple[_T, Optional[str]]]:
+        """Fetch documents for the given items concurrently, yielding
+        (item, document) tuples in order of completion. The items are
+        consumed lazily, keeping a bounded number of fetches in flight."""
+
+        def task(item: _T) -> Tuple[_T, Optional[str]]:
+            return item, fetch_item(item)
+
+        max_pending = 2 * self._concurrency
+        pending: Set["Future[Tuple[_T, Optional[str]]]"] = set()
+        for item in items:
+            pending.add(self._pool.submit(task, item))
+            if len(pending) >= max_pending:
+                done, pending = wait(pending, return_when=FIRST_COMPLETED)
+                for f in done:
+                    yield f.result()
+        while pending:
+            done, pending = wait(pending, return_when=FIRST_COMPLETED)
+            for f in done:
+                yield f.result()
+
+
+class KnownUrls:
+    """A compact membership structure for the URLs already in the articles
+    table, loaded with a single query and held as a sorted array of 64-bit
+    URL hashes. A lookup is a binary search, with no database round-trip.
+    URLs added after loading are kept in a separate set. Hash collisions,
+    which would cause a new URL to be taken as known, are vanishingly rare
+    at 64 bits."""
+
+    # Compute the same 64-bit hash as url_hash() below, in PostgreSQL
+    _HASH_SQL = "('x' || substr(md5(url), 1, 16))::bit(64)::bigint"
+
+    def __init__(self, hashes: Optional[Iterable[int]] = None) -> None:
+        self._hashes = array("q", sorted(hashes or ()))
+        self._added: Set[int] = set()
+        self._lock = threading.Lock()
+
+    @staticmethod
+    def url_hash(url: str) -> int:
+        """Return a signed 64-bit hash of a URL"""
+        digest = hashlib.md5(url.encode("utf-8")).digest()
+        return int.from_bytes(digest[:8], "big", signed=True)
+
+    @classmethod
+    def load(cls, enclosing_session: Optional[Session] = None) -> "KnownUrls":
+        """Load the hashes of all article URLs from the database"""
+        known = cls()
+        with SessionContext(enclosing_session, read_only=True) as session:
+            result = session.execute(
+                text(
+                    f"select {cls._HASH_SQL} from articles order by 1"
+                ).execution_options(stream_results=True)
+            )
+            # The hashes arrive sorted, so we build the array directly
+            known._hashes = array("q", (h for (h,) in result))
+        return known
+
+    def __len__(self) -> int:
+        return len(self._hashes) + len(self._added)
+
+    def __contains__(self, url: str) -> bool:
+        h = self.url_hash(url)
+        a = self._hashes
+        ix = bisect_left(a, h)
+        if ix < len(a) and a[ix] == h:
+            return True
+        with self._lock:
+            return h in self._added
+
+    def add(self, url: str) -> None:
+        """Mark a URL as known"""
+        h = self.url_hash(url)
+        with self._lock:
+            self._added.add(h)
@@ -56,6 +56,8 @@ from reynir.fastparser import Fast_Parser
 
 from settings import Settings, ConfigError
 from article import Article as ArticleProxy
+from ttscache import tts_cache
+from metrics import metrics
 from utility import (
     CONFIG_DIR,
     QUERIES_DIALOGUE_DIR,
@@ -206,6 +208,12 @@ except ConfigError as e:
     logging.error(f"Greynir did not start due to a configuration error: {e}")
     sys.exit(1)
 
+# Size the speech synthesis audio cache, now that the settings have been read
+tts_cache.configure(Settings.TTS_CACHE_SIZE * 1024 * 1024)
+
+# Record the metrics of the web server processes, if enabled
+metrics.start("web")
+
 if Settings.DEBUG:
     print(
         "\nStarting Greynir web app at {0} with debug={1}, "
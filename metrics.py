@@ -0,0 +1,393 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Latency and throughput metrics
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements lightweight instrumentation of the processing
+    stages of the web server and the batch jobs: histograms of the latency
+    of each stage, and counters of events such as cache hits. A stage can
+    be divided by component, such as a query module or an API host:
+
+        with timer("query_processor", module_name):
+            ...
+
+        @timed("article_parse")
+        def _parse(...):
+            ...
+
+    Nothing is recorded unless the metrics setting is enabled, in which
+    case the process calls start() with the name of its job ("web",
+    "scraper" or "processor") once the settings have been read. When
+    disabled, a timer costs no more than checking a flag.
+
+    Each process keeps its metrics in memory and stores a snapshot in
+    a file in the metrics directory every few seconds, and when it exits.
+    The /metrics route merges the snapshots of the running web server
+    processes and of the worker processes of the latest batch runs,
+    in the Prometheus text format. Batch jobs also print a summary per
+    stage when they finish.
+
+"""
+
+from typing import Any, Callable, Dict, Iterable, List, Optional, Tuple, TypeVar, cast
+
+import bisect
+import functools
+import json
+import logging
+import math
+import multiprocessing.util
+import os
+import threading
+import time
+from contextlib import nullcontext
+from pathlib import Path
+
+from settings import Settings
+
+
+# Upper bounds, in seconds, of the buckets of the latency histograms
+BUCKETS: Tuple[float, ...] = (
+    0.001,
+    0.0025,
+    0.005,
+    0.01,
+    0.025,
+    0.05,
+    0.1,
+    0.25,
+    0.5,
+    1.0,
+    2.5,
+    5.0,
+    10.0,
+    30.0,
+    60.0,
+    math.inf,
+)
+
+# A merged metric is identified by its job, its stage (or event) and its component
+Key = Tuple[str, str, str]
+
+F = TypeVar("F", bound=Callable[..., Any])
+
+# The timer returned when metrics are disabled
+_NULL_TIMER = nullcontext()
+
+
+class Histogram:
+
+    """A latency histogram with fixed buckets"""
+
+    __slots__ = ("counts", "sum")
+
+    def __init__(self) -> None:
+        self.counts = [0] * len(BUCKETS)
+        self.sum = 0.0
+
+    @property
+    def count(self) -> int:
+        return sum(self.counts)
+
+    def observe(self, seconds: float) -> None:
+        self.counts[bisect.bisect_left(BUCKETS, seconds)] += 1
+        self.sum += seconds
+
+    def merge(self, counts: Iterable[int], total: float) -> None:
+        self.counts = [a + b for a, b in zip(self.counts, counts)]
+        self.sum += total
+
+    def quantile(self, q: float) -> float:
+        """Estimate a quantile, in seconds, by interpolating within
+        the bucket that contains it, as Prometheus does"""
+        rank = q * self.count
+        below = 0
+        for i, n in enumerate(self.counts):
+            if n and below + n >= rank:
+                lower = BUCKETS[i - 1] if i else 0.0
+                if math.isinf(BUCKETS[i]):
+                    # Beyond the largest finite bucket
+                    return lower
+                return lower + (BUCKETS[i] - lower) * (rank - below) / n
+            below += n
+        return 0.0
+
+
+class _Timer:
+
+    """Records the time spent within a with statement"""
+
+    __slots__ = ("_metrics", "_stage", "_name", "_t0")
+
+    def __init__(self, metrics: "Metrics", stage: str, name: str) -> None:
+        self._metrics = metrics
+        self._stage = stage
+        self._name = name
+        self._t0 = 0.0
+
+    def __enter__(self) -> "_Timer":
+        self._t0 = time.perf_counter()
+        return self
+
+    def __exit__(self, *args: Any) -> None:
+        self._metrics.observe(self._stage, time.perf_counter() - self._t0, self._name)
+
+
+class Metrics:
+
+    """The metrics recorded by this process"""
+
+    # Minimum interval, in seconds, between stored snapshots
+    FLUSH_INTERVAL = 10.0
+
+    def __init__(self) -> None:
+        self.enabled = False
+        self.job = ""
+        self._batch = False
+        self._lock = threading.Lock()
+        self._pid = 0
+        self._histograms: Dict[Tuple[str, str], Histogram] = dict()
+        self._counters: Dict[Tuple[str, str], int] = dict()
+        self._last_flush = 0.0
+
+    def start(self, job: str, *, batch: bool = False) -> None:
+        """Start recording the metrics of a job in this process and the
+        processes forked from it, if enabled in the settings. The metrics
+        stored by previous runs of a batch job are deleted."""
+        self.enabled = Settings.METRICS
+        self.job = job
+        self._batch = batch
+        if self.enabled and batch:
+            for path in Path(Settings.METRICS_DIR).glob(f"{job}-*.json"):
+                try:
+                    path.unlink()
+                except OSError:
+                    pass
+
+    def _check_process(self) -> None:
+        """Start afresh in a forked child process, since the metrics
+        inherited from the parent are stored by the parent. Must be
+        called with the lock held."""
+        pid = os.getpid()
+        if pid == self._pid:
+            return
+        self._pid = pid
+        self._histograms = dict()
+        self._counters = dict()
+        self._last_flush = time.monotonic()
+        # Store the metrics when the process exits, including worker
+        # processes of multiprocessing pools, which skip atexit handlers
+        multiprocessing.util.Finalize(None, self.flush, exitpriority=10)
+
+    def observe(self, stage: str, seconds: float, name: str = "") -> None:
+        """Record the latency of a stage"""
+        with self._lock:
+            self._check_process()
+            h = self._histograms.get((stage, name))
+            if h is None:
+                h = self._histograms[(stage, name)] = Histogram()
+            h.observe(seconds)
+            due = time.monotonic() - self._last_flush > self.FLUSH_INTERVAL
+        if due:
+            self.flush()
+
+    def count(self, event: str, n: int = 1, name: str = "") -> None:
+        """Count occurrences of an event"""
+        if not self.enabled:
+            return
+        with self._lock:
+            self._check_process()
+            self._counters[(event, name)] = self._counters.get((event, name), 0) + n
+
+    def timer(self, stage: str, name: str = "") -> Any:
+        """Return a context manager that records the time spent in a stage"""
+        if not self.enabled:
+            return _NULL_TIMER
+        return _Timer(self, stage, name)
+
+    def timed(self, stage: str, name: str = "") -> Callable[[F], F]:
+        """Decorator that records the time spent in a function"""
+
+        def decorator(func: F) -> F:
+            @functools.wraps(func)
+            def wrapper(*args: Any, **kwargs: Any) -> Any:
+                if not self.enabled:
+                    return func(*args, **kwargs)
+                with _Timer(self, stage, name):
+                    return func(*args, **kwargs)
+
+            return cast(F, wrapper)
+
+        return decorator
+
+    def _path(self, pid: int) -> Path:
+        return Path(Settings.METRICS_DIR) / f"{self.job}-{pid}.json"
+
+    def flush(self) -> None:
+        """Store a snapshot of the metrics of this process"""
+        if not self.enabled:
+            return
+        with self._lock:
+            self._check_process()
+            self._last_flush = time.monotonic()
+            if not self._histograms and not self._counters:
+                return
+            snapshot = dict(
+                job=self.job,
+                pid=self._pid,
+                batch=self._batch,
+                histograms=[
+                    [stage, name, h.counts, h.sum]
+                    for (stage, name), h in self._histograms.items()
+                ],
+                counters=[[e, name, n] for (e, name), n in self._counters.items()],
+            )
+        path = self._path(snapshot["pid"])
+        try:
+            path.parent.mkdir(parents=True, exist_ok=True)
+            tmp = path.with_suffix(".tmp")
+            with open(tmp, "w", encoding="utf-8") as f:
+                json.dump(snapshot, f)
+            os.replace(tmp, path)
+        except OSError as e:
+            logging.warning(f"Unable to store metrics in {path}: {e}")
+
+    def collect(
+        self, job: Optional[str] = None
+    ) -> Tuple[Dict[Key, Histogram], Dict[Key, int]]:
+        """Merge the stored metrics of all processes, or of those of one job.
+        The snapshots of server processes that are no longer running
+        are deleted. Nothing is collected if metrics are disabled."""
+        if not self.enabled:
+            return dict(), dict()
+        self.flush()
+        histograms: Dict[Key, Histogram] = dict()
+        counters: Dict[Key, int] = dict()
+        for path in Path(Settings.METRICS_DIR).glob(f"{job or '*'}-*.json"):
+            try:
+                with open(path, "r", encoding="utf-8") as f:
+                    snapshot = json.load(f)
+            except (OSError, ValueError):
+                # Deleted or being replaced concurrently
+                continue
+            if not snapshot.get("batch") and not _running(snapshot["pid"]):
+                try:
+                    path.unlink()
+                except OSError:
+                    pass
+                continue
+            j = snapshot["job"]
+            for stage, name, counts, total in snapshot["histograms"]:
+                h = histograms.get((j, stage, name))
+                if h is None:
+                    h = histograms[(j, stage, name)] = Histogram()
+                h.merge(counts, total)
+            for event, name, n in snapshot["counters"]:
+                counters[(j, event, name)] = counters.get((j, event, name), 0) + n
+        return histograms, counters
+
+    def exposition(self) -> str:
+        """Return the merged metrics in the Prometheus text format,
+        or an empty string if metrics are disabled"""
+        if not self.enabled:
+            # Don't serve the snapshots left behind while metrics were enabled
+            return ""
+        histograms, counters = self.collect()
+        lines: List[str] = [
+            "# HELP greynir_stage_seconds Time spent in processing stages",
+            "# TYPE greynir_stage_seconds histogram",
+        ]
+        for (job, stage, name), h in sorted(histograms.items()):
+            labels = _labels(job=job, stage=stage, name=name)
+            cumulative = 0
+            for le, n in zip(BUCKETS, h.counts):
+                cumulative += n
+                bound = "+Inf" if math.isinf(le) else repr(le)
+                lines.append(
+                    'greynir_stage_seconds_bucket{{{0},le="{1}"}} {2}'.format(
+                        labels, bound, cumulative
+                    )
+                )
+            lines.append(f"greynir_stage_seconds_sum{{{labels}}} {h.sum!r}")
+            lines.append(f"greynir_stage_seconds_count{{{labels}}} {cumulative}")
+        lines.append("# HELP greynir_events_total Number of events")
+        lines.append("# TYPE greynir_events_total counter")
+        for (job, event, name), n in sorted(counters.items()):
+            labels = _labels(job=job, event=event, name=name)
+            lines.append(f"greynir_events_total{{{labels}}} {n}")
+        return "\n".join(lines) + "\n"
+
+    def summary(self) -> str:
+        """Return a summary of the metrics of this job, per stage,
+        in decreasing order of the total time spent"""
+        histograms, counters = self.collect(self.job)
+        if not histograms and not counters:
+            return ""
+        lines = [
+            "{0:<40} {1:>9} {2:>10} {3:>9} {4:>9} {5:>9} {6:>9}".format(
+                "Stage", "Count", "Total s", "Mean ms", "p50 ms", "p90 ms", "p99 ms"
+            )
+        ]
+        for (_, stage, name), h in sorted(
+            histograms.items(), key=lambda kv: kv[1].sum, reverse=True
+        ):
+            n = h.count
+            mean = h.sum / n if n else 0.0
+            lines.append(
+                "{0:<40} {1:>9} {2:>10.2f}".format(
+                    f"{stage} {name}".strip()[:40], n, h.sum
+                )
+                + "".join(
+                    " {0:>9.2f}".format(1000.0 * t)
+                    for t in (mean, h.quantile(0.5), h.quantile(0.9), h.quantile(0.99))
+                )
+            )
+        for (_, event, name), n in sorted(counters.items()):
+            lines.append("{0:<40} {1:>9}".format(f"{event} {name}".strip()[:40], n))
+        return "\n".join(lines)
+
+
+def _running(pid: int) -> bool:
+    """Return True if a process with the given pid is running"""
+    try:
+        os.kill(pid, 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+    return True
+
+
+def _labels(**labels: str) -> str:
+    """Format Prometheus labels, leaving out empty ones"""
+    return ",".join(
+        '{0}="{1}"'.format(
+            k, v.replace("\\", "\\\\").replace('"', '\\"').replace("\n", "\\n")
+        )
+        for k, v in labels.items()
+        if v
+    )
+
+
+# The metrics of this process
+metrics = Metrics()
+
+timer = metrics.timer
+timed = metrics.timed
+count = metrics.count
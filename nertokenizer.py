@@ -27,21 +27,179 @@
     and is thus not appropriate for inclusion in reynir.bintokenizer,
     as GreynirEngine does not (and should not) require a database to be present.
 
+    The entity names are held in a process-wide word trie, which is loaded
+    from the database on first use and then refreshed incrementally, so that
+    recognizing entities does not require database round-trips per word.
+
 """
 
-from typing import DefaultDict, List, Iterator, Dict, Union, Tuple, Optional, Type
+from typing import (
+    DefaultDict,
+    List,
+    Iterator,
+    Dict,
+    Union,
+    Tuple,
+    Optional,
+    Sequence,
+    Type,
+)
 
 from collections import defaultdict
+from datetime import datetime
 import logging
+import threading
+import time
 
 from tokenizer import TOK, Tok
 from tokenizer.abbrev import Abbreviations
 from reynir.bindb import GreynirBin
 
-from db import SessionContext, OperationalError, Session
+from db import SessionContext, OperationalError, Session, dbfunc
 from db.models import Entity
 
 
+class _TrieNode:
+
+    """A node in the entity name trie, having child nodes for the
+    following words, and the names of all entities in its subtree"""
+
+    __slots__ = ("children", "names")
+
+    def __init__(self) -> None:
+        self.children: Dict[str, "_TrieNode"] = dict()
+        self.names: List[str] = []
+
+
+class EntityNames:
+
+    """A process-wide word trie of the distinct entity names in the
+    entities table. New names are fetched from the database, by timestamp,
+    at most every REFRESH_INTERVAL seconds, and added to the trie in place;
+    since names are only appended, readers see each name list either with
+    or without a new name. Since entities are also deleted when articles
+    are reprocessed, the trie is rebuilt from scratch, and swapped in when
+    complete, every REBUILD_INTERVAL seconds, or on the next use after
+    invalidate() has been called by a writer in this process. Other
+    processes are not notified, so they may keep serving deleted names
+    until their next rebuild, i.e. for up to REBUILD_INTERVAL seconds."""
+
+    REFRESH_INTERVAL = 60.0
+    REBUILD_INTERVAL = 3600.0
+
+    def __init__(self) -> None:
+        self._root: Optional[_TrieNode] = None
+        self._count = 0
+        # Timestamp of the newest entity in the trie
+        self._newest: Optional[datetime] = None
+        self._built = 0.0
+        self._refreshed = 0.0
+        self._stale = False
+        self._lock = threading.Lock()
+
+    def __len__(self) -> int:
+        """Return the number of distinct entity names in the trie"""
+        return self._count
+
+    def invalidate(self) -> None:
+        """Mark the trie for rebuilding on its next use"""
+        self._stale = True
+
+    @staticmethod
+    def _insert(root: _TrieNode, name: str) -> bool:
+        """Insert a name into the trie, returning False if already there"""
+        words = name.split(" ")
+        node = root
+        path: List[_TrieNode] = []
+        for w in words:
+            child = node.children.get(w)
+            if child is None:
+                child = node.children[w] = _TrieNode()
+            path.append(child)
+            node = child
+        if name in node.names:
+            return False
+        for n in path:
+            n.names.append(name)
+        return True
+
+    def _load(self, session: Session, since: Optional[datetime]) -> None:
+        """Load all names, or the names added after the given timestamp,
+        into the trie"""
+        # Each distinct name once, along with its newest timestamp
+        q = session.query(Entity.name, dbfunc.max(Entity.timestamp)).group_by(
+            Entity.name
+        )
+        root = self._root
+        if since is None or root is None:
+            root = _TrieNode()
+            count = 0
+            newest = None
+        else:
+            q = q.filter(Entity.timestamp > since)
+            count = self._count
+            newest = since
+        for name, ts in q.all():
+            if name and self._insert(root, name):
+                count += 1
+            if ts is not None and (newest is None or ts > newest):
+                newest = ts
+        # When rebuilding, readers see either the old trie or the completed
+        # new one; when refreshing, names have been added in place
+        self._root = root
+        self._count = count
+        self._newest = newest
+
+    def _refresh(self, session: Session) -> None:
+        """Load or refresh the trie as required"""
+        now = time.monotonic()
+        if (
+            self._root is not None
+            and not self._stale
+            and now - self._refreshed < self.REFRESH_INTERVAL
+        ):
+            return
+        with self._lock:
+            if self._root is not None and not self._stale:
+                if now - self._refreshed < self.REFRESH_INTERVAL:
+                    # Another thread refreshed the trie while we waited
+                    return
+            rebuild = (
+                self._root is None
+                or self._stale
+                or now - self._built >= self.REBUILD_INTERVAL
+            )
+            # Clear the flag before loading, so that an invalidation
+            # during the load is not lost
+            self._stale = False
+            try:
+                self._load(session, None if rebuild else self._newest)
+            except OperationalError as e:
+                logging.warning(f"SQL error in EntityNames.refresh(): {e}")
+                if self._root is None:
+                    self._root = _TrieNode()
+                    self._built = now
+            else:
+                if rebuild:
+                    self._built = now
+            self._refreshed = now
+
+    def lookup(self, session: Session, w: str) -> Sequence[str]:
+        """Return the names of the entities whose name is w, or starts with
+        the word(s) of w. The returned sequence should not be modified."""
+        self._refresh(session)
+        node = self._root
+        for word in w.split(" "):
+            if node is None:
+                break
+            node = node.children.get(word)
+        return () if node is None else node.names
+
+
+# The process-wide entity name trie
+entity_names = EntityNames()
+
+
 def recognize_entities(
     token_stream: Iterator[Tok],
     enclosing_session: Optional[Session] = None,
@@ -58,9 +216,7 @@ def recognize_entities(
     # Phrases we're considering. Note that an entry of None
     # indicates that the accumulated phrase so far is a complete
     # and valid known entity name.
-    state: Dict[Union[str, None], List[Tuple[List[str], Entity]]] = defaultdict(list)
-    # Entitiy definition cache
-    ecache: Dict[str, List[Entity]] = dict()
+    state: Dict[Union[str, None], List[Tuple[List[str], str]]] = defaultdict(list)
     # Last name to full name mapping ('Clinton' -> 'Hillary Clinton')
     lastnames: Dict[str, Tok] = dict()
 
@@ -68,26 +224,9 @@ def recognize_entities(
         session=enclosing_session, commit=True, read_only=True
     ) as session:
 
-        def fetch_entities(w: str, fuzzy: bool = True) -> List[Entity]:
-            """Return a list of entities matching the word(s) given,
-            exactly if fuzzy = False, otherwise also as a starting word(s)"""
-            try:
-                q = session.query(Entity.name, Entity.verb, Entity.definition)
-                if fuzzy:
-                    q = q.filter(Entity.name.like(w + " %") | (Entity.name == w))
-                else:
-                    q = q.filter(Entity.name == w)
-                return q.all()
-            except OperationalError as e:
-                logging.warning(f"SQL error in fetch_entities(): {e}")
-                return []
-
-        def query_entities(w: str) -> List[Entity]:
-            """Return a list of entities matching the initial word given"""
-            e = ecache.get(w)
-            if e is None:
-                ecache[w] = e = fetch_entities(w)
-            return e
+        def query_entities(w: str) -> Sequence[str]:
+            """Return the names of entities matching the initial word(s) given"""
+            return entity_names.lookup(session, w)
 
         def lookup_lastname(lastname: str) -> Optional[Tok]:
             """Look up a last name in the lastnames registry,
@@ -148,11 +287,11 @@ def recognize_entities(
 
                 # Look for matches in the current state and build a new state
                 newstate: DefaultDict[
-                    Union[str, None], List[Tuple[List[str], Entity]]
+                    Union[str, None], List[Tuple[List[str], str]]
                 ] = defaultdict(list)
                 w = token.txt  # Original word
 
-                def add_to_state(slist: List[str], entity: Entity) -> None:
+                def add_to_state(slist: List[str], entity: str) -> None:
                     """Add the list of subsequent words to the new parser state"""
                     wrd = slist[0] if slist else None
                     rest = slist[1:]
@@ -220,7 +359,7 @@ def recognize_entities(
                             else:
                                 lastnames[lastname] = token
 
-                    elist: List[Entity] = []
+                    elist: Sequence[str] = ()
                     if token.kind == TOK.WORD and upper and w not in Abbreviations.DICT:
                         if " " in w:
                             # w may be a person name with more than one embedded word
@@ -231,7 +370,7 @@ def recognize_entities(
                             # were constructed by concatenation (indicated by a hyphen
                             # in the stem)
                             weak = False  # Accept single-word entity references
-                        # elist is a list of Entity instances
+                        # elist is a sequence of entity names
                         elist = query_entities(w)
 
                     if elist:
@@ -239,7 +378,7 @@ def recognize_entities(
                         candidate = False
                         for e in elist:
                             # List of subsequent words in entity name
-                            sl = e.name.split()[cnt:]
+                            sl = e.split()[cnt:]
                             if sl:
                                 # Here's a candidate for a longer entity reference
                                 # than we already have
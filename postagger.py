@@ -56,7 +56,12 @@ from typing import (
 )
 
 import math
+import mmap
 import os
+import struct
+import sys
+import threading
+from array import array
 from collections import defaultdict
 from itertools import islice, tee
 import xml.etree.ElementTree as ET
@@ -197,6 +202,9 @@ class NgramCounter:
     def count(self, ngram: Tuple[str, ...]) -> int:
         return self._d.get(ngram, 0)
 
+    def items(self) -> Iterable[Tuple[Tuple[str, ...], int]]:
+        return self._d.items()
+
     def store(self, f: TextIO) -> None:
         """Store the ngram dictionary in a compact text format"""
         d = self._d
@@ -232,6 +240,268 @@ class NgramCounter:
             self._d[ngram] = cnt
 
 
+class MappedNgramModel:
+
+    """A read-only n-gram model in a compiled binary file, which is
+    memory-mapped so that all processes using it share one physical copy.
+
+    The file contains the tag vocabulary, an open addressing hash table
+    of n-grams, where each key packs the tag ids (plus one) of an n-gram
+    into 16-bit fields, with the n-gram counts in a parallel array, and
+    the lemmas sorted by their UTF-8 encoding, each with a range of
+    (tag id, count) entries and a precomputed total count.
+    The arrays are in native byte order, so the file is not portable
+    between platforms; it is compiled from the text model if required."""
+
+    MAGIC = b"GNGM"
+    VERSION = 1
+    # Magic, version, byte order, n, number of tags, hash table bits,
+    # number of n-grams, number of lemmas, number of lemma entries,
+    # followed by the offsets of the sections
+    _HEADER = struct.Struct("<4sHBBIIIII" + "Q" * 10)
+    _SECTIONS = (
+        ("tag_offsets", "I"),
+        ("tag_bytes", "B"),
+        ("keys", "Q"),
+        ("counts", "I"),
+        ("lemma_offsets", "I"),
+        ("lemma_bytes", "B"),
+        ("lemma_starts", "I"),
+        ("lemma_totals", "I"),
+        ("entry_tags", "I"),
+        ("entry_counts", "I"),
+    )
+    # Multiplier for Fibonacci hashing of n-gram keys
+    _FIB = 0x9E3779B97F4A7C15
+    _MASK64 = 0xFFFFFFFFFFFFFFFF
+
+    def __init__(self, filename: str) -> None:
+        with open(filename, "rb") as f:
+            self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        h = self._HEADER.unpack_from(self._mm, 0)
+        magic, version, byteorder, n, num_tags, bits = h[0:6]
+        if magic != self.MAGIC or version != self.VERSION:
+            raise ValueError("Not a compiled n-gram model: {0}".format(filename))
+        if byteorder != (sys.byteorder == "little"):
+            raise ValueError("Compiled n-gram model is of the wrong byte order")
+        self.n = n
+        self._num_ngrams, self._num_lemmas = h[6], h[7]
+        self._bits = bits
+        self._mask = (1 << bits) - 1
+        lengths = {
+            "tag_offsets": num_tags + 1,
+            "keys": 1 << bits,
+            "counts": 1 << bits,
+            "lemma_offsets": self._num_lemmas + 1,
+            "lemma_starts": self._num_lemmas + 1,
+            "lemma_totals": self._num_lemmas,
+            "entry_tags": h[8],
+            "entry_counts": h[8],
+        }
+        mv = memoryview(self._mm)
+        offsets = h[9:]
+        sections: Dict[str, memoryview] = dict()
+        for ix, (name, fmt) in enumerate(self._SECTIONS):
+            if fmt == "B":
+                # A byte section ends at the last offset
+                # in the section that precedes it
+                length = sections[self._SECTIONS[ix - 1][0]][-1]
+            else:
+                length = lengths[name]
+            start = offsets[ix]
+            end = start + length * struct.calcsize(fmt)
+            sections[name] = mv[start:end].cast(fmt)
+        self._keys = sections["keys"]
+        self._counts = sections["counts"]
+        self._lemma_offsets = sections["lemma_offsets"]
+        self._lemma_base = offsets[5]
+        self._lemma_starts = sections["lemma_starts"]
+        self._lemma_totals = sections["lemma_totals"]
+        self._entry_tags = sections["entry_tags"]
+        self._entry_counts = sections["entry_counts"]
+        # The tag vocabulary is small, so it is decoded up front
+        tag_offsets = sections["tag_offsets"]
+        tag_bytes = sections["tag_bytes"]
+        self._tags: List[str] = [
+            bytes(tag_bytes[tag_offsets[i] : tag_offsets[i + 1]]).decode("utf-8")
+            for i in range(num_tags)
+        ]
+        self._tag_ids: Dict[str, int] = {t: i for i, t in enumerate(self._tags)}
+
+    @property
+    def size(self) -> int:
+        return self._num_ngrams
+
+    @classmethod
+    def _slot(cls, key: int, bits: int) -> int:
+        return ((key * cls._FIB) & cls._MASK64) >> (64 - bits)
+
+    def count(self, ngram: Tuple[str, ...]) -> int:
+        """Return the count of the given n-gram"""
+        key = 0
+        shift = 0
+        tag_ids = self._tag_ids
+        for w in ngram:
+            ix = tag_ids.get(w)
+            if ix is None:
+                return 0
+            key |= (ix + 1) << shift
+            shift += 16
+        keys = self._keys
+        mask = self._mask
+        slot = self._slot(key, self._bits)
+        while True:
+            k = keys[slot]
+            if k == key:
+                return self._counts[slot]
+            if k == 0:
+                return 0
+            slot = (slot + 1) & mask
+
+    def _lemma_index(self, lemma: str) -> int:
+        """Return the index of the lemma, or -1 if not found"""
+        b = lemma.encode("utf-8")
+        mm = self._mm
+        base = self._lemma_base
+        offs = self._lemma_offsets
+        lo, hi = 0, self._num_lemmas
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if mm[base + offs[mid] : base + offs[mid + 1]] < b:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self._num_lemmas and mm[base + offs[lo] : base + offs[lo + 1]] == b:
+            return lo
+        return -1
+
+    def lemma_tags(self, lemma: str) -> Dict[str, int]:
+        """Return a dict of tags and counts for this lemma"""
+        ix = self._lemma_index(lemma)
+        if ix < 0:
+            return dict()
+        tags = self._tags
+        entry_tags, entry_counts = self._entry_tags, self._entry_counts
+        return {
+            tags[entry_tags[i]]: entry_counts[i]
+            for i in range(self._lemma_starts[ix], self._lemma_starts[ix + 1])
+        }
+
+    def lemma_count(self, lemma: str) -> int:
+        """Return the total occurrence count for a lemma"""
+        ix = self._lemma_index(lemma)
+        return 0 if ix < 0 else self._lemma_totals[ix]
+
+    @property
+    def num_lemmas(self) -> int:
+        return self._num_lemmas
+
+    @classmethod
+    def write(
+        cls,
+        filename: str,
+        n: int,
+        lemma_cnt: Dict[str, Dict[str, int]],
+        cnt: NgramCounter,
+    ) -> None:
+        """Compile a model to a binary file. The file is written under
+        a temporary name and then renamed, so that processes that are
+        loading the model never see a partially written file."""
+        # Collect the tag vocabulary from the n-grams and the lemmas
+        tag_ids: Dict[str, int] = dict()
+        for ngram, _ in cnt.items():
+            for w in ngram:
+                if w not in tag_ids:
+                    tag_ids[w] = len(tag_ids)
+        for tags in lemma_cnt.values():
+            for t in tags:
+                if t not in tag_ids:
+                    tag_ids[t] = len(tag_ids)
+        if len(tag_ids) >= 0xFFFF or n * 16 > 64:
+            raise ValueError("Too many tags or too long n-grams for a compiled model")
+        tag_offsets = array("I", [0])
+        tag_bytes = bytearray()
+        for t in tag_ids:
+            tag_bytes += t.encode("utf-8")
+            tag_offsets.append(len(tag_bytes))
+        # Build the hash table, at most half full
+        bits = max(4, (2 * cnt.size).bit_length())
+        mask = (1 << bits) - 1
+        keys = array("Q", bytes(8 << bits))
+        counts = array("I", bytes(4 << bits))
+        for ngram, c in cnt.items():
+            key = 0
+            for i, w in enumerate(ngram):
+                key |= (tag_ids[w] + 1) << (16 * i)
+            slot = cls._slot(key, bits)
+            while keys[slot]:
+                slot = (slot + 1) & mask
+            keys[slot] = key
+            counts[slot] = c
+        # Sort the lemmas by their UTF-8 encoding
+        lemmas = sorted(
+            ((lemma.encode("utf-8"), tags) for lemma, tags in lemma_cnt.items()),
+            key=lambda x: x[0],
+        )
+        lemma_offsets = array("I", [0])
+        lemma_bytes = bytearray()
+        lemma_starts = array("I", [0])
+        lemma_totals = array("I")
+        entry_tags = array("I")
+        entry_counts = array("I")
+        for b, tags in lemmas:
+            lemma_bytes += b
+            lemma_offsets.append(len(lemma_bytes))
+            for t, c in tags.items():
+                entry_tags.append(tag_ids[t])
+                entry_counts.append(c)
+            lemma_starts.append(len(entry_tags))
+            lemma_totals.append(sum(tags.values()))
+        data = (
+            tag_offsets.tobytes(),
+            bytes(tag_bytes),
+            keys.tobytes(),
+            counts.tobytes(),
+            lemma_offsets.tobytes(),
+            bytes(lemma_bytes),
+            lemma_starts.tobytes(),
+            lemma_totals.tobytes(),
+            entry_tags.tobytes(),
+            entry_counts.tobytes(),
+        )
+        # Lay out the sections after the header, aligned to 8 bytes
+        offsets: List[int] = []
+        pos = cls._HEADER.size
+        for d in data:
+            pos = (pos + 7) & ~7
+            offsets.append(pos)
+            pos += len(d)
+        header = cls._HEADER.pack(
+            cls.MAGIC,
+            cls.VERSION,
+            sys.byteorder == "little",
+            n,
+            len(tag_ids),
+            bits,
+            cnt.size,
+            len(lemmas),
+            len(entry_tags),
+            *offsets,
+        )
+        tmpname = "{0}.{1}.tmp".format(filename, os.getpid())
+        with open(tmpname, "wb") as f:
+            f.write(header)
+            for offset, d in zip(offsets, data):
+                f.write(bytes(offset - f.tell()))
+                f.write(d)
+        os.replace(tmpname, filename)
+
+
+# Memory-mapped models, by n-gram size, shared by all taggers in the process
+_MAPPED_MODELS: Dict[int, MappedNgramModel] = dict()
+_MAPPED_LOCK = threading.Lock()
+
+
 class NgramTagger:
     """A class to assign Icelandic Frequency Dictionary (IFD) tags
     to sentences consisting of 'raw' tokens coming out of the
@@ -249,7 +519,9 @@ class NgramTagger:
         self.EMPTY = tuple([""] * n)
         # ngram count
         # self.cnt = defaultdict(int)
-        self.cnt = NgramCounter()
+        self.cnt: Union[NgramCounter, MappedNgramModel] = NgramCounter()
+        # The memory-mapped model, if loaded
+        self._mapped: Optional[MappedNgramModel] = None
         # { lemma: { tag : count} }
         self.lemma_cnt: Dict[str, Dict[str, int]] = defaultdict(
             lambda: defaultdict(int)
@@ -257,10 +529,14 @@ class NgramTagger:
 
     def lemma_tags(self, lemma: str) -> Dict[str, int]:
         """Return a dict of tags and counts for this lemma"""
+        if self._mapped is not None:
+            return self._mapped.lemma_tags(lemma)
         return self.lemma_cnt.get(lemma, dict())
 
     def lemma_count(self, lemma: str) -> int:
         """Return the total occurrence count for a lemma"""
+        if self._mapped is not None:
+            return self._mapped.lemma_count(lemma)
         d = self.lemma_cnt.get(lemma)
         return 0 if d is None else sum(d.values())
 
@@ -269,6 +545,7 @@ class NgramTagger:
         and extract tag trigrams"""
 
         n = self.n
+        assert self._mapped is None, "A memory-mapped model is read-only"
 
         def tag_stream(sentence_stream: Iterable[Iterable[TokenDict]]) -> Iterator[str]:
             """Generator for tag stream from a token stream"""
@@ -324,11 +601,22 @@ class NgramTagger:
 
         return self
 
+    @staticmethod
+    def model_file(n: int) -> str:
+        """Return the name of the text model file"""
+        return "ngram-{0}-model.txt".format(n)
+
+    @staticmethod
+    def compiled_file(n: int) -> str:
+        """Return the name of the compiled model file"""
+        return "ngram-{0}-model.bin".format(n)
+
     def store_model(self):
-        """Store the model in a pickle file"""
-        if self.cnt.size:
+        """Store the model in a text file, and compile it to a binary file"""
+        cnt = self.cnt
+        if cnt.size and isinstance(cnt, NgramCounter):
             # Don't store an empty count
-            with open("ngram-{0}-model.txt".format(self.n), "w") as f:
+            with open(self.model_file(self.n), "w") as f:
                 f.write(str(len(self.lemma_cnt)) + "\n")
 
                 def lemma_strings():
@@ -341,11 +629,27 @@ class NgramTagger:
                         )
 
                 f.writelines(lemma_strings())
-                self.cnt.store(f)
+                cnt.store(f)
+            MappedNgramModel.write(
+                self.compiled_file(self.n), self.n, self.lemma_cnt, cnt
+            )
 
-    def load_model(self):
-        """Load the model from a pickle file"""
-        with open("ngram-{0}-model.txt".format(self.n), "r") as f:
+    def load_model(self, mapped: bool = True):
+        """Load the model. By default, the compiled model is memory-mapped,
+        and shared with other taggers and processes. It is (re)compiled
+        from the text model first if it is missing or older than the text
+        model. If mapped is False, or the compiled model is not available,
+        the text model is loaded into dicts, which can be trained further."""
+        if mapped:
+            model = self._load_mapped()
+            if model is not None:
+                self._mapped = model
+                self.cnt = model
+                self.lemma_cnt = dict()
+                return
+        self._mapped = None
+        self.cnt = NgramCounter()
+        with open(self.model_file(self.n), "r") as f:
             cnt = int(f.readline()[:-1])
             self.lemma_cnt = dict()
             for _ in range(cnt):
@@ -358,9 +662,41 @@ class NgramTagger:
                 self.lemma_cnt[v[0]] = d
             self.cnt.load(f)
 
+    def _load_mapped(self) -> Optional[MappedNgramModel]:
+        """Return the memory-mapped model for our n-gram size, mapping it
+        on first use and compiling it from the text model if required"""
+        n = self.n
+        with _MAPPED_LOCK:
+            model = _MAPPED_MODELS.get(n)
+            if model is not None:
+                return model
+            fname = self.compiled_file(n)
+            try:
+                src_mtime = os.path.getmtime(self.model_file(n))
+            except OSError:
+                src_mtime = None
+            try:
+                if src_mtime is not None and (
+                    not os.path.exists(fname) or os.path.getmtime(fname) < src_mtime
+                ):
+                    source = NgramTagger(n)
+                    source.load_model(mapped=False)
+                    MappedNgramModel.write(
+                        fname, n, source.lemma_cnt, cast(NgramCounter, source.cnt)
+                    )
+                model = _MAPPED_MODELS[n] = MappedNgramModel(fname)
+            except (OSError, ValueError) as e:
+                if self._verbose:
+                    print("Unable to map compiled model {0}: {1}".format(fname, e))
+                return None
+            return model
+
     def show_model(self):
         """Dump the tag count statistics"""
-        print("\nLemmas are {0}".format(len(self.lemma_cnt)))
+        num_lemmas = (
+            len(self.lemma_cnt) if self._mapped is None else self._mapped.num_lemmas
+        )
+        print("\nLemmas are {0}".format(num_lemmas))
         print("\nCount contains {0} distinct {1}-grams".format(self.cnt.size, self.n))
         print("\n")
 
@@ -29,14 +29,30 @@
     A multiprocessing pool is employed to process articles in parallel on all available
     CPUs.
 
+    In batch mode (--batch=N), each worker receives a chunk of N article ids,
+    loads only the columns required for all of them in one query, and writes
+    the processor output to the database in bulk, in one transaction per chunk.
+
 """
 
-from typing import TYPE_CHECKING, Any, Callable, Iterable, Optional, List, Union, cast
+from typing import (
+    TYPE_CHECKING,
+    Any,
+    Callable,
+    Dict,
+    Iterable,
+    Iterator,
+    Optional,
+    List,
+    Set,
+    Union,
+    cast,
+)
 from types import ModuleType
 
 import getopt
 import importlib
-import json
+import operator
 import sys
 import time
 
@@ -47,12 +63,20 @@ else:
 
 from contextlib import closing
 from datetime import datetime, timezone
+from itertools import islice
 from pathlib import Path
 
+from sqlalchemy import Table
+from sqlalchemy.sql.dml import Delete
+from sqlalchemy.sql.elements import BinaryExpression, BindParameter
+
 from settings import Settings, ConfigError
+from compact import load_tokens
+from metrics import metrics, timer
 from db import GreynirDB, Session
 from db.models import Article, Person
-from tree import Tree, ProcEnv, TreeStateDict
+from tree import ProcEnv, TreeStateDict
+from tree.flat import FlatTree
 from tree.util import PgsList
 from utility import modules_in_dir
 
@@ -68,8 +92,8 @@ def _now() -> datetime:
 class TokenContainer:
     """Class wrapper around tokens"""
 
-    def __init__(self, tokens_json: str, url: str, authority: float) -> None:
-        self.tokens = cast(PgsList, json.loads(tokens_json))
+    def __init__(self, tokens: str, url: str, authority: float) -> None:
+        self.tokens = cast(PgsList, load_tokens(tokens))
         self.url = url
         self.authority = authority
 
@@ -147,6 +171,72 @@ class TokenContainer:
             article_end(state)
 
 
+class BatchSession:
+    """A stand-in for a database session, passed to processors in batch mode.
+    Deletions of rows by article URL, and added ORM objects, are collected
+    in memory and written to the database in bulk by flush(). Other
+    operations are relayed to the underlying session."""
+
+    def __init__(self, session: Session) -> None:
+        self._session = session
+        # Article URLs whose rows are to be deleted, by table
+        self._deletes: Dict[Table, Set[str]] = dict()
+        # ORM objects to be inserted, in order of addition
+        self._objects: List[Any] = []
+
+    @staticmethod
+    def _deleted_article_url(statement: Any) -> Optional[str]:
+        """If the statement is of the form DELETE FROM table
+        WHERE article_url = :url, return the URL, else None"""
+        if not isinstance(statement, Delete):
+            return None
+        where = statement.whereclause
+        if not isinstance(where, BinaryExpression) or where.operator is not operator.eq:
+            return None
+        if getattr(where.left, "name", None) != "article_url":
+            return None
+        if not isinstance(where.right, BindParameter):
+            return None
+        return cast(Optional[str], where.right.value)
+
+    def execute(self, statement: Any, *args: Any, **kwargs: Any) -> Any:
+        url = self._deleted_article_url(statement)
+        if url is None or args or kwargs:
+            return self._session.execute(statement, *args, **kwargs)
+        self._deletes.setdefault(cast(Table, statement.table), set()).add(url)
+        return None
+
+    def add(self, obj: Any) -> None:
+        self._objects.append(obj)
+
+    def add_all(self, objs: Iterable[Any]) -> None:
+        self._objects.extend(objs)
+
+    def flush(self) -> None:
+        """Write the collected deletions and insertions to the database,
+        with one DELETE per table and batched INSERTs per model class"""
+        session = self._session
+        for table, urls in self._deletes.items():
+            session.execute(table.delete().where(table.c.article_url.in_(urls)))
+        if self._objects:
+            session.bulk_save_objects(self._objects)
+        self._deletes = dict()
+        self._objects = []
+
+    def __getattr__(self, name: str) -> Any:
+        return getattr(self._session, name)
+
+
+def _chunks(it: Iterable[str], size: int) -> Iterator[List[str]]:
+    """Split an iterable into lists of at most the given size"""
+    i = iter(it)
+    while True:
+        chunk = list(islice(i, size))
+        if not chunk:
+            break
+        yield chunk
+
+
 _PROCESSOR_TYPE_TREE = "tree"
 _PROCESSOR_TYPE_TOKEN = "token"
 _PROCESSOR_TYPES = frozenset((_PROCESSOR_TYPE_TREE, _PROCESSOR_TYPE_TOKEN))
@@ -217,21 +307,47 @@ class Processor:
             else:
                 print(f"No processors found in directory {processor_directory}")
 
-    def go_single(self, url: str) -> None:
+    def _import_processors(self) -> List[ProcEnv]:
+        """If first article within a new process, import the processor modules"""
+        if self.pmodules is None:
+            self.pmodules = [
+                vars(importlib.import_module(modname)) for modname in self.processors
+            ]
+        return self.pmodules
+
+    def _run_processors(
+        self, session: Session, url: str, tree_txt: str, tokens: str, authority: float
+    ) -> None:
+        """Run all processors in turn on the tree and tokens of an article"""
+        # Create a flat tree object from the article,
+        # materializing only the sentences that the
+        # processors need to visit
+        tree = FlatTree(url, authority)
+        with timer("tree_load"):
+            tree.load(tree_txt)
+
+        # Create token container object from article
+        token_container = TokenContainer(tokens, url, authority)
+
+        for p in self._import_processors():
+            ptype: str = p.get("PROCESSOR_TYPE", "")
+            assert ptype in _PROCESSOR_TYPES, "Unknown processor type"
+            with timer("processor", p.get("__name__", "")):
+                if ptype == _PROCESSOR_TYPE_TREE:
+                    tree.process(session, p)
+                elif ptype == _PROCESSOR_TYPE_TOKEN:
+                    token_container.process(session, p)
+
+    def go_single(self, url: str) -> int:
         """Single article processor that will be called by a process within a
-        multiprocessing pool"""
+        multiprocessing pool. Returns 1 if the article was found, else 0."""
 
         assert self._db is not None
 
+        found = False
         print(f"Processing article {url}")
         sys.stdout.flush()
 
-        # If first article within a new process, import the processor modules
-        if self.pmodules is None:
-            self.pmodules = [
-                vars(importlib.import_module(modname)) for modname in self.processors
-            ]
-
         # Load the article
         with closing(self._db.session) as session:
             try:
@@ -240,25 +356,16 @@ class Processor:
                 if article is None:
                     print("Article not found in scraper database")
                 else:
+                    found = True
                     if article.tree and article.tokens:
-                        # Create tree object from article
-                        tree = Tree(url, float(article.authority))
-                        tree.load(article.tree)
-
-                        # Create token container object from article
-                        token_container = TokenContainer(
-                            article.tokens, url, article.authority
+                        self._run_processors(
+                            session,
+                            url,
+                            article.tree,
+                            article.tokens,
+                            float(article.authority),
                         )
 
-                        # Run all processors in turn
-                        for p in self.pmodules:
-                            ptype: str = p.get("PROCESSOR_TYPE", "")
-                            assert ptype in _PROCESSOR_TYPES, "Unknown processor type"
-                            if ptype == _PROCESSOR_TYPE_TREE:
-                                tree.process(session, p)
-                            elif ptype == _PROCESSOR_TYPE_TOKEN:
-                                token_container.process(session, p)
-
                     # Mark the article as being processed
                     article.processed = _now()
 
@@ -274,6 +381,56 @@ class Processor:
                 raise
 
         sys.stdout.flush()
+        return 1 if found else 0
+
+    def go_batch(self, ids: List[str]) -> int:
+        """Process a batch of articles, given by their ids, within a single
+        transaction. Only the columns required are loaded, with one query for
+        the entire batch, and the processor output is written in bulk.
+        Returns the number of articles processed."""
+
+        assert self._db is not None
+
+        with closing(self._db.session) as session:
+            try:
+                rows = (
+                    session.query(
+                        Article.url, Article.tree, Article.tokens, Article.authority
+                    )
+                    .filter(Article.id.in_(ids))
+                    .all()
+                )
+                batch_session = BatchSession(session)
+                for url, tree_txt, tokens, authority in rows:
+                    if tree_txt and tokens:
+                        self._run_processors(
+                            cast(Session, batch_session),
+                            url,
+                            tree_txt,
+                            tokens,
+                            float(authority),
+                        )
+                batch_session.flush()
+                # Mark the articles as being processed
+                session.execute(
+                    Article.table()
+                    .update()
+                    .where(Article.id.in_(ids))
+                    .values(processed=_now())
+                )
+                session.commit()
+            except Exception as e:
+                # If an exception occurred, roll back the transaction
+                session.rollback()
+                print(
+                    f"Exception in batch of {len(ids)} articles, "
+                    f"transaction rolled back\nException: {e}"
+                )
+                raise
+
+        print(f"Processed batch of {len(rows)} articles")
+        sys.stdout.flush()
+        return len(rows)
 
     def go(
         self,
@@ -282,11 +439,15 @@ class Processor:
         force: bool = False,
         update: bool = False,
         title: Optional[str] = None,
-    ) -> None:
-        """Process already parsed articles from the database"""
+        batch_size: int = 0,
+    ) -> int:
+        """Process already parsed articles from the database,
+        returning the number of articles processed"""
 
         # noinspection PyComparisonWithNone,PyShadowingNames
         def iter_parsed_articles() -> Iterable[str]:
+            """Yield the URLs of the articles to process, or
+            their ids if processing in batches"""
             assert self._db is not None
 
             with closing(self._db.session) as session:
@@ -298,13 +459,27 @@ class Processor:
                     if "%" not in qtitle:
                         # Match start of title by default
                         qtitle += "%"
-                    q = session.query(Person.article_url).filter(
-                        Person.title_lc.like(qtitle)
-                    )
-                    field = lambda x: x.article_url
+                    if batch_size:
+                        q = (
+                            session.query(Article.id)
+                            .join(Person, Person.article_url == Article.url)
+                            .filter(Person.title_lc.like(qtitle))
+                            .distinct()
+                        )
+                        field = lambda x: x.id
+                    else:
+                        q = session.query(Person.article_url).filter(
+                            Person.title_lc.like(qtitle)
+                        )
+                        field = lambda x: x.article_url
                 else:
-                    q = session.query(Article.url).filter(Article.tree != None)
-                    field = lambda x: x.url
+                    if batch_size:
+                        q = session.query(Article.id)
+                        field = lambda x: x.id
+                    else:
+                        q = session.query(Article.url)
+                        field = lambda x: x.url
+                    q = q.filter(Article.tree != None)
                     if not force:
                         # If force = True, re-process articles even if
                         # they have been processed before
@@ -326,18 +501,27 @@ class Processor:
                 for a in q.yield_per(200):
                     yield field(a)
 
+        func: Callable[[Any], int]
+        work: Iterable[Any]
+        if batch_size:
+            func, work = self.go_batch, _chunks(iter_parsed_articles(), batch_size)
+        else:
+            func, work = self.go_single, iter_parsed_articles()
+
+        count = 0
         if _profiling:
             # If profiling, just do a simple map within a single thread and process
-            for url in iter_parsed_articles():
-                self.go_single(url)
+            for item in work:
+                count += func(item)
         else:
             # Use a multiprocessing pool to process the articles
             # Defaults to using as many processes as there are CPUs
             with Pool(self.num_workers) as pool:
-                for _ in pool.imap_unordered(self.go_single, iter_parsed_articles()):
-                    pass
+                for n in pool.imap_unordered(func, work):
+                    count += n
                 pool.close()
                 pool.join()
+        return count
 
 
 def process_articles(
@@ -348,6 +532,7 @@ def process_articles(
     title: Optional[str] = None,
     processor: Optional[str] = None,
     num_workers: Optional[int] = None,
+    batch_size: int = 0,
 ) -> None:
     """Process multiple articles according to the given parameters"""
     print("------ Greynir starting processing -------")
@@ -365,11 +550,18 @@ def process_articles(
         print(f"Invoke single processor: {processor}")
     if num_workers:
         print(f"Number of workers: {num_workers}")
+    if batch_size:
+        print(f"Batch size: {batch_size} articles")
     ts = str(_now())[0:19]
     print(f"Time: {ts}\n")
 
+    # Record the metrics of this run, if enabled, in this process
+    # and the worker processes
+    metrics.start("processor", batch=True)
+
     t0 = time.time()
 
+    count = 0
     proc = None
     try:
         # Run all processors in the processors directory, or the single processor given
@@ -378,7 +570,14 @@ def process_articles(
             single_processor=processor,
             num_workers=num_workers,
         )
-        proc.go(from_date, limit=limit, force=force, update=update, title=title)
+        count = proc.go(
+            from_date,
+            limit=limit,
+            force=force,
+            update=update,
+            title=title,
+            batch_size=batch_size,
+        )
     finally:
         if proc is not None:
             del proc
@@ -388,6 +587,14 @@ def process_articles(
 
     print("\n------ Processing completed -------")
     print("Total time: {0:.2f} seconds".format(t1 - t0))
+    print(
+        "Articles processed: {0}, {1:.1f} articles/second".format(
+            count, count / (t1 - t0) if t1 > t0 else 0.0
+        )
+    )
+    summary = metrics.summary()
+    if summary:
+        print(f"\n{summary}")
     ts = str(_now())[0:19]
     print(f"Time: {ts}\n")
 
@@ -437,6 +644,9 @@ __doc__ = """
         -t T, --title=T: Specify a title pattern in the persons table
                             to select articles to reprocess
         --update: Process files that have been reparsed but not reprocessed
+        -w N, --workers=N: Number of worker processes to run simultaneously
+        -b N, --batch=N: Process articles in batches of N, each within a single
+                            transaction and with bulk database writes
 
 """
 
@@ -449,7 +659,7 @@ def _main(argv: Optional[List[str]] = None) -> int:
         try:
             opts, _ = getopt.getopt(
                 argv[1:],
-                "hifl:u:p:t:w:",
+                "hifl:u:p:t:w:b:",
                 [
                     "help",
                     "init",
@@ -460,6 +670,7 @@ def _main(argv: Optional[List[str]] = None) -> int:
                     "processor=",
                     "title=",
                     "workers=",
+                    "batch=",
                 ],
             )
         except getopt.error as msg:
@@ -473,6 +684,7 @@ def _main(argv: Optional[List[str]] = None) -> int:
         title = None  # Title pattern
         proc = None  # Single processor to invoke
         num_workers = None  # Number of workers to run simultaneously
+        batch_size = 0  # Number of articles per batch, or 0 for no batching
 
         # Process options
         for o, a in opts:
@@ -506,6 +718,12 @@ def _main(argv: Optional[List[str]] = None) -> int:
             elif o in ("-w", "--workers"):
                 # Limit the number of workers
                 num_workers = int(a) if int(a) else None
+            elif o in ("-b", "--batch"):
+                # Process articles in batches of the given size
+                try:
+                    batch_size = max(0, int(a))
+                except ValueError:
+                    pass
 
         if init:
             # Initialize the database
@@ -545,6 +763,7 @@ def _main(argv: Optional[List[str]] = None) -> int:
                     title=title,
                     processor=proc,
                     num_workers=num_workers,
+                    batch_size=batch_size,
                 )
                 # process_articles(limit = limit)
 
@@ -38,6 +38,7 @@ import re
 from datetime import datetime, timezone
 
 from db.models import Entity
+from nertokenizer import entity_names
 from tokenizer import Abbreviations
 
 from queries import QueryStateDict
@@ -405,7 +406,9 @@ def article_begin(state: TreeStateDict) -> None:
 
 def article_end(state: TreeStateDict) -> None:
     """Called at the end of article processing"""
-    pass
+    # The entities of the article have been deleted and eventually
+    # redefined: rebuild the entity name trie of this process on its next use
+    entity_names.invalidate()
 
 
 def sentence(state: QueryStateDict, result: Result) -> None:
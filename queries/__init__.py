@@ -26,8 +26,10 @@
 """
 
 from typing import (
+    TYPE_CHECKING,
     ChainMap as ChainMapType,
     DefaultDict,
+    NamedTuple,
     Optional,
     Sequence,
     Set,
@@ -46,14 +48,42 @@ from typing_extensions import Protocol, Literal
 
 from types import FunctionType, ModuleType
 
+import atexit
+import glob
+import hashlib
 import importlib
 import logging
+import os
+import pickle
+import queue
 from datetime import datetime, timedelta, timezone
 import json
 import re
 import random
+import threading
+import time
 from collections import defaultdict, ChainMap
 
+from cachetools import LRUCache, TLRUCache
+
+if TYPE_CHECKING:
+    from concurrent.futures import Future, ThreadPoolExecutor
+else:
+    from concurrent.futures import Future
+
+    # Under Gunicorn/eventlet, the threading module is monkey-patched
+    # to use green threads, which cannot parse concurrently. We make sure
+    # to obtain a thread pool that uses real (OS) threads, allowing the
+    # C++ parser to run in parallel while the GIL is released.
+    try:
+        import eventlet  # type: ignore
+
+        ThreadPoolExecutor = eventlet.patcher.original(
+            "concurrent.futures.thread"
+        ).ThreadPoolExecutor
+    except ImportError:
+        from concurrent.futures import ThreadPoolExecutor
+
 from tokenizer import BIN_Tuple, detokenize
 from reynir import TOK, Tok, tokenize
 from reynir.fastparser import (
@@ -66,14 +96,17 @@ from reynir.binparser import BIN_Grammar, BIN_Token
 from reynir.reducer import Reducer
 from reynir.bindb import GreynirBin
 from reynir.grammar import GrammarError
+from reynir.version import __version__ as greynir_version
 from islenska.bindb import BinFilterFunc
 
 from settings import Settings
+from metrics import count, timed, timer
 
 from queries.util import read_grammar_file
 
 from db import SessionContext, Session, desc
 from db.models import Query as QueryRow, QueryClientData, QueryLog
+from db.rollups import KIND_QUERIES, day_of, mark_dirty
 
 from tree import ProcEnv, Tree, TreeStateDict, Node
 
@@ -101,6 +134,26 @@ LookupFunc = Callable[[str], Tuple[str, List[BIN_Tuple]]]
 HelpFunc = Callable[[str], str]
 
 
+class TextProcessor(NamedTuple):
+    """A plain text query handler, with an optional prefilter
+    that cheaply rejects query strings that the handler won't accept"""
+
+    prefilter: Optional[Callable[[str], bool]]
+    handler: Callable[["Query"], bool]
+
+
+class PreparsedQuery(NamedTuple):
+    """The result of tokenizing and parsing a query string"""
+
+    toklist: List[Tok]
+    # The query string, re-created from the auto-capitalized token list
+    actual_q: str
+    # The text representation of the parse tree, if successfully parsed
+    tree_string: Optional[str]
+    # The error code, if not successfully parsed
+    error: Optional[str]
+
+
 class QueryStateDict(TreeStateDict):
     query: "Query"
     names: Dict[str, str]
@@ -235,14 +288,213 @@ class QueryParser(Fast_Parser):
     # need to store them per-instance)
     _grammar_additions = ""
 
+    # The key of the compiled query grammar that has been loaded, if any
+    _grammar_key: Optional[str] = None
+    _grammar_key_lock = threading.Lock()
+
+    # Compiled query grammars are stored in the same directory
+    # as the binary grammar files, named by their keys
+    _COMPILED_GRAMMAR_PREFIX = Fast_Parser._GRAMMAR_FILE + ".query-"
+    # Compiled grammars with other keys are deleted after a day
+    _COMPILED_GRAMMAR_MAX_AGE = 86400.0
+
+    # The private attributes of GreynirEngine's parser classes that
+    # installing a compiled grammar relies on, see _load_compiled_grammar()
+    _ENGINE_ATTRIBUTES = (
+        "_grammar",
+        "_grammar_ts",
+        "_GRAMMAR_BINARY_FILE",
+        "_c_grammar_ts",
+    )
+
+    # The modification time and hash of the grammar file, which is
+    # only read again if it has been modified since it was hashed
+    _grammar_file_digest: Optional[Tuple[float, bytes]] = None
+
     def __init__(self, grammar_additions: str) -> None:
         QueryParser._grammar_additions = grammar_additions
+        QueryParser._load_compiled_grammar()
         super().__init__(verbose=False, root=QUERY_GRAMMAR_ROOT)
 
     @classmethod
     def grammar_additions(cls) -> str:
         return cls._grammar_additions
 
+    @classmethod
+    def grammar_key(cls) -> str:
+        """Return a key that identifies the compiled query grammar:
+        a hash of the grammar sources and the GreynirEngine version.
+        The grammar file is hashed once, and again only if modified."""
+        ts = os.path.getmtime(cls._GRAMMAR_FILE)
+        if cls._grammar_file_digest is None or cls._grammar_file_digest[0] != ts:
+            with open(cls._GRAMMAR_FILE, "rb") as f:
+                digest = hashlib.sha256(f.read()).digest()
+            cls._grammar_file_digest = (ts, digest)
+        h = hashlib.sha256(greynir_version.encode("utf-8"))
+        h.update(cls._grammar_file_digest[1])
+        for text in (_QUERY_ROOT_GRAMMAR, cls._grammar_additions):
+            h.update(b"\0")
+            h.update(text.encode("utf-8"))
+        return h.hexdigest()[:32]
+
+    @classmethod
+    def _load_compiled_grammar(cls) -> None:
+        """Make the compiled query grammar for the current grammar additions
+        the one that parser instances share. Reading and compiling the
+        grammar text takes several seconds, so the compiled grammar is
+        stored, as a pickled QueryGrammar instance along with the binary
+        grammar file that the C++ parser loads, and loaded from there by
+        other processes and later starts. If anything fails, the grammar
+        is read by the parser as before."""
+        key = cls.grammar_key()
+        with cls._grammar_key_lock:
+            if cls._grammar_key == key:
+                # Already loaded by this process
+                return
+            missing = [
+                a for a in cls._ENGINE_ATTRIBUTES if not hasattr(Fast_Parser, a)
+            ]
+            if missing:
+                # The grammar would be installed where the parser doesn't
+                # look for it, so leave the loading to the parser
+                logging.warning(
+                    f"GreynirEngine {greynir_version} lacks the parser attributes "
+                    f"{', '.join(missing)}; not using compiled query grammars"
+                )
+                cls._grammar_key = key
+                return
+            base = cls._COMPILED_GRAMMAR_PREFIX + key
+            grammar = cls._read_compiled_grammar(base)
+            if grammar is None:
+                grammar = cls._compile_grammar(base)
+                if grammar is None:
+                    # Don't try again in this process
+                    cls._grammar_key = key
+                    return
+            # Install the grammar as if BIN_Parser had read it, and point the
+            # C++ parser to the corresponding binary file, making it reload
+            # if a grammar with another key has been loaded
+            cls._grammar = grammar
+            cls._grammar_ts = os.path.getmtime(cls._GRAMMAR_FILE)
+            if cls._GRAMMAR_BINARY_FILE != base + ".bin":
+                cls._GRAMMAR_BINARY_FILE = base + ".bin"
+                cls._c_grammar_ts = None
+            cls._grammar_key = key
+
+    @staticmethod
+    def _read_compiled_grammar(base: str) -> Optional[QueryGrammar]:
+        """Load a stored compiled grammar, if found"""
+        if not os.path.exists(base + ".bin"):
+            return None
+        try:
+            with open(base + ".pickle", "rb") as f:
+                grammar = pickle.load(f)
+        except FileNotFoundError:
+            return None
+        except Exception as e:
+            logging.warning(f"Unable to load compiled query grammar {base}: {e}")
+            return None
+        return grammar if isinstance(grammar, QueryGrammar) else None
+
+    @classmethod
+    def _compile_grammar(cls, base: str) -> Optional[QueryGrammar]:
+        """Read and compile the query grammar, and store it. The files are
+        written under temporary names and then renamed, the binary file
+        last, so that other processes never load a partially written or
+        mismatched grammar."""
+        tmp = f"{base}.{os.getpid()}"
+        try:
+            grammar = QueryGrammar()
+            grammar.read(cls._GRAMMAR_FILE, binary_fname=tmp + ".bin")
+            with open(tmp + ".pickle", "wb") as f:
+                pickle.dump(grammar, f, protocol=pickle.HIGHEST_PROTOCOL)
+            os.replace(tmp + ".pickle", base + ".pickle")
+            os.replace(tmp + ".bin", base + ".bin")
+        except Exception as e:
+            logging.warning(f"Unable to store compiled query grammar {base}: {e}")
+            for suffix in (".pickle", ".bin"):
+                try:
+                    os.remove(tmp + suffix)
+                except OSError:
+                    pass
+            return None
+        # Delete the compiled grammars of previous versions
+        cutoff = time.time() - cls._COMPILED_GRAMMAR_MAX_AGE
+        for fname in glob.glob(cls._COMPILED_GRAMMAR_PREFIX + "*"):
+            try:
+                if not fname.startswith(base) and os.path.getmtime(fname) < cutoff:
+                    os.remove(fname)
+            except OSError:
+                # Deleted concurrently by another process
+                pass
+        return grammar
+
+
+# The outcome of parsing a query token list: a tuple of
+# (tree string, error code), where exactly one is not None
+ParseOutcome = Tuple[Optional[str], Optional[str]]
+# Key of the query parse cache: the (kind, text) tuples of the query tokens
+ParseCacheKey = Tuple[Tuple[int, str], ...]
+
+
+class QueryParseCache:
+
+    """A bounded LRU cache of query parse outcomes, keyed by the normalized
+    token sequence of the query. Only the tokenization-independent grammar
+    work, i.e. parsing and reduction, is cached; the query processors
+    still run on every query. The cache is invalidated if the query
+    grammar is (re)loaded."""
+
+    def __init__(self, maxsize: int) -> None:
+        self._lock = threading.Lock()
+        self.configure(maxsize)
+
+    def configure(self, maxsize: int) -> None:
+        """(Re)initialize the cache with the given maximum size"""
+        with self._lock:
+            self._enabled = maxsize > 0
+            self._cache: LRUCache[ParseCacheKey, ParseOutcome] = LRUCache(
+                maxsize=max(1, maxsize)
+            )
+            # The grammar that the cached outcomes were obtained with
+            self._grammar: Any = None
+            self.hits = 0
+            self.misses = 0
+
+    @staticmethod
+    def key(toklist: Iterable[Tok]) -> ParseCacheKey:
+        """Return the cache key corresponding to a token list"""
+        return tuple((t.kind, t.txt) for t in toklist)
+
+    def get(self, key: ParseCacheKey, grammar: Any) -> Optional[ParseOutcome]:
+        """Return the cached outcome of parsing the given
+        token sequence with the given grammar, if any"""
+        if not self._enabled:
+            return None
+        with self._lock:
+            if grammar is not self._grammar:
+                # The grammar has been replaced: invalidate the cache
+                self._cache.clear()
+                self._grammar = grammar
+            outcome = self._cache.get(key)
+            if outcome is None:
+                self.misses += 1
+            else:
+                self.hits += 1
+            return outcome
+
+    def put(self, key: ParseCacheKey, grammar: Any, outcome: ParseOutcome) -> None:
+        """Store the outcome of parsing a token sequence with a grammar"""
+        if not self._enabled:
+            return
+        with self._lock:
+            if grammar is self._grammar:
+                self._cache[key] = outcome
+
+
+# The singleton query parse cache of this process
+query_parse_cache = QueryParseCache(Settings.QUERY_PARSE_CACHE_SIZE)
+
 
 class QueryTree(Tree):
 
@@ -315,8 +567,12 @@ class Query:
     # Functions from utility modules,
     # facilitating code reuse between query modules
     _utility_functions: ChainMapType[str, FunctionType] = ChainMap()
-    # Handler functions within processors that handle plain text
-    _text_processors: List[Callable[["Query"], bool]] = []
+    # Index from query nonterminals to the indices (in priority order)
+    # of the tree processors that are interested in them
+    _tree_processor_index: Dict[str, List[int]] = dict()
+    # Handler functions within processors that handle plain text,
+    # each with an optional prefilter on the lower case query string
+    _text_processors: List[TextProcessor] = []
     # Handler of last resort for queries that no processor handles
     _last_resort_processor: Optional[Callable[["Query"], bool]] = None
     # Singleton instance of the query parser
@@ -389,8 +645,12 @@ class Query:
         # Query context, which is None until fetched via self.fetch_context()
         # This should be a dict that can be represented in JSON
         self._context: Optional[ContextDict] = None
+        # The outcome of tokenizing and parsing the query string
+        # ahead of time, if it is being done concurrently
+        self._preparsed: Optional["Future[PreparsedQuery]"] = None
 
-    def _preprocess_query_string(self, q: str) -> str:
+    @staticmethod
+    def _preprocess_query_string(q: str) -> str:
         """Preprocess the query string prior to further analysis"""
         # Note: Whitespace, periods, question marks, and exclamation marks
         # have already been stripped off the end of the query string
@@ -413,7 +673,7 @@ class Query:
         processor modules and the query parser instance"""
         all_procs: List[ModuleType] = []
         tree_procs: List[Tuple[int, ModuleType]] = []
-        text_procs: List[Tuple[int, Callable[["Query"], bool]]] = []
+        text_procs: List[Tuple[int, TextProcessor]] = []
         last_resort_proc: Optional[Callable[["Query"], bool]] = None
         # Load the query processor modules found in the
         # queries directory. The modules can be tree and/or text processors,
@@ -452,7 +712,12 @@ class Query:
                     # This is a text processor:
                     # store a reference to its handler function
                     is_proc = True
-                    text_procs.append((priority, handle_plain_text))
+                    prefilter = cls.create_prefilter(
+                        modname, getattr(m, "PLAIN_TEXT_PREFILTER", None)
+                    )
+                    text_procs.append(
+                        (priority, TextProcessor(prefilter, handle_plain_text))
+                    )
                 if is_proc:
                     all_procs.append(m)
             except ImportError as e:
@@ -469,13 +734,23 @@ class Query:
         cls._text_processors = [t[1] for t in sorted(text_procs, key=lambda x: -x[0])]
         cls._last_resort_processor = last_resort_proc
 
+        # Index the tree processors by the query nonterminals that they
+        # handle, so that only the relevant ones are visited for a given tree
+        index: DefaultDict[str, List[int]] = defaultdict(list)
+        for ix, processor in enumerate(cls._tree_processors):
+            for nt in processor.get("QUERY_NONTERMINALS", set()):
+                index[nt].append(ix)
+        cls._tree_processor_index = dict(index)
+
         if Settings.DEBUG:
             # Print the active processors in descending priority order
             print("Text processors:")
             print(
                 "\n".join(
-                    f"{p[0]:4} -> {p[1].__module__}.{p[1].__qualname__}"
+                    f"{p[0]:4} -> {h.__module__}.{h.__qualname__}"
+                    + ("" if p[1].prefilter is None else " (prefiltered)")
                     for p in sorted(text_procs, key=lambda x: -x[0])
+                    for h in (p[1].handler,)
                 )
             )
             print("Tree processors:")
@@ -549,6 +824,43 @@ class Query:
         # with the nonterminal 'QueryRoot' as the grammar root
         cls._parser = QueryParser(grammar_additions)
 
+        # Configure the caches and the concurrent parser from the settings,
+        # which have been read by now. This also discards previously cached
+        # parse outcomes, which may no longer be valid.
+        query_cache.configure(Settings.QUERY_CACHE_SIZE, Settings.QUERY_CACHE_REDIS_URL)
+        query_parse_cache.configure(Settings.QUERY_PARSE_CACHE_SIZE)
+        parallel_query_parser.configure(Settings.QUERY_PARSE_WORKERS)
+        query_log_writer.configure(Settings.QUERY_LOG_QUEUE_SIZE)
+
+    @staticmethod
+    def create_prefilter(modname: str, spec: Any) -> Optional[Callable[[str], bool]]:
+        """Create a prefilter function from the PLAIN_TEXT_PREFILTER attribute
+        of a text processor module. The attribute can be a regular expression
+        (string or compiled), which is searched for in the lower case query
+        string without trailing question marks, or a collection of keywords,
+        at least one of which must occur in that string. The module's
+        handle_plain_text() function is only called for query strings
+        that pass the prefilter. Only the tel, words, repeat, distance
+        and play modules define prefilters. Of the other text processors,
+        special, stats, test and time start with a lookup of the query
+        string in a set or dict, and gain little from a prefilter, the
+        queries handled by userinfo share no common keyword, and gpt is
+        the last resort, which must see every query."""
+        if spec is None:
+            return None
+        if isinstance(spec, str):
+            spec = re.compile(spec)
+        if isinstance(spec, re.Pattern):
+            return lambda ql: spec.search(ql) is not None
+        keywords = tuple(spec)
+        if not keywords or not all(isinstance(kw, str) for kw in keywords):
+            logging.error(
+                f"Module {modname} has an invalid PLAIN_TEXT_PREFILTER: "
+                "expected a regular expression or a collection of keywords"
+            )
+            return None
+        return lambda ql: any(kw in ql for kw in keywords)
+
     @staticmethod
     def create_processing_env(processor: ModuleType) -> ProcEnv:
         """
@@ -560,9 +872,13 @@ class Query:
         return Query._utility_functions.new_child(vars(processor))
 
     @staticmethod
-    def _parse(toklist: Iterable[Tok]) -> Tuple[ResponseDict, Dict[int, str]]:
-        """Parse a token list as a query"""
-        bp = Query._parser
+    @timed("query_parse")
+    def _parse(
+        toklist: Iterable[Tok], parser: Optional[QueryParser] = None
+    ) -> Tuple[ResponseDict, Dict[int, str]]:
+        """Parse a token list as a query, by default
+        using the singleton query parser"""
+        bp = parser or Query._parser
         assert bp is not None
         num_sent = 0
         num_parsed_sent = 0
@@ -626,85 +942,127 @@ class Query:
                 actual_q += "?"
         return actual_q
 
-    def parse(self, result: ResponseDict) -> bool:
-        """Parse the query from its string, returning True if valid"""
-        self._tree = None  # Erase previous tree, if any
-        self._error = None  # Erase previous error, if any
-        self._qtype = None  # Erase previous query type, if any
-        self._key = None
-        self._toklist = None
-
-        q = self._query
-        if not q:
-            self.set_error("E_EMPTY_QUERY")
-            return False
+    @staticmethod
+    def preparse(
+        q: str, auto_uppercase: bool, parser: Optional[QueryParser] = None
+    ) -> PreparsedQuery:
+        """Tokenize and parse a (preprocessed, non-empty) query string.
+        This has no side effects and can thus be done concurrently
+        for several query strings, given a parser instance per thread."""
 
         # Tokenize and auto-capitalize the query string, without multiplying numbers together
-        toklist = list(
-            tokenize(
-                q,
-                auto_uppercase=self._auto_uppercase and q.islower(),
-                no_multiply_numbers=True,
+        with timer("query_tokenize"):
+            toklist = list(
+                tokenize(
+                    q,
+                    auto_uppercase=auto_uppercase and q.islower(),
+                    no_multiply_numbers=True,
+                )
             )
-        )
 
-        actual_q = self._query_string_from_toklist(toklist)
-
-        # Update the beautified query string, as the actual_q string
-        # probably has more correct capitalization
-        self.set_beautified_query(actual_q)
+        actual_q = Query._query_string_from_toklist(toklist)
 
         # TODO: We might want to re-tokenize the actual_q string with
         # auto_uppercase=False, since we may have fixed capitalization
         # errors in _query_string_from_toklist()
 
-        if Settings.DEBUG:
-            # Log the query string as seen by the parser
-            print(f"Query is: '{actual_q}'")
+        bp = parser or Query._parser
+        assert bp is not None
+        # Near-identical queries are common: look up the
+        # parse outcome of the same token sequence in the cache
+        key = QueryParseCache.key(toklist)
+        outcome = query_parse_cache.get(key, bp.grammar)
+        if outcome is None:
+            outcome = Query._parse_toklist(toklist, bp)
+            query_parse_cache.put(key, bp.grammar, outcome)
+        tree_string, error = outcome
+        return PreparsedQuery(toklist, actual_q, tree_string, error)
 
+    @staticmethod
+    def _parse_toklist(toklist: List[Tok], parser: QueryParser) -> ParseOutcome:
+        """Parse a query token list, returning a (tree string, error code) tuple"""
         try:
-            parse_result, trees = Query._parse(toklist)
+            parse_result, trees = Query._parse(toklist, parser)
         except ParseError:
-            self.set_error("E_PARSE_ERROR")
-            return False
+            return None, "E_PARSE_ERROR"
 
         if not trees:
             # No parse at all
-            self.set_error("E_NO_PARSE_TREES")
-            return False
+            return None, "E_NO_PARSE_TREES"
 
         if parse_result["num_sent"] != 1:
             # Queries must be one sentence
-            self.set_error("E_MULTIPLE_SENTENCES")
-            return False
+            return None, "E_MULTIPLE_SENTENCES"
         if parse_result["num_parsed_sent"] != 1:
             # Unable to parse the single sentence
-            self.set_error("E_NO_PARSE")
-            return False
+            return None, "E_NO_PARSE"
         if 1 not in trees:
             # No sentence number 1
-            self.set_error("E_NO_FIRST_SENTENCE")
-            return False
+            return None, "E_NO_FIRST_SENTENCE"
         # Looks good
-        # Store the resulting parsed query as a tree
-        tree_string = "S1\n" + trees[1]
+        # Return the resulting parsed query as a tree string
+        return "S1\n" + trees[1], None
+
+    def set_preparsed(self, preparsed: "Future[PreparsedQuery]") -> None:
+        """Provide the (future) outcome of tokenizing and parsing
+        the query string, which is then used by parse()"""
+        self._preparsed = preparsed
+
+    def parse(self, result: ResponseDict) -> bool:
+        """Parse the query from its string, returning True if valid"""
+        self._tree = None  # Erase previous tree, if any
+        self._error = None  # Erase previous error, if any
+        self._qtype = None  # Erase previous query type, if any
+        self._key = None
+        self._toklist = None
+
+        q = self._query
+        if not q:
+            self.set_error("E_EMPTY_QUERY")
+            return False
+
+        if self._preparsed is not None:
+            # Already being tokenized and parsed concurrently
+            pq = self._preparsed.result()
+        else:
+            pq = Query.preparse(q, self._auto_uppercase)
+
+        # Update the beautified query string, as the actual_q string
+        # probably has more correct capitalization
+        self.set_beautified_query(pq.actual_q)
+
+        if Settings.DEBUG:
+            # Log the query string as seen by the parser
+            print(f"Query is: '{pq.actual_q}'")
+
+        if pq.error is not None:
+            self.set_error(pq.error)
+            return False
+
+        assert pq.tree_string is not None
         # if Settings.DEBUG:
-        #    print(tree_string)
+        #    print(pq.tree_string)
+        # Store the resulting parsed query as a tree
         self._tree = QueryTree()
-        self._tree.load(tree_string)
+        self._tree.load(pq.tree_string)
         # Store the token list
-        self._toklist = toklist
+        self._toklist = pq.toklist
         return True
 
     def execute_from_plain_text(self) -> bool:
         """Attempt to execute a plain text query, without having to parse it"""
         if not self._query:
             return False
-        # Call the handle_plain_text() function in each text processor,
+        ql = self.query_lower.rstrip("?")
+        # Call the handle_plain_text() function in each text processor
+        # whose prefilter (if any) accepts the query string,
         # until we find one that returns True, or return False otherwise
-        return any(
-            handle_plain_text(self) for handle_plain_text in self._text_processors
-        )
+        for tp in self._text_processors:
+            if tp.prefilter is None or tp.prefilter(ql):
+                with timer("query_processor", getattr(tp.handler, "__module__", "")):
+                    if tp.handler(self):
+                        return True
+        return False
 
     def execute_from_tree(self) -> bool:
         """Execute the query or queries contained in the previously parsed tree;
@@ -712,8 +1070,15 @@ class Query:
         if self._tree is None:
             self.set_error("E_QUERY_NOT_PARSED")
             return False
-        # Try each tree processor in turn, in priority order (highest priority first)
-        for processor in self._tree_processors:
+        # Look up the tree processors that are interested in any of the
+        # query nonterminals in the parse forest. Try each of them in turn,
+        # in priority order (highest priority first).
+        index = self._tree_processor_index
+        candidates: Set[int] = set()
+        for nt in self._tree.query_nonterminals:
+            candidates.update(index.get(nt, ()))
+        for ix in sorted(candidates):
+            processor = self._tree_processors[ix]
             self._error = None
             self._qtype = None
             # Process the tree, which has only one sentence, but may
@@ -723,11 +1088,13 @@ class Query:
                 # Note that passing query=self here means that the
                 # "query" field of the TreeStateDict is populated,
                 # turning it into a QueryStateDict.
-                if self._tree.process_queries(
-                    self,
-                    self._session,
-                    processor,
-                ):
+                with timer("query_processor", processor.get("__name__", "")):
+                    found = self._tree.process_queries(
+                        self,
+                        self._session,
+                        processor,
+                    )
+                if found:
                     # This processor found an answer, which is already stored
                     # in the Query object: return True
                     return True
@@ -749,6 +1116,8 @@ class Query:
         if not self._client_id:
             # Can't find the last answer if no client_id given
             return None
+        # Make sure that the previous queries of the client have been logged
+        query_log_writer.wait_for_client(self._client_id)
         # Find the newest non-error, no-repeat query result for this client
         q = (
             self._session.query(QueryRow.answer, QueryRow.voice)
@@ -770,6 +1139,8 @@ class Query:
         if not self._client_id:
             # Can't find the last answer if no client_id given
             return None
+        # Make sure that the previous queries of the client have been logged
+        query_log_writer.wait_for_client(self._client_id)
         # Find the newest non-error, no-repeat query result for this client
         q = (
             self._session.query(QueryRow.context)
@@ -794,6 +1165,8 @@ class Query:
         if not self._client_id:
             # Can't find the last answer if no client_id given
             return 0
+        # Make sure that the previous queries of the client have been logged
+        query_log_writer.wait_for_client(self._client_id)
         # Count the non-error query results for this client and query type
         return (
             self._session.query(QueryRow.id)
@@ -1127,7 +1500,9 @@ class Query:
         # question mark (or other ending punctuation).
         result: ResponseDict = dict(q_raw=self.query, q=self.beautified_query)
         # Execute the query, modifying the result dictionary
-        if not self._execute(result):
+        with timer("query_execute"):
+            ok = self._execute(result)
+        if not ok:
             # Error: return it
             return result
         # Successful query: return the answer in response
@@ -1288,38 +1663,462 @@ def to_genitive(np: str, *, filter_func: Optional[BinFilterFunc] = None) -> str:
         )
 
 
+# A cached answer: a dict with the fields q, answer, voice, expires, qtype and key,
+# or None if the question is known not to have a cached answer
+CachedAnswer = Optional[Dict[str, Any]]
+
+
+class QueryCache:
+
+    """A bounded, per-process in-memory cache in front of the voice query
+    cache in the queries table. Answers are keyed by the lower case question
+    and are evicted when their expiry timestamp passes, or in least recently
+    used order if the cache is full. Optionally, answers are shared between
+    worker processes via Redis. The absence of a cached answer is not
+    remembered, since another process may store one at any time, so
+    questions not found in memory are always looked up further."""
+
+    # Prefix of Redis keys
+    _REDIS_PREFIX = "greynir:qcache:"
+
+    def __init__(self, maxsize: int, redis_url: Optional[str] = None) -> None:
+        self._lock = threading.Lock()
+        self.configure(maxsize, redis_url)
+
+    def configure(self, maxsize: int, redis_url: Optional[str] = None) -> None:
+        """(Re)initialize the cache with the given maximum
+        size and optional Redis server URL"""
+        redis_client: Any = None
+        if redis_url:
+            try:
+                import redis  # type: ignore
+
+                redis_client = redis.Redis.from_url(redis_url)
+            except Exception as e:
+                logging.warning(f"Unable to use Redis for the query cache: {e}")
+        with self._lock:
+            self._cache: TLRUCache[str, Tuple[float, Dict[str, Any]]] = TLRUCache(
+                maxsize=max(1, maxsize),
+                ttu=lambda _key, value, _now: value[0],
+                timer=time.time,
+            )
+            self._enabled = maxsize > 0
+            self._redis = redis_client
+            self.hits = 0
+            self.shared_hits = 0
+            self.misses = 0
+
+    @staticmethod
+    def _timestamp(ts: datetime) -> float:
+        """Convert a datetime, naive ones assumed to be in UTC, to a POSIX timestamp"""
+        if ts.tzinfo is None:
+            ts = ts.replace(tzinfo=timezone.utc)
+        return ts.timestamp()
+
+    def _shared_get(self, key: str) -> CachedAnswer:
+        """Look up an answer in the shared (Redis) cache, if any"""
+        if self._redis is None:
+            return None
+        try:
+            v = self._redis.get(self._REDIS_PREFIX + key)
+        except Exception as e:
+            logging.warning(f"Error reading from shared query cache: {e}")
+            return None
+        if v is None:
+            return None
+        a = json.loads(v)
+        a["expires"] = datetime.fromisoformat(a["expires"])
+        return a
+
+    def _shared_put(self, key: str, a: Dict[str, Any]) -> None:
+        """Store an answer in the shared (Redis) cache, if any"""
+        if self._redis is None:
+            return
+        ms = int((self._timestamp(a["expires"]) - time.time()) * 1000.0)
+        if ms <= 0:
+            return
+        v = json.dumps(dict(a, expires=a["expires"].isoformat()), ensure_ascii=False)
+        try:
+            self._redis.set(self._REDIS_PREFIX + key, v, px=ms)
+        except Exception as e:
+            logging.warning(f"Error writing to shared query cache: {e}")
+
+    def put(self, question: str, a: Dict[str, Any]) -> None:
+        """Store an answer for a question"""
+        if not self._enabled:
+            return
+        key = question.lower()
+        expires = self._timestamp(a["expires"])
+        with self._lock:
+            old = self._cache.get(key)
+            if old is not None and old[0] > expires:
+                # Keep the answer that expires later, as the database lookup does
+                return
+            self._cache[key] = (expires, a)
+        self._shared_put(key, a)
+
+    def get(self, session: Session, question: str, now: datetime) -> CachedAnswer:
+        """Return a cached answer for the question, looking it up
+        in the shared cache and the database if not found in memory"""
+        key = question.lower()
+        if self._enabled:
+            with self._lock:
+                entry = self._cache.get(key)
+                if entry is not None:
+                    self.hits += 1
+                    return entry[1]
+            a = self._shared_get(key)
+            if a is not None and a["expires"] >= now:
+                with self._lock:
+                    self.shared_hits += 1
+                    self._cache[key] = (self._timestamp(a["expires"]), a)
+                return a
+        with self._lock:
+            self.misses += 1
+        cached_answer: Optional[QueryRow] = (
+            session.query(QueryRow)
+            .filter(QueryRow.question_lc == key)  # type: ignore
+            .filter(QueryRow.expires >= now)
+            .order_by(desc(QueryRow.expires))
+            .limit(1)
+            .one_or_none()
+        )
+        a = None
+        if cached_answer is not None:
+            a = dict(
+                q=cached_answer.bquestion,
+                answer=cached_answer.answer,
+                voice=cached_answer.voice,
+                expires=cached_answer.expires,
+                qtype=cached_answer.qtype,
+                key=cached_answer.key,
+            )
+        if a is not None:
+            self.put(key, a)
+        return a
+
+    def stats(self) -> Dict[str, int]:
+        """Return the hit and miss counters of the cache"""
+        with self._lock:
+            return dict(
+                size=len(self._cache),
+                hits=self.hits,
+                shared_hits=self.shared_hits,
+                misses=self.misses,
+            )
+
+
+# The singleton voice query cache of this process
+query_cache = QueryCache(Settings.QUERY_CACHE_SIZE, Settings.QUERY_CACHE_REDIS_URL)
+
+
+class ParallelQueryParser:
+
+    """Tokenizes and parses alternative query strings, such as
+    speech recognition hypotheses, concurrently in a pool of threads,
+    each of which has its own query parser instance"""
+
+    def __init__(self, workers: int) -> None:
+        self._workers = workers
+        self._pool: Optional[ThreadPoolExecutor] = None
+        self._lock = threading.Lock()
+        self._local = threading.local()
+
+    def configure(self, workers: int) -> None:
+        """Set the number of threads in the pool, which is
+        created upon the first use of the parser"""
+        with self._lock:
+            if self._pool is None:
+                self._workers = workers
+
+    @property
+    def enabled(self) -> bool:
+        return self._workers > 0
+
+    def _preparse(self, q: str, auto_uppercase: bool) -> PreparsedQuery:
+        """Tokenize and parse a query string within a pool thread"""
+        parser: Optional[QueryParser] = getattr(self._local, "parser", None)
+        if parser is None:
+            # First query in this thread: create a parser instance,
+            # sharing the already loaded query grammar
+            parser = QueryParser(QueryParser.grammar_additions())
+            self._local.parser = parser
+        return Query.preparse(q, auto_uppercase, parser)
+
+    def submit(
+        self, queries: Iterable[str], auto_uppercase: bool
+    ) -> List[Optional["Future[PreparsedQuery]"]]:
+        """Start tokenizing and parsing the given query strings, returning a
+        list of futures (None for strings that are empty after preprocessing)"""
+        if Query._parser is None:
+            # Make sure that the query grammar is loaded before the threads need it
+            Query.init_class()
+        with self._lock:
+            if self._pool is None:
+                self._pool = ThreadPoolExecutor(
+                    max_workers=self._workers, thread_name_prefix="query_parser"
+                )
+        result: List[Optional["Future[PreparsedQuery]"]] = []
+        for qtext in queries:
+            q = Query._preprocess_query_string(qtext.strip())
+            result.append(
+                self._pool.submit(self._preparse, q, auto_uppercase) if q else None
+            )
+        return result
+
+
+# The singleton concurrent parser of alternative query strings
+parallel_query_parser = ParallelQueryParser(Settings.QUERY_PARSE_WORKERS)
+
+
+# The column values of a queries table row
+QueryRowValues = Dict[str, Any]
+
+# Under Gunicorn/eventlet, the threading module is monkey-patched and the
+# query log writer thread is a green thread. Since psycopg2 is not patched
+# to cooperate with eventlet, its blocking database I/O would then stall
+# all requests of the worker process. The writer therefore delegates its
+# inserts to eventlet's pool of real (OS) threads.
+try:
+    from eventlet import patcher, tpool  # type: ignore
+
+    _run_blocking: Optional[Callable[..., Any]] = (
+        tpool.execute if patcher.is_monkey_patched("thread") else None
+    )
+except ImportError:
+    _run_blocking = None
+
+
+class QueryLogWriter:
+
+    """Writes logged queries to the queries and querylog tables in a
+    background thread, off the request path. Rows wait in a bounded queue
+    and are inserted in batches, each with multi-row inserts in a single
+    transaction. If the queue is full, a request waits for a short while
+    for room and the row is then dropped, and counted as such. Queries that
+    read the previous queries of a client (for context, repetition etc.)
+    first wait until that client's pending rows have been written.
+    Under eventlet, the inserts run in a real (OS) thread, see above."""
+
+    # Maximum number of rows inserted in a single transaction
+    BATCH_SIZE = 500
+    # Maximum time, in seconds, that a row waits for a batch to fill up
+    BATCH_DELAY = 0.25
+    # Time, in seconds, that a request waits for room in a full queue
+    PUT_TIMEOUT = 0.05
+    # Maximum time, in seconds, to wait for the pending rows
+    # of a client, or for all rows upon shutdown
+    SYNC_TIMEOUT = 5.0
+
+    def __init__(self, maxsize: int) -> None:
+        self._lock = threading.Lock()
+        self._written_cond = threading.Condition(self._lock)
+        self._thread: Optional[threading.Thread] = None
+        self._pid = 0
+        self.configure(maxsize)
+        atexit.register(self.close)
+
+    def configure(self, maxsize: int) -> None:
+        """Set the maximum number of rows waiting to be written
+        (0 means that rows are written synchronously by the caller).
+        Any rows already waiting are written first."""
+        self.close()
+        with self._lock:
+            self._maxsize = maxsize
+            self._queue: "queue.Queue[Optional[QueryRowValues]]" = queue.Queue(
+                maxsize=max(1, maxsize)
+            )
+            # Number of rows submitted but not yet written, per client
+            self._pending: DefaultDict[str, int] = defaultdict(int)
+            self.submitted = 0
+            self.written = 0
+            self.blocked = 0
+            self.dropped = 0
+            self.failed = 0
+            self.batches = 0
+
+    @property
+    def enabled(self) -> bool:
+        return self._maxsize > 0
+
+    def _start(self) -> None:
+        """Start the writer thread in this process, if not already running"""
+        pid = os.getpid()
+        with self._lock:
+            if self._thread is not None and self._pid == pid:
+                return
+            if self._pid != pid:
+                # Forked from a process that already had a writer thread,
+                # which does not exist in this one: discard its state
+                self._queue = queue.Queue(maxsize=max(1, self._maxsize))
+                self._pending = defaultdict(int)
+            self._pid = pid
+            self._thread = threading.Thread(
+                target=self._run, name="query_log_writer", daemon=True
+            )
+            self._thread.start()
+
+    def put(self, values: QueryRowValues) -> bool:
+        """Submit a row for writing, returning False if it was dropped
+        because the queue is full"""
+        self._start()
+        client_id: Optional[str] = values.get("client_id")
+        with self._lock:
+            self.submitted += 1
+            if client_id:
+                self._pending[client_id] += 1
+        try:
+            try:
+                self._queue.put_nowait(values)
+            except queue.Full:
+                # Back-pressure: wait briefly for the writer to catch up
+                with self._lock:
+                    self.blocked += 1
+                self._queue.put(values, timeout=self.PUT_TIMEOUT)
+        except queue.Full:
+            with self._lock:
+                self.dropped += 1
+                dropped = self.dropped
+                if client_id:
+                    self._done(client_id)
+            if dropped % 1000 == 1:
+                logging.warning(
+                    f"Query log queue is full: {dropped} queries not logged so far"
+                )
+            return False
+        return True
+
+    def _done(self, client_id: str) -> None:
+        """Note that a row of the given client has been handled;
+        called with the lock held"""
+        n = self._pending[client_id] - 1
+        if n > 0:
+            self._pending[client_id] = n
+        else:
+            del self._pending[client_id]
+            self._written_cond.notify_all()
+
+    def wait_for_client(self, client_id: Optional[str]) -> None:
+        """Wait until the pending rows of the given client have been written"""
+        if not client_id:
+            return
+        with self._lock:
+            self._written_cond.wait_for(
+                lambda: client_id not in self._pending, timeout=self.SYNC_TIMEOUT
+            )
+
+    def _run(self) -> None:
+        """Collect rows from the queue and write them in batches,
+        until a None sentinel is received"""
+        q = self._queue
+        running = True
+        while running:
+            row = q.get()
+            if row is None:
+                break
+            batch = [row]
+            deadline = time.monotonic() + self.BATCH_DELAY
+            while len(batch) < self.BATCH_SIZE:
+                timeout = deadline - time.monotonic()
+                try:
+                    row = q.get(timeout=timeout) if timeout > 0 else q.get_nowait()
+                except queue.Empty:
+                    break
+                if row is None:
+                    running = False
+                    break
+                batch.append(row)
+            self._write(batch)
+
+    def _insert(self, batch: List[QueryRowValues]) -> None:
+        """Insert a batch of rows into the queries and querylog tables"""
+        with SessionContext(commit=True) as session:
+            s = cast(Any, session)
+            s.execute(cast(Any, QueryRow).table().insert(), batch)
+            s.execute(
+                cast(Any, QueryLog).table().insert(),
+                [{c: row.get(c) for c in QueryLog.COPIED_COLUMNS} for row in batch],
+            )
+            days = [day_of(row["timestamp"]) for row in batch]
+            mark_dirty(session, KIND_QUERIES, days)
+
+    def _write(self, batch: List[QueryRowValues]) -> None:
+        """Write a batch of rows and update the counters"""
+        try:
+            if _run_blocking is not None:
+                _run_blocking(self._insert, batch)
+            else:
+                self._insert(batch)
+            ok = True
+        except Exception as e:
+            logging.error(f"Error writing {len(batch)} logged queries: {e}")
+            ok = False
+        with self._lock:
+            self.batches += 1
+            if ok:
+                self.written += len(batch)
+            else:
+                self.failed += len(batch)
+            for row in batch:
+                client_id = row.get("client_id")
+                if client_id:
+                    self._done(client_id)
+
+    def close(self) -> None:
+        """Write all waiting rows and stop the writer thread"""
+        with self._lock:
+            thread = self._thread if self._pid == os.getpid() else None
+            self._thread = None
+        if thread is None:
+            return
+        self._queue.put(None)
+        thread.join(timeout=self.SYNC_TIMEOUT)
+        if thread.is_alive():
+            logging.warning("Timed out writing logged queries upon shutdown")
+
+    def stats(self) -> Dict[str, int]:
+        """Return the counters of the writer"""
+        with self._lock:
+            return dict(
+                queued=self._queue.qsize(),
+                submitted=self.submitted,
+                written=self.written,
+                batches=self.batches,
+                blocked=self.blocked,
+                dropped=self.dropped,
+                failed=self.failed,
+            )
+
+
+# The singleton query log writer of this process
+query_log_writer = QueryLogWriter(Settings.QUERY_LOG_QUEUE_SIZE)
+
+
 def _get_cached_answer(
     session: Session, qtext: str, clean_q: str, now: datetime
 ) -> ResponseDict:
     """Attempt to fetch a previously cached answer for the given query"""
-    cached_answer: Optional[QueryRow] = (
-        session.query(QueryRow)
-        .filter(QueryRow.question_lc == clean_q.lower())  # type: ignore
-        .filter(QueryRow.expires >= now)
-        .order_by(desc(QueryRow.expires))
-        .limit(1)
-        .one_or_none()
-    )
-    if cached_answer is None:
+    a = query_cache.get(session, clean_q, now)
+    if a is None:
         # Not found in cache: return an empty dict
         return dict()
     # The same question is found in the cache and has not expired:
     # return the previous answer
-    a = cached_answer
     # !!! TBD: Log the cached answer as well?
     return dict(
         valid=True,
         q_raw=qtext,
-        q=a.bquestion,
-        answer=a.answer,
-        response=dict(answer=a.answer or ""),
-        voice=a.voice,
-        expires=a.expires,
-        qtype=a.qtype,
-        key=a.key,
+        q=a["q"],
+        answer=a["answer"],
+        response=dict(answer=a["answer"] or ""),
+        voice=a["voice"],
+        expires=a["expires"],
+        qtype=a["qtype"],
+        key=a["key"],
     )
 
 
+@timed("query_log")
 def _log_query(
     session: Session,
     it: List[str],
@@ -1333,10 +2132,11 @@ def _log_query(
     client_type: Optional[str],
     client_version: Optional[str],
 ) -> None:
-    """Add a query log entry to the database"""
+    """Add a query log entry to the database, either via the
+    background writer or directly within the given session"""
     try:
         # Standard query logging
-        qrow = QueryRow(
+        values: QueryRowValues = dict(
             timestamp=now,
             interpretations=it,
             question=clean_q,
@@ -1362,13 +2162,35 @@ def _log_query(
             context=None if query is None else query.context,
             # All other fields are set to NULL
         )
-        session.add(qrow)
-        # Also log anonymised query
-        session.add(QueryLog.from_Query(qrow))
+        if query_log_writer.enabled:
+            query_log_writer.put(values)
+        else:
+            qrow = QueryRow(**values)
+            session.add(qrow)
+            # The daily query rollups are recomputed when next read
+            mark_dirty(session, KIND_QUERIES, [day_of(now)])
+            # Also log anonymised query
+            session.add(QueryLog.from_Query(qrow))
+        valid = result.get("valid") and not values["error"]
+        if values["expires"] is not None and valid:
+            # Make the answer available to subsequent identical voice queries
+            # from the cache, before it has been written to the database
+            query_cache.put(
+                clean_q,
+                dict(
+                    q=values["bquestion"],
+                    answer=values["answer"],
+                    voice=values["voice"],
+                    expires=values["expires"],
+                    qtype=values["qtype"],
+                    key=values["key"],
+                ),
+            )
     except Exception as e:
         logging.error(f"Error logging query: {e}")
 
 
+@timed("query")
 def process_query(
     q: Union[str, Iterable[str]],
     voice: bool,
@@ -1393,6 +2215,10 @@ def process_query(
     or an iterable of strings that will be processed in
     order until a successful one is found."""
 
+    if Query._parser is None:
+        # Load the query processors and configure the query caches
+        Query.init_class()
+
     now = _now()
     result: ResponseDict = dict()
     client_id = client_id[:256] if client_id else None
@@ -1409,12 +2235,17 @@ def process_query(
             # in decreasing priority order
             it = list(q)
 
+        preparsed: List[Optional["Future[PreparsedQuery]"]] = []
         try:
+            if len(it) > 1 and parallel_query_parser.enabled:
+                # Tokenize and parse all the query strings concurrently,
+                # while still executing them in priority order below
+                preparsed = parallel_query_parser.submit(it, auto_uppercase)
             # Iterate through the submitted query strings,
             # assuming that they are in decreasing order of probability,
             # attempting to execute them in turn until we find
             # one that works (or we're stumped)
-            for qtext in it:
+            for ix, qtext in enumerate(it):
                 qtext = qtext.strip()
                 clean_q = qtext.rstrip("?.! \n\r\t")
                 if first_clean_q is None:
@@ -1432,8 +2263,10 @@ def process_query(
                     # Only use the cache for voice queries
                     # (handling detailed responses in other queries
                     # is too much for the cache)
-                    result = _get_cached_answer(session, qtext, clean_q, now)
+                    with timer("query_cache"):
+                        result = _get_cached_answer(session, qtext, clean_q, now)
                     if result:
+                        count("query_cache_hit")
                         return result
 
                 # The answer is not found in the cache:
@@ -1450,6 +2283,8 @@ def process_query(
                     authenticated,
                     private,
                 )
+                if preparsed and preparsed[ix] is not None:
+                    query.set_preparsed(cast("Future[PreparsedQuery]", preparsed[ix]))
                 result = query.execute()
                 if result.get("valid", False) and "error" not in result:
                     # Successful: our job is done
@@ -1511,6 +2346,13 @@ def process_query(
             logging.error(f"Error processing query: {e}")
             result = dict(valid=False, error=f"E_EXCEPTION: {e}")
 
+        finally:
+            # Don't bother parsing lower-priority query strings
+            # once we have an answer
+            for f in preparsed:
+                if f is not None:
+                    f.cancel()
+
         # If we get here, we failed to answer the query
         result["valid"] = False
         if "error" not in result:
@@ -29,7 +29,6 @@
 
 from typing import Any, Dict, List, Mapping, Optional, Sequence, cast
 
-import cachetools  # type: ignore
 import random
 import logging
 
@@ -43,6 +42,7 @@ from queries.util import (
     is_plural,
     read_grammar_file,
 )
+from queries.util.feeds import Feed
 from tree import Result, Node, NonterminalNode
 
 
@@ -203,9 +203,8 @@ _CURR_API_URL = "https://apis.is/currency/arion"
 _CURR_CACHE_TTL = 3600  # seconds
 
 
-@cachetools.cached(cachetools.TTLCache(1, _CURR_CACHE_TTL))
 def _fetch_exchange_rates() -> Optional[Dict[str, float]]:
-    """Fetch exchange rate data from apis.is and cache it."""
+    """Fetch exchange rate data from apis.is"""
     res = query_json_api(_CURR_API_URL)
     if not isinstance(res, dict) or "results" not in res:
         logging.warning(f"Unable to fetch exchange rate data from {_CURR_API_URL}")
@@ -217,9 +216,14 @@ def _fetch_exchange_rates() -> Optional[Dict[str, float]]:
     }
 
 
+_CURR_FEED: Feed[Dict[str, float]] = Feed(
+    "currency", _fetch_exchange_rates, _CURR_CACHE_TTL
+)
+
+
 def fetch_exchange_rates() -> Optional[Dict[str, float]]:
     """Fetch exchange rate data using cache"""
-    return _fetch_exchange_rates()
+    return _CURR_FEED.get()
 
 
 def _query_exchange_rate(curr1: str, curr2: str) -> Optional[float]:
@@ -231,7 +235,7 @@ def _query_exchange_rate(curr1: str, curr2: str) -> Optional[float]:
         return 1
 
     # Get exchange rate data
-    xr = _fetch_exchange_rates()
+    xr = fetch_exchange_rates()
     if xr is None:
         return None
 
@@ -54,6 +54,8 @@ from geo import distance, capitalize_placename
 
 _DISTANCE_QTYPE = "Distance"
 
+# Keywords that all distance and travel time queries contain
+PLAIN_TEXT_PREFILTER = ("langt", "metr", "lengi", "langan")
 
 _QDISTANCE_REGEXES = (
     r"^(?:en\s)?hvað er ég langt frá (.+)$",
@@ -32,6 +32,11 @@ from datetime import datetime, timedelta, timezone
 
 from queries import Query
 
+# Optional prefilter: a regular expression or a collection of keywords.
+# handle_plain_text() is only called for lower case query strings
+# that match the expression or contain at least one of the keywords.
+PLAIN_TEXT_PREFILTER = ("prufa",)
+
 
 def handle_plain_text(q: Query) -> bool:
     """Handle a plain text query, contained in the q parameter
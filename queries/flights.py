@@ -26,13 +26,12 @@
 # TODO: Map country to capital city, e.g. "Svíþjóð" -> "Stokkhólmur"
 # TODO: Fetch more than one flight using "flight_count"?
 
-from typing import Any, List, Dict, Optional, cast
+from typing import List, Dict, Optional
 from typing_extensions import TypedDict
 
 import re
 import random
 import logging
-import cachetools
 from datetime import datetime, timedelta, timezone
 
 from reynir import NounPhrase
@@ -40,6 +39,7 @@ from icespeak import gssml
 
 from queries import Query, QueryStateDict
 from queries.util import query_json_api, is_plural, read_grammar_file
+from queries.util.feeds import KeyedFeed
 from tree import Result, Node
 from settings import changedlocale
 from geo import capitalize_placename, iceprep_for_placename, icelandic_city_name
@@ -158,15 +158,9 @@ class FlightType(TypedDict, total=False):
 
 FlightList = List[FlightType]
 
-# Cache for flights either departing or arriving
-_FLIGHT_CACHE: Dict[bool, FlightList] = cast(Any, cachetools).TTLCache(
-    maxsize=2, ttl=_FLIGHTS_CACHE_TTL
-)
-
-
 def _fetch_flight_data(
     from_date: datetime, to_date: datetime, iata_code: str, departing: bool
-) -> FlightList:
+) -> Optional[FlightList]:
     """
     Fetch data on flights to/from an Icelandic airport (given with its IATA code)
     between from_date and to_date from Isavia's JSON API.
@@ -189,13 +183,27 @@ def _fetch_flight_data(
         or not res["Success"]
         or "Items" not in res
     ):
-        return []
+        return None
 
-    # Add result to cache
-    _FLIGHT_CACHE[departing] = res["Items"]
     return res["Items"]
 
 
+def _fetch_upcoming_flights(key: str) -> Optional[FlightList]:
+    """Fetch flights to/from an airport within a number of days from now,
+    given a key of the form IATA:departing:days"""
+    iata_code, departing, days = key.split(":")
+    now = datetime.now(timezone.utc)
+    return _fetch_flight_data(
+        now, now + timedelta(days=int(days)), iata_code, departing == "1"
+    )
+
+
+# Flights either departing from or arriving to each airport
+_FLIGHTS_FEED: KeyedFeed[FlightList] = KeyedFeed(
+    "flights", _fetch_upcoming_flights, _FLIGHTS_CACHE_TTL, maxsize=16
+)
+
+
 def _attribute_airport_match(flight: FlightType, attribute: str, airport: str) -> bool:
     """
     Safely checks whether the string flight[attribute] in lowercase
@@ -388,12 +396,7 @@ def _process_result(result: Result) -> Dict[str, str]:
         api_airport = result.get("to_loc", "keflavík").lower()
         airport = result.get("from_loc", "*").lower()
 
-    from_date: datetime
-    to_date: datetime
-    now = datetime.now(timezone.utc)
     days: int = result.get("day_count", 5)  # Check 5 days into future by default
-    from_date = result.get("from_date", now)
-    to_date = result.get("to_date", now + timedelta(days=days))
 
     # Normalize airport/city names
     airport = _LOCATION_ABBREV_MAP.get(airport, airport)
@@ -407,11 +410,9 @@ def _process_result(result: Result) -> Dict[str, str]:
 
     flight_count: int = result.get("flight_count", 1)
 
-    # Check first if function result in cache, else fetch data from API
-    if departing in _FLIGHT_CACHE:
-        flight_data = _FLIGHT_CACHE[departing]
-    else:
-        flight_data = _fetch_flight_data(from_date, to_date, iata_code, departing)
+    # Read the shared flight data, fetching it from the API if not found
+    key = f"{iata_code.upper()}:{int(departing)}:{days}"
+    flight_data = _FLIGHTS_FEED.get(key) or []
 
     flight_data = _filter_flight_data(flight_data, airport, api_airport, flight_count)
 
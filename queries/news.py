@@ -28,16 +28,16 @@
 # TODO: Hvað er helst í fréttum í dag? Fréttir dagsins?
 # TODO: Phonetically transcribe news
 
-from typing import Any, List, Optional, Dict, cast
+from typing import List, Optional, Dict
 
 import logging
-import cachetools  # type: ignore
 import random
 
 from icespeak import gssml
 
 from queries import Query, QueryStateDict, AnswerTuple
 from queries.util import gen_answer, query_json_api, read_grammar_file
+from queries.util.feeds import Feed
 from tree import Result, Node
 
 
@@ -75,8 +75,7 @@ _NEWS_API = "https://ruv.is/json/frettir/hladbord"
 _NEWS_CACHE_TTL = 300  # seconds, ttl = 5 mins
 
 
-@cachetools.cached(cast(Any, cachetools).TTLCache(1, _NEWS_CACHE_TTL))
-def _get_news_data(max_items: int = 8) -> Optional[List[Dict[str, str]]]:
+def _fetch_news_data(max_items: int = 8) -> Optional[List[Dict[str, str]]]:
     """Fetch news headline data from RÚV, preprocess it."""
     res = query_json_api(_NEWS_API)
     if not isinstance(res, dict) or "nodes" not in res or not len(res["nodes"]):
@@ -94,6 +93,16 @@ def _get_news_data(max_items: int = 8) -> Optional[List[Dict[str, str]]]:
     return None
 
 
+_NEWS_FEED: Feed[List[Dict[str, str]]] = Feed(
+    "news", _fetch_news_data, _NEWS_CACHE_TTL
+)
+
+
+def _get_news_data() -> Optional[List[Dict[str, str]]]:
+    """Return news headline data, using cache"""
+    return _NEWS_FEED.get()
+
+
 def _clean_text(txt: str) -> str:
     txt = txt.replace("\r", " ").replace("\n", " ").replace("  ", " ")
     return txt.strip()
@@ -29,7 +29,6 @@
 from typing import List, Dict, Optional
 
 import logging
-import cachetools  # type: ignore
 import random
 
 from icespeak import gssml
@@ -46,6 +45,7 @@ from queries.util import (
     LatLonTuple,
     read_grammar_file,
 )
+from queries.util.feeds import Feed
 
 _PETROL_QTYPE = "Petrol"
 
@@ -115,8 +115,7 @@ _PETROL_API = "https://apis.is/petrol"
 _PETROL_CACHE_TTL = 3600  # seconds, ttl 1 hour
 
 
-@cachetools.cached(cachetools.TTLCache(1, _PETROL_CACHE_TTL))
-def _get_petrol_station_data() -> Optional[List]:
+def _fetch_petrol_station_data() -> Optional[List]:
     """Fetch list of petrol stations w. prices from apis.is (Gasvaktin)"""
     pd = query_json_api(_PETROL_API)
     if not isinstance(pd, dict) or "results" not in pd:
@@ -130,6 +129,14 @@ def _get_petrol_station_data() -> Optional[List]:
     return pd["results"]
 
 
+_PETROL_FEED: Feed[List] = Feed("petrol", _fetch_petrol_station_data, _PETROL_CACHE_TTL)
+
+
+def _get_petrol_station_data() -> Optional[List]:
+    """Return list of petrol stations w. prices, using cache"""
+    return _PETROL_FEED.get()
+
+
 def _stations_with_distance(loc: Optional[LatLonTuple]) -> Optional[List]:
     """Return list of petrol stations w. added distance data."""
     pd = _get_petrol_station_data()
@@ -69,6 +69,8 @@ class SearchResults:
 
 _PLAY_QTYPE = "Play"
 
+# Keywords that all play and show queries contain
+PLAIN_TEXT_PREFILTER = ("spil", "fóninn", "sýndu")
 
 _AFFIRMATIVE = "Skal gert!"
 
@@ -60,6 +60,9 @@ _REPEAT_PREFIXES = tuple(
     )
 )
 
+# Only queries containing one of the prefixes are handled by this module
+PLAIN_TEXT_PREFILTER = _REPEAT_PREFIXES
+
 # _PREFIX_BLACKLIST = frozenset(
 #     ("segðu mér", "segðu okkur", "segðu eitthvað", "segðu frá")
 # )
@@ -35,7 +35,6 @@ from tree import Node, TerminalNode, ParamList, Result
 import logging
 import random
 import datetime
-import cachetools
 
 from tokenizer import split_into_sentences
 
@@ -43,6 +42,7 @@ from icespeak import gssml
 
 from settings import changedlocale
 from queries.util import query_json_api, read_grammar_file
+from queries.util.feeds import KeyedFeed
 
 
 _SCHEDULES_QTYPE = "Schedule"
@@ -251,9 +251,6 @@ _STATION_ENDPOINTS = {
     # _SIMINN: "https://api.tv.siminn.is/oreo-api/v2/channels/{0}/events?start={1}&end={2}",
 }
 
-# Schedule cache (keep for one day)
-_SCHED_CACHE: cachetools.TTLCache = cachetools.TTLCache(maxsize=15, ttl=86400)  # type: ignore
-
 # Type for schedules
 _SchedType = List[Dict[str, Any]]
 
@@ -286,22 +283,21 @@ def _extract_ruv_schedule(response: Dict[str, Any]) -> _SchedType:
         return []
 
 
-def _query_schedule_api(channel: str, station: str, date: datetime.date) -> _SchedType:
-    """Fetch and return channel schedule from API or cache for specified date."""
-
-    if (channel, date) in _SCHED_CACHE:
-        return cast(_SchedType, _SCHED_CACHE[(channel, date)])
+def _fetch_schedule(key: str) -> Optional[_SchedType]:
+    """Fetch a channel schedule from API, given a key
+    of the form station:channel:date"""
+    station, channel, date = key.split(":")
 
     if station == _SIMINN:
         # TODO: Síminn endpoint needs its own formatting
         # since url includes start and end time along with channel ID
-        return []
+        return None
     else:
-        url: str = _STATION_ENDPOINTS[station].format(channel, date.isoformat())
+        url: str = _STATION_ENDPOINTS[station].format(channel, date)
     response = query_json_api(url, timeout=30)
 
     if response is None:
-        return []
+        return None
 
     sched: _SchedType
     if station == _RUV:
@@ -310,12 +306,22 @@ def _query_schedule_api(channel: str, station: str, date: datetime.date) -> _Sch
         # Other stations respond with list of dicts
         sched = cast(_SchedType, response)
 
-    # Only cache non-empty schedules
+    # Only store non-empty schedules
     # (the empty schedules might get updated during the day)
     if len(sched) > 0:
-        _SCHED_CACHE[(channel, date)] = sched
+        return sched
+    return None
 
-    return sched
+
+# Schedules of each channel and date (keep for one day)
+_SCHED_FEED: KeyedFeed[_SchedType] = KeyedFeed(
+    "schedules", _fetch_schedule, 86400, maxsize=32
+)
+
+
+def _query_schedule_api(channel: str, station: str, date: datetime.date) -> _SchedType:
+    """Fetch and return channel schedule from API or cache for specified date."""
+    return _SCHED_FEED.get(f"{station}:{channel}:{date.isoformat()}") or []
 
 
 def _get_program_start_end(
@@ -346,6 +346,8 @@ _QTYPE_TO_DESC = {
 
 def _gen_most_freq_queries_answer(q: Query) -> bool:
     """Answer question concerning most frequent queries."""
+    # The rollups are read as they stand; recomputing them is left to the
+    # scraper and the statistics pages, away from the voice query path
     with SessionContext(read_only=True) as session:
         now = datetime.now(timezone.utc)
         start = now - timedelta(days=_QUERIES_PERIOD)
@@ -34,10 +34,8 @@ import datetime
 import logging
 import random
 import re
-import requests
 
 from bs4 import BeautifulSoup  # type: ignore
-from cachetools import TTLCache
 
 from iceaddr import placename_lookup
 from icespeak.transcribe.num import numbers_to_ordinal, floats_to_text
@@ -51,7 +49,9 @@ from queries.util import (
     read_grammar_file,
     sing_or_plur,
     gen_answer,
+    http_session,
 )
+from queries.util.feeds import Feed
 from settings import changedlocale
 from geo import (
     distance,
@@ -337,18 +337,10 @@ def _parse_almanak_hi_data(text: Iterable[str]) -> _SOLAR_DICT_TYPE:
     return data
 
 
-_ALMANAK_HI_CACHE: TTLCache = TTLCache(maxsize=1, ttl=86400)
-
-
-def _get_almanak_hi_data() -> Optional[_SOLAR_DICT_TYPE]:
-    """Fetch solar calendar from Univeristy of Iceland."""
-    data = cast(Optional[_SOLAR_DICT_TYPE], _ALMANAK_HI_CACHE.get("data"))
-
-    if data:
-        return data
-
+def _fetch_almanak_hi_text() -> Optional[List[str]]:
+    """Fetch solar calendar from Univeristy of Iceland, as lines of text."""
     try:
-        r = requests.get(_ALMANAK_HI_URL, timeout=10)
+        r = http_session().get(_ALMANAK_HI_URL, timeout=10)
     except Exception as e:
         logging.warning(str(e))
         return None
@@ -367,17 +359,27 @@ def _get_almanak_hi_data() -> Optional[_SOLAR_DICT_TYPE]:
             .split("\n")
         )
 
-        data = _parse_almanak_hi_data(text)
-        # Only cache valid data
-        _ALMANAK_HI_CACHE["data"] = data
-
-        return data
+        # Only store valid data
+        if _parse_almanak_hi_data(text):
+            return text
     except Exception as e:
         logging.warning(f"Error parsing Almanak HÍ response: {e}")
 
     return None
 
 
+# The text is stored, since the parsed data has date and time keys
+# and values, and is parsed once in each process
+_ALMANAK_HI_FEED: Feed[_SOLAR_DICT_TYPE] = Feed(
+    "almanak_hi", _fetch_almanak_hi_text, 86400, transform=_parse_almanak_hi_data
+)
+
+
+def _get_almanak_hi_data() -> Optional[_SOLAR_DICT_TYPE]:
+    """Fetch solar calendar from Univeristy of Iceland."""
+    return _ALMANAK_HI_FEED.get()
+
+
 def _find_closest_city(data: _SOLAR_DICT_TYPE, loc: LatLonTuple) -> Optional[str]:
     """Find city closest to loc in data."""
     closest_city = None
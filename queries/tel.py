@@ -107,6 +107,9 @@ _CONTEXT_SUBJ = frozenset(
 
 _CONTEXT_RX = "|".join(_CONTEXT_SUBJ)
 
+# Keywords that all phone call queries contain
+PLAIN_TEXT_PREFILTER = ("hring",)
+
 # TODO: This should be moved over to grammar at some point, too many manually defined,
 # almost identical commands. But at the moment, the grammar has poor support for phone
 # numbers, especially  when the numbers are coming out of a speech recognition engine
@@ -37,11 +37,13 @@ from typing import (
 from typing_extensions import TypedDict
 
 import logging
+import os
 import requests
+from requests.adapters import HTTPAdapter
 import json
 import re
 import locale
-from urllib.parse import urlencode
+from urllib.parse import urlencode, urlparse
 from functools import lru_cache
 
 from timezonefinder import TimezoneFinder
@@ -52,6 +54,7 @@ from icespeak.transcribe.num import number_to_text, float_to_text, CaseType
 from reynir import NounPhrase
 from tree import Node
 from settings import changedlocale
+from metrics import timer
 from utility import (
     QUERIES_GRAMMAR_DIR,
     QUERIES_JS_DIR,
@@ -406,6 +409,30 @@ def gen_answer(a: str) -> AnswerTuple:
     return dict(answer=a), a, a
 
 
+# The HTTP session of this process, and the id of the process
+_HTTP_SESSION: Optional[Tuple[int, requests.Session]] = None
+
+# Maximum number of pooled connections to each host
+_HTTP_POOL_SIZE = 16
+
+
+def http_session() -> requests.Session:
+    """Return a requests session that keeps connections to the
+    external APIs used by query modules alive for reuse. Sessions
+    are not shared with processes forked after their creation."""
+    global _HTTP_SESSION
+    pid = os.getpid()
+    if _HTTP_SESSION is None or _HTTP_SESSION[0] != pid:
+        session = requests.Session()
+        adapter = HTTPAdapter(
+            pool_connections=_HTTP_POOL_SIZE, pool_maxsize=_HTTP_POOL_SIZE
+        )
+        session.mount("https://", adapter)
+        session.mount("http://", adapter)
+        _HTTP_SESSION = (pid, session)
+    return _HTTP_SESSION[1]
+
+
 def query_json_api(
     url: str, headers: Optional[Dict[str, str]] = None, *, timeout: int = 10
 ) -> JsonResponse:
@@ -414,7 +441,8 @@ def query_json_api(
 
     # Send request
     try:
-        r = requests.get(url, headers=headers, timeout=timeout)
+        with timer("external_api", urlparse(url).hostname or ""):
+            r = http_session().get(url, headers=headers, timeout=timeout)
     except Exception as e:
         logging.warning(f"Exception when fetching {url}: {e}")
         return None
@@ -0,0 +1,360 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Shared data feeds for query modules
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements data feeds: data that query modules fetch
+    from external APIs, such as exchange rates or petrol prices, shared
+    by all worker processes on a server.
+
+    A query module registers a feed with a fetch function and a time to
+    live. The fetched data, which must be serializable as JSON, is stored
+    in a file in the feed directory by whichever process fetches it, and
+    read by all processes. Each process keeps the decoded data in memory
+    for as long as the file is unchanged.
+
+    A background thread in each process refreshes the feeds that the
+    process has read recently, before they expire, holding a file lock
+    so that only one process fetches a feed at a time. Query handlers
+    thus normally only read stored data, and only fetch it themselves
+    if it is missing, e.g. after a server restart, or has expired, e.g.
+    because it has not been read recently. If that fetch fails, expired
+    data is served until it is too stale. After a failed fetch, a process
+    doesn't fetch the entry again for a backoff period, serving expired
+    data or nothing in the meantime, so that query handlers don't each
+    wait for an upstream that is down.
+
+    Keyed feeds have a separate entry for each key, such as a location
+    or an article title, fetched by a function of the key.
+
+"""
+
+from typing import Any, Callable, Generic, List, Optional, Tuple, TypeVar
+
+import hashlib
+import json
+import logging
+import os
+import threading
+import time
+from pathlib import Path
+
+from cachetools import LRUCache
+
+from settings import Settings
+
+try:
+    import fcntl
+except ImportError:  # pragma: no cover
+    # Not available on Windows: fetches are not coordinated between processes
+    fcntl = None  # type: ignore
+
+
+T = TypeVar("T")
+
+# A None result from a fetch function means that the fetch failed
+FetchFunc = Callable[[str], Any]
+TransformFunc = Callable[[Any], T]
+
+
+class _Entry(Generic[T]):
+
+    """The decoded data of a feed entry, as read from its file"""
+
+    __slots__ = ("mtime", "data")
+
+    def __init__(self, mtime: float, data: Optional[T]) -> None:
+        self.mtime = mtime
+        self.data = data
+
+
+class KeyedFeed(Generic[T]):
+
+    """A data feed with a separate entry for each key"""
+
+    # Entries are refreshed in the background when they are this
+    # fraction of their time to live old
+    REFRESH_AHEAD = 0.8
+    # Entries are served for up to this many times their time to live,
+    # if refreshing them fails
+    STALE_FACTOR = 2.0
+    # Maximum time, in seconds, that a reader waits for another
+    # process that is fetching the same entry
+    LOCK_TIMEOUT = 15.0
+    # Number of lock files of a keyed feed, each shared by a subset of its keys
+    LOCK_STRIPES = 16
+    # Maximum time, in seconds, after a failed fetch of an entry during
+    # which this process doesn't fetch it again (at most the time to live)
+    FAILURE_BACKOFF = 60.0
+
+    def __init__(
+        self,
+        name: str,
+        fetch: FetchFunc,
+        ttl: float,
+        *,
+        transform: Optional[TransformFunc[T]] = None,
+        keep_warm: Optional[float] = None,
+        maxsize: int = 256,
+    ) -> None:
+        """Register a feed, with a function that fetches the data of an entry
+        given its key. The optional transform function converts the stored
+        data to the form returned by get(), once per process for each fetch.
+        Entries that have been read within keep_warm seconds (by default the
+        time to live) are refreshed in the background."""
+        self.name = name
+        self._fetch = fetch
+        self.ttl = ttl
+        self._transform = transform
+        self.keep_warm = ttl if keep_warm is None else keep_warm
+        self._lock = threading.Lock()
+        self._entries: LRUCache[str, _Entry[T]] = LRUCache(maxsize=maxsize)
+        # The keys read by this process, with the time of the last read
+        self._reads: LRUCache[str, float] = LRUCache(maxsize=maxsize)
+        # The keys whose last fetch by this process failed, with its time
+        self._failures: LRUCache[str, float] = LRUCache(maxsize=maxsize)
+        _scheduler.register(self)
+
+    @staticmethod
+    def _hash(key: str) -> str:
+        return hashlib.sha1(key.encode("utf-8")).hexdigest()[:24]
+
+    def _path(self, key: str) -> Path:
+        d = Path(Settings.FEED_DIR)
+        if not key:
+            return d / f"{self.name}.json"
+        return d / f"{self.name}-{self._hash(key)}.json"
+
+    def _age(self, key: str) -> Optional[float]:
+        """Return the age, in seconds, of the stored entry, if any"""
+        try:
+            return time.time() - self._path(key).stat().st_mtime
+        except OSError:
+            return None
+
+    def _read(self, key: str) -> Tuple[Optional[T], Optional[float]]:
+        """Return the data of the stored entry and its age, decoding
+        it only if the file has changed since it was last read"""
+        path = self._path(key)
+        try:
+            mtime = path.stat().st_mtime
+        except OSError:
+            return None, None
+        with self._lock:
+            entry = self._entries.get(key)
+        if entry is None or entry.mtime != mtime:
+            try:
+                with open(path, "r", encoding="utf-8") as f:
+                    stored = json.load(f)
+                data = stored["data"]
+                if self._transform is not None:
+                    data = self._transform(data)
+            except Exception as e:
+                logging.warning(f"Unable to read data feed {path}: {e}")
+                return None, None
+            entry = _Entry(mtime, data)
+            with self._lock:
+                self._entries[key] = entry
+        return entry.data, time.time() - mtime
+
+    def _lock_file(self, key: str, wait: bool) -> Optional[Any]:
+        """Acquire the lock file of an entry, returning the open file,
+        or None if it is held by another process and wait is False
+        (or the lock timeout expires)"""
+        path = Path(Settings.FEED_DIR) / f"{self.name}.lock"
+        if key:
+            stripe = int(self._hash(key), 16) % self.LOCK_STRIPES
+            path = path.with_suffix(f".{stripe}.lock")
+        path.parent.mkdir(parents=True, exist_ok=True)
+        f = open(path, "a")
+        if fcntl is None:
+            return f
+        deadline = time.monotonic() + self.LOCK_TIMEOUT
+        while True:
+            try:
+                fcntl.flock(f.fileno(), fcntl.LOCK_EX | fcntl.LOCK_NB)
+                return f
+            except OSError:
+                if not wait or time.monotonic() > deadline:
+                    f.close()
+                    return None
+            # Poll rather than block, which would stall all green
+            # threads of the process if running under eventlet
+            time.sleep(0.05)
+
+    def _backing_off(self, key: str) -> bool:
+        """Return True if a fetch of the entry by this process
+        has failed within the backoff period"""
+        with self._lock:
+            failed = self._failures.get(key)
+        backoff = min(self.ttl, self.FAILURE_BACKOFF)
+        return failed is not None and time.monotonic() - failed < backoff
+
+    def refresh(
+        self, key: str = "", *, min_age: float = 0.0, wait: bool = True
+    ) -> bool:
+        """Fetch and store the entry, unless the stored one is younger than
+        min_age seconds (e.g. because another process just refreshed it).
+        Returns False if the fetch failed or, when not waiting, if another
+        process is fetching the entry."""
+        f = self._lock_file(key, wait)
+        if f is None:
+            return False
+        try:
+            age = self._age(key)
+            if age is not None and age < min_age:
+                return True
+            try:
+                data = self._fetch(key)
+            except Exception as e:
+                logging.warning(f"Error fetching data feed {self.name}: {e}")
+                data = None
+            if data is None:
+                with self._lock:
+                    self._failures[key] = time.monotonic()
+                return False
+            with self._lock:
+                self._failures.pop(key, None)
+            path = self._path(key)
+            tmp = path.with_suffix(f".{os.getpid()}.tmp")
+            with open(tmp, "w", encoding="utf-8") as out:
+                json.dump(dict(key=key, data=data), out, ensure_ascii=False)
+            os.replace(tmp, path)
+            return True
+        finally:
+            f.close()
+
+    def get(self, key: str = "") -> Optional[T]:
+        """Return the data of the entry having the given key, fetching it
+        if the stored entry is missing or has expired. Expired data is
+        returned if the fetch fails, unless it is too stale, as it is
+        without fetching during the backoff period after a failure."""
+        with self._lock:
+            self._reads[key] = time.monotonic()
+        _scheduler.start()
+        data, age = self._read(key)
+        if data is not None and age is not None and age < self.ttl:
+            return data
+        # Skip the fetch if another process has just refreshed the entry,
+        # or if a fetch by this process has just failed
+        if not self._backing_off(key) and self.refresh(key, min_age=self.ttl):
+            fresh, _ = self._read(key)
+            if fresh is not None:
+                return fresh
+        if data is not None and age is not None and age < self.ttl * self.STALE_FACTOR:
+            return data
+        return None
+
+    def refresh_due(self) -> None:
+        """Refresh, if another process is not already doing so, the entries
+        that this process has read recently and that will expire soon"""
+        now = time.monotonic()
+        with self._lock:
+            keys = [k for k, t in self._reads.items() if now - t < self.keep_warm]
+        ahead = self.ttl * self.REFRESH_AHEAD
+        for key in keys:
+            age = self._age(key)
+            if age is not None and age >= ahead and not self._backing_off(key):
+                self.refresh(key, min_age=ahead, wait=False)
+
+    def prune(self) -> None:
+        """Delete the stored entries of a keyed feed that are too stale to be
+        served, i.e. that no process has read (and refreshed) recently"""
+        stale = self.ttl * self.STALE_FACTOR
+        for path in Path(Settings.FEED_DIR).glob(f"{self.name}-*.json"):
+            try:
+                if time.time() - path.stat().st_mtime > stale:
+                    path.unlink()
+            except OSError:
+                # Deleted concurrently by another process
+                pass
+
+
+class Feed(KeyedFeed[T]):
+
+    """A data feed with a single entry"""
+
+    def __init__(
+        self,
+        name: str,
+        fetch: Callable[[], Any],
+        ttl: float,
+        *,
+        transform: Optional[TransformFunc[T]] = None,
+        keep_warm: float = 3600.0,
+    ) -> None:
+        super().__init__(
+            name,
+            lambda _key: fetch(),
+            ttl,
+            transform=transform,
+            keep_warm=keep_warm,
+            maxsize=1,
+        )
+
+
+class _Scheduler:
+
+    """Refreshes the registered feeds in a background thread"""
+
+    # Interval, in seconds, between checks for feeds to refresh
+    INTERVAL = 10.0
+    # Interval, in seconds, between deletions of stale entries
+    PRUNE_INTERVAL = 3600.0
+
+    def __init__(self) -> None:
+        self._lock = threading.Lock()
+        self._feeds: List[KeyedFeed[Any]] = []
+        self._pid = 0
+
+    def register(self, feed: KeyedFeed[Any]) -> None:
+        with self._lock:
+            self._feeds.append(feed)
+
+    def start(self) -> None:
+        """Start the refresh thread of this process, if not already running"""
+        pid = os.getpid()
+        if self._pid == pid:
+            return
+        with self._lock:
+            if self._pid == pid:
+                return
+            self._pid = pid
+        threading.Thread(target=self._run, name="data_feeds", daemon=True).start()
+
+    def _run(self) -> None:
+        last_prune = time.monotonic()
+        while True:
+            time.sleep(self.INTERVAL)
+            with self._lock:
+                feeds = list(self._feeds)
+            prune = time.monotonic() - last_prune > self.PRUNE_INTERVAL
+            if prune:
+                last_prune = time.monotonic()
+            for feed in feeds:
+                try:
+                    feed.refresh_due()
+                    if prune and not isinstance(feed, Feed):
+                        feed.prune()
+                except Exception as e:
+                    logging.warning(f"Error refreshing data feed {feed.name}: {e}")
+
+
+_scheduler = _Scheduler()
+
@@ -66,6 +66,7 @@ from queries.util import (
     query_json_api,
     read_grammar_file,
 )
+from queries.util.feeds import KeyedFeed
 from tree import Result, Node
 from geo import in_iceland, RVK_COORDS, near_capital_region, ICE_PLACENAME_BLACKLIST
 from utility import cap_first
@@ -242,6 +243,41 @@ def _round_to_nearest_hour(t: datetime) -> datetime:
 _RVK_STATION_ID = 1
 
 
+def _fetch_observations(key: str) -> Optional[JsonResponse]:
+    """Fetch latest weather observation data, given either the ID of
+    a weather station or the coordinates of a location as a key"""
+    if "," in key:
+        lat, lon = key.split(",")
+        res = observation_for_closest(float(lat), float(lon))
+        if isinstance(res, tuple):
+            # !!! FIXME: The type annotations here should be made more accurate
+            res = res[0]  # type: ignore
+    else:
+        res = observation_for_station(int(key))
+    # Only store valid responses
+    if not res or "results" not in res:
+        return None
+    return res
+
+
+def _fetch_forecast_text(key: str) -> Optional[JsonResponse]:
+    """Fetch weather forecast text, given its ID as a key"""
+    res = forecast_text(int(key))
+    # Only store valid responses
+    if not res or "results" not in res:
+        return None
+    return res
+
+
+# Weather observations by station or location, and forecast texts
+_OBSERVATIONS_FEED: KeyedFeed[JsonResponse] = KeyedFeed(
+    "weather_obs", _fetch_observations, 600
+)
+_FORECAST_FEED: KeyedFeed[JsonResponse] = KeyedFeed(
+    "weather_fc", _fetch_forecast_text, 1800, maxsize=4
+)
+
+
 def _curr_observations(query: Query, result: Result):
     """Fetch latest weather observation data from weather station closest
     to the location associated with the query (i.e. either user location
@@ -280,19 +316,13 @@ def _curr_observations(query: Query, result: Result):
             #  else
             # fetch data from openweathermap api
 
-    # Talk to weather API
-    try:
-        if loc and loc[0] and loc[1]:
-            res = observation_for_closest(loc[0], loc[1])
-            if isinstance(res, tuple):
-                # !!! FIXME: The type annotations here should be made more accurate
-                res = res[0]  # type: ignore
-        else:
-            res = observation_for_station(_RVK_STATION_ID)  # Default to Reykjavík
-            result.subject = "Í Reykjavík"
-    except Exception as e:
-        logging.warning(f"Failed to fetch weather info: {e}")
-        return None
+    # Read shared observations, fetching them from weather API if not found
+    if loc and loc[0] and loc[1]:
+        # Nearby locations (within about a kilometre) share an entry
+        res = _OBSERVATIONS_FEED.get(f"{loc[0]:.2f},{loc[1]:.2f}")
+    else:
+        res = _OBSERVATIONS_FEED.get(str(_RVK_STATION_ID))  # Default to Reykjavík
+        result.subject = "Í Reykjavík"
 
     # Verify that response from server is sane
     if (
@@ -411,11 +441,8 @@ def get_forecast_answer(query: Query, result: Result) -> AnswerTuple:
         elif result.location == "general":
             txt_id = _COUNTRY_FC_ID
 
-    try:
-        res = forecast_text(txt_id)
-    except Exception as e:
-        logging.warning(f"Failed to fetch weather text: {e}")
-        res = None
+    # Read shared forecast, fetching it from weather API if not found
+    res = _FORECAST_FEED.get(str(txt_id))
 
     if (
         not res
@@ -41,6 +41,7 @@ from tree import Result, Node
 from utility import cap_first
 from queries import Query, QueryStateDict, ContextDict
 from queries.util import query_json_api, gen_answer, read_grammar_file
+from queries.util.feeds import KeyedFeed
 
 
 _WIKI_QTYPE = "Wikipedia"
@@ -236,12 +237,24 @@ _WIKI_API_URL = (
 )
 
 
-def _query_wiki_api(subject: str) -> Union[None, List[Any], Dict[str, Any]]:
+def _fetch_wiki_json(subject: str) -> Union[None, List[Any], Dict[str, Any]]:
     """Fetch JSON from Wikipedia API"""
     url = _WIKI_API_URL.format(subject)
     return query_json_api(url)
 
 
+# Wikipedia responses by subject, which are only refreshed when read again,
+# since few subjects are asked about repeatedly
+_WIKI_FEED: KeyedFeed[Union[List[Any], Dict[str, Any]]] = KeyedFeed(
+    "wiki", _fetch_wiki_json, 86400, keep_warm=0, maxsize=1024
+)
+
+
+def _query_wiki_api(subject: str) -> Union[None, List[Any], Dict[str, Any]]:
+    """Fetch JSON from Wikipedia API or cache"""
+    return _WIKI_FEED.get(subject)
+
+
 def get_wiki_summary(result: Result) -> Optional[str]:
     """Fetch summary of subject from Icelandic Wikipedia"""
 
@@ -53,6 +53,9 @@ _WORDTYPE_RX_NOM = "(?:orðið|nafnið|nafnorðið)"
 _WORDTYPE_RX_GEN = "(?:orðsins|nafnsins|nafnorðsins)"
 _WORDTYPE_RX_DAT = "(?:orðinu|nafninu|nafnorðinu)"
 
+# Keywords that all spelling and declension queries contain
+PLAIN_TEXT_PREFILTER = ("hvernig", "beygingarmyndir", "fallbeyging")
+
 _SPELLING_RX = (
     r"^hvernig stafsetur maður {0}?\s?(.+)$".format(_WORDTYPE_RX_NOM),
     r"^hvernig stafset ég {0}?\s?(.+)$".format(_WORDTYPE_RX_NOM),
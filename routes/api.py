@@ -29,25 +29,26 @@ from datetime import datetime, timezone
 from flask import request, abort
 from flask.wrappers import Response, Request
 
-from icespeak import GreynirSSMLParser, tts_to_file, TTSOptions, VOICES
+from icespeak import GreynirSSMLParser, VOICES
 from icespeak.settings import SETTINGS as TTS_SETTINGS
 from icespeak.settings import TextFormats
-from icespeak.tts import TTSOutput
 from reynir.bintokenizer import TokenDict
 from reynir.binparser import canonicalize_token
 
 from settings import Settings
 from tnttagger import ifd_tag
 from db import SessionContext
-from db.models import ArticleTopic, Query, QueryClientData, Summary
+from db.models import Query, QueryClientData, Summary
+from db.rollups import KIND_QUERIES, day_of, mark_dirty
 from geo import LatLonTuple
 from tree.util import TreeUtility
 from article import Article as ArticleProxy
-from queries import process_query
+from queries import process_query, query_cache, query_log_writer
 from queries import Query as QueryObject
 from queries.util.openai_gpt import summarize
 from tts import voice_for_locale
-from utility import read_txt_api_key, icelandic_asciify, TTS_AUDIO_DIR
+from ttscache import tts_cache
+from utility import read_txt_api_key, icelandic_asciify
 
 from . import routes, better_jsonify, text_from_request, bool_from_request
 from . import MAX_URL_LENGTH, MAX_UUID_LENGTH
@@ -195,10 +196,7 @@ def article_api(version: int = 1) -> Response:
         a.prepare(session)
         register = a.create_register(session, all_names=True)
         # Fetch names of article topics, if any
-        topics = (
-            session.query(ArticleTopic).filter(ArticleTopic.article_id == a.uuid).all()
-        )
-        topics = [dict(name=t.topic.name, id=t.topic.identifier) for t in topics]
+        topics = a.topics(session)
 
         return better_jsonify(
             valid=True,
@@ -252,10 +250,7 @@ def summary_api(version: int = 1) -> Response:
             return better_jsonify(valid=False, reason="Unable to fetch article")
 
         # Fetch names of article topics, if any
-        topics = (
-            session.query(ArticleTopic).filter(ArticleTopic.article_id == a.uuid).all()
-        )
-        topics = [dict(name=t.topic.name, id=t.topic.identifier) for t in topics]
+        topics = a.topics(session)
 
         # Generate a summary of the article in the indicated languages,
         # if not already available
@@ -471,16 +466,12 @@ def query_api(version: int = 1) -> Response:
                 # use the default voice for that locale.
                 vid = voice_for_locale(result["voice_locale"])
             result["voice_id"] = vid
-            # Create audio data
-            TTS_SETTINGS.AUDIO_DIR = TTS_AUDIO_DIR
-            tts_options = TTSOptions(voice=vid, speed=voice_speed)
+            # Create audio data, or reuse it from the cache
             # Set transcribe to False here, as we don't need to transcribe twice
-            tts_output: TTSOutput = tts_to_file(
-                v,
-                tts_options=tts_options,
-                transcribe=False,
+            audio_file = tts_cache.synthesize(
+                v, voice=vid, speed=voice_speed, transcribe=False
             )
-            url = tts_output.file.as_uri()
+            url = audio_file.as_uri()
             if url:
                 result["audio"] = _audio_file_url_to_host_url(url, request)
         response = cast(Optional[Dict[str, str]], result.get("response"))
@@ -542,11 +533,17 @@ def query_history_api(version: int = 1) -> Response:
             errmsg=f"Invalid action parameter '{action}'. Should be in {VALID_ACTIONS}.",
         )
 
+    # Make sure that no queries of the client are written after they are cleared
+    query_log_writer.wait_for_client(client_id)
     with SessionContext(commit=True) as session:
         # Clear all logged user queries
         # pylint: disable=no-member
         q = cast(Any, Query).table()
-        session.execute(q.delete().where(Query.client_id == client_id))
+        deleted = session.execute(
+            q.delete().where(Query.client_id == client_id).returning(Query.timestamp)
+        )
+        # Recompute the daily query rollups of the affected days
+        mark_dirty(session, KIND_QUERIES, [day_of(ts) for (ts,) in deleted])
         # Clear all user query data
         if action == "clear_all":
             # pylint: disable=no-member
@@ -556,6 +553,24 @@ def query_history_api(version: int = 1) -> Response:
     return better_jsonify(**resp)
 
 
+@routes.route("/query_cache.api", methods=["GET"])
+def query_cache_api() -> Response:
+    """Return the hit and miss counters of the voice query cache
+    of the worker process that serves the request"""
+    if not _has_valid_api_key(request, allow_query_param=True):
+        return better_jsonify(valid=False, errmsg="Invalid or missing API key.")
+    return better_jsonify(valid=True, **query_cache.stats())
+
+
+@routes.route("/query_log.api", methods=["GET"])
+def query_log_api() -> Response:
+    """Return the counters of the query log writer
+    of the worker process that serves the request"""
+    if not _has_valid_api_key(request, allow_query_param=True):
+        return better_jsonify(valid=False, errmsg="Invalid or missing API key.")
+    return better_jsonify(valid=True, **query_log_writer.stats())
+
+
 @routes.route("/speech.api", methods=["GET", "POST"])
 @routes.route("/speech.api/v<int:version>", methods=["GET", "POST"])
 def speech_api(version: int = 1) -> Response:
@@ -593,16 +608,14 @@ def speech_api(version: int = 1) -> Response:
         voice_speed = TTS_SETTINGS.DEFAULT_VOICE_SPEED
 
     try:
-        TTS_SETTINGS.AUDIO_DIR = TTS_AUDIO_DIR
-        tts_options = TTSOptions(
-            voice=voice_id, speed=voice_speed, text_format=text_format
-        )
-        tts_output: TTSOutput = tts_to_file(
+        audio_file = tts_cache.synthesize(
             text,
-            tts_options=tts_options,
+            voice=voice_id,
+            speed=voice_speed,
+            text_format=text_format,
             transcribe=transcribe,
         )
-        url = tts_output.file.as_uri()
+        url = audio_file.as_uri()
         if url:
             url = _audio_file_url_to_host_url(url, request)
     except Exception:
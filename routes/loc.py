@@ -21,13 +21,12 @@
 
 """
 
-from typing import Dict, Iterable, List, NamedTuple, Optional, Tuple, Union, cast
+from typing import Any, Dict, Iterable, List, NamedTuple, Optional, Tuple, Union, cast
 from typing_extensions import TypedDict
 
 from . import routes, better_jsonify, cache, days_from_period_arg
 
 from datetime import datetime, timedelta, timezone
-from collections import defaultdict
 import json
 
 from flask import Response, request, render_template, abort, send_file
@@ -99,40 +98,68 @@ def top_locations(
     from_time = now - timedelta(days=days)
 
     with SessionContext(read_only=True) as session:
+
+        def recent(q: Any) -> Any:
+            q = (
+                q.join(Article, Article.url == Location.article_url)
+                .filter(Article.timestamp > from_time)
+                .join(Root)
+                .filter(Root.visible)
+            )
+            # Filter by kind
+            if kind:
+                q = q.filter(Location.kind == kind)
+            return q
+
+        # Find the most frequently mentioned locations in the database,
+        # rather than fetching every mention of every location
+        keycols = (
+            Location.name,
+            Location.kind,
+            Location.country,
+            Location.latitude,
+            Location.longitude,
+        )
+        num_mentions = dbfunc.count(Location.id)
+        top: List[KeyTuple] = [
+            cast(KeyTuple, tuple(r[:-1]))
+            for r in recent(session.query(*keycols, num_mentions))
+            .group_by(*keycols)
+            .order_by(desc(num_mentions), Location.name)
+            .limit(limit)
+            .all()
+        ]
+        if not top:
+            return []
+
+        # Fetch the articles in which these locations are mentioned
         q = (
-            session.query(
-                Location.name,
-                Location.kind,
-                Location.country,
-                Location.article_url,
-                Location.latitude,
-                Location.longitude,
-                Article.id,
-                Article.heading,
-                Root.domain,
+            recent(
+                session.query(
+                    *keycols,
+                    Location.article_url,
+                    Article.id,
+                    Article.heading,
+                    Root.domain,
+                )
             )
-            .join(Article, Article.url == Location.article_url)
-            .filter(Article.timestamp > from_time)
-            .join(Root)
-            .filter(Root.visible)
+            .filter(Location.name.in_(set(k[0] for k in top)))
+            .order_by(desc(Article.timestamp))
         )
 
-        # Filter by kind
-        if kind:
-            q = q.filter(Location.kind == kind)
-
-        q = q.order_by(desc(Article.timestamp))
-
         # Group articles by unique location
-        locs: Dict[KeyTuple, List[ArticleDict]] = defaultdict(list)
+        locs: Dict[KeyTuple, List[ArticleDict]] = {k: [] for k in top}
         for r in q.all():
+            k: KeyTuple = (r.name, r.kind, r.country, r.latitude, r.longitude)
+            if k not in locs:
+                # Another location by the same name
+                continue
             article: ArticleDict = {
                 "url": r.article_url,
                 "id": r.id,
                 "heading": r.heading,
                 "domain": r.domain,
             }
-            k: KeyTuple = (r.name, r.kind, r.country, r.latitude, r.longitude)
             locs[k].append(article)
 
         # Create top locations list sorted by article count
@@ -181,9 +208,9 @@ def icemap_markers(days: int = _TOP_LOC_PERIOD) -> List[MarkerTuple]:
             .filter(Location.latitude != None)
             .filter(Location.longitude != None)
         )
-        markers: List[MarkerTuple] = list(
-            set((i.name, i.latitude, i.longitude) for i in q.all())
-        )
+        markers: List[MarkerTuple] = [
+            (i.name, i.latitude, i.longitude) for i in q.distinct().all()
+        ]
 
         return markers
 
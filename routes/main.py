@@ -26,7 +26,6 @@ from typing import Dict, Any, Iterable, List, Optional, Sequence, Tuple, Union,
 import platform
 import sys
 import random
-import json
 from datetime import datetime, timezone
 
 from flask import render_template, request, redirect, url_for
@@ -36,9 +35,10 @@ import reynir
 from reynir.fastparser import ParseForestFlattener
 
 from db import SessionContext, desc, dbfunc
-from db.models import Person, Article, ArticleTopic, Entity
+from db.models import Person, Article, Entity
 
 from settings import Settings
+from compact import load_tokens
 from article import Article as ArticleProxy
 from search import Search
 from tree.util import TreeUtility, StatsDict
@@ -161,10 +161,7 @@ def page() -> Union[Response, str]:
         register = a.create_register(session, all_names=True)
 
         # Fetch names of article topics, if any
-        topics = (
-            session.query(ArticleTopic).filter(ArticleTopic.article_id == a.uuid).all()
-        )
-        topics = [dict(name=t.topic.name, id=t.topic.identifier) for t in topics]
+        topics = a.topics(session)
 
         return render_template(
             "page.html", title=a.heading, article=a, register=register, topics=topics
@@ -309,7 +306,7 @@ def parsefail() -> str:
 
         for a in q.all():
             try:
-                tokens = json.loads(a.tokens)
+                tokens = load_tokens(a.tokens)
             except Exception:
                 continue
             # Paragraphs
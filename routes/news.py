@@ -23,17 +23,18 @@
 
 from __future__ import annotations
 
-from typing import List, Optional, Union
+from typing import List, Optional, Tuple, Union
 
 from flask.wrappers import Response
-from . import routes, max_age, better_jsonify
+from . import routes, max_age, better_jsonify, cache, MAX_UUID_LENGTH
 
 from datetime import datetime, timedelta, timezone
 from flask import request, render_template
+from sqlalchemy import tuple_
 
 from settings import changedlocale
 
-from db import Session, SessionContext, desc
+from db import Session, SessionContext, desc, dbfunc
 from db.models import Article, Root, Location, ArticleTopic, Topic
 
 
@@ -41,10 +42,92 @@ from db.models import Article, Root, Location, ArticleTopic, Topic
 _DEFAULT_NUM_ARTICLES = 20
 _MAX_NUM_ARTICLES = 100
 
+# Time to live, in seconds, of cached first pages of article lists
+_ARTICLES_CACHE_TTL = 60
+
+# The (timestamp, id) key of an article, by which article lists are paginated
+ArticleKey = Tuple[datetime, str]
+
+
+class ArticleDisplay:
+    """Utility class to carry information about an article to the web template"""
+
+    def __init__(
+        self,
+        heading: str,
+        timestamp: datetime,
+        url: str,
+        uuid: str,
+        num_sentences: int,
+        num_parsed: int,
+        icon: str,
+        localized_date: str,
+        source: str,
+    ):
+        self.heading = heading
+        self.timestamp = timestamp
+        self.url = url
+        self.uuid = uuid
+        self.num_sentences = num_sentences
+        self.num_parsed = num_parsed
+        self.icon = icon
+        self.localized_date = localized_date
+        self.source = source
+
+    @property
+    def width(self) -> str:
+        """The ratio of parsed sentences to the total number of sentences,
+        expressed as a percentage string"""
+        if self.num_sentences == 0:
+            return "0%"
+        return "{0}%".format((100 * self.num_parsed) // self.num_sentences)
+
+    @property
+    def time(self) -> str:
+        return self.timestamp.isoformat()[11:16]
+
+    @property
+    def date(self) -> str:
+        now = datetime.now(timezone.utc)
+        if now.year == self.timestamp.year:
+            return self.localized_date
+        return self.fulldate
+
+    @property
+    def fulldate(self) -> str:
+        return self.localized_date + self.timestamp.strftime(" %Y")
+
+    @property
+    def key(self) -> str:
+        """The pagination key of the article, as a URL parameter value"""
+        return f"{self.timestamp.isoformat()},{self.uuid}"
+
+
+def parse_key(value: Optional[str]) -> Optional[ArticleKey]:
+    """Parse a pagination key URL parameter, returning None if invalid"""
+    if not value:
+        return None
+    ts, _, uuid = value.partition(",")
+    try:
+        timestamp = datetime.fromisoformat(ts)
+    except ValueError:
+        return None
+    if not uuid or len(uuid) > MAX_UUID_LENGTH or timestamp.tzinfo is None:
+        return None
+    return timestamp, uuid
+
+
+def articles_version(session: Session) -> str:
+    """Return a value that changes whenever the scraper stores articles,
+    used in the keys of cached article lists to invalidate them"""
+    scraped = session.query(dbfunc.max(Article.scraped)).scalar()
+    return scraped.isoformat() if scraped else ""
+
 
 def fetch_articles(
     topic: Optional[str]=None,
-    offset: int=0,
+    before: Optional[ArticleKey]=None,
+    after: Optional[ArticleKey]=None,
     limit: int=_DEFAULT_NUM_ARTICLES,
     start: Optional[datetime]=None,
     location: Optional[str]=None,
@@ -52,15 +135,26 @@ def fetch_articles(
     root: Optional[str]=None,
     author: Optional[str]=None,
     enclosing_session: Optional[Session]=None,
-):
+) -> List[ArticleDisplay]:
     """Return a list of articles in chronologically reversed order.
-    Articles can be filtered by start date, location, country, root etc."""
+    Articles can be filtered by start date, location, country, root etc.
+    The list starts with the newest article, or the one following the
+    article with the key given in before, or ends with the one preceding
+    the article with the key given in after."""
     toplist: List[ArticleDisplay] = []
     now = datetime.now(timezone.utc)
 
     with SessionContext(read_only=True, session=enclosing_session) as session:
         q = (
-            session.query(Article)
+            session.query(
+                Article.heading,
+                Article.timestamp,
+                Article.url,
+                Article.id,
+                Article.num_sentences,
+                Article.num_parsed,
+                Root.domain,
+            )
             .filter(Article.tree != None)
             .filter(Article.timestamp != None)
             .filter(Article.timestamp <= now)
@@ -95,64 +189,26 @@ def fetch_articles(
         if topic:
             q = q.join(ArticleTopic).join(Topic).filter(Topic.identifier == topic)
 
-        q = (
-            q.order_by(desc(Article.timestamp))
-            .offset(offset)
-            .limit(limit)
-        )
-
-        class ArticleDisplay:
-            """Utility class to carry information about an article to the web template"""
-
-            def __init__(
-                self,
-                heading: str,
-                timestamp: datetime,
-                url: str,
-                uuid: str,
-                num_sentences: int,
-                num_parsed: int,
-                icon: str,
-                localized_date: str,
-                source: str,
-            ):
-                self.heading = heading
-                self.timestamp = timestamp
-                self.url = url
-                self.uuid = uuid
-                self.num_sentences = num_sentences
-                self.num_parsed = num_parsed
-                self.icon = icon
-                self.localized_date = localized_date
-                self.source = source
-
-            @property
-            def width(self) -> str:
-                """The ratio of parsed sentences to the total number of sentences,
-                expressed as a percentage string"""
-                if self.num_sentences == 0:
-                    return "0%"
-                return "{0}%".format((100 * self.num_parsed) // self.num_sentences)
-
-            @property
-            def time(self) -> str:
-                return self.timestamp.isoformat()[11:16]
-
-            @property
-            def date(self) -> str:
-                now = datetime.now(timezone.utc)
-                if now.year == self.timestamp.year:
-                    return self.localized_date
-                return self.fulldate
-
-            @property
-            def fulldate(self) -> str:
-                return self.localized_date + self.timestamp.strftime(" %Y")
+        # Paginate by (timestamp, id) keys rather than by offset,
+        # so that each page is read directly off the timestamp index
+        key = tuple_(Article.timestamp, Article.id)
+        if after is not None:
+            q = q.filter(Article.timestamp >= after[0]).filter(key > tuple_(*after))
+            q = q.order_by(Article.timestamp, Article.id)
+        else:
+            if before is not None:
+                q = q.filter(Article.timestamp <= before[0])
+                q = q.filter(key < tuple_(*before))
+            q = q.order_by(desc(Article.timestamp), desc(Article.id))
+
+        rows = q.limit(limit).all()
+        if after is not None:
+            rows.reverse()
 
         with changedlocale(category="LC_TIME"):
-            for a in q:
+            for a in rows:
                 # Instantiate article objects from results
-                source = a.root.domain
+                source = a.domain
                 icon = source + ".png"
                 locdate = a.timestamp.strftime("%-d. %b")
 
@@ -179,27 +235,57 @@ def news() -> Union[str, Response]:
     topic = request.args.get("topic")
     root = request.args.get("root")
     author = request.args.get("author")
+    before = parse_key(request.args.get("before"))
+    after = None if before else parse_key(request.args.get("after"))
 
     try:
-        offset = max(0, int(request.args.get("offset", 0)))
-        limit = max(0, int(request.args.get("limit", _DEFAULT_NUM_ARTICLES)))
+        limit = max(1, int(request.args.get("limit", _DEFAULT_NUM_ARTICLES)))
     except:
-        offset = 0
         limit = _DEFAULT_NUM_ARTICLES
 
     limit = min(limit, _MAX_NUM_ARTICLES)  # Cap at max 100 results per page
     now = datetime.now(timezone.utc)
 
     with SessionContext(read_only=True) as session:
-        # Fetch articles
-        articles = fetch_articles(
-            topic=topic,
-            offset=offset,
-            limit=limit,
-            root=root,
-            author=author,
-            enclosing_session=session,
-        )
+
+        def fetch() -> List[ArticleDisplay]:
+            # Fetch one extra article to find out whether there are more
+            return fetch_articles(
+                topic=topic,
+                before=before,
+                after=after,
+                limit=limit + 1,
+                root=root,
+                author=author,
+                enclosing_session=session,
+            )
+
+        if before or after:
+            articles = fetch()
+        else:
+            # First pages are cached until the scraper stores new articles
+            key = "news:{0}:{1}:{2}:{3}:{4}".format(
+                articles_version(session), topic or "", root or "", author or "", limit
+            )
+            articles = cache.get(key)
+            if articles is None:
+                articles = fetch()
+                cache.set(key, articles, timeout=_ARTICLES_CACHE_TTL)
+
+        more = len(articles) > limit
+        if after:
+            # The extra article is the newest one
+            articles = articles[1:] if more else articles
+        else:
+            articles = articles[:limit]
+        # Keys of the articles before and after the page, if there are any
+        newer: Optional[str] = None
+        older: Optional[str] = None
+        if articles:
+            if before or (after and more):
+                newer = articles[0].key
+            if after or more:
+                older = articles[-1].key
 
         # If all articles in the list are timestamped within 24 hours of now,
         # we display their times in HH:MM format. Otherwise, we display full date.
@@ -226,7 +312,8 @@ def news() -> Union[str, Response]:
             articles=articles,
             topics=topics,
             display_time=display_time,
-            offset=offset,
+            newer=newer,
+            older=older,
             limit=limit,
             selected_root=root,
             roots=roots,
@@ -247,13 +334,22 @@ def articles_list() -> Response:
     days = 7 if period == "week" else 1
     start_date = datetime.now(timezone.utc) - timedelta(days=days)
 
-    # Fetch articles
-    articles = fetch_articles(
-        start=start_date,
-        location=locname,
-        country=country,
-        limit=ARTICLES_LIST_MAXITEMS,
-    )
+    with SessionContext(read_only=True) as session:
+        # Fetch articles, or use the cached list if the scraper
+        # hasn't stored new articles since it was fetched
+        key = "articles:{0}:{1}:{2}:{3}".format(
+            articles_version(session), locname or "", country or "", days
+        )
+        articles = cache.get(key)
+        if articles is None:
+            articles = fetch_articles(
+                start=start_date,
+                location=locname,
+                country=country,
+                limit=ARTICLES_LIST_MAXITEMS,
+                enclosing_session=session,
+            )
+            cache.set(key, articles, timeout=_ARTICLES_CACHE_TTL)
 
     # Render template
     count = len(articles)
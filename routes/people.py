@@ -33,7 +33,9 @@ from flask import request, render_template
 
 from settings import changedlocale
 
-from db import SessionContext, desc
+from sqlalchemy import tuple_
+
+from db import SessionContext, desc, dbfunc
 from db.models import Person, Article, Root, Word
 
 from reynir import correct_spaces
@@ -111,7 +113,33 @@ def top_persons(
     personlist: List[Dict[str, Any]] = []
 
     with SessionContext(read_only=True) as session:
-        q = (
+        since = datetime.now(timezone.utc) - timedelta(days=days)
+
+        def recent(q: Any) -> Any:
+            return (
+                q.join(Article, Article.id == Word.article_id)
+                .join(Root)
+                .filter(Root.visible)
+                .filter(Article.timestamp > since)
+                .filter((Word.cat == "person_kk") | (Word.cat == "person_kvk"))
+                .filter(Word.stem.like("% %"))  # Match whitespace for least two names.
+            )
+
+        # Find the most frequently mentioned persons in the database,
+        # rather than fetching every mention of every person
+        num_articles = dbfunc.count(Word.article_id.distinct())
+        top = (
+            recent(session.query(Word.stem, Word.cat, num_articles))
+            .group_by(Word.stem, Word.cat)
+            .order_by(desc(num_articles), Word.stem)
+            .limit(limit)
+            .all()
+        )
+        if not top:
+            return personlist
+
+        # Fetch the articles in which these persons are mentioned
+        q = recent(
             session.query(
                 Word.stem,
                 Word.cat,
@@ -120,32 +148,24 @@ def top_persons(
                 Article.url,
                 Root.domain,
             )
-            .join(Article, Article.id == Word.article_id)
-            .join(Root)
-            .filter(Root.visible)
-            .filter(Article.timestamp > datetime.now(timezone.utc) - timedelta(days=days))
-            .filter((Word.cat == "person_kk") | (Word.cat == "person_kvk"))
-            .filter(Word.stem.like("% %"))  # Match whitespace for least two names.
-            .distinct()
         )
+        q = q.filter(tuple_(Word.stem, Word.cat).in_([(r[0], r[1]) for r in top]))
 
         persons: Dict[Tuple[str, str], List[Dict[str, str]]] = defaultdict(list)
-        for r in q.all():
+        for r in q.distinct().all():
             article = {
                 "url": r.url,
                 "id": r.id,
                 "heading": r.heading,
                 "domain": r.domain,
             }
-            gender = r.cat.split("_")[1]  # Get gender from _ suffix
-            k = (r.stem, gender)
-            persons[k].append(article)
+            persons[(r.stem, r.cat)].append(article)
 
-        for k, v in persons.items():
-            (name, gender) = k  # Unpack tuple key
-            personlist.append({"name": name, "gender": gender, "articles": v})
-
-        personlist.sort(key=lambda x: len(x["articles"]), reverse=True)
+        for stem, cat, _ in top:
+            gender = cat.split("_")[1]  # Get gender from _ suffix
+            personlist.append(
+                {"name": stem, "gender": gender, "articles": persons[(stem, cat)]}
+            )
 
     return personlist[:limit]
 
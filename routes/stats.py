@@ -36,15 +36,18 @@ from flask import request, render_template
 from reynir.bindb import GreynirBin
 
 from . import routes, cache, max_age
+from .api import _has_valid_api_key
 from settings import changedlocale
 from utility import read_txt_api_key
+from metrics import metrics
 from db import SessionContext, Session
+from db.rollups import ensure_rollups
 from db.sql import (
     StatsQuery,
     ChartsQuery,
     GenderQuery,
     BestAuthorsQuery,
-    QueryCountQuery,
+    DailyQueryCountQuery,
     QueryTypesQuery,
     QueryClientTypeQuery,
     TopUnansweredQueriesQuery,
@@ -88,34 +91,35 @@ def _now() -> datetime:
 def chart_stats(session: Optional[Session] = None, num_days: int = 7) -> Dict[str, Any]:
     """Return scraping and parsing stats for charts"""
     today = _now().replace(hour=0, minute=0, second=0, microsecond=0)
+    first = today - timedelta(days=num_days - 1)
     labels: List[str] = []
-    sources: Dict[str, List[int]] = {}
+    sent = [0] * num_days
+    parsed = [0] * num_days
     parsed_data: List[float] = []
 
-    # Get article count for each source for each day, and query count for each day
+    # Get article count for each source for each day,
+    # also collecting parsing stats for the parse % chart
+    sources: Dict[str, List[int]] = {
+        name: [0] * num_days
+        for name in ChartsQuery.sources(enclosing_session=session)
+    }
+    q = ChartsQuery.period(first, today + timedelta(days=1), enclosing_session=session)
+    for day, name, cnt, s, p in q:
+        n = (day - first.date()).days
+        sources.setdefault(name, [0] * num_days)[n] = cnt
+        sent[n] += s
+        parsed[n] += p
+
     # We change locale to get localized weekday/month names
     with changedlocale(category="LC_TIME"):
         for n in range(0, num_days):
-            days_back = num_days - n - 1
-            start = today - timedelta(days=days_back)
-            end = today - timedelta(days=days_back - 1)
+            start = first + timedelta(days=n)
 
             # Generate date label
             dfmtstr = "%a %-d. %b"
             labels.append(start.strftime(dfmtstr))
 
-            sent = 0
-            parsed = 0
-
-            # Get article count per source for day
-            # Also collect parsing stats for parse % chart
-            q = ChartsQuery.period(start, end, enclosing_session=session)
-            for name, cnt, s, p in q:
-                sources.setdefault(name, []).append(cnt)
-                sent += s
-                parsed += p
-
-            percent = round((parsed / sent) * 100, 2) if sent else 0
+            percent = round((parsed[n] / sent[n]) * 100, 2) if sent[n] else 0
             parsed_data.append(percent)
 
     # Create datasets for bar chart
@@ -178,6 +182,7 @@ def stats() -> Union[Response, str]:
 
     chart_data: Dict[str, Any] = dict()
 
+    ensure_rollups()
     try:
         with SessionContext(read_only=True) as session:
             # Article stats
@@ -235,30 +240,30 @@ def query_stats_data(
 ) -> Dict[str, Any]:
     """Return all data for query stats dashboard."""
     today = _now().replace(hour=0, minute=0, second=0, microsecond=0)
+    first = today - timedelta(days=num_days - 1)
 
     labels = []
-    query_count_data = []
-    unique_count_data = []
+    # Query count and number of unique clients for each day
+    query_count_data = [0] * num_days
+    unique_count_data = [0] * num_days
+
+    q = DailyQueryCountQuery.period(
+        first, today + timedelta(days=1), enclosing_session=session
+    )
+    for day, queries, clients in q:
+        n = (day - first.date()).days
+        query_count_data[n] = queries
+        unique_count_data[n] = clients
 
-    # Get query count for each day
     # We change locale to get localized date weekday/month names
     with changedlocale(category="LC_TIME"):
         for n in range(0, num_days):
-            days_back = num_days - n - 1
-            start = today - timedelta(days=days_back)
-            end = today - timedelta(days=days_back - 1)
+            start = first + timedelta(days=n)
 
             # Generate date label
             dfmtstr = "%a %-d. %b"
             labels.append(start.strftime(dfmtstr))
 
-            # Get query count for day
-            q = list(QueryCountQuery.period(start, end, enclosing_session=session))
-            query_count_data.append(q[0][0])
-
-            # Get num unique clients for day
-            unique_count_data.append(q[0][1])
-
     query_avg = sum(query_count_data) / num_days
     unique_avg = sum(unique_count_data) / num_days
 
@@ -372,6 +377,7 @@ def stats_queries() -> Union[Response, str]:
     except Exception:
         pass
 
+    ensure_rollups()
     stats_data = query_stats_data(num_days=days)
 
     return render_template(
@@ -387,3 +393,15 @@ def stats_queries() -> Union[Response, str]:
         top_unanswered=stats_data["top_unanswered"],
         top_answered=stats_data["top_answered"],
     )
+
+
+@routes.route("/metrics", methods=["GET"])
+def stage_metrics() -> Response:
+    """Return the latency metrics of the processing stages of the web server
+    and the batch jobs, in the Prometheus text format. The exposition
+    is empty unless metrics are enabled in the settings."""
+    # Accessing this route requires an API key, as for the other
+    # operational routes (/query_cache.api, /query_log.api)
+    if not _has_valid_api_key(request, allow_query_param=True):
+        return Response("Not authorized", status=401)
+    return Response(metrics.exposition(), mimetype="text/plain; version=0.0.4")
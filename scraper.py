@@ -28,12 +28,30 @@
     scraping output are stored in tables in a PostgreSQL database
     and accessed via SQLAlchemy.
 
+    Unless scrape_concurrency is set to 0 in Greynir.conf, the network
+    fetches of a scraping pass are done concurrently by a FetchEngine,
+    on I/O threads, and the fetched HTML is handed to a multiprocessing
+    pool for the CPU-bound parsing and storage of the articles.
+
 """
 
 from __future__ import annotations
 from types import ModuleType
 
-from typing import Any, Iterable, List, Optional, Set, Union, cast
+from typing import (
+    Any,
+    Callable,
+    Deque,
+    Dict,
+    Iterable,
+    Iterator,
+    List,
+    Optional,
+    Set,
+    Tuple,
+    Union,
+    cast,
+)
 
 import sys
 import os
@@ -41,22 +59,36 @@ import gc
 import getopt
 import time
 import logging
+import resource
 
 import traceback
+from collections import deque
+from datetime import datetime, timezone
 
 # Uncomment the following to force running in a single process,
 # for instance for debugging
 # from multiprocessing.dummy import Pool
 # cpu_count = lambda: 1
 from multiprocessing import Pool, cpu_count
+import multiprocessing as mp
+import multiprocessing.connection
+from multiprocessing.connection import Connection
 
 from settings import Settings, ConfigError
-from fetcher import Fetcher
+from metrics import metrics
+from fetcher import Fetcher, FetchEngine, KnownUrls
 from article import Article
+import compact
 
-from db import SessionContext, IntegrityError
-from db.models import Root, Article as ArticleRow
+from db import SessionContext
+from db.models import Root, RootValidator, Article as ArticleRow
 from db.setup import init_roots
+from db.rollups import refresh_rollups
+
+from sqlalchemy import Integer, case, func as dbfunc
+from sqlalchemy import cast as sqlcast
+from sqlalchemy.orm import load_only
+from sqlalchemy.dialects.postgresql import insert as pg_insert
 
 import feedparser  # type: ignore
 
@@ -65,10 +97,212 @@ class ArticleDescr:
 
     """Unit of work descriptor that is shipped between processes"""
 
-    def __init__(self, seq: int, root: Root, url: str) -> None:
+    def __init__(self, seq: int, root: Root, url: str, cost: int = 0) -> None:
         self.seq = seq  # Sequence number
         self.root = root
         self.url = url
+        # Expected cost of parsing the article, relative to others
+        self.cost = cost
+
+
+def _rss() -> int:
+    """Return the resident memory of the current process, in bytes"""
+    try:
+        with open("/proc/self/statm") as f:
+            return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    except (OSError, ValueError, IndexError):
+        # Not on Linux: use the peak resident memory instead
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+
+
+# Messages from parse pool worker processes
+_TASK_DONE = 1
+_WORKER_RETIRED = 2
+
+
+def _parse_worker(
+    func: Callable[[ArticleDescr], Any], conn: Connection, max_growth: int
+) -> None:
+    """The main loop of a parse pool worker process, which receives tasks
+    from the pool over its own pipe and reports back on the same pipe.
+    Messages are sent synchronously, so that they aren't lost if the
+    process is killed."""
+    base = _rss()
+    while True:
+        try:
+            d: Optional[ArticleDescr] = conn.recv()
+        except EOFError:
+            # The pool has gone away
+            return
+        if d is None:
+            break
+        func(d)
+        conn.send((_TASK_DONE, d.seq))
+        if max_growth and _rss() - base > max_growth:
+            # Retire this process before taking on another task,
+            # so that the pool replaces it with a fresh one
+            break
+    conn.send((_WORKER_RETIRED, 0))
+
+
+class ParsePool:
+
+    """A long-lived pool of worker processes for parsing articles. The
+    workers are forked from the calling process, sharing its loaded
+    parser and grammar copy-on-write. Each worker has its own pipe, on
+    which the pool hands it one task at a time, so that no lock is shared
+    between processes. A worker whose resident memory has grown by more
+    than max_growth megabytes is replaced by a freshly forked one between
+    tasks, so no work is lost when recycling. A worker that dies, e.g. by
+    being killed for running out of memory, is replaced as soon as the
+    pool notices, and its task is handed to another worker."""
+
+    # Number of times that a task is attempted before giving up on it
+    MAX_ATTEMPTS = 2
+
+    def __init__(
+        self,
+        numprocs: int,
+        func: Callable[[ArticleDescr], Any],
+        max_growth: int = 0,
+    ) -> None:
+        self._ctx = mp.get_context("fork")
+        self._numprocs = max(1, numprocs)
+        self._func = func
+        self._max_growth = max(0, max_growth) * 1024 * 1024
+        # The process and the pipe of each worker, by pid
+        self._workers: Dict[int, Tuple[Any, Connection]] = dict()
+        # The task handed to each busy worker
+        self._assigned: Dict[int, ArticleDescr] = dict()
+        # Workers that have retired but have not been replaced yet
+        self._retired: Set[int] = set()
+        # Tasks to hand out before taking new ones from the items
+        self._retry: Deque[ArticleDescr] = deque()
+        # Sequence numbers of completed tasks, not yet yielded by run()
+        self._done: List[int] = []
+
+    def __enter__(self) -> "ParsePool":
+        for _ in range(self._numprocs):
+            self._spawn()
+        return self
+
+    def __exit__(self, *args: Any) -> None:
+        for _, conn in self._workers.values():
+            try:
+                conn.send(None)
+            except OSError:
+                # Already dead
+                pass
+        for p, conn in self._workers.values():
+            p.join()
+            conn.close()
+        self._workers.clear()
+        self._assigned.clear()
+
+    def _spawn(self) -> None:
+        conn, child_conn = self._ctx.Pipe()
+        p = self._ctx.Process(
+            target=_parse_worker,
+            args=(self._func, child_conn, self._max_growth),
+            daemon=True,
+        )
+        p.start()
+        # Only the worker holds its end of the pipe
+        child_conn.close()
+        assert p.pid is not None
+        self._workers[p.pid] = (p, conn)
+
+    def _receive(self, pid: int) -> None:
+        """Read the pending messages of a worker"""
+        _, conn = self._workers[pid]
+        try:
+            while conn.poll():
+                msg, seq = conn.recv()
+                if msg == _TASK_DONE:
+                    self._assigned.pop(pid, None)
+                    self._done.append(seq)
+                elif msg == _WORKER_RETIRED:
+                    self._retired.add(pid)
+                    break
+        except (EOFError, OSError):
+            # The worker died, possibly in the middle of a message
+            pass
+
+    def _reap(self) -> List[ArticleDescr]:
+        """Replace the worker processes that have retired or died. Returns
+        the tasks that were lost with workers that died without retiring,
+        e.g. by being killed for running out of memory. A task handed to
+        a worker that was retiring is queued again."""
+        lost: List[ArticleDescr] = []
+        for pid, (p, conn) in list(self._workers.items()):
+            if pid not in self._retired:
+                if p.is_alive():
+                    continue
+                # Read any messages sent before the worker died
+                self._receive(pid)
+            retired = pid in self._retired
+            self._retired.discard(pid)
+            del self._workers[pid]
+            p.join()
+            conn.close()
+            d = self._assigned.pop(pid, None)
+            if retired:
+                logging.info(f"Parse process {pid} retired, forking a new one")
+                if d is not None:
+                    self._retry.appendleft(d)
+            elif d is not None:
+                logging.warning(
+                    f"Parse process {pid} died while parsing article [{d.seq}]"
+                )
+                lost.append(d)
+            self._spawn()
+        return lost
+
+    def run(self, items: Iterable[ArticleDescr]) -> Iterator[int]:
+        """Run the worker function on the given items, yielding the
+        sequence numbers of the items as they are completed (or -1 for
+        items given up on). The items are consumed lazily, in order, each
+        one handed to the next idle worker."""
+        it = iter(items)
+        attempts: Dict[int, int] = dict()
+        while True:
+            # Hand out tasks to the idle workers, retrying lost ones first
+            for pid, (_, conn) in list(self._workers.items()):
+                if pid in self._assigned or pid in self._retired:
+                    continue
+                d = self._retry.popleft() if self._retry else next(it, None)
+                if d is None:
+                    break
+                self._assigned[pid] = d
+                try:
+                    conn.send(d)
+                except OSError:
+                    # The worker has died: the task is lost with it below
+                    pass
+            if not self._assigned and not self._retry:
+                # All items have been completed
+                break
+            # Wait for a busy worker to finish a task or to die
+            waitables: Dict[Any, int] = dict()
+            for pid in self._assigned:
+                p, conn = self._workers[pid]
+                waitables[conn] = pid
+                waitables[p.sentinel] = pid
+            for r in mp.connection.wait(list(waitables), timeout=5.0):
+                pid = waitables[r]
+                if pid in self._workers and pid not in self._retired:
+                    self._receive(pid)
+            # Check the liveness of all workers on every round, so that
+            # dead ones are replaced even while others are busy
+            for d in self._reap():
+                attempts[d.seq] = attempts.get(d.seq, 1) + 1
+                if attempts[d.seq] <= self.MAX_ATTEMPTS:
+                    self._retry.append(d)
+                else:
+                    logging.warning(f"Giving up on parsing article [{d.seq}]")
+                    self._done.append(-1)
+            yield from self._done
+            self._done.clear()
 
 
 class Scraper:
@@ -78,11 +312,53 @@ class Scraper:
     def __init__(self) -> None:
         logging.info("Initializing scraper instance")
 
-    def urls2fetch(self, root: Root, helper: Optional[ModuleType]) -> Set[str]:
+    def _fetch_if_modified(
+        self, url: str, root: Root, engine: Optional[FetchEngine] = None
+    ) -> Tuple[Optional[str], Optional[RootValidator]]:
+        """Fetch a root page or feed with a conditional GET, using the
+        validators stored from the previous fetch. Returns the document,
+        or None if it hasn't been modified since then, or if error, along
+        with the new validators to store once its links have been stored."""
+        etag: Optional[str] = None
+        last_modified: Optional[str] = None
+        with SessionContext(read_only=True) as session:
+            v = session.query(RootValidator).filter_by(url=url).one_or_none()
+            if v is not None:
+                etag, last_modified = v.etag, v.last_modified
+        if engine is None:
+            r = Fetcher.conditional_fetch_url(url, etag, last_modified)
+        else:
+            r = engine.fetch_conditional(url, root.domain, etag, last_modified)
+        if r.not_modified:
+            logging.info(f"Not modified since last fetch: {url}")
+        if r.doc is None:
+            return None, None
+        if not (r.etag or r.last_modified or v is not None):
+            return r.doc, None
+        return r.doc, RootValidator(
+            url=url,
+            root_id=root.id,
+            etag=r.etag,
+            last_modified=r.last_modified,
+            timestamp=datetime.now(timezone.utc),
+        )
+
+    def urls2fetch(
+        self,
+        root: Root,
+        helper: Optional[ModuleType],
+        engine: Optional[FetchEngine] = None,
+        validators: Optional[List[RootValidator]] = None,
+    ) -> Set[str]:
         """Returns a set of URLs to fetch. If the scraper helper class has
         associated RSS feed URLs, these are used to acquire article URLs.
         Otherwise, the URLs are found by scraping the root website and
-        searching for links to subpages."""
+        searching for links to subpages. Root pages and feeds are fetched
+        with conditional GETs, so unmodified ones yield no URLs. If a fetch
+        engine is given, it is used for the HTTP fetches. The new validators
+        of the pages and feeds whose links were found are appended to the
+        validators list, if given, for the caller to store along with the
+        links."""
 
         fetch_set: Set[str] = set()
         feeds: Optional[List[str]] = None if helper is None else helper.feeds
@@ -91,10 +367,15 @@ class Scraper:
             for feed_url in feeds:
                 logging.info(f"Fetching feed {feed_url}")
                 try:
-                    d = feedparser.parse(feed_url)
+                    feed_doc, v = self._fetch_if_modified(feed_url, root, engine)
+                    if not feed_doc:
+                        continue
+                    d = feedparser.parse(feed_doc)
                 except Exception as e:
                     logging.warning(f"Error fetching/parsing feed {feed_url}: {e}")
                     continue
+                if v is not None and validators is not None:
+                    validators.append(v)
                 for entry in d.entries:
                     if entry.link and helper and not helper.skip_rss_entry(entry):
                         fetch_set.add(entry.link)
@@ -105,9 +386,8 @@ class Scraper:
             logging.info(f"Fetching root {root.url}")
 
             # Read the HTML document at the root URL
-            html_doc = Fetcher.raw_fetch_url(root.url)
+            html_doc, v = self._fetch_if_modified(root.url, root, engine)
             if not html_doc:
-                logging.warning(f"Unable to fetch root {root.url}")
                 return set()
 
             # Parse the HTML document
@@ -116,54 +396,87 @@ class Scraper:
             # Obtain the set of child URLs to fetch
             if soup:
                 fetch_set = Fetcher.children(root, soup)
+                if v is not None and validators is not None:
+                    validators.append(v)
             else:
                 fetch_set = set()
 
         return fetch_set
 
-    def scrape_root(self, root: Root, helper: ModuleType) -> None:
-        """Scrape a root URL"""
+    def scrape_root(
+        self,
+        root: Root,
+        helper: ModuleType,
+        engine: Optional[FetchEngine] = None,
+        known: Optional[KnownUrls] = None,
+    ) -> None:
+        """Scrape a root URL. If a set of known URLs is given,
+        it is used to skip URLs that are already in the articles table."""
 
         t0 = time.time()
 
-        fetch_set = self.urls2fetch(root, helper)
+        validators: List[RootValidator] = []
+        fetch_set = self.urls2fetch(root, helper, engine, validators)
 
-        # Add the children whose URLs we don't already have
-        # stored in the scraper articles table
-        with SessionContext() as session:
-            for url in fetch_set:
-                if helper and helper.skip_url(url):
-                    # The helper doesn't want this URL
-                    continue
+        new_urls: List[str] = []
+        for url in fetch_set:
+            if helper and helper.skip_url(url):
+                # The helper doesn't want this URL
+                continue
 
-                if url.startswith("http:") and ("https:" + url[5:]) in fetch_set:
-                    # Don't fetch both http and https versions of the same article
-                    continue
+            if url.startswith("http:") and ("https:" + url[5:]) in fetch_set:
+                # Don't fetch both http and https versions of the same article
+                continue
+
+            if known is not None and url in known:
+                # Already stored in the scraper articles table
+                continue
+
+            new_urls.append(url)
 
-                # noinspection PyBroadException
+        # Add the children whose URLs we don't already have
+        # stored in the scraper articles table, in a single statement.
+        # The validators of the root pages and feeds are stored in the
+        # same transaction, so that if it fails, the next pass fetches
+        # them again rather than being told that they haven't changed.
+        if new_urls or validators:
+            with SessionContext() as session:
                 try:
-                    article = ArticleRow(url=url, root_id=root.id)
-                    # Leave article.scraped as NULL for later retrieval
-                    session.add(article)
+                    if new_urls:
+                        session.execute(
+                            pg_insert(ArticleRow.table())
+                            .values(
+                                [dict(url=url, root_id=root.id) for url in new_urls]
+                            )
+                            # Leave article.scraped as NULL for later retrieval
+                            .on_conflict_do_nothing(index_elements=["url"])
+                        )
+                    for v in validators:
+                        session.merge(v)
                     session.commit()
-                except IntegrityError:
-                    # Article URL already exists in database:
-                    # roll back and continue
-                    session.rollback()
                 except Exception as e:
                     logging.warning(
-                        f"Rollback due to exception when handling URL '{url}': {e}"
+                        f"Rollback due to exception when adding URLs of {root}: {e}"
                     )
                     session.rollback()
+                    new_urls = []
+            if known is not None:
+                for url in new_urls:
+                    known.add(url)
 
         t1 = time.time()
 
         logging.info(
-            "Root scrape of {0} completed in {1:.2f} seconds".format(str(root), t1 - t0)
+            "Root scrape of {0} completed in {1:.2f} seconds, {2} new URLs".format(
+                str(root), t1 - t0, len(new_urls)
+            )
         )
 
-    def scrape_article(self, url: str, helper: ModuleType) -> None:
-        """Scrape a single article, retrieving its HTML and metadata"""
+    def scrape_article(
+        self, url: str, helper: ModuleType, html_doc: Optional[str] = None
+    ) -> None:
+        """Scrape a single article, retrieving its HTML and metadata.
+        If the HTML has already been fetched, it is passed in html_doc."""
 
         if helper.skip_url(url):
             logging.info(f"Skipping article {url}")
@@ -175,7 +488,7 @@ class Scraper:
         t0 = time.time()
 
         with SessionContext(commit=True) as session:
-            a = Article.scrape_from_url(url, session)
+            a = Article.scrape_from_url(url, session, html_doc)
             if a is not None:
                 a.store(session)
 
@@ -205,9 +518,14 @@ class Scraper:
             )
         )
 
-    def _scrape_single_root(self, r: Root) -> None:
+    def _scrape_single_root(
+        self,
+        r: Root,
+        engine: Optional[FetchEngine] = None,
+        known: Optional[KnownUrls] = None,
+    ) -> None:
         """Single root scraper that will be called by a process within a
-        multiprocessing pool"""
+        multiprocessing pool, or by a thread of a fetch engine"""
         if r.domain.endswith(".local"):
             # We do not scrape .local roots
             return
@@ -217,17 +535,37 @@ class Scraper:
             # parsing child URLs that have not been seen before
             helper = Fetcher._get_helper(r)
             if helper:
-                self.scrape_root(r, helper)
+                self.scrape_root(r, helper, engine, known)
         except Exception as e:
             logging.warning(f"Exception when scraping root at {r.url}: {e!r}")
 
-    def _scrape_single_article(self, d: ArticleDescr) -> None:
+    def _fetch_single_article(
+        self, engine: FetchEngine, d: ArticleDescr
+    ) -> Optional[str]:
+        """Fetch the HTML of a single article, on a thread of the fetch engine"""
+        helper = Fetcher._get_helper(d.root)
+        if helper is None or helper.skip_url(d.url):
+            return None
+        return engine.fetch(d.url, d.root.domain, getattr(helper, "fetch_url", None))
+
+    def _store_fetched_article(
+        self, fetched: Tuple[ArticleDescr, Optional[str]]
+    ) -> None:
+        """Parse and store an article whose HTML has been fetched by the
+        fetch engine. This is called by a process within a multiprocessing pool."""
+        d, html_doc = fetched
+        if html_doc:
+            self._scrape_single_article(d, html_doc)
+
+    def _scrape_single_article(
+        self, d: ArticleDescr, html_doc: Optional[str] = None
+    ) -> None:
         """Single article scraper that will be called by a process within a
         multiprocessing pool"""
         try:
             helper = Fetcher._get_helper(d.root)
             if helper:
-                self.scrape_article(d.url, helper)
+                self.scrape_article(d.url, helper, html_doc)
         except Exception as e:
             logging.warning(
                 "[{2}] Exception when scraping article at {0}: {1!r}".format(
@@ -260,6 +598,53 @@ class Scraper:
             # raise
         return True
 
+    def _fetch_pass(
+        self, numprocs: int, roots: List[Root], articles: Iterable[ArticleDescr]
+    ) -> None:
+        """Scrape the given roots, and then the given unscraped articles,
+        doing the network fetches concurrently on the threads of a fetch
+        engine and the parsing in a multiprocessing pool"""
+        t0 = time.time()
+        cnt = 0
+        with FetchEngine(
+            Settings.SCRAPE_CONCURRENCY,
+            Settings.SCRAPE_DOMAIN_CONCURRENCY,
+            Settings.SCRAPE_DOMAIN_DELAY,
+        ) as engine:
+            # Scrape the roots on the I/O threads, inserting
+            # their new child URLs into the articles table.
+            # The URLs already in the table are loaded once for the pass.
+            known = KnownUrls.load()
+            logging.info(f"Loaded {len(known)} known article URLs")
+            futures = [
+                engine.submit(self._scrape_single_root, r, engine, known)
+                for r in roots
+            ]
+            for f in futures:
+                f.result()
+            t1 = time.time()
+            logging.info(
+                "Scraped {0} roots in {1:.2f} seconds".format(len(roots), t1 - t0)
+            )
+            # Fetch the articles on the I/O threads, and hand their HTML
+            # over to a multiprocessing pool as it arrives
+            fetched = engine.fetch_all(
+                articles, lambda d: self._fetch_single_article(engine, d)
+            )
+            with Pool(numprocs) as pool:
+                try:
+                    for _ in pool.imap_unordered(self._store_fetched_article, fetched):
+                        cnt += 1
+                except Exception as e:
+                    logging.warning(f"Caught exception: {e}")
+                pool.close()
+                pool.join()
+        logging.info(
+            "Fetched and stored {0} articles in {1:.2f} seconds".format(
+                cnt, time.time() - t1
+            )
+        )
+
     def go(
         self,
         reparse: bool = False,
@@ -273,9 +658,8 @@ class Scraper:
         cnt = 0
 
         with SessionContext(commit=True) as session:
-            # Use a multiprocessing pool to parse the articles.
-            # Let the pool work on chunks of articles, recycling the
-            # processes after each chunk to contain memory creep.
+            # Use a pool of processes to parse the articles, recycling
+            # the processes as their memory grows, to contain memory creep.
             # Default to using as many processes as there are CPUs
             CPU_COUNT = numprocs or cpu_count() or 1
 
@@ -287,19 +671,6 @@ class Scraper:
                     for r in session.query(Root).filter(Root.scrape == True).all():
                         yield r
 
-                # Use a multiprocessing pool to scrape the roots
-
-                with Pool(CPU_COUNT) as pool:
-                    try:
-                        for _ in pool.imap_unordered(
-                            self._scrape_single_root, iter_roots()
-                        ):
-                            pass
-                    except Exception as e:
-                        logging.warning(f"Caught exception: {e}")
-                    pool.close()
-                    pool.join()
-
                 # noinspection PyComparisonWithNone
                 def iter_unscraped_articles() -> Iterable[ArticleDescr]:
                     """Go through any unscraped articles and scrape them"""
@@ -316,18 +687,36 @@ class Scraper:
                         yield ArticleDescr(seq, a.root, a.url)
                         seq += 1
 
-                # Use a multiprocessing pool to scrape the articles
+                if Settings.SCRAPE_CONCURRENCY > 0:
+                    self._fetch_pass(
+                        CPU_COUNT, list(iter_roots()), iter_unscraped_articles()
+                    )
+                else:
+                    # Use a multiprocessing pool to scrape the roots
 
-                with Pool(CPU_COUNT) as pool:
-                    try:
-                        for _ in pool.imap_unordered(
-                            self._scrape_single_article, iter_unscraped_articles()
-                        ):
-                            pass
-                    except Exception as e:
-                        logging.warning(f"Caught exception: {e}")
-                    pool.close()
-                    pool.join()
+                    with Pool(CPU_COUNT) as pool:
+                        try:
+                            for _ in pool.imap_unordered(
+                                self._scrape_single_root, iter_roots()
+                            ):
+                                pass
+                        except Exception as e:
+                            logging.warning(f"Caught exception: {e}")
+                        pool.close()
+                        pool.join()
+
+                    # Use a multiprocessing pool to scrape the articles
+
+                    with Pool(CPU_COUNT) as pool:
+                        try:
+                            for _ in pool.imap_unordered(
+                                self._scrape_single_article, iter_unscraped_articles()
+                            ):
+                                pass
+                        except Exception as e:
+                            logging.warning(f"Caught exception: {e}")
+                        pool.close()
+                        pool.join()
 
             # noinspection PyComparisonWithNone
             def iter_unparsed_articles(
@@ -338,7 +727,35 @@ class Scraper:
                 # Note that the query(ArticleRow) below cannot be directly changed
                 # to query(ArticleRow.root, ArticleRow.url) since
                 # ArticleRow.root is a joined subrecord
-                q = session.query(ArticleRow).filter(ArticleRow.scraped != None)
+                # The length of the token list from the previous parse,
+                # or failing that of the HTML, is a proxy for the effort
+                # required to parse the article. It is computed by the
+                # database, and the large columns themselves are not loaded.
+                # Token lists in the compact encoding carry the length of
+                # their plain JSON text after the prefix.
+                prefix = dbfunc.substr(ArticleRow.tokens, 1, len(compact.PREFIX))
+                tokens_length = case(
+                    (
+                        prefix == compact.PREFIX,
+                        sqlcast(
+                            dbfunc.split_part(
+                                dbfunc.substr(
+                                    ArticleRow.tokens, len(compact.PREFIX) + 1, 24
+                                ),
+                                ":",
+                                1,
+                            ),
+                            Integer,
+                        ),
+                    ),
+                    else_=dbfunc.length(ArticleRow.tokens),
+                )
+                cost = dbfunc.coalesce(tokens_length, dbfunc.length(ArticleRow.html), 0)
+                q = (
+                    session.query(ArticleRow, cost)
+                    .options(load_only(ArticleRow.url, ArticleRow.root_id))
+                    .filter(ArticleRow.scraped != None)
+                )
                 if reparse:
                     # Reparse articles that were originally parsed with an older
                     # grammar and/or parser version
@@ -352,8 +769,8 @@ class Scraper:
                 if limit > 0:
                     # Impose a limit on the query, if given
                     q = q.limit(limit)
-                for seq, a in enumerate(q):
-                    yield ArticleDescr(seq, a.root, a.url)
+                for seq, (a, c) in enumerate(q):
+                    yield ArticleDescr(seq, a.root, a.url, c)
 
             def iter_urls(urls: str) -> Iterable[ArticleDescr]:
                 """Iterate through the text file whose name is given in urls"""
@@ -383,8 +800,14 @@ class Scraper:
                     # Found the article: yield it
                     yield ArticleDescr(0, a.root, a.url)
 
-            # Distribute the load between the CPUs, although never exceeding
-            # 100 articles per CPU per process cycle
+            if reparse and Settings.SENTENCE_CACHE:
+                # Discard cached sentence parses from older parser versions
+                n = Article.prune_sentence_cache()
+                logging.info(f"Pruned {n} outdated sentence parses from the cache")
+
+            # Schedule the articles in windows of up to 100 articles per CPU,
+            # the most expensive ones first within each window, so that
+            # no single long article holds up the end of the pass
             if limit > 0:
                 CHUNK_SIZE = min(100 * CPU_COUNT, limit)
             else:
@@ -397,35 +820,41 @@ class Scraper:
                 limit = 0
             else:
                 g = iter_unparsed_articles(reparse, limit)
-            while True:
-                adlist: List[ArticleDescr] = []
-                lcnt = 0
-                for ad in g:
-                    adlist.append(ad)
-                    lcnt += 1
-                    if lcnt == CHUNK_SIZE or (0 < limit <= cnt + lcnt):
+
+            def iter_scheduled() -> Iterable[ArticleDescr]:
+                """Yield the articles to be parsed, in windows sorted
+                by descending expected parsing cost"""
+                n = 0
+                while True:
+                    adlist: List[ArticleDescr] = []
+                    for ad in g:
+                        adlist.append(ad)
+                        n += 1
+                        if len(adlist) == CHUNK_SIZE or (0 < limit <= n):
+                            break
+                    adlist.sort(key=lambda ad: ad.cost, reverse=True)
+                    yield from adlist
+                    if len(adlist) < CHUNK_SIZE or (0 < limit <= n):
                         break
-                if lcnt:
-                    # Run garbage collection to minimize common memory footprint
-                    gc.collect()
-                    logging.info(f"Parser processes forking, chunk of {lcnt} articles")
-                    with Pool(CPU_COUNT) as pool:
-                        try:
-                            for _ in pool.imap_unordered(
-                                self._parse_single_article, adlist
-                            ):
-                                pass
-                        except Exception as e:
-                            logging.warning(f"Caught exception: {e}")
-                        pool.close()
-                        pool.join()
-                    cnt += lcnt
-                    logging.info(
-                        "Parser processes joined, chunk of {0} articles parsed, "
-                        "total {1}".format(lcnt, cnt)
-                    )
-                if lcnt < CHUNK_SIZE:
-                    break
+
+            # Make sure the parser is loaded before forking, so that
+            # the processes share it, and minimize the common memory footprint
+            Article.get_parser()
+            gc.collect()
+            logging.info(f"Forking {CPU_COUNT} parser processes")
+            with ParsePool(
+                CPU_COUNT, self._parse_single_article, Settings.PARSE_WORKER_MEMORY
+            ) as pool:
+                for _ in pool.run(iter_scheduled()):
+                    cnt += 1
+                    if cnt % CHUNK_SIZE == 0:
+                        logging.info(f"Parsed {cnt} articles")
+            logging.info(f"Parser processes joined, total {cnt} articles parsed")
+
+        # Bring the daily rollups up to date with the stored articles and
+        # queries, backfilling empty rollup tables, so that the statistics
+        # pages only need to recompute the days that have changed since
+        refresh_rollups(backfill=True)
 
         # Return the total number of articles parsed
         return cnt
@@ -509,6 +938,10 @@ def scrape_articles(
                 limit, reparse, ncpus
             )
         )
+    # Record the metrics of this run, if enabled, in this process
+    # and the worker processes
+    metrics.start("scraper", batch=True)
+
     t0 = time.time()
     count = 0
 
@@ -531,6 +964,9 @@ def scrape_articles(
     logging.info("{1} articles parsed in {0:.1f} minutes".format((t1 - t0) / 60, count))
     if count:
         logging.info("Average: {0:.2f} seconds per article".format((t1 - t0) / count))
+    summary = metrics.summary()
+    if summary:
+        logging.info(f"Time spent per stage:\n{summary}")
 
     logging.info("------ Scrape completed -------")
 
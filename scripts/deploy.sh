@@ -61,10 +61,13 @@ cp config/Index.conf $DEST/config/Index.conf
 
 cp .env $DEST/.env
 cp article.py $DEST/article.py
+cp compact.py $DEST/compact.py
+cp corpus.py $DEST/corpus.py
 cp fetcher.py $DEST/fetcher.py
 cp geo.py $DEST/geo.py
 cp images.py $DEST/images.py
 cp main.py $DEST/main.py
+cp metrics.py $DEST/metrics.py
 cp nertokenizer.py $DEST/nertokenizer.py
 cp postagger.py $DEST/postagger.py
 cp processor.py $DEST/processor.py
@@ -74,6 +77,7 @@ cp settings.py $DEST/settings.py
 cp similar.py $DEST/similar.py
 cp tnttagger.py $DEST/tnttagger.py
 cp tts.py $DEST/tts.py
+cp ttscache.py $DEST/ttscache.py
 cp utility.py $DEST/utility.py
 cp -r db $DEST/
 cp -r routes $DEST/
@@ -97,6 +101,17 @@ GITVERS=$(git rev-parse HEAD) # Get git commit ID
 GITVERS=${GITVERS:0:7} # Truncate it
 sed -i "s/\[Git-útgáfa\]/${GITVERS}/g" "${ABOUT_TPL}"
 
+echo "Compiling query grammar..."
+
+# Compile and store the query grammar before the workers are restarted,
+# so that they load it instead of each compiling it when starting
+cd $DEST || exit 1
+# shellcheck disable=SC1091
+source "venv/bin/activate"
+python -c "from settings import Settings; Settings.read('config/Greynir.conf'); \
+from queries import Query; Query.init_class()"
+deactivate
+
 echo "Reloading gunicorn server..."
 
 sudo systemctl reload $SERVICE
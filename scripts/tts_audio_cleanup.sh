@@ -1,4 +1,17 @@
 #!/usr/bin/env bash
+#
+# Evict the least recently used text-to-speech audio files when the
+# audio cache exceeds its configured size (tts_cache_size in Greynir.conf),
+# and pre-synthesize the most frequent voice answers of the last week
+#
+# Runs in the deployed web server directory, with its settings,
+# on the audio directory that nginx serves
+#
 
-# Delete all text-to-speech audio scratch files older than 1 day (24 hours)
-find /usr/share/nginx/greynir.is/static/audio/tmp/* -mtime +1 -exec rm {} \;
+DEST="/usr/share/nginx/greynir.is"
+
+cd $DEST || exit 1
+# shellcheck disable=SC1091
+source venv/bin/activate
+python ttscache.py --dir="$DEST/static/audio/tmp" --presynthesize=200 --days=7
+deactivate
@@ -26,9 +26,11 @@
 
 """
 
-from typing import Iterable, Iterator, Optional, List, Tuple
+from typing import DefaultDict, Iterable, Optional, List, Tuple
 from typing_extensions import TypedDict
 
+import bisect
+from collections import defaultdict
 from datetime import datetime, timedelta
 
 from settings import Settings
@@ -118,18 +120,80 @@ class Search:
             weights=weights, articles=cls.list_articles(session, articles, n)
         )
 
+    # Articles from the same domain whose timestamps are less than
+    # this far apart, and whose similarity is practically the same,
+    # are probably duplicates
+    _DUPLICATE_WINDOW = timedelta(minutes=10)
+
     @classmethod
     def list_articles(
         cls, session: Session, result: Iterable[Tuple[str, float]], n: int
     ) -> List[SimilarDict]:
         """Convert similarity result tuples into article descriptors"""
+        # Skip the original article (or at least a verbatim copy of it)
+        candidates = [(sid, sim) for sid, sim in result if sim <= 0.9999]
+        if not candidates:
+            return []
+        # Fetch the columns we need for all candidates in a single query
+        q = (
+            session.query(
+                Article.id,
+                Article.heading,
+                Article.url,
+                Article.timestamp,
+                Root.domain,
+            )
+            .join(Root)
+            .filter(Article.id.in_([sid for sid, _ in candidates]))
+        )
+        rows = {r.id: r for r in q}
+
         similar: List[SimilarDict] = []
-        for sid, similarity in result:
-            if similarity > 0.9999:
-                # The original article (or at least a verbatim copy of it)
-                continue
-            q = session.query(Article).join(Root).filter(Article.id == sid)
-            sa: Optional[Article] = q.one_or_none()
+        # The indices of the entries in the similar list,
+        # by domain and timestamp bucket
+        buckets: DefaultDict[Tuple[str, int], List[int]] = defaultdict(list)
+        window = cls._DUPLICATE_WINDOW
+        window_secs = window.total_seconds()
+
+        def bucket_of(d: SimilarDict) -> Tuple[str, int]:
+            return d["domain"], int(d["ts"].timestamp() // window_secs)
+
+        def find_same(d: SimilarDict) -> Optional[int]:
+            """Return the index of the first entry in the result list
+            that is probably the same article as d, or None"""
+            domain, b = bucket_of(d)
+            found: Optional[int] = None
+            # Timestamps within the window are in the same
+            # or adjacent buckets
+            for key in ((domain, b - 1), (domain, b), (domain, b + 1)):
+                for ix in buckets.get(key, ()):
+                    if found is not None and ix > found:
+                        continue
+                    last = similar[ix]
+                    if abs(last["ts"] - d["ts"]) > window:
+                        # More than 10 minutes timestamp difference
+                        continue
+                    # Quite similar: probably the same article
+                    if d["similarity"] / last["similarity"] > 0.993:
+                        found = ix
+            if found is not None and Settings.DEBUG:
+                last = similar[found]
+                print(
+                    "Rejecting {0}, domain {1}, ts {2} because of similarity with {3},"
+                    " {4}, {5}; ratio is {6:.3f}".format(
+                        d["heading"],
+                        d["domain"],
+                        d["ts"],
+                        last["heading"],
+                        last["domain"],
+                        last["ts"],
+                        d["similarity"] / last["similarity"],
+                    )
+                )
+            return found
+
+        for sid, similarity in candidates:
+            sa = rows.get(sid)
             if sa is None:
                 # Article not found
                 continue
@@ -140,74 +204,38 @@ class Search:
             spercent = 100.0 * similarity
 
             assert sa.timestamp is not None  # Silence type checker
-
-            def is_probably_same_as(last: SimilarDict) -> bool:
-                """Return True if the current article is probably different from
-                the one already described in the last object"""
-                assert sa is not None
-                if last["domain"] != sa.root.domain:
-                    # Another root domain: can't be the same content
-                    return False
-                assert sa.timestamp is not None
-                if abs(last["ts"] - sa.timestamp) > timedelta(minutes=10):
-                    # More than 10 minutes timestamp difference
-                    return False
-                # Quite similar: probably the same article
-                ratio = spercent / last["similarity"]
-                if ratio > 0.993:
-                    if Settings.DEBUG:
-                        print(
-                            "Rejecting {0}, domain {1}, ts {2} because of similarity with {3},"
-                            " {4}, {5}; ratio is {6:.3f}".format(
-                                sa.heading,
-                                sa.root.domain,
-                                sa.timestamp,
-                                last["heading"],
-                                last["domain"],
-                                last["ts"],
-                                ratio,
-                            )
-                        )
-                    return True
-                return False
-
-            def gen_similar() -> Iterator[Tuple[int, SimilarDict]]:
-                """Generate the entries in the result list that are probably
-                the same as the one we are considering"""
-                for ix, p in enumerate(similar):
-                    if is_probably_same_as(p):
-                        yield (ix, p)
-
             d = SimilarDict(
                 heading=sa.heading,
                 url=sa.url,
                 uuid=sid,
-                domain=sa.root.domain,
+                domain=sa.domain,
                 ts=sa.timestamp,
                 ts_text=sa.timestamp.isoformat()[0:10],
                 similarity=spercent,
             )
             # Don't add another article with practically the same similarity
             # as the previous one, as it is very probably a duplicate
-            same = next(gen_similar(), None)
+            same = find_same(d)
             if same is None:
                 # No similar article
+                buckets[bucket_of(d)].append(len(similar))
                 similar.append(d)
                 if len(similar) == n:
                     # Enough articles: we're done
                     break
-            elif d["ts"] > same[1]["ts"]:
+            elif d["ts"] > similar[same]["ts"]:
                 # Similar article, and the one we're considering is
                 # newer: replace the one in the list
                 if Settings.DEBUG:
                     print("Replacing: {0} ({1:.2f})".format(sa.heading, spercent))
-                similar[same[0]] = d
+                buckets[bucket_of(similar[same])].remove(same)
+                bisect.insort(buckets[bucket_of(d)], same)
+                similar[same] = d
             else:
                 # Similar article, and the previous one is newer:
                 # drop the one we're considering
                 if Settings.DEBUG:
                     print("Ignoring: {0} ({1:.2f})".format(sa.heading, spercent))
-                pass
 
         if Settings.DEBUG and similar:
             print(
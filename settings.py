@@ -31,9 +31,10 @@
 
 """
 
-from typing import Set, Tuple, Union
+from typing import Optional, Set, Tuple, Union
 
 import os
+import tempfile
 import threading
 
 from reynir.basics import ConfigError, LineReader
@@ -155,11 +156,91 @@ class Settings:
             )
         )
 
+    # Maximum number of questions held in the per-process
+    # in-memory voice query cache (0 disables it)
+    QUERY_CACHE_SIZE = 4096
+    # If set, the voice query cache is shared between worker processes
+    # via the Redis server at this URL (e.g. redis://localhost:6379/0)
+    QUERY_CACHE_REDIS_URL: Optional[str] = (
+        os.environ.get("GREYNIR_QUERY_CACHE_REDIS") or None
+    )
+
+    # Number of threads used to tokenize and parse alternative query
+    # strings (e.g. speech recognition hypotheses) concurrently
+    # (0 means that they are tokenized and parsed serially)
+    QUERY_PARSE_WORKERS = 0
+
+    # Maximum number of logged queries waiting to be written to the
+    # database by the background writer of each worker process
+    # (0 means that queries are logged within the request's transaction)
+    QUERY_LOG_QUEUE_SIZE = 10000
+
+    # Directory where the data that query modules fetch from external
+    # APIs is stored, shared by the worker processes (see queries/util/feeds.py)
+    FEED_DIR = os.environ.get("GREYNIR_FEED_DIR") or os.path.join(
+        tempfile.gettempdir(), "greynir-feeds"
+    )
+
+    # Maximum total size, in megabytes, of the synthesized speech audio
+    # files kept in the TTS audio directory for reuse (0 disables reuse)
+    TTS_CACHE_SIZE = 1024
+
+    # Maximum number of query parse outcomes held in the
+    # per-process query parse cache (0 disables it)
+    QUERY_PARSE_CACHE_SIZE = 2048
+
+    # Number of worker processes that read and decode articles for
+    # Article.sentence_stream() and Article.token_stream()
+    # (0 means that the articles are read serially; see corpus.py)
+    CORPUS_WORKERS = 0
+
+    # Record latency and throughput metrics of the processing stages,
+    # exposed on the /metrics route and summarized by batch jobs
+    METRICS = False
+
+    # Directory where each process stores its metrics (see metrics.py)
+    METRICS_DIR = os.environ.get("GREYNIR_METRICS_DIR") or os.path.join(
+        tempfile.gettempdir(), "greynir-metrics"
+    )
+
+    # Maximum number of concurrent HTTP fetches in a scraping pass
+    # (0 means that roots and articles are fetched by the
+    # multiprocessing pool, one at a time per process)
+    SCRAPE_CONCURRENCY = 32
+    # Maximum number of concurrent HTTP fetches from a single domain
+    SCRAPE_DOMAIN_CONCURRENCY = 4
+    # Minimum interval, in seconds, between the start of
+    # consecutive fetches from a single domain
+    SCRAPE_DOMAIN_DELAY = 0.25
+
+    # Memory growth, in megabytes, after which an article parsing
+    # process is recycled (0 means never)
+    PARSE_WORKER_MEMORY = 4096
+
+    # Reuse the cached parses of sentences whose tokens have been
+    # parsed before by the same parser version. Off by default, since
+    # the cache table grows with every distinct sentence parsed.
+    SENTENCE_CACHE = False
+
+    # Maximum estimated parse effort for a sentence, as the base-10 logarithm
+    # of the number of combinations of its token meanings (0 means no limit).
+    # Sentences over the limit are not parsed.
+    PARSE_COST_BUDGET = 0.0
+    # Time, in seconds, after which a sentence parse is logged as slow
+    # and counted in the parse statistics (0 means never)
+    PARSE_TIME_BUDGET = 30.0
+
+    # Store the parse trees and token lists of articles
+    # in the compact encoding (see compact.py)
+    COMPACT_STORAGE = False
+
     # Configuration settings from the Greynir.conf file
     @staticmethod
     def _handle_settings(s: str) -> None:
         """Handle config parameters in the settings section"""
-        a = s.lower().split("=", maxsplit=1)
+        # Parameter names are case-insensitive, but values such as
+        # directory paths are taken as written
+        a = s.split("=", maxsplit=1)
         par = a[0].strip().lower()
         sval = a[1].strip()
         val: Union[None, str, bool] = sval
@@ -190,6 +271,40 @@ class Settings:
                 Settings.SIMSERVER_PORT = int(val or 0)
             elif par == "debug":
                 Settings.DEBUG = bool(val)
+            elif par == "query_cache_size":
+                Settings.QUERY_CACHE_SIZE = int(val or 0)
+            elif par == "query_parse_workers":
+                Settings.QUERY_PARSE_WORKERS = int(val or 0)
+            elif par == "query_log_queue_size":
+                Settings.QUERY_LOG_QUEUE_SIZE = int(val or 0)
+            elif par == "feed_dir":
+                Settings.FEED_DIR = str(val)
+            elif par == "tts_cache_size":
+                Settings.TTS_CACHE_SIZE = int(val or 0)
+            elif par == "query_parse_cache_size":
+                Settings.QUERY_PARSE_CACHE_SIZE = int(val or 0)
+            elif par == "corpus_workers":
+                Settings.CORPUS_WORKERS = int(val or 0)
+            elif par == "metrics":
+                Settings.METRICS = bool(val)
+            elif par == "metrics_dir":
+                Settings.METRICS_DIR = str(val)
+            elif par == "scrape_concurrency":
+                Settings.SCRAPE_CONCURRENCY = int(val or 0)
+            elif par == "scrape_domain_concurrency":
+                Settings.SCRAPE_DOMAIN_CONCURRENCY = max(1, int(val or 1))
+            elif par == "scrape_domain_delay":
+                Settings.SCRAPE_DOMAIN_DELAY = float(val or 0.0)
+            elif par == "parse_worker_memory":
+                Settings.PARSE_WORKER_MEMORY = int(val or 0)
+            elif par == "sentence_cache":
+                Settings.SENTENCE_CACHE = bool(val)
+            elif par == "parse_cost_budget":
+                Settings.PARSE_COST_BUDGET = float(val or 0.0)
+            elif par == "parse_time_budget":
+                Settings.PARSE_TIME_BUDGET = float(val or 0.0)
+            elif par == "compact_storage":
+                Settings.COMPACT_STORAGE = bool(val)
             else:
                 raise ConfigError("Unknown configuration parameter '{0}'".format(par))
         except ValueError:
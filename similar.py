@@ -30,11 +30,20 @@ from typing import TYPE_CHECKING
 
 import os
 import sys
-from contextlib import closing
+from contextlib import closing, nullcontext
 from multiprocessing.connection import Connection, answer_challenge, deliver_challenge
 
 from settings import Settings
 
+try:
+    from metrics import timer
+except ImportError:
+    # The similarity server in the vectors subdirectory imports this
+    # module without metrics.py or the metrics settings
+    def timer(stage: str, name: str = "") -> Any:
+        return nullcontext()
+
+
 # Hack to allow the similarity client run both under Gunicorn/eventlet
 # on a live server, and stand-alone using the regular Python 3.x library.
 # Under Gunicorn/eventlet, the socket class is 'monkey-patched' in ways
@@ -139,8 +148,9 @@ class SimilarityClient:
             if self._conn is None:
                 break
             try:
-                self._conn.send(kwargs)
-                return self._conn.recv()
+                with timer("similarity", kwargs.get("cmd", "")):
+                    self._conn.send(kwargs)
+                    return self._conn.recv()
             except (EOFError, BlockingIOError):
                 self.close()
                 retries += 1
@@ -179,6 +189,11 @@ class SimilarityClient:
         list of (article_id, similarity) tuples"""
         return self._retry_list(cmd="similar", terms=terms, n=n)
 
+    def index_recall(self, n: int=10) -> Optional[float]:
+        """Returns the recall@N of the server's approximate similarity
+        index against exact search, or None if it uses exact search only"""
+        return self._retry_list(cmd="recall", n=n).get("recall")
+
     def refresh_topics(self) -> None:
         """Cause the server to refresh article topic vectors from the database"""
         self._retry_cmd(cmd="refresh")
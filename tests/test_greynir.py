@@ -213,11 +213,29 @@ def test_nertokenizer() -> None:
     assert recognize_entities
 
 
-def test_postagger() -> None:
-    from postagger import NgramTagger
+def test_postagger(tmp_path) -> None:
+    from postagger import MappedNgramModel, NgramCounter, NgramTagger
 
     assert NgramTagger
 
+    cnt = NgramCounter()
+    for ngram in [("", "", "fpken"), ("", "fpken", "sfg3en"), ("", "", "fpken")]:
+        cnt.add(ngram)
+    lemma_cnt = {"hann": {"fpken": 5, "fpkeo": 2}, "lesa": {"sfg3en": 3}}
+    fname = str(tmp_path / "ngram-3-model.bin")
+    MappedNgramModel.write(fname, 3, lemma_cnt, cnt)
+    m = MappedNgramModel(fname)
+    assert m.size == 2
+    assert m.count(("", "", "fpken")) == 2
+    assert m.count(("", "fpken", "sfg3en")) == 1
+    assert m.count(("fpken", "sfg3en", "")) == 0
+    assert m.count(("", "", "óþekkt")) == 0
+    assert m.lemma_tags("hann") == {"fpken": 5, "fpkeo": 2}
+    assert m.lemma_count("hann") == 7
+    assert m.lemma_count("lesa") == 3
+    assert m.lemma_tags("hestur") == {}
+    assert m.lemma_count("") == 0
+
 
 def test_query() -> None:
     # TODO: Import all query modules and test whether
@@ -231,12 +249,347 @@ def test_query() -> None:
     assert Query  # Silence linter
 
 
+def test_news_pagination_keys() -> None:
+    from datetime import datetime, timezone
+    from routes.news import ArticleDisplay, parse_key
+
+    ts = datetime(2023, 5, 17, 12, 30, 15, tzinfo=timezone.utc)
+    uuid = "8c2a4b6e-0d1f-4e3a-9b5c-7d8e9f0a1b2c"
+    a = ArticleDisplay(
+        heading="Fyrirsögn",
+        timestamp=ts,
+        url="https://www.ruv.is/frett/1",
+        uuid=uuid,
+        num_sentences=10,
+        num_parsed=7,
+        icon="ruv.is.png",
+        localized_date="17. maí",
+        source="ruv.is",
+    )
+    assert a.width == "70%"
+    assert parse_key(a.key) == (ts, uuid)
+    assert parse_key(None) is None
+    assert parse_key("") is None
+    assert parse_key("2023-05-17T12:30:15+00:00") is None
+    assert parse_key("2023-05-17T12:30:15," + uuid) is None  # No timezone
+    assert parse_key("not a timestamp," + uuid) is None
+    assert parse_key(a.key + "x" * 40) is None
+
+
+def test_bench(tmp_path) -> None:
+    import importlib.util
+
+    spec = importlib.util.spec_from_file_location(
+        "bench", os.path.join(os.path.dirname(__file__), "..", "tools", "bench.py")
+    )
+    assert spec is not None and spec.loader is not None
+    bench = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(bench)
+
+    samples = [float(n) for n in range(1, 101)]
+    assert bench.percentile(samples, 50) == 50.0
+    assert bench.percentile(samples, 99) == 99.0
+    assert bench.percentile(samples, 100) == 100.0
+    assert bench.percentile([3.0], 90) == 3.0
+    assert bench.percentile([], 50) == 0.0
+
+    calls = []
+    r = bench.measure([lambda: calls.append(1)] * 5, 2)
+    assert len(calls) == 11  # One warmup call
+    assert r["ops"] == 10
+    assert r["ops_per_sec"] > 0.0
+    assert r["p50_ms"] <= r["p90_ms"] <= r["p99_ms"] <= r["max_ms"]
+
+    base = dict(ops=10, ops_per_sec=100.0, p50_ms=10.0, p90_ms=12.0)
+    fname = str(tmp_path / "baseline.json")
+    bench.save_baseline(fname, {"parse": base})
+    bench.save_baseline(fname, {"query": base})
+    baseline = bench.load_baseline(fname)
+    assert sorted(baseline) == ["parse", "query"]
+    ok = dict(base, ops_per_sec=95.0, p50_ms=10.5)
+    slower = dict(base, ops_per_sec=80.0)
+    laggier = dict(base, p50_ms=12.0)
+    assert bench.compare({"parse": ok, "other": slower}, baseline, 0.1) == []
+    regressions = bench.compare({"parse": slower, "query": laggier}, baseline, 0.1)
+    assert len(regressions) == 2
+    assert regressions[0].startswith("parse:")
+    assert "median latency" in regressions[1]
+    assert bench.compare({"parse": slower}, baseline, 0.25) == []
+
+
 def test_scraper() -> None:
     from scraper import Scraper
 
     assert Scraper
 
 
+def test_parse_pool(tmp_path) -> None:
+    import signal
+    from typing import Any
+    from scraper import ArticleDescr, ParsePool
+
+    marker = tmp_path / "killed"
+
+    def parse(d: ArticleDescr) -> None:
+        if d.seq == 3 and not marker.exists():
+            # Killed the first time only: the article is parsed again
+            marker.touch()
+            os.kill(os.getpid(), signal.SIGKILL)
+        if d.seq == 5:
+            # Always dies: given up on after the second attempt
+            os._exit(1)
+
+    root: Any = None
+    items = [ArticleDescr(n, root, f"https://example.is/{n}") for n in range(12)]
+    with ParsePool(3, parse) as pool:
+        done = sorted(pool.run(items))
+    assert done == [-1] + [n for n in range(12) if n != 5]
+
+
+def test_known_urls() -> None:
+    from fetcher import KnownUrls
+
+    urls = ["https://www.ruv.is/frett/{0}".format(i) for i in range(100)]
+    known = KnownUrls(KnownUrls.url_hash(url) for url in urls[:50])
+    assert len(known) == 50
+    assert all(url in known for url in urls[:50])
+    assert not any(url in known for url in urls[50:])
+    known.add(urls[50])
+    assert urls[50] in known
+    assert urls[51] not in known
+    assert len(known) == 51
+
+
+def test_compact() -> None:
+    import compact
+
+    tree = (
+        "S1\nC-12\nL2\nN0 S0\nN1 S-MAIN\nT2 no_et_nf_kk \"Hestur\"\nP2\nQ0\n"
+        "S2\nE5\n"
+    )
+    ct = compact.encode_tree(tree)
+    assert compact.is_compact(ct) and not compact.is_compact(tree)
+    assert compact.decode_tree(ct) == tree
+    assert compact.decode_tree_sentence(ct, 2) == "S2\nE5\n"
+    assert compact.decode_tree_sentence(ct, 3) is None
+    # Lines that aren't in the regular format are stored verbatim
+    odd = "S1\n leading space\nX\nT2x y\nE1\n"
+    assert compact.decode_tree(compact.encode_tree(odd)) == odd
+
+    tokens = (
+        '[[[{"x":"Hestur","t":"no_et_nf_kk","m":["hestur","kk","alm","NFET"]},'
+        '{"x":".","k":1}]],[[{"x":"3,5","k":12,"v":3.5,"err":1}]]]'
+    )
+    ck = compact.encode_tokens(tokens)
+    assert compact.decode_tokens(ck) == tokens
+    assert compact.load_tokens(ck) == compact.load_tokens(tokens)
+    assert compact.load_tokens(ck) == json.loads(tokens)
+    assert compact.decode_token_sentence(ck, 1, 0) == [
+        {"x": "3,5", "k": 12, "v": 3.5, "err": 1}
+    ]
+    assert compact.plain_length(ck) == len(tokens)
+    assert compact.plain_length(ct) == len(tree)
+
+
+def _corpus_batch(task):
+    # Stands in for corpus.read_batch in test_corpus_reader
+    ix = task[0]
+    return ix, [[{"x": f"{ix}.{n}"}] for n in range(3)]
+
+
+def test_corpus_reader(tmp_path) -> None:
+    import compact
+    from datetime import datetime, timedelta
+    from corpus import CorpusReader, decode_sentences
+
+    tokens = '[[[{"x":"Hestur"}],[]],[[{"x":"3,5","err":1}],[{"x":"Já"}]]]'
+    for t in (tokens, compact.encode_tokens(tokens)):
+        assert decode_sentences(t, True) == [[{"x": "Hestur"}], [{"x": "Já"}]]
+        assert len(decode_sentences(t, False)) == 3
+
+    class TestReader(CorpusReader):
+        _read = staticmethod(_corpus_batch)
+
+        def _bounds(self):
+            ts = datetime(2023, 5, 1)
+            return [(ts - timedelta(hours=i), f"id{i}") for i in range(5)]
+
+    def texts(sents):
+        return [s[0]["x"] for s in sents]
+
+    expected = [f"{ix}.{n}" for ix in range(5) for n in range(3)]
+    assert texts(TestReader(2).sentences()) == expected
+    assert texts(TestReader(2).sentences(limit=4, skip=2)) == expected[2:6]
+    unordered = texts(TestReader(3, ordered=False).sentences())
+    assert sorted(unordered) == expected
+    # An interrupted pass continues after the last sentence consumed
+    cp = str(tmp_path / "corpus.json")
+    first = texts(TestReader(2, checkpoint=cp).sentences(limit=7))
+    rest = TestReader(2, checkpoint=cp).sentences()
+    second = [next(rest)[0]["x"] for _ in range(2)]
+    rest.close()
+    third = texts(TestReader(2, checkpoint=cp).sentences())
+    assert first + second + third == expected
+    assert not texts(TestReader(2, checkpoint=cp).sentences())
+
+
+def test_rollups() -> None:
+    from datetime import date, datetime, timezone
+    from db.rollups import day_of
+    from db.sql import rollup_days
+
+    ts = datetime(2023, 5, 1, 23, 30, tzinfo=timezone.utc)
+    assert day_of(ts) == date(2023, 5, 1)
+    assert day_of(None) is None
+    assert rollup_days(datetime(2023, 5, 1), datetime(2023, 5, 3)) == (
+        date(2023, 5, 1),
+        date(2023, 5, 3),
+    )
+    assert rollup_days(ts, datetime(2023, 5, 3, 1)) == (
+        date(2023, 5, 1),
+        date(2023, 5, 4),
+    )
+
+
+def test_question_rollups() -> None:
+    import hashlib
+    from datetime import date, datetime
+    from db import SessionContext
+    from db.models import QuestionRollup
+    from db.sql import TopAnsweredQueriesQuery, TopUnansweredQueriesQuery
+
+    day = date(2000, 1, 1)
+    rows = [
+        # (answered, question, count)
+        (True, "hvað er klukkan", 5),
+        (True, "hver er forseti íslands", 2),
+        (False, "blergh smergh", 3),
+        (False, "hvað er klukkan", 1),
+    ]
+    # The session is rolled back on exit, discarding the rows
+    with SessionContext() as session:
+        for answered, question, cnt in rows:
+            session.add(
+                QuestionRollup(
+                    day=day,
+                    answered=answered,
+                    qhash=hashlib.md5(question.encode("utf-8")).hexdigest(),
+                    question=question,
+                    cnt=cnt,
+                )
+            )
+        session.flush()
+        start, end = datetime(2000, 1, 1), datetime(2000, 1, 2)
+        answered = TopAnsweredQueriesQuery.period(start, end, enclosing_session=session)
+        unanswered = TopUnansweredQueriesQuery.period(
+            start, end, enclosing_session=session
+        )
+        assert [tuple(r) for r in answered] == [
+            ("hvað er klukkan", 5),
+            ("hver er forseti íslands", 2),
+        ]
+        assert [tuple(r) for r in unanswered] == [
+            ("blergh smergh", 3),
+            ("hvað er klukkan", 1),
+        ]
+
+
+def test_tts_cache(tmp_path) -> None:
+    import time
+    from icespeak import TTSOptions
+    from ttscache import TTSAudioCache
+
+    cache = TTSAudioCache(tmp_path, max_bytes=2500, secret="leyndarmál")
+    assert cache.enabled
+    opts = TTSOptions(voice="Gudrun", speed=1.0)
+    key = cache.key("Klukkan  er\ntólf.", opts, False)
+    assert key == cache.key(" Klukkan er tólf. ", opts, False)
+    assert key != cache.key("Klukkan er tólf.", opts, True)
+    other = TTSOptions(voice="Gunnar", speed=1.0)
+    assert key != cache.key("Klukkan er tólf.", other, False)
+    # The key depends on the server secret
+    assert key != TTSAudioCache(tmp_path, 2500, secret="annað").key(
+        "Klukkan er tólf.", opts, False
+    )
+    # The cache is disabled without a secret
+    assert not TTSAudioCache(tmp_path, 2500, secret="").enabled
+
+    assert cache.lookup(key) is None
+    old = time.time() - 2 * cache.MIN_AGE
+    for i in range(3):
+        p = tmp_path / f"{i}.mp3"
+        p.write_bytes(b"x" * 1000)
+        os.utime(p, (old + i, old + i))
+    (tmp_path / f"{key}.mp3").write_bytes(b"x" * 1000)
+    # Reusing a file marks it as recently used
+    assert cache.lookup(key) == tmp_path / f"{key}.mp3"
+    # The least recently used files are evicted down to the low water mark
+    assert cache.evict() == 2
+    assert sorted(p.name for p in tmp_path.iterdir()) == ["2.mp3", f"{key}.mp3"]
+
+
+
+def test_metrics(tmp_path, monkeypatch) -> None:
+    from settings import Settings
+    from metrics import Histogram, Metrics
+
+    h = Histogram()
+    for ms in (2, 3, 4, 40, 4000):
+        h.observe(ms / 1000)
+    assert h.count == 5
+    assert abs(h.sum - 4.049) < 1e-9
+    # The median lies in the (2.5 ms, 5 ms] bucket
+    assert 0.0025 < h.quantile(0.5) <= 0.005
+    assert 2.5 < h.quantile(0.99) <= 5.0
+    assert Histogram().quantile(0.5) == 0.0
+
+    monkeypatch.setattr(Settings, "METRICS", False)
+    m = Metrics()
+    m.start("test")
+    with m.timer("stage"):
+        pass
+    m.count("event")
+    assert m.summary() == ""
+    assert m.exposition() == ""
+
+    monkeypatch.setattr(Settings, "METRICS", True)
+    monkeypatch.setattr(Settings, "METRICS_DIR", str(tmp_path))
+    # Snapshots of previous runs of a batch job are deleted
+    (tmp_path / f"test-{os.getpid() + 1}.json").write_text("{}")
+    m.start("test", batch=True)
+    assert not list(tmp_path.iterdir())
+
+    @m.timed("stage", "f")
+    def f(n: int) -> int:
+        return n + 1
+
+    assert f(1) == 2
+    for _ in range(3):
+        with m.timer("stage"):
+            pass
+    m.count("event", 2, "x")
+    histograms, counters = m.collect("test")
+    assert histograms[("test", "stage", "")].count == 3
+    assert histograms[("test", "stage", "f")].count == 1
+    assert counters == {("test", "event", "x"): 2}
+    assert (tmp_path / f"test-{os.getpid()}.json").exists()
+
+    text = m.exposition()
+    assert 'greynir_stage_seconds_bucket{job="test",stage="stage",le="+Inf"} 3' in text
+    assert 'greynir_stage_seconds_count{job="test",stage="stage",name="f"} 1' in text
+    assert 'greynir_events_total{job="test",event="event",name="x"} 2' in text
+    assert m.summary().splitlines()[0].startswith("Stage")
+
+    # The snapshots of server processes that have exited are deleted
+    m.start("web")
+    m.flush()
+    dead = tmp_path / "web-999999999.json"
+    snapshot = dict(job="web", pid=999999999, batch=False, histograms=[], counters=[])
+    dead.write_text(json.dumps(snapshot))
+    m.collect()
+    assert not dead.exists()
+
+
 def test_search() -> None:
     from search import Search
 
@@ -246,7 +599,20 @@ def test_search() -> None:
 def test_tnttagger() -> None:
     from tnttagger import TnT
 
-    assert TnT  # Silence linter
+    tnt = TnT(N=10, C=True)
+    tnt.train(
+        [
+            [("Hún", "fpven"), ("les", "sfg3en"), ("bók", "nveo")],
+            [("Hann", "fpken"), ("les", "sfg3en"), ("blað", "nheo")],
+            [("bók", "nven"), ("er", "sfg3en"), ("góð", "lvensf")],
+            [("blað", "nhen"), ("er", "sfg3en"), ("gott", "lhensf")],
+        ]
+    )
+    sents = [["Hún", "les", "blað"], ["bók", "er", "gott"], []]
+    tagged = tnt.tag_sents(sents)
+    assert tagged == [tnt.tag(s) for s in sents]
+    assert [t for _, t in tagged[0]] == ["fpven", "sfg3en", "nheo"]
+    assert tagged[2] == []
 
 
 def test_geo() -> None:
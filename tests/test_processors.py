@@ -40,6 +40,7 @@ from reynir import tokenize  # noqa
 from reynir.incparser import IncrementalParser  # noqa
 from reynir.fastparser import Fast_Parser, ParseForestDumper  # noqa
 from tree import Tree, Session  # noqa
+from tree.flat import FlatTree  # noqa
 from tree.util import TreeUtility  # noqa
 
 
@@ -96,9 +97,9 @@ class LocationsSessionShim(SessionShim):
         self.defs.add((row.name, row.kind))
 
 
-def _make_tree(text: str) -> Tuple[Tree, str]:
+def _make_tree(text: str, flat: bool = False) -> Tuple[Tree, str]:
     """Tokenize and parse text, create tree representation string
-    from all the parse trees, return Tree object and token JSON."""
+    from all the parse trees, return Tree (or FlatTree) object and token JSON."""
     toklist = tokenize(text)
     fp = Fast_Parser(verbose=False)
     ip = IncrementalParser(fp, toklist, verbose=False)
@@ -131,7 +132,7 @@ def _make_tree(text: str) -> Tuple[Tree, str]:
     tree_string = "".join("S{0}\n{1}\n".format(key, val) for key, val in trees.items())
     tokens_json = json.dumps(pgs, separators=(",", ":"), ensure_ascii=False)
 
-    tree = Tree()
+    tree = FlatTree() if flat else Tree()
     tree.load(tree_string)
     return tree, tokens_json
 
@@ -269,6 +270,38 @@ def test_persons():
     assert session.is_empty()
 
 
+def test_flat_tree():
+    text = """
+
+    Katrín Jakobsdóttir, forsætisráðherra, var á Alþingi í dag.
+
+    Danska byggingavörukeðjan Bygma hefur keypt íslenska
+    verslunarfyrirtækið Húsasmiðjuna.
+
+    """
+
+    tree, _ = _make_tree(text)
+    flat_tree, _ = _make_tree(text, flat=True)
+    # The flat tree materializes the same node structure as the linked tree
+    assert [ix for ix, _ in flat_tree.sentences()] == [ix for ix, _ in tree.sentences()]
+    for ix, sent in tree.sentences():
+        assert str(flat_tree[ix]) == str(sent)
+        assert flat_tree.score(ix) == tree.score(ix)
+        assert flat_tree.length(ix) == tree.length(ix)
+
+    # The processors give the same results on both representations
+    session = PersonsSessionShim()
+    flat_tree.process(cast(Session, session), persons)
+    session.check(("Katrín Jakobsdóttir", "forsætisráðherra", "kvk"))
+    assert session.is_empty()
+
+    session = EntitiesSessionShim()
+    flat_tree.process(cast(Session, session), entities)
+    session.check(("Bygma", "er", "dönsk byggingavörukeðja"))
+    session.check(("Húsasmiðjan", "er", "íslenskt verslunarfyrirtæki"))
+    assert session.is_empty()
+
+
 def test_locations():
     text = """
 
@@ -45,7 +45,7 @@ from main import app
 from settings import changedlocale
 from db import SessionContext
 from db.models import Query, QueryClientData  # , QueryLog
-from queries import ResponseDict
+from queries import ResponseDict, query_log_writer
 from utility import read_txt_api_key
 from icespeak.transcribe import strip_markup
 from utility import QUERIES_RESOURCES_DIR
@@ -128,6 +128,8 @@ def _query_data_cleanup() -> None:
     """Delete any queries or query data logged as
     result of query module tests."""
 
+    # Wait for the background writer to log the queries of the tests
+    query_log_writer.wait_for_client(DUMMY_CLIENT_ID)
     with SessionContext(commit=True) as session:
         session.execute(
             Query.table().delete().where(Query.client_id == DUMMY_CLIENT_ID)
@@ -1946,3 +1948,274 @@ def test_query_utility_functions() -> None:
 
     assert timezone4loc((64.157202, -21.948536)) == "Atlantic/Reykjavik"
     assert timezone4loc((40.093368, 57.000067)) == "Asia/Ashgabat"
+
+
+def test_query_cache() -> None:
+    """Test the in-memory tier of the voice query cache."""
+
+    from queries import QueryCache
+
+    qc = QueryCache(maxsize=2)
+    now = _now()
+    answer = dict(
+        q="Hvað er klukkan?",
+        answer="12:00",
+        voice="Klukkan er tólf",
+        expires=now + timedelta(minutes=1),
+        qtype="Time",
+        key=None,
+    )
+    qc.put("Hvað er klukkan", answer)
+    # Questions are looked up in lower case, without touching the database
+    assert qc.get(None, "hvað er KLUKKAN", now) == answer  # type: ignore
+    # An answer that expires earlier does not replace a later one
+    qc.put("hvað er klukkan", dict(answer, expires=now + timedelta(seconds=10)))
+    assert qc.get(None, "hvað er klukkan", now) == answer  # type: ignore
+    # Expired answers are evicted
+    qc.put("hvað er í fréttum", dict(answer, expires=now - timedelta(seconds=1)))
+    stats = qc.stats()
+    assert stats["size"] == 1
+    assert stats["hits"] == 2
+    assert stats["misses"] == 0
+
+    # An answer cached by another process is found via the shared cache
+    class SharedCache:
+        def __init__(self) -> None:
+            self.values: Dict[str, str] = dict()
+
+        def get(self, key: str) -> Optional[str]:
+            return self.values.get(key)
+
+        def set(self, key: str, value: str, px: int) -> None:
+            self.values[key] = value
+
+    qc = QueryCache(maxsize=2)
+    qc._redis = SharedCache()
+    qc._shared_put("hvað er klukkan", answer)
+    assert qc.get(None, "hvað er klukkan", now) == answer  # type: ignore
+    # ...and then served from memory
+    assert qc.get(None, "hvað er klukkan", now) == answer  # type: ignore
+    stats = qc.stats()
+    assert stats["shared_hits"] == 1
+    assert stats["hits"] == 1
+    assert stats["misses"] == 0
+
+
+def test_query_log_writer() -> None:
+    """Test batching and back-pressure in the background query log writer."""
+
+    import threading
+    from queries import QueryLogWriter
+
+    batches = []
+    inserting = threading.Event()
+    release = threading.Event()
+
+    class TestWriter(QueryLogWriter):
+        BATCH_DELAY = 0.01
+        PUT_TIMEOUT = 0.01
+
+        def _insert(self, batch):
+            inserting.set()
+            release.wait(timeout=5.0)
+            batches.append(batch)
+
+    w = TestWriter(maxsize=2)
+    rows = [dict(timestamp=_now(), client_id=f"client{i}") for i in range(6)]
+    # The first row is taken by the writer thread, which then waits,
+    # the next two fill the queue and the rest are dropped
+    assert w.put(rows[0])
+    assert inserting.wait(timeout=5.0)
+    assert w.put(rows[1]) and w.put(rows[2])
+    assert not w.put(rows[3]) and not w.put(rows[4])
+    release.set()
+    w.wait_for_client("client2")
+    assert w.put(rows[5])
+    w.close()
+    assert [r["client_id"] for b in batches for r in b] == [
+        "client0",
+        "client1",
+        "client2",
+        "client5",
+    ]
+    stats = w.stats()
+    assert stats["submitted"] == 6
+    assert stats["written"] == 4
+    assert stats["dropped"] == 2
+    assert stats["blocked"] == 2
+    assert stats["failed"] == 0
+
+
+def test_data_feeds(tmp_path) -> None:
+    """Test storing, sharing and refreshing data feeds."""
+
+    import time
+    from settings import Settings
+    from queries.util.feeds import Feed, KeyedFeed
+
+    feed_dir = Settings.FEED_DIR
+    Settings.FEED_DIR = str(tmp_path)
+    try:
+        fetched = []
+
+        def fetch_rates():
+            fetched.append("rates")
+            return None if len(fetched) > 2 else dict(USD=140.0)
+
+        # Two instances of a feed stand in for two processes
+        f1 = Feed("test_rates", fetch_rates, 3600)
+        f2 = Feed("test_rates", fetch_rates, 3600)
+        assert f1.get() == dict(USD=140.0)
+        assert f2.get() == dict(USD=140.0)
+        assert len(fetched) == 1
+        # Refreshing ahead is skipped while the stored entry is fresh
+        f2.refresh_due()
+        assert len(fetched) == 1
+        # Stale entries are refreshed, and kept if refreshing fails
+        path = tmp_path / "test_rates.json"
+        ts = time.time() - f1.ttl
+        os.utime(path, (ts, ts))
+        f1.refresh_due()
+        assert len(fetched) == 2
+        os.utime(path, (ts, ts))
+        f2.refresh_due()
+        assert len(fetched) == 3
+        # Reading an expired entry tries to refresh it first,
+        # and serves the expired data if that fails
+        assert f1.get() == dict(USD=140.0)
+        assert len(fetched) == 4
+        # After a failed fetch, a process doesn't fetch again for a while
+        assert f1.get() == dict(USD=140.0)
+        assert f2.get() == dict(USD=140.0)
+        assert len(fetched) == 4
+        # Entries that are too stale are not served
+        ts = time.time() - f1.ttl * f1.STALE_FACTOR
+        os.utime(path, (ts, ts))
+        assert f1.get() is None
+        assert len(fetched) == 4
+        f1.FAILURE_BACKOFF = 0.0
+        assert f1.get() is None
+        assert len(fetched) == 5
+
+        keys = []
+
+        def fetch_length(key: str) -> Dict[str, int]:
+            keys.append(key)
+            return dict(length=len(key))
+
+        kf: KeyedFeed[Dict[str, int]] = KeyedFeed(
+            "test_lengths", fetch_length, 60, transform=dict
+        )
+        assert kf.get("Reykjavík") == dict(length=9)
+        assert kf.get("Akureyri") == dict(length=8)
+        assert kf.get("Akureyri") == dict(length=8)
+        assert keys == ["Reykjavík", "Akureyri"]
+        assert len(list(tmp_path.glob("test_lengths-*.json"))) == 2
+        # Expired entries are fetched again when read
+        ts = time.time() - kf.ttl - 1
+        for p in tmp_path.glob("test_lengths-*.json"):
+            os.utime(p, (ts, ts))
+        assert kf.get("Akureyri") == dict(length=8)
+        assert keys == ["Reykjavík", "Akureyri", "Akureyri"]
+        ts = time.time() - kf.ttl * kf.STALE_FACTOR - 1
+        for p in tmp_path.glob("test_lengths-*.json"):
+            os.utime(p, (ts, ts))
+        kf.prune()
+        assert not list(tmp_path.glob("test_lengths-*.json"))
+    finally:
+        Settings.FEED_DIR = feed_dir
+
+
+def test_text_processor_prefilter() -> None:
+    """Test the creation of prefilters for plain text query processors."""
+
+    from queries import Query
+
+    pf = Query.create_prefilter("test", ("hring", "síma"))
+    assert pf is not None
+    assert pf("hringdu í 5551234")
+    assert not pf("hvað er klukkan")
+    pf = Query.create_prefilter("test", r"^hvernig (?:beygi|stafa) ég")
+    assert pf is not None
+    assert pf("hvernig beygi ég orðið hestur")
+    assert not pf("beygi ég hvernig")
+    assert Query.create_prefilter("test", None) is None
+    assert Query.create_prefilter("test", ()) is None
+
+
+def test_query_parse_cache() -> None:
+    """Test the cache of parse outcomes keyed by token sequence."""
+
+    from tokenizer import tokenize
+    from queries import QueryParseCache
+
+    pc = QueryParseCache(maxsize=2)
+    grammar = object()
+    key = pc.key(tokenize("Hvað er klukkan?"))
+    # Token sequences that differ only in whitespace share a key
+    assert key == pc.key(tokenize("Hvað  er klukkan ?"))
+    assert pc.get(key, grammar) is None
+    outcome = ("S0", None)
+    pc.put(key, grammar, outcome)  # type: ignore
+    assert pc.get(key, grammar) == outcome
+    # Replacing the grammar invalidates the cache
+    assert pc.get(key, object()) is None
+    assert pc.hits == 1
+    assert pc.misses == 2
+
+
+def test_compiled_query_grammar(monkeypatch, caplog) -> None:
+    """Test storing and loading the compiled query grammar."""
+
+    from queries import Query, QueryParser
+
+    if Query._parser is None:
+        Query.init_class()
+    key = QueryParser.grammar_key()
+    base = QueryParser._COMPILED_GRAMMAR_PREFIX + key
+    assert os.path.exists(base + ".pickle")
+    assert QueryParser._GRAMMAR_BINARY_FILE == base + ".bin"
+    # Parsers with the same grammar additions share the loaded grammar
+    grammar = QueryParser._grammar
+    QueryParser(QueryParser.grammar_additions())
+    assert QueryParser._grammar is grammar
+    # A process that starts later loads the stored grammar
+    QueryParser._grammar_key = None
+    parser = QueryParser(QueryParser.grammar_additions())
+    assert QueryParser._grammar is not grammar
+    assert QueryParser._grammar_key == key
+    pq = Query.preparse("hvað er klukkan", auto_uppercase=True, parser=parser)
+    assert pq.tree_string is not None
+    # If the engine lacks the attributes that installing a compiled grammar
+    # relies on, the parser loads the grammar itself, as before
+    monkeypatch.setattr(
+        QueryParser,
+        "_ENGINE_ATTRIBUTES",
+        QueryParser._ENGINE_ATTRIBUTES + ("_no_such_attribute",),
+    )
+    QueryParser._grammar_key = None
+    grammar = QueryParser._grammar
+    parser = QueryParser(QueryParser.grammar_additions())
+    assert "_no_such_attribute" in caplog.text
+    assert QueryParser._grammar is grammar
+    assert QueryParser._grammar_key == key
+    pq = Query.preparse("hvað er klukkan", auto_uppercase=True, parser=parser)
+    assert pq.tree_string is not None
+
+
+def test_parallel_query_parser() -> None:
+    """Test concurrent tokenization and parsing of alternative query strings."""
+
+    from queries import ParallelQueryParser, Query
+
+    pqp = ParallelQueryParser(2)
+    queries = ["blergh smergh vlurgh", "hvað er klukkan", "  ", "hver er forseti íslands"]
+    futures = pqp.submit(queries, auto_uppercase=True)
+    assert len(futures) == len(queries)
+    assert futures[2] is None
+    for q, f in zip(queries, futures):
+        if f is not None:
+            # The outcome is the same as when parsing serially
+            assert f.result() == Query.preparse(q, auto_uppercase=True)
+    assert futures[0] is not None and futures[0].result().error is not None
+    assert futures[1] is not None and futures[1].result().tree_string is not None
@@ -50,14 +50,18 @@
 
 """
 
-from typing import Any, Callable, DefaultDict, Dict, List, Optional, Sequence, Tuple, Type
+from typing import Any, DefaultDict, Dict, List, Optional, Sequence, Tuple, Type
 
 import os
 import time
 import pickle
 import logging
+import threading
 
+from array import array
+from heapq import nlargest
 from math import log
+from operator import itemgetter
 from contextlib import contextmanager
 
 from tokenizer import TOK, paragraphs, parse_tokens
@@ -66,7 +70,13 @@ from reynir.bintokenizer import tokenize
 from postagger import NgramTagger
 
 
-StateList = List[Tuple[float, List[Tuple[str, bool]]]]
+# A tag together with its capitalization flag
+TagC = Tuple[str, bool]
+
+# A trellis state: the ids of the last two tags
+State = Tuple[int, int]
+
+_BOS: TagC = ("BOS", False)
 
 
 @contextmanager
@@ -164,6 +174,104 @@ class UnknownWordTagger:
         return [(w, "Unk")]
 
 
+class _CompiledModel:
+
+    """An array-based representation of a trained TnT model, used for
+    decoding. Each (tag, capitalization) pair has an integer id. The
+    interpolated unigram probabilities are held in a dense array, the
+    bigram probabilities in dense rows (one per preceding tag) and the
+    trigram probabilities in sparse rows (one per pair of preceding tags).
+    The lambda weights are already multiplied into the stored values.
+    The rows and the per-word entries are built on first use."""
+
+    def __init__(self, tnt: "TnT") -> None:
+        self._tnt = tnt
+        self.tags: List[TagC] = list(tnt._uni.keys())
+        if _BOS not in tnt._uni:
+            self.tags.append(_BOS)
+        self.ids: Dict[TagC, int] = {tC: ix for ix, tC in enumerate(self.tags)}
+        self.bos = self.ids[_BOS]
+        # Tags outside the trained model, assigned by the unknown word
+        # tagger, get ids from num_fixed upwards and zero probabilities
+        self.num_fixed = len(self.tags)
+        uni = tnt._uni
+        n = uni.N()
+        l1 = tnt._l1
+        self.uni = array(
+            "d", (l1 * ((uni.get(tC, 0) / n) if n else 0) for tC in self.tags)
+        )
+        self._zero_row = array("d", bytes(8 * self.num_fixed))
+        self._empty_row: Dict[int, float] = dict()
+        self._bi: Dict[int, array] = dict()
+        self._tri: Dict[State, Dict[int, float]] = dict()
+        # Known words: word -> (tag ids, log lexical probabilities)
+        self._words: Dict[str, Tuple[array, array]] = dict()
+        self._lock = threading.Lock()
+
+    def tag_id(self, tC: TagC) -> int:
+        """Return the id of a (tag, capitalization) pair, adding it if required"""
+        ix = self.ids.get(tC)
+        if ix is None:
+            with self._lock:
+                ix = self.ids.get(tC)
+                if ix is None:
+                    ix = len(self.tags)
+                    self.tags.append(tC)
+                    self.ids[tC] = ix
+        return ix
+
+    def bi_row(self, h1: int) -> array:
+        """Return the dense row of bigram probabilities following tag h1"""
+        row = self._bi.get(h1)
+        if row is None:
+            fd = self._tnt._bi.get(self.tags[h1]) if h1 < self.num_fixed else None
+            if not fd:
+                row = self._zero_row
+            else:
+                row = array("d", self._zero_row)
+                n = fd.N()
+                l2 = self._tnt._l2
+                ids = self.ids
+                for tC, cnt in fd.items():
+                    row[ids[tC]] = l2 * (cnt / n)
+            self._bi[h1] = row
+        return row
+
+    def tri_row(self, state: State) -> Dict[int, float]:
+        """Return the sparse row of trigram probabilities following
+        the tags of the given state"""
+        row = self._tri.get(state)
+        if row is None:
+            h0, h1 = state
+            fd = None
+            if h0 < self.num_fixed and h1 < self.num_fixed:
+                fd = self._tnt._tri.get((self.tags[h0], self.tags[h1]))
+            if not fd:
+                row = self._empty_row
+            else:
+                n = fd.N()
+                l3 = self._tnt._l3
+                ids = self.ids
+                row = {ids[tC]: l3 * (cnt / n) for tC, cnt in fd.items()}
+            self._tri[state] = row
+        return row
+
+    def word(self, word: str, C: bool) -> Tuple[array, array]:
+        """Return the tag ids of a known word, along with the logarithms
+        of the lexical probabilities P(word | tag)"""
+        entry = self._words.get(word)
+        if entry is None:
+            uni = self._tnt._uni
+            tids = array("l")
+            lpwd = array("d")
+            for t, cnt in self._tnt._wd[word].items():
+                tC = (t, C)
+                tids.append(self.tag_id(tC))
+                lpwd.append(log(cnt / uni[tC]))
+            entry = self._words[word] = (tids, lpwd)
+        return entry
+
+
 class TnT:
     """
     TnT - Statistical POS tagger
@@ -187,7 +295,8 @@ class TnT:
     A beam search is used to limit the memory usage of the algorithm.
     The degree of the beam can be changed using N in the initialization.
     N represents the maximum number of possible solutions to maintain
-    while tagging.
+    while tagging. The solutions are kept in a trellis, with back-pointers
+    instead of copied tag histories.
     It is possible to differentiate the tags which are assigned to
     capitalized words. However this does not result in a significant
     gain in the accuracy of the results.
@@ -230,6 +339,9 @@ class TnT:
         self._training = True  # In training phase?
         self._count = 0  # Trained sentences
 
+        # The compiled model used for decoding, built on first use
+        self._compiled: Optional[_CompiledModel] = None
+
         # statistical tools (ignore or delete me)
         self.unknown = 0
         self.known = 0
@@ -238,12 +350,14 @@ class TnT:
         """Obtain the state of this object to be pickled"""
         state = self.__dict__.copy()
         del state["_unk"]
+        state.pop("_compiled", None)
         return state
 
     def __setstate__(self, state: Dict[str, Any]) -> None:
         """Restore the state of this object from a pickle"""
         self.__dict__.update(state)
         self._unk = UnknownWordTagger()
+        self._compiled = None
 
     def _freeze_N(self) -> None:
         """Make sure all contained FreqDicts are 'frozen'"""
@@ -288,8 +402,9 @@ class TnT:
         :param data: List of lists of (word, tag) tuples
         :type data: tuple(str)
         """
+        self._compiled = None
         for sent in sentences:
-            history = (("BOS", False), ("BOS", False))
+            history = (_BOS, _BOS)
             self._count += 1
             for w, t in sent:
 
@@ -399,17 +514,27 @@ class TnT:
         """
         return -1 if v2 == 0 else v1 / v2
 
+    def _model(self) -> _CompiledModel:
+        """Return the compiled model, building it on first use"""
+        if self._training:
+            self._finish_training()
+        model = self._compiled
+        if model is None:
+            model = self._compiled = _CompiledModel(self)
+        return model
+
     def tag_sents(self, sentences: List[List[str]]) -> List[List[Tuple[str, str]]]:
         """
         Tags each sentence in a list of sentences
         :param data:list of list of words
         :type data: [[string,],]
         :return: list of list of (word, tag) tuples
-        Invokes tag(sent) function for each sentence
-        compiles the results into a list of tagged sentences
+        The compiled model, with its rows and word entries,
+        is shared by all the sentences in the batch
         each tagged sentence is a list of (word, tag) tuples
         """
-        return [self.tag(sent) for sent in sentences]
+        model = self._model()
+        return [self._viterbi(model, list(sent)) for sent in sentences]
 
     def tag(self, sentence: List[str]) -> List[Tuple[str, str]]:
         """
@@ -417,54 +542,50 @@ class TnT:
         :param data: list of words
         :type data: [string,]
         :return: [(word, tag),]
-        Calls recursive function '_tagword'
-        to produce a list of tags
-        Associates the sequence of returned tags
-        with the correct words in the input sequence
-        returns a list of (word, tag) tuples
         """
-        if self._training:
-            self._finish_training()
-
-        sent = list(sentence)
+        return self._viterbi(self._model(), list(sentence))
+
+    def _viterbi(
+        self, model: _CompiledModel, sent: List[str]
+    ) -> List[Tuple[str, str]]:
+        """Find the most probable tag sequence for a sentence. Each column
+        of the trellis holds the N most probable partial paths, as the state
+        reached (the last two tag ids) and a back-pointer to the preceding
+        path, in descending order of log probability. Since the candidates
+        are generated, scored and ordered exactly as by the original beam
+        search over copied tag histories, the result is the same."""
         _wd = self._wd
-        _uni = self._uni
-        _bi = self._bi
-        _tri = self._tri
         _C = self._C
+        N = self._N
 
-        current_state: StateList = [(0.0, [("BOS", False), ("BOS", False)])]
-        keyfunc: Callable[[Any], float] = lambda x: x[0]
+        states: List[State] = [(model.bos, model.bos)]
+        scores: List[float] = [0.0]
+        # For each word, the tag ids of the paths kept, and the index
+        # of the preceding path of each in the previous column
+        trellis: List[Tuple[List[int], List[int]]] = []
+        first = itemgetter(0)
 
         for index, word in enumerate(sent):
 
-            new_state: StateList = []
-
             # if the Capitalisation is requested,
             # initalise the flag for this word
             C = _C and word[0].isupper()
 
-            # if word is known
-            # compute the set of possible tags
-            # and their associated log probabilities
+            # Candidates as (log probability, preceding path index, tag id)
+            cands: List[Tuple[float, int, int]] = []
+            add = cands.append
+
             if word in _wd:
                 self.known += 1
-
-                for (curr_sent_logprob, history) in current_state:
-
-                    h1 = history[-1]
-                    h2 = tuple(history[-2:])
-
-                    for t in _wd[word]:
-                        tC = (t, C)
-                        p_uni = _uni.freq(tC)
-                        p_bi = _bi[h1].freq(tC)
-                        p_tri = _tri[h2].freq(tC)
-                        p_wd = _wd[word][t] / _uni[tC]
-                        p = self._l1 * p_uni + self._l2 * p_bi + self._l3 * p_tri
-                        p2 = log(p) + log(p_wd)
-
-                        new_state.append((curr_sent_logprob + p2, history + [tC]))
+                uni = model.uni
+                tags = list(zip(*model.word(word, C)))
+                for ix, state in enumerate(states):
+                    logprob = scores[ix]
+                    bi = model.bi_row(state[1])
+                    tri = model.tri_row(state)
+                    for t, lp in tags:
+                        p = uni[t] + bi[t] + tri.get(t, 0.0)
+                        add((logprob + (log(p) + lp), ix, t))
 
             else:
                 # otherwise a new word, set of possible tags is unknown
@@ -479,25 +600,28 @@ class TnT:
                     # or no tag is found, use the tag 'Unk'
                     taglist = [("Unk", 1.0)]
 
-                for (curr_sent_logprob, history) in current_state:
-                    for t, prob in taglist:
-                        new_state.append(
-                            (curr_sent_logprob + log(prob), history + [(t, C)])
-                        )
-
-            # now have computed a set of possible new_states
-
-            # sort states by log prob
-            new_state.sort(reverse=True, key=keyfunc)
-
-            # set is now ordered greatest to least log probability
-            # del everything after N (threshold)
-            # this is the beam search cut
-            current_state = new_state[0 : self._N]
-
-        # return the most probable tag history
-        tags = current_state[0][1]
-        return [(w, tags[i + 2][0]) for i, w in enumerate(sent)]
+                tags = [(model.tag_id((t, C)), log(prob)) for t, prob in taglist]
+                for ix, logprob in enumerate(scores):
+                    for t, lp in tags:
+                        add((logprob + lp, ix, t))
+
+            # Keep the N most probable candidates. Like a stable sort
+            # in descending order, this keeps candidates of equal
+            # probability in the order in which they were generated.
+            kept = nlargest(N, cands, key=first)
+            states = [(states[ix][1], t) for _, ix, t in kept]
+            scores = [c[0] for c in kept]
+            trellis.append(([c[2] for c in kept], [c[1] for c in kept]))
+
+        # Follow the back-pointers from the most probable path
+        path: List[int] = []
+        ix = 0
+        for tids, back in reversed(trellis):
+            path.append(tids[ix])
+            ix = back[ix]
+        path.reverse()
+        tagnames = model.tags
+        return [(w, tagnames[t][0]) for w, t in zip(sent, path)]
 
 
 # Global tagger singleton instance
@@ -519,7 +643,6 @@ def ifd_tag(text: str) -> List[List[Tuple[str, str]]]:
             return []  # No tagger model - unable to tag
 
     token_stream = tokenize(text)
-    result: List[List[Tuple[str, str]]] = []
 
     def xlt(txt: str) -> str:
         """Translate the token text as required before tagging it"""
@@ -528,12 +651,12 @@ def ifd_tag(text: str) -> List[List[Tuple[str, str]]]:
             return txt[1:-1]
         return _XLT.get(txt, txt)
 
-    for pg in paragraphs(token_stream):
-        for _, sent in pg:
-            toklist = [xlt(t.txt) for t in sent if t.txt]
-            # print(f"Toklist: {toklist}")
-            tagged = _TAGGER.tag(toklist)
-            result.append(tagged)
+    sentences = [
+        [xlt(t.txt) for t in sent if t.txt]
+        for pg in paragraphs(token_stream)
+        for _, sent in pg
+    ]
+    result = _TAGGER.tag_sents(sentences)
 
     # Return a list of paragraphs, consisting of sentences, consisting of tokens
     return result
@@ -0,0 +1,493 @@
+#!/usr/bin/env python
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Benchmark suite
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This program measures the throughput and latency of the natural
+    language processing stages that the web server and the batch jobs
+    depend on, using fixed corpora in tests/files, so that the results
+    are comparable between runs and versions:
+
+        tokenize_html   Fetcher.tokenize_html() of each article
+        parse           Article._parse() of each article
+        tree_load       TreeBase.load() of the parse trees of each article
+        tree_process    Tree.process() of each article by all tree processors
+        entities        recognize_entities() on each sentence
+        tnt_tag         TnT.tag() of each sentence
+        ngram_tag       NgramTagger.tag() of each sentence
+        query           process_query() of each voice query
+        similar_*       SimilarityServer.find_similar() at several corpus
+                        sizes, with exact search and with the IVF index
+
+    Each benchmark reports the number of operations per second and
+    percentiles of their latency. The results can be stored as a baseline,
+    in a JSON file, and compared with a previously stored baseline, in
+    which case the program exits with status 1 if the throughput or the
+    median latency of any benchmark is worse than in the baseline by more
+    than a threshold (10% by default).
+
+    The similarity benchmarks use the modules and packages of the vectors
+    subdirectory, and are run separately, in its virtualenv, with
+    --suite vectors. The other benchmarks need the configured database,
+    for entity names and scraper roots; they do not modify it.
+
+    The voice queries can instead be read from another file, given with
+    --queries, or sampled from the query log with --sample-queries. A
+    sample is kept in memory, and if --queries is also given it is stored
+    in that file, for use in later runs. The fixed corpora in tests/files
+    are never written to.
+
+    Usage:
+
+        python tools/bench.py [--suite nlp|vectors] [--only NAME ...]
+            [--repeat N] [--queries FILE] [--sample-queries N] [--save FILE]
+            [--compare FILE] [--threshold PERCENT]
+
+"""
+
+from typing import Any, Callable, Dict, Iterator, List, Optional, Tuple
+
+import argparse
+import json
+import math
+import os
+import platform
+import sys
+import tempfile
+import time
+from contextlib import closing
+
+# Hack to make this Python program executable from the tools subdirectory
+basepath, _ = os.path.split(os.path.realpath(__file__))
+_TOOLS = os.sep + "tools"
+if basepath.endswith(_TOOLS):
+    basepath = basepath[0 : -len(_TOOLS)]
+    sys.path.append(basepath)
+
+
+# The fixed corpora: HTML documents of articles, and voice queries
+_ARTICLES_FILE = os.path.join(basepath, "tests", "files", "bench_articles.json")
+_QUERIES_FILE = os.path.join(basepath, "tests", "files", "bench_queries.txt")
+
+# Number of topic vectors in the similarity benchmarks
+_SIMILAR_SIZES = (1000, 10000, 100000)
+# Number of dimensions of the topic vectors
+_SIMILAR_DIMENSIONS = 200
+# Number of queries in each similarity benchmark
+_SIMILAR_QUERIES = 200
+
+# Version of the baseline file format
+_BASELINE_VERSION = 1
+
+# An operation, whose latency is measured
+Op = Callable[[], Any]
+# A function that sets up a benchmark, returning its operations,
+# or None if the benchmark can't be run
+Factory = Callable[[], Optional[List[Op]]]
+# Results of a benchmark
+Stats = Dict[str, float]
+
+
+def percentile(samples: List[float], p: float) -> float:
+    """Return the p-th percentile of a sorted list of samples,
+    using the nearest-rank method"""
+    if not samples:
+        return 0.0
+    k = math.ceil(p / 100.0 * len(samples)) - 1
+    return samples[max(0, min(k, len(samples) - 1))]
+
+
+def measure(ops: List[Op], repeat: int = 1, *, warmup: int = 1) -> Stats:
+    """Run the operations `repeat` times, after running the first `warmup`
+    of them once, e.g. to load models and fill caches, returning the
+    throughput and latency statistics"""
+    for op in ops[:warmup]:
+        op()
+    latencies: List[float] = []
+    for _ in range(repeat):
+        for op in ops:
+            t0 = time.perf_counter()
+            op()
+            latencies.append(time.perf_counter() - t0)
+    latencies.sort()
+    total = sum(latencies)
+    return dict(
+        ops=len(latencies),
+        ops_per_sec=len(latencies) / total if total > 0.0 else 0.0,
+        p50_ms=1000.0 * percentile(latencies, 50),
+        p90_ms=1000.0 * percentile(latencies, 90),
+        p99_ms=1000.0 * percentile(latencies, 99),
+        max_ms=1000.0 * (latencies[-1] if latencies else 0.0),
+    )
+
+
+def compare(
+    results: Dict[str, Stats], baseline: Dict[str, Stats], threshold: float
+) -> List[str]:
+    """Return descriptions of the regressions of the results against the
+    baseline, i.e. of the benchmarks whose throughput is lower, or whose
+    median latency is higher, by more than the threshold fraction"""
+    regressions: List[str] = []
+    for name, r in results.items():
+        b = baseline.get(name)
+        if not b:
+            continue
+        if r["ops_per_sec"] < b["ops_per_sec"] * (1.0 - threshold):
+            regressions.append(
+                "{0}: {1:,.1f} ops/s, baseline {2:,.1f} ops/s".format(
+                    name, r["ops_per_sec"], b["ops_per_sec"]
+                )
+            )
+        elif r["p50_ms"] > b["p50_ms"] * (1.0 + threshold):
+            regressions.append(
+                "{0}: median latency {1:.2f} ms, baseline {2:.2f} ms".format(
+                    name, r["p50_ms"], b["p50_ms"]
+                )
+            )
+    return regressions
+
+
+def load_baseline(fname: str) -> Dict[str, Stats]:
+    """Return the results stored in a baseline file"""
+    with open(fname, "r", encoding="utf-8") as f:
+        baseline = json.load(f)
+    if baseline.get("version") != _BASELINE_VERSION:
+        raise ValueError(f"Baseline {fname} has an unknown format version")
+    return baseline["results"]
+
+
+def save_baseline(fname: str, results: Dict[str, Stats]) -> None:
+    """Store the results in a baseline file, keeping the results
+    of other benchmarks (e.g. of the other suite) already in it"""
+    stored: Dict[str, Stats] = dict()
+    if os.path.exists(fname):
+        stored = load_baseline(fname)
+    stored.update(results)
+    baseline = dict(
+        version=_BASELINE_VERSION,
+        python=platform.python_implementation() + " " + platform.python_version(),
+        machine=platform.machine(),
+        results=stored,
+    )
+    with open(fname, "w", encoding="utf-8") as f:
+        json.dump(baseline, f, indent=2, sort_keys=True)
+        f.write("\n")
+
+
+def sample_queries(num: int, days: int = 30) -> List[str]:
+    """Return a random sample of the questions in the query log
+    within the given number of days"""
+    from datetime import datetime, timedelta, timezone
+    from sqlalchemy import func
+    from db import SessionContext
+    from db.models import Query
+
+    since = datetime.now(timezone.utc) - timedelta(days=days)
+    with SessionContext(read_only=True) as session:
+        q = (
+            session.query(Query.question)
+            .filter(Query.question != None)
+            .filter(Query.qtype != None)
+            .filter(Query.timestamp >= since)
+            .order_by(func.random())
+            .limit(num)
+        )
+        return [r[0] for r in q if r[0]]
+
+
+def nlp_suite(args: argparse.Namespace) -> Iterator[Tuple[str, Factory]]:
+    """The benchmarks of the tokenizing, parsing, processing,
+    tagging and query stages"""
+    from settings import Settings, ConfigError
+
+    try:
+        # Read configuration file
+        Settings.read(os.path.join(basepath, "config", "Greynir.conf"))
+    except ConfigError as e:
+        print("Configuration error: {0}".format(e))
+        quit()
+    # Measure the parser rather than the cache of parsed sentences
+    Settings.SENTENCE_CACHE = False
+
+    import importlib
+    from pathlib import Path
+    from reynir import tokenize
+    from db import SessionContext
+    from fetcher import Fetcher
+    from article import Article
+    from tree.flat import FlatTree
+    from nertokenizer import recognize_entities
+    from utility import modules_in_dir
+
+    with open(_ARTICLES_FILE, "r", encoding="utf-8") as f:
+        corpus: List[Dict[str, str]] = json.load(f)
+
+    if args.sample_queries:
+        queries = sample_queries(args.sample_queries)
+        print(f"Sampled {len(queries)} queries from the query log")
+        if args.queries:
+            with open(args.queries, "w", encoding="utf-8") as f:
+                f.writelines(q + "\n" for q in queries)
+            print(f"Stored the sampled queries in {args.queries}")
+    else:
+        with open(args.queries or _QUERIES_FILE, "r", encoding="utf-8") as f:
+            queries = [q.strip() for q in f if q.strip()]
+
+    # The session is not committed, so that whatever the
+    # tree processors write is discarded when it is closed
+    with SessionContext() as session:
+        parsed: List[Article] = []
+
+        def articles() -> List[Article]:
+            """Return the articles of the corpus, scraped from their HTML"""
+            result: List[Article] = []
+            for d in corpus:
+                a = Article._init_from_scrape(d["url"], session, html_doc=d["html"])
+                assert a is not None
+                result.append(a)
+            return result
+
+        def parsed_articles() -> List[Article]:
+            """Return the articles of the corpus, parsed once"""
+            if not parsed:
+                for a in articles():
+                    a._parse(session)
+                    parsed.append(a)
+            return parsed
+
+        def sentences() -> List[str]:
+            """Return the text of the sentences in the corpus"""
+            return [
+                " ".join(t["x"] for t in sent if t.get("x"))
+                for a in parsed_articles()
+                for pg in a._raw_tokens or []
+                for sent in pg
+                if sent
+            ]
+
+        def tokenize_html() -> List[Op]:
+            return [
+                lambda d=d: list(
+                    Fetcher.tokenize_html(d["url"], d["html"], session) or []
+                )
+                for d in corpus
+            ]
+
+        yield "tokenize_html", tokenize_html
+
+        def parse() -> List[Op]:
+            return [lambda a=a: a._parse(session) for a in articles()]
+
+        yield "parse", parse
+
+        def tree_load() -> List[Op]:
+            return [
+                lambda a=a: FlatTree(a._url or "").load(a._tree or "")
+                for a in parsed_articles()
+            ]
+
+        yield "tree_load", tree_load
+
+        def tree_process() -> Optional[List[Op]]:
+            processors = []
+            for modname in modules_in_dir(Path(basepath) / "processors"):
+                m = importlib.import_module(modname)
+                if getattr(m, "PROCESSOR_TYPE", None) == "tree":
+                    processors.append(m)
+            if not processors:
+                return None
+
+            def process(a: Article) -> None:
+                # Load and process the tree as the processor does
+                tree = FlatTree(a._url or "", a._authority)
+                tree.load(a._tree or "")
+                for p in processors:
+                    tree.process(session, p)
+
+            return [lambda a=a: process(a) for a in parsed_articles()]
+
+        yield "tree_process", tree_process
+
+        def entities() -> List[Op]:
+            return [
+                lambda s=s: list(recognize_entities(tokenize(s), session))
+                for s in sentences()
+            ]
+
+        yield "entities", entities
+
+        def tnt_tag() -> Optional[List[Op]]:
+            from tnttagger import TnT
+
+            tagger = TnT.load(os.path.join(basepath, "config", "TnT-model.pickle"))
+            if tagger is None:
+                return None
+            words = [[t.txt for t in tokenize(s) if t.txt] for s in sentences()]
+            return [lambda w=w: tagger.tag(w) for w in words]
+
+        yield "tnt_tag", tnt_tag
+
+        def ngram_tag() -> Optional[List[Op]]:
+            from postagger import NgramTagger
+
+            tagger = NgramTagger(n=3)
+            try:
+                tagger.load_model()
+            except OSError:
+                return None
+            return [lambda s=s: tagger.tag(s) for s in sentences()]
+
+        yield "ngram_tag", ngram_tag
+
+        def query() -> List[Op]:
+            from queries import process_query
+
+            # Private queries are not logged, and bypassing the
+            # query cache measures the whole query path
+            return [
+                lambda q=q: process_query(q, True, private=True, bypass_cache=True)
+                for q in queries
+            ]
+
+        yield "query", query
+
+
+def vectors_suite(args: argparse.Namespace) -> Iterator[Tuple[str, Factory]]:
+    """The benchmarks of the similarity server"""
+    # Import the modules of the vectors subdirectory, as the server does
+    sys.path.insert(0, os.path.join(basepath, "vectors"))
+    import numpy as np
+    from topicmatrix import TopicMatrix
+    from simserver import IVFIndex, SimilarityServer
+
+    rng = np.random.default_rng(42)
+    tmpdir = tempfile.mkdtemp(prefix="bench-")
+
+    def server(size: int, ivf: bool) -> Optional[List[Op]]:
+        if ivf and size < IVFIndex._MIN_ROWS:
+            return None
+        s = SimilarityServer()
+        atopics = TopicMatrix(_SIMILAR_DIMENSIONS)
+        matrix = rng.standard_normal((size, _SIMILAR_DIMENSIONS), dtype=np.float32)
+        for i, vector in enumerate(matrix):
+            atopics.add(str(i), vector)
+        s._atopics = atopics
+        if ivf:
+            index = IVFIndex(atopics)
+            # Train the index rather than using the one saved by the server
+            index._IVF_INDEX_FILE = os.path.join(tmpdir, f"ivf-{size}-{{0}}.npy")
+            index.build()
+            s._index = index
+        vectors = rng.standard_normal((_SIMILAR_QUERIES, _SIMILAR_DIMENSIONS))
+        return [lambda v=v: s.find_similar(10, v) for v in vectors.tolist()]
+
+    for size in _SIMILAR_SIZES:
+        yield f"similar_exact_{size}", lambda size=size: server(size, False)
+        yield f"similar_ivf_{size}", lambda size=size: server(size, True)
+
+
+_SUITES = dict(nlp=nlp_suite, vectors=vectors_suite)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Benchmark the natural language processing stages"
+    )
+    parser.add_argument(
+        "--suite", choices=sorted(_SUITES), default="nlp", help="benchmark suite"
+    )
+    parser.add_argument(
+        "--only",
+        action="append",
+        metavar="NAME",
+        help="run only the benchmarks whose names start with NAME (may be repeated)",
+    )
+    parser.add_argument(
+        "--repeat", type=int, default=3, help="number of runs of each benchmark"
+    )
+    parser.add_argument(
+        "--queries",
+        metavar="FILE",
+        help="read the query corpus from FILE, or store a sample of queries in it",
+    )
+    parser.add_argument(
+        "--sample-queries",
+        type=int,
+        default=0,
+        metavar="N",
+        help="replace the query corpus with N queries sampled from the query log",
+    )
+    parser.add_argument("--save", metavar="FILE", help="store results as a baseline")
+    parser.add_argument(
+        "--compare", metavar="FILE", help="compare results with a baseline"
+    )
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=10.0,
+        metavar="PERCENT",
+        help="regression threshold, in percent (default 10)",
+    )
+    args = parser.parse_args()
+    if args.queries and args.sample_queries:
+        fixed = os.path.dirname(_QUERIES_FILE)
+        if os.path.commonpath([fixed, os.path.realpath(args.queries)]) == fixed:
+            parser.error(f"--queries: the sample may not be stored in {fixed}")
+
+    results: Dict[str, Stats] = dict()
+    with closing(_SUITES[args.suite](args)) as benchmarks:
+        for name, factory in benchmarks:
+            if args.only and not any(name.startswith(o) for o in args.only):
+                continue
+            ops = factory()
+            if not ops:
+                print("{0:<20} skipped".format(name))
+                continue
+            r = results[name] = measure(ops, args.repeat)
+            print(
+                "{0:<20} {1:>6} ops {2:>10,.1f} ops/s   p50 {3:>8.2f} ms   "
+                "p90 {4:>8.2f} ms   p99 {5:>8.2f} ms".format(
+                    name,
+                    int(r["ops"]),
+                    r["ops_per_sec"],
+                    r["p50_ms"],
+                    r["p90_ms"],
+                    r["p99_ms"],
+                )
+            )
+            sys.stdout.flush()
+
+    if args.save:
+        save_baseline(args.save, results)
+        print(f"Stored baseline in {args.save}")
+
+    if args.compare:
+        regressions = compare(
+            results, load_baseline(args.compare), args.threshold / 100.0
+        )
+        for r in regressions:
+            print(f"Regression: {r}")
+        if regressions:
+            sys.exit(1)
+        print(f"No regressions against {args.compare}")
+
+
+if __name__ == "__main__":
+    main()
@@ -42,6 +42,7 @@ if basepath.endswith(_TOOLS):
 from settings import Settings, ConfigError
 from db import SessionContext
 from db.models import Article
+from compact import load_tokens
 from tokenizer import correct_spaces
 
 
@@ -69,7 +70,7 @@ def main() -> None:
             (url, ts, title, tokens) = r
             if not tokens:
                 continue
-            tokens = json.loads(tokens)
+            tokens = load_tokens(tokens)
             if not tokens:
                 continue
             text = ""
@@ -29,7 +29,6 @@
 import getopt
 import sys
 import time
-import json
 
 from contextlib import closing
 from datetime import datetime, timezone
@@ -38,6 +37,7 @@ from typing import Any, List, Optional, cast, IO
 from sqlalchemy.orm.query import Query
 
 from settings import Settings, ConfigError
+from compact import load_tokens
 from db import GreynirDB
 from db.models import Article
 from tokenizer import TOK
@@ -62,7 +62,7 @@ class Dumper:
     def dump(self, tokens_json: str, file: IO[str]) -> None:
         """Dump the sentences of a single article to a text file,
         one sentence per line"""
-        tokens = json.loads(tokens_json)
+        tokens = load_tokens(tokens_json)
         skip_punctuation = frozenset(("„", "“", "”"))
         abort_punctuation = frozenset(("…", "|", "#", "@"))
         for p in tokens:
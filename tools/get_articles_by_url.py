@@ -11,6 +11,7 @@ sys.path.insert(1, os.path.join(sys.path[0], ".."))
 
 from db import SessionContext
 from db.models import Article
+from compact import load_tokens
 from tokenizer import correct_spaces
 
 
@@ -19,7 +20,7 @@ def tokens2text(tokens):
     text = ""
     if not tokens:
         return text
-    tokens = json.loads(tokens)
+    tokens = load_tokens(tokens)
     if not tokens:
         return text
     # Paragraphs
@@ -6,7 +6,6 @@
 
 
 import datetime
-import json
 import sys
 
 import sqlalchemy
@@ -15,11 +14,12 @@ from sqlalchemy.dialects.postgresql import UUID as psql_UUID
 
 from db import SessionContext, DataError, desc
 from db.models import Article as ArticleRow, Word, Root
+from compact import load_tokens
 from article import Article
 
 
 def gen_sent_text(art):
-    tokens = json.loads(art.tokens)
+    tokens = load_tokens(art.tokens)
     idx = 0
     for pg in tokens:
         for sent in pg:
@@ -6,7 +6,7 @@
     add them to a dictionary and spit it out.
 """
 
-import json, sys, os
+import sys, os
 from datetime import datetime, timezone
 from collections import defaultdict
 from pprint import pprint
@@ -17,6 +17,7 @@ sys.path.insert(1, os.path.join(sys.path[0], ".."))
 
 from db import SessionContext
 from db.models import Article
+from compact import load_tokens
 
 with SessionContext(read_only=True) as session:
     q = (
@@ -34,7 +35,7 @@ with SessionContext(read_only=True) as session:
         print("%d\r" % i, end="")
         if not a.tokens:
             continue
-        tokens = json.loads(a.tokens)
+        tokens = load_tokens(a.tokens)
         # Paragraphs
         for p in tokens:
             # Sentences
@@ -0,0 +1,144 @@
+#!/usr/bin/env python
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Entity recognition benchmark
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This program measures the throughput, in tokens per second, of
+    recognize_entities() on text from recently parsed articles, using
+    the process-wide entity name trie and, for comparison, the previous
+    method of querying the entities table for each distinct capitalized
+    word in a token stream.
+
+"""
+
+from typing import Dict, List, Sequence
+
+import os
+import sys
+import time
+
+# Hack to make this Python program executable from the tools subdirectory
+basepath, _ = os.path.split(os.path.realpath(__file__))
+_TOOLS = os.sep + "tools"
+if basepath.endswith(_TOOLS):
+    basepath = basepath[0 : -len(_TOOLS)]
+    sys.path.append(basepath)
+
+from settings import Settings, ConfigError
+from db import SessionContext, Session
+from db.models import Entity
+from article import Article
+from reynir import tokenize
+import nertokenizer
+
+
+class QueryEntityNames:
+
+    """Look up entity names with a LIKE query for each distinct word
+    in a token stream, as recognize_entities() did before the trie"""
+
+    def __init__(self) -> None:
+        self._cache: Dict[str, List[str]] = dict()
+
+    def reset(self) -> None:
+        """Start a new token stream"""
+        self._cache = dict()
+
+    def lookup(self, session: Session, w: str) -> Sequence[str]:
+        names = self._cache.get(w)
+        if names is None:
+            q = session.query(Entity.name, Entity.verb, Entity.definition).filter(
+                Entity.name.like(w + " %") | (Entity.name == w)
+            )
+            names = self._cache[w] = [e.name for e in q.all()]
+        return names
+
+
+def run(texts: List[str], num_tokens: int, names: object, title: str) -> None:
+    """Recognize the entities in each text as a separate token stream"""
+    nertokenizer.entity_names = names  # type: ignore
+    with SessionContext(commit=True, read_only=True) as session:
+        # Warm up, eventually loading the trie
+        list(nertokenizer.recognize_entities(tokenize(texts[0]), session))
+        t0 = time.perf_counter()
+        for text in texts:
+            if isinstance(names, QueryEntityNames):
+                names.reset()
+            list(nertokenizer.recognize_entities(tokenize(text), session))
+        elapsed = time.perf_counter() - t0
+    print(
+        "{0}: {1} texts in {2:.2f} seconds, {3:,.0f} tokens/sec".format(
+            title, len(texts), elapsed, num_tokens / elapsed
+        )
+    )
+
+
+def main() -> None:
+    import argparse
+
+    parser = argparse.ArgumentParser(description="Benchmark entity recognition")
+    parser.add_argument(
+        "--sentences", type=int, default=5000, help="number of sentences to use"
+    )
+    parser.add_argument(
+        "--per-text",
+        type=int,
+        default=25,
+        help="number of sentences in each token stream (article)",
+    )
+    args = parser.parse_args()
+
+    try:
+        # Read configuration file
+        Settings.read(os.path.join(basepath, "config", "Greynir.conf"))
+    except ConfigError as e:
+        print("Configuration error: {0}".format(e))
+        quit()
+
+    sentences = [
+        " ".join(t["x"] for t in sent if t.get("x"))
+        for sent in Article.sentence_stream(limit=args.sentences)
+    ]
+    if not sentences:
+        print("No parsed articles found")
+        return
+    texts = [
+        " ".join(sentences[i : i + args.per_text])
+        for i in range(0, len(sentences), args.per_text)
+    ]
+    num_tokens = sum(sum(1 for t in tokenize(text) if t.txt) for text in texts)
+    print("{0} texts containing {1} tokens".format(len(texts), num_tokens))
+
+    trie = nertokenizer.entity_names
+    run(texts, num_tokens, QueryEntityNames(), "Per-word queries")
+    t0 = time.perf_counter()
+    with SessionContext(commit=True, read_only=True) as session:
+        trie.invalidate()
+        trie.lookup(session, "")
+    print(
+        "Loaded {0} entity names into the trie in {1:.2f} seconds".format(
+            len(trie), time.perf_counter() - t0
+        )
+    )
+    run(texts, num_tokens, trie, "Entity name trie")
+
+
+if __name__ == "__main__":
+    main()
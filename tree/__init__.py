@@ -1409,7 +1409,7 @@ class TreeBase:
         # Hack to allow nodes to access the BIN database
         with GreynirBin.get_db() as bin_db:
             state = dict(bin_db=bin_db)
-            for ix, sent in self.s.items():
+            for ix, sent in self.sentences():
                 if sent is not None:
                     builder = SimpleTreeBuilder(nt_map, id_map, terminal_map)
                     builder.state = state
@@ -1474,6 +1474,10 @@ class TreeBase:
         self.stack = None
         self.n = None
 
+    def handle_X(self, n: int) -> None:
+        """End of sentence that was not parsed, being over the parse budget"""
+        self.handle_E(n)
+
     def handle_P(self, n: int) -> None:
         """Epsilon node: leave the parent nonterminal childless"""
         pass
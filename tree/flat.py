@@ -0,0 +1,344 @@
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Flat tree module
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements a flat, array-backed representation of the
+    sentence trees of a parsed article, intended for bulk processing.
+
+    Each sentence is decoded straight from the text format stored by the
+    scraper into parallel arrays of node kinds, labels, first-child and
+    next-sibling indices, without going through one handler call per line.
+    Nonterminal names are interned in a table that is shared by all trees.
+
+    The FlatTree class is a drop-in replacement for Tree: node objects are
+    only materialized for sentences that a processor actually visits,
+    and the sentences are then visited in an iterative post-order, so the
+    Result-based processor API works unchanged.
+
+"""
+
+from __future__ import annotations
+
+from typing import Dict, Iterator, List, Optional, Set, Tuple
+
+from array import array
+import threading
+
+from tree import (
+    Node,
+    NonterminalNode,
+    ParamList,
+    Result,
+    TerminalNode,
+    Tree,
+    TreeStateDict,
+    TreeToken,
+)
+
+
+# Node kinds
+KIND_NONTERMINAL = 0
+KIND_TERMINAL = 1
+
+# Index value denoting no node
+NO_NODE = -1
+
+# Interned nonterminal names and their base names (without variants),
+# shared by all flat trees in the process
+_NT_IDS: Dict[str, int] = dict()
+_NT_NAMES: List[str] = []
+_NT_BASES: List[str] = []
+_NT_LOCK = threading.Lock()
+
+
+def intern_nonterminal(nt: str) -> int:
+    """Return the id of the given nonterminal name, adding it if required"""
+    ix = _NT_IDS.get(nt)
+    if ix is None:
+        with _NT_LOCK:
+            ix = _NT_IDS.get(nt)
+            if ix is None:
+                ix = len(_NT_NAMES)
+                _NT_NAMES.append(nt)
+                _NT_BASES.append(nt.split("_", maxsplit=1)[0])
+                _NT_IDS[nt] = ix
+    return ix
+
+
+class FlatSentence:
+
+    """The nodes of a single sentence tree, stored in parallel arrays
+    in pre-order. The root node has index 0. For a nonterminal node,
+    the label is the id of its interned name; for a terminal node,
+    it is an index into the token list."""
+
+    __slots__ = ("kind", "label", "child", "nxt", "tokens", "_nodes")
+
+    def __init__(self) -> None:
+        self.kind = array("b")
+        self.label = array("i")
+        self.child = array("i")
+        self.nxt = array("i")
+        self.tokens: List[TreeToken] = []
+        # Materialized node objects, if any
+        self._nodes: Optional[List[Node]] = None
+
+    def __len__(self) -> int:
+        return len(self.kind)
+
+    def add_nonterminal(self, nt: str) -> int:
+        """Append a nonterminal node, returning its index"""
+        return self._add(KIND_NONTERMINAL, intern_nonterminal(nt))
+
+    def add_terminal(self, token: TreeToken) -> int:
+        """Append a terminal node, returning its index"""
+        self.tokens.append(token)
+        return self._add(KIND_TERMINAL, len(self.tokens) - 1)
+
+    def _add(self, kind: int, label: int) -> int:
+        self.kind.append(kind)
+        self.label.append(label)
+        self.child.append(NO_NODE)
+        self.nxt.append(NO_NODE)
+        return len(self.kind) - 1
+
+    def is_terminal(self, ix: int) -> bool:
+        return self.kind[ix] == KIND_TERMINAL
+
+    def nonterminal(self, ix: int) -> str:
+        """Return the name of the nonterminal at index ix"""
+        assert self.kind[ix] == KIND_NONTERMINAL
+        return _NT_NAMES[self.label[ix]]
+
+    def terminal(self, ix: int) -> TreeToken:
+        """Return the token of the terminal at index ix"""
+        assert self.kind[ix] == KIND_TERMINAL
+        return self.tokens[self.label[ix]]
+
+    def children(self, ix: int) -> Iterator[int]:
+        """Yield the indices of the children of the node at index ix"""
+        c = self.child[ix]
+        while c != NO_NODE:
+            yield c
+            c = self.nxt[c]
+
+    def postorder(self) -> Iterator[int]:
+        """Yield the node indices in post-order, i.e. each parent
+        after all of its children, without recursion"""
+        if not self.kind:
+            return
+        child, nxt = self.child, self.nxt
+        stack: List[int] = [0]
+        cursor: List[int] = [child[0]]
+        while stack:
+            c = cursor[-1]
+            if c == NO_NODE:
+                cursor.pop()
+                yield stack.pop()
+            else:
+                cursor[-1] = nxt[c]
+                stack.append(c)
+                cursor.append(child[c])
+
+    def nonterminal_bases(self) -> Set[str]:
+        """Return the set of nonterminal base names occurring in the sentence"""
+        kind, label = self.kind, self.label
+        return {
+            _NT_BASES[label[ix]]
+            for ix in range(len(kind))
+            if kind[ix] == KIND_NONTERMINAL
+        }
+
+    def nodes(self) -> List[Node]:
+        """Materialize the sentence as linked Node objects, returned in a
+        list indexed like the arrays. The nodes are cached, so that per-node
+        caches (word roots and so on) are shared between processors."""
+        if self._nodes is not None:
+            return self._nodes
+        nodes: List[Node] = []
+        at_start = True
+        for kind, label in zip(self.kind, self.label):
+            if kind == KIND_NONTERMINAL:
+                nodes.append(NonterminalNode(_NT_NAMES[label]))
+            else:
+                terminal, augmented_terminal, token, tokentype, aux, cat = self.tokens[
+                    label
+                ]
+                constructor = FlatTree._TC.get(cat, TerminalNode)
+                nodes.append(
+                    constructor(
+                        terminal, augmented_terminal, token, tokentype, aux, at_start
+                    )
+                )
+                at_start = False
+        # Link the nodes
+        for ix, (c, n) in enumerate(zip(self.child, self.nxt)):
+            node = nodes[ix]
+            if c != NO_NODE:
+                node.child = nodes[c]
+            if n != NO_NODE:
+                node.nxt = nodes[n]
+        self._nodes = nodes
+        return nodes
+
+
+class FlatTree(Tree):
+
+    """A processable tree corresponding to a single parsed article,
+    where each sentence is stored as a FlatSentence"""
+
+    def __init__(self, url: str = "", authority: float = 1.0) -> None:
+        super().__init__(url, authority)
+        self.flat: Dict[int, FlatSentence] = dict()
+
+    def __getitem__(self, n: int) -> Optional[Node]:
+        """Allow indexing to get sentence roots from the tree"""
+        return self.flat[n].nodes()[0]
+
+    def __contains__(self, n: int) -> bool:
+        return n in self.flat
+
+    def sentences(self) -> Iterator[Tuple[int, Optional[Node]]]:
+        """Enumerate the sentences in this tree, materializing their nodes"""
+        for ix, fs in self.flat.items():
+            yield ix, fs.nodes()[0]
+
+    def flat_sentences(self) -> Iterator[Tuple[int, FlatSentence]]:
+        """Enumerate the sentences in this tree in their flat form"""
+        yield from self.flat.items()
+
+    def load(self, txt: str) -> None:
+        """Decode a tree from the text format stored by the scraper"""
+        parse_T = self._parse_T
+        fs: Optional[FlatSentence] = None
+        n_sent: Optional[int] = None
+        # The index of the last node at each depth on the current path
+        stack: List[int] = []
+        for line in txt.split("\n"):
+            if not line:
+                continue
+            code, _, rest = line.partition(" ")
+            op = code[0]
+            n = int(code[1:])
+            if op == "T" or op == "N":
+                assert fs is not None
+                if op == "T":
+                    ix = fs.add_terminal(parse_T(rest))
+                else:
+                    ix = fs.add_nonterminal(rest)
+                if n == len(stack):
+                    # First child of parent
+                    if n:
+                        fs.child[stack[n - 1]] = ix
+                    stack.append(ix)
+                else:
+                    assert n < len(stack)
+                    # Next child of parent
+                    fs.nxt[stack[n]] = ix
+                    stack[n] = ix
+                    del stack[n + 1 :]
+            elif op == "S":
+                # Start of sentence
+                n_sent = n
+                fs = FlatSentence()
+                stack = []
+            elif op == "Q":
+                # End of sentence
+                assert n_sent is not None and fs is not None
+                assert n_sent not in self.flat
+                assert len(fs) > 0
+                self.flat[n_sent] = fs
+                fs, n_sent = None, None
+            elif op == "E" or op == "X":
+                # End of sentence with error, or over the parse budget:
+                # nothing stored
+                assert n_sent not in self.flat
+                fs, n_sent = None, None
+            elif op == "C":
+                # Sentence score
+                assert n_sent is not None
+                assert n_sent not in self.scores
+                self.scores[n_sent] = n
+            elif op == "L":
+                # Sentence length
+                assert n_sent is not None
+                assert n_sent not in self.lengths
+                self.lengths[n_sent] = n
+            elif op == "R" or op == "P":
+                # Greynir version info, or epsilon node
+                pass
+            else:
+                assert False, "*** No handler for {0}".format(line)
+
+    def visit_flat(self, state: TreeStateDict, fs: FlatSentence) -> Optional[Result]:
+        """Visit the nodes of a flat sentence in post-order, passing the
+        results from the children of each node to the node itself"""
+        # If the processor has a visit() method that returns False for a node,
+        # we do not visit the node or its children
+        visit = state.get("_visit")
+        nodes = fs.nodes()
+        if visit is not None and not visit(state, nodes[0]):
+            return None
+        child, nxt = fs.child, fs.nxt
+        # Stack of the nodes being visited, their parameter lists,
+        # and the next child to visit
+        stack: List[Tuple[int, ParamList]] = [(0, [])]
+        cursor: List[int] = [child[0]]
+        while True:
+            c = cursor[-1]
+            if c == NO_NODE:
+                # All children visited: process the node itself
+                cursor.pop()
+                ix, params = stack.pop()
+                result = nodes[ix].process(state, params)
+                if not stack:
+                    return result
+                stack[-1][1].append(result)
+                continue
+            cursor[-1] = nxt[c]
+            if visit is None or visit(state, nodes[c]):
+                stack.append((c, []))
+                cursor.append(child[c])
+
+    def process_trees(self, state: TreeStateDict) -> None:
+        """Process the sentences in the article, in index order"""
+        processor = state["processor"]
+        # If the processor has no sentence(), visit() or default() function,
+        # the only observable effect of processing a sentence is through
+        # the nonterminal functions, so we skip sentences in which the
+        # processor handles no nonterminal
+        sentence = state.get("_sentence")
+        needs_all = (
+            sentence is not None
+            or state.get("_visit") is not None
+            or state.get("_default") is not None
+        )
+        for index, fs in self.flat.items():
+            if not needs_all and all(
+                nt not in processor for nt in fs.nonterminal_bases()
+            ):
+                continue
+            state["index"] = index
+            result = self.visit_flat(state, fs)
+            # Sentence processing completed:
+            # Invoke a function called 'sentence(state, result)',
+            # if present in the processor
+            if sentence is not None:
+                sentence(state, result)
@@ -27,6 +27,7 @@
 
 from typing import (
     TYPE_CHECKING,
+    Any,
     Callable,
     Dict,
     Iterable,
@@ -39,7 +40,9 @@ from typing import (
     cast,
 )
 
+import math
 import time
+import logging
 
 from sqlalchemy.orm.session import Session
 from tokenizer.definitions import PersonNameList, PersonNameTuple, BIN_Tuple
@@ -64,6 +67,8 @@ from reynir.simpletree import (
     IdMap,
 )
 
+from settings import Settings
+
 if TYPE_CHECKING:
     from reynir.simpletree import TerminalMap
     from queries.builtin import RegisterType
@@ -78,6 +83,64 @@ StatsDict = Dict[str, Union[int, float]]
 PgsList = List[List[List[TokenDict]]]
 XformFunc = Callable[[List[Tok], Optional[Node], Optional[int]], List[TokenDict]]
 
+
+class ParseBudget:
+
+    """Per-sentence budget for parsing. The C++ parser can't be interrupted
+    once started, so the budget is enforced up front on an estimate of the
+    parse effort: the base-10 logarithm of the number of combinations of the
+    BÍN meanings of the sentence's tokens, which drives the size of the parse
+    forest. Sentences over max_cost are not parsed at all. Parses that take
+    longer than max_time seconds are completed, but counted and logged."""
+
+    # Tree code for a sentence that was not parsed because it was over budget
+    CODE = "X"
+
+    def __init__(
+        self, max_cost: Optional[float] = None, max_time: Optional[float] = None
+    ) -> None:
+        self.max_cost = Settings.PARSE_COST_BUDGET if max_cost is None else max_cost
+        self.max_time = Settings.PARSE_TIME_BUDGET if max_time is None else max_time
+        # Number of sentences skipped because they were over budget
+        self.num_skipped = 0
+        # Number of parses that exceeded the time budget
+        self.num_overtime = 0
+
+    @staticmethod
+    def cost(tokens: Iterable[Tok]) -> float:
+        """Return the estimated parse effort for a sentence"""
+        return sum(
+            math.log10(len(t.val))
+            for t in tokens
+            if t.kind == TOK.WORD and t.val and len(t.val) > 1
+        )
+
+    def admits(self, tokens: List[Tok]) -> bool:
+        """Return True if a sentence with the given tokens is within budget"""
+        if self.max_cost > 0.0 and self.cost(tokens) > self.max_cost:
+            self.num_skipped += 1
+            return False
+        return True
+
+    def parse(self, sent: Any) -> bool:
+        """Parse an IncrementalParser sentence, keeping track of
+        the time it takes. Returns True if the parse succeeded."""
+        t0 = time.time()
+        result = sent.parse()
+        elapsed = time.time() - t0
+        if self.max_time > 0.0 and elapsed > self.max_time:
+            self.num_overtime += 1
+            logging.warning(
+                "Parse of {0}-token sentence took {1:.1f} seconds: {2}".format(
+                    len(sent), elapsed, sent.text
+                )
+            )
+        return result
+
+    def stats(self) -> StatsDict:
+        """Return the budget statistics of a parse"""
+        return dict(num_skipped=self.num_skipped, num_overtime=self.num_overtime)
+
 _TEST_NT_MAP: Mapping[str, str] = {  # Til að prófa í parse_text_to_bracket_form()
     "S0": "M",  # P veldur ruglingi við FS, breyti í M
     "HreinYfirsetning": "S",
@@ -357,10 +420,15 @@ class TreeUtility:
         # Paragraph list, containing sentences, containing tokens
         pgs: PgsList = []
         ip = IncrementalParser(parser, toklist, verbose=True)
+        budget = ParseBudget()
         for p in ip.paragraphs():
             pgs.append([])
             for sent in p.sentences():
-                if sent.parse():
+                if not budget.admits(sent.tokens):
+                    # Over the parse budget: not parsed, but with
+                    # no particular token to mark as the error
+                    pgs[-1].append(xform(sent.tokens, None, len(sent)))
+                elif budget.parse(sent):
                     # Parsed successfully
                     pgs[-1].append(xform(sent.tokens, sent.tree, None))
                 else:
@@ -374,6 +442,7 @@ class TreeUtility:
             ambiguity=ip.ambiguity,
             num_combinations=ip.num_combinations,
             total_score=ip.total_score,
+            **budget.stats(),
         )
 
         return pgs, stats
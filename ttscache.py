@@ -0,0 +1,342 @@
+#!/usr/bin/env python
+"""
+
+    Greynir: Natural language processing for Icelandic
+
+    Speech synthesis audio cache
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module implements a content-addressed cache of synthesized
+    speech audio files in the TTS audio directory, which is served
+    as static files.
+
+    Each audio file is named by a hash of the (whitespace-normalized)
+    text and the synthesis options, so that the same text, spoken by the
+    same voice at the same speed, is only synthesized once, by any worker
+    process. The hash is an HMAC keyed by a server secret, read from
+    resources/TTSCacheKey.txt, since the files are served publicly and
+    may outlive the answers they contain: without the secret, nobody can
+    derive the URL of the audio of a guessed answer, e.g. a personal
+    reply, to check whether it has been spoken. Without the secret file,
+    the cache is disabled. The modification time of a file is updated when it is reused,
+    and the least recently used files are evicted when the total size of
+    the directory exceeds the configured limit.
+
+    When run as a program, the module evicts files from the cache and
+    optionally pre-synthesizes the most frequent voice answers in the
+    query log, e.g. from a cron job:
+
+        python ttscache.py [--presynthesize N] [--days D] [--voice V]
+
+"""
+
+from typing import Dict, Iterable, List, Optional, Tuple
+
+import hashlib
+import hmac
+import json
+import logging
+import os
+import re
+import shutil
+import threading
+import time
+from pathlib import Path
+
+from icespeak import GreynirSSMLParser, tts_to_file, TTSOptions
+from icespeak.settings import SETTINGS as TTS_SETTINGS
+from icespeak.settings import TextFormats
+
+from settings import Settings
+from metrics import timer
+from utility import TTS_AUDIO_DIR, read_txt_api_key
+
+
+# Suffixes of audio files that the speech synthesis services produce
+_AUDIO_SUFFIXES = (".mp3", ".ogg", ".wav", ".pcm")
+
+_WHITESPACE = re.compile(r"\s+")
+
+
+class TTSAudioCache:
+
+    """A size-bounded, content-addressed cache of synthesized audio files"""
+
+    # Minimum interval, in seconds, between evictions in a worker process
+    EVICT_INTERVAL = 60.0
+    # Files used within this many seconds are never evicted,
+    # since clients may not have fetched them yet
+    MIN_AGE = 600.0
+    # Eviction brings the total size down to this fraction of the limit
+    LOW_WATER = 0.9
+
+    def __init__(
+        self, directory: Path, max_bytes: int, secret: Optional[str] = None
+    ) -> None:
+        self._dir = directory
+        self._max_bytes = max_bytes
+        if secret is None and max_bytes > 0:
+            secret = read_txt_api_key("TTSCacheKey")
+        self._secret = (secret or "").encode("utf-8")
+        self._lock = threading.Lock()
+        self._last_evict = 0.0
+        self.hits = 0
+        self.misses = 0
+        self.evicted = 0
+
+    def configure(self, max_bytes: int, directory: Optional[Path] = None) -> None:
+        """Set the maximum total size of the cache (0 disables it),
+        and optionally its directory"""
+        self._max_bytes = max_bytes
+        if directory is not None:
+            self._dir = directory
+        if max_bytes > 0 and not self._secret:
+            self._secret = read_txt_api_key("TTSCacheKey").encode("utf-8")
+
+    @property
+    def enabled(self) -> bool:
+        return self._max_bytes > 0 and bool(self._secret)
+
+    def key(self, text: str, options: TTSOptions, transcribe: bool) -> str:
+        """Return the cache key of a text to be synthesized with the given
+        options: an HMAC of the text and options with the server secret"""
+        text = _WHITESPACE.sub(" ", text).strip()
+        fields = [
+            text,
+            str(getattr(options, "voice", "")),
+            # Round the speed, so that e.g. 1.0 and 1 give the same key
+            round(float(getattr(options, "speed", 1.0)), 3),
+            str(getattr(options, "text_format", "")),
+            str(getattr(options, "audio_format", "")),
+            transcribe,
+        ]
+        return hmac.new(
+            self._secret,
+            json.dumps(fields, ensure_ascii=False).encode("utf-8"),
+            hashlib.sha256,
+        ).hexdigest()
+
+    def lookup(self, key: str) -> Optional[Path]:
+        """Return the cached audio file having the given key, if any,
+        marking it as recently used"""
+        for suffix in _AUDIO_SUFFIXES:
+            path = self._dir / (key + suffix)
+            try:
+                os.utime(path)
+            except OSError:
+                continue
+            return path
+        return None
+
+    def synthesize(
+        self,
+        text: str,
+        *,
+        voice: str,
+        speed: float,
+        text_format: Optional[TextFormats] = None,
+        transcribe: bool = False,
+    ) -> Path:
+        """Return an audio file of the given text, synthesizing it
+        only if it is not found in the cache"""
+        if text_format is None:
+            options = TTSOptions(voice=voice, speed=speed)
+        else:
+            options = TTSOptions(voice=voice, speed=speed, text_format=text_format)
+        key = self.key(text, options, transcribe) if self.enabled else ""
+        if key:
+            path = self.lookup(key)
+            if path is not None:
+                with self._lock:
+                    self.hits += 1
+                return path
+        TTS_SETTINGS.AUDIO_DIR = self._dir
+        with timer("tts", voice):
+            output = tts_to_file(text, tts_options=options, transcribe=transcribe)
+        if not key:
+            return output.file
+        with self._lock:
+            self.misses += 1
+        path = self._dir / (key + output.file.suffix)
+        try:
+            # Atomic within the directory, replacing any file stored
+            # concurrently by another process for the same key
+            os.replace(output.file, path)
+        except OSError:
+            try:
+                shutil.move(str(output.file), str(path))
+            except OSError as e:
+                logging.warning(f"Unable to store synthesized audio in cache: {e}")
+                return output.file
+        self._maybe_evict()
+        return path
+
+    def _maybe_evict(self) -> None:
+        """Start an eviction pass in a background thread, unless
+        one has been started within the last EVICT_INTERVAL seconds"""
+        now = time.monotonic()
+        with self._lock:
+            if now - self._last_evict < self.EVICT_INTERVAL:
+                return
+            self._last_evict = now
+        threading.Thread(target=self.evict, name="tts_cache_evict", daemon=True).start()
+
+    def _files(self) -> List[Tuple[float, int, Path]]:
+        """Return (mtime, size, path) tuples of the audio files in the cache"""
+        result: List[Tuple[float, int, Path]] = []
+        try:
+            entries = list(os.scandir(self._dir))
+        except OSError:
+            return result
+        for entry in entries:
+            try:
+                if entry.is_file():
+                    st = entry.stat()
+                    result.append((st.st_mtime, st.st_size, Path(entry.path)))
+            except OSError:
+                # Deleted concurrently
+                pass
+        return result
+
+    def evict(self) -> int:
+        """Delete the least recently used files until the total size of
+        the cache is below the low water mark, returning the number of
+        files deleted. If the cache is disabled, all files not used
+        within MIN_AGE seconds are deleted."""
+        files = self._files()
+        total = sum(size for _, size, _ in files)
+        target = int(self._max_bytes * self.LOW_WATER)
+        if total <= self._max_bytes and self.enabled:
+            return 0
+        files.sort()
+        cutoff = time.time() - self.MIN_AGE
+        cnt = 0
+        for mtime, size, path in files:
+            if total <= target or mtime >= cutoff:
+                break
+            try:
+                path.unlink()
+            except OSError:
+                continue
+            total -= size
+            cnt += 1
+        with self._lock:
+            self.evicted += cnt
+        if cnt:
+            logging.info(f"Evicted {cnt} audio files from the speech synthesis cache")
+        return cnt
+
+    def stats(self) -> Dict[str, int]:
+        """Return the counters of the cache"""
+        with self._lock:
+            return dict(hits=self.hits, misses=self.misses, evicted=self.evicted)
+
+
+# The singleton audio cache of this process
+tts_cache = TTSAudioCache(TTS_AUDIO_DIR, Settings.TTS_CACHE_SIZE * 1024 * 1024)
+
+
+def frequent_voice_answers(days: int, limit: int) -> Iterable[str]:
+    """Return the most frequent voice answers in the query log
+    within the given number of days, most frequent first"""
+    from datetime import datetime, timedelta, timezone
+    from sqlalchemy import func
+    from db import SessionContext
+    from db.models import Query
+
+    since = datetime.now(timezone.utc) - timedelta(days=days)
+    with SessionContext(read_only=True) as session:
+        q = (
+            session.query(Query.voice, func.count(Query.id).label("cnt"))
+            .filter(Query.voice != None)
+            .filter(Query.error == None)
+            .filter(Query.timestamp >= since)
+            .group_by(Query.voice)
+            .order_by(func.count(Query.id).desc())
+            .limit(limit)
+        )
+        return [r[0] for r in q if r[0]]
+
+
+def presynthesize(num: int, days: int, voices: List[str]) -> int:
+    """Synthesize the most frequent voice answers, in the same way as
+    the query API does, so that their audio is found in the cache.
+    Returns the number of answers that had to be synthesized."""
+    cnt = 0
+    for v in frequent_voice_answers(days, num):
+        for voice in voices:
+            text = GreynirSSMLParser(voice).transcribe(v)
+            speed = TTS_SETTINGS.DEFAULT_VOICE_SPEED
+            options = TTSOptions(voice=voice, speed=speed)
+            if tts_cache.lookup(tts_cache.key(text, options, False)) is not None:
+                continue
+            try:
+                tts_cache.synthesize(text, voice=voice, speed=speed)
+                cnt += 1
+            except Exception as e:
+                logging.warning(f"Unable to synthesize '{v}': {e}")
+    return cnt
+
+
+def main() -> None:
+    import argparse
+    from settings import ConfigError
+
+    parser = argparse.ArgumentParser(
+        description="Evict and pre-synthesize audio in the speech synthesis cache"
+    )
+    parser.add_argument(
+        "--presynthesize",
+        type=int,
+        default=0,
+        metavar="N",
+        help="pre-synthesize the N most frequent voice answers",
+    )
+    parser.add_argument(
+        "--days", type=int, default=7, help="period of the query log to consider"
+    )
+    parser.add_argument(
+        "--voice",
+        action="append",
+        help="voice to pre-synthesize (may be repeated; default voice if omitted)",
+    )
+    parser.add_argument(
+        "--dir",
+        type=Path,
+        default=None,
+        help=f"directory of the audio cache (default {TTS_AUDIO_DIR})",
+    )
+    args = parser.parse_args()
+
+    try:
+        # Read configuration file
+        Settings.read(os.path.join("config", "Greynir.conf"))
+    except ConfigError as e:
+        print("Configuration error: {0}".format(e))
+        quit()
+    tts_cache.configure(Settings.TTS_CACHE_SIZE * 1024 * 1024, args.dir)
+
+    if args.presynthesize > 0 and tts_cache.enabled:
+        voices = args.voice or [TTS_SETTINGS.DEFAULT_VOICE]
+        n = presynthesize(args.presynthesize, args.days, voices)
+        print(f"Synthesized {n} voice answers")
+    n = tts_cache.evict()
+    print(f"Evicted {n} audio files")
+
+
+if __name__ == "__main__":
+    main()
@@ -60,13 +60,18 @@ import sys
 import getopt
 import json
 import time
+from collections import defaultdict
 from datetime import datetime, timezone
+from multiprocessing import Pool
+
+from sqlalchemy import bindparam
 
 from settings import Settings, Topics, NoIndexWords
 from db import SessionContext
-from db.models import Article, Topic, ArticleTopic, Word
+from db.models import Article, Root, Topic, ArticleTopic, Word
 from db.sql import TermTopicsQuery
 from similar import SimilarityClient
+from topicmatrix import TopicMatrix
 
 import numpy as np
 from gensim import corpora, models, matutils
@@ -146,6 +151,9 @@ class ReynirCorpus:
     # Default number of dimensions in topic vectors
     _DEFAULT_DIMENSIONS = 200
 
+    # Number of articles in each chunk when assigning topics in batch mode
+    _BATCH_SIZE = 500
+
     # Work file names
     _DICTIONARY_FILE = "./models/reynir.dict"
     _PLAIN_CORPUS_FILE = "./models/corpus.mm"
@@ -161,6 +169,7 @@ class ReynirCorpus:
         self._model = None
         self._model_name = None
         self._topics = None
+        self._topic_arrays = None
         self._dimensions = dimensions or ReynirCorpus._DEFAULT_DIMENSIONS
 
     @property
@@ -468,8 +477,8 @@ class ReynirCorpus:
 
         return topic_vector, term_weights
 
-    def assign_article_topics(self, article_id, heading, process_all=False):
-        """Assign the appropriate topics to the given article in the database"""
+    def _load_models(self):
+        """Ensure that the dictionary, the models and the topics are loaded"""
         if self._dictionary is None:
             self.load_dictionary()
         if self._tfidf is None:
@@ -478,6 +487,35 @@ class ReynirCorpus:
             self.load_lsi_model()
         if self._topics is None:
             self.load_topics()
+
+    def _load_topic_arrays(self):
+        """Return a tuple of (topic ids, matrix of unit length topic vectors,
+        array of thresholds), for scoring articles against all topics at once.
+        Topics with zero vectors are left out, since no article is similar
+        to them."""
+        if self._topic_arrays is None:
+            topic_ids = list(self._topics.keys())
+            matrix = np.zeros((len(topic_ids), self._dimensions))
+            thresholds = np.zeros(len(topic_ids))
+            for row, topic_id in enumerate(topic_ids):
+                topic_info = self._topics[topic_id]
+                matrix[row] = matutils.sparse2full(
+                    topic_info["vector"], self._dimensions
+                )
+                thresholds[row] = topic_info["threshold"]
+            norms = np.linalg.norm(matrix, axis=1)
+            keep = norms > 0.0
+            topic_ids = [topic_id for topic_id, k in zip(topic_ids, keep) if k]
+            self._topic_arrays = (
+                topic_ids,
+                matrix[keep] / norms[keep][:, np.newaxis],
+                thresholds[keep],
+            )
+        return self._topic_arrays
+
+    def assign_article_topics(self, article_id, heading, process_all=False):
+        """Assign the appropriate topics to the given article in the database"""
+        self._load_models()
         with SessionContext(commit=True) as session:
             q = (
                 session.query(Word.stem, Word.cat, Word.cnt)
@@ -539,7 +577,94 @@ class ReynirCorpus:
                 else:
                     a.topic_vector = None
 
-    def assign_topics(self, limit=None, process_all=False, uuid=None):
+    def assign_articles_batch(self, articles, process_all=False):
+        """Assign the appropriate topics to a chunk of articles, given as a list
+        of (article_id, heading) tuples, within a single transaction"""
+        self._load_models()
+        article_ids = [article_id for article_id, _ in articles]
+        with SessionContext(commit=True) as session:
+            # Fetch the bags of words of all articles in the chunk in one query
+            bags = defaultdict(list)
+            q = session.query(Word.article_id, Word.stem, Word.cat, Word.cnt).filter(
+                Word.article_id.in_(article_ids)
+            )
+            for article_id, stem, cat, cnt in q:
+                w = w_from_stem(stem, cat)
+                if cnt == 1:
+                    bags[article_id].append(w)
+                else:
+                    bags[article_id].extend([w] * cnt)
+            # Push the chunk through the TFIDF and LSI models as a corpus
+            article_vectors = [[] for _ in article_ids]
+            rows = [ix for ix, aid in enumerate(article_ids) if bags[aid]]
+            if self._topics and rows:
+                corpus = [
+                    self._dictionary.doc2bow(bags[article_ids[ix]]) for ix in rows
+                ]
+                for ix, vec in zip(rows, self._model[self._tfidf[corpus]]):
+                    article_vectors[ix] = vec
+            topic_rows = []
+            if self._topics:
+                # Score all articles against all topics with one matrix product
+                topic_ids, topic_matrix, thresholds = self._load_topic_arrays()
+                dense = np.array(
+                    [matutils.sparse2full(v, self._dimensions) for v in article_vectors]
+                ).reshape(len(article_ids), self._dimensions)
+                norms = np.linalg.norm(dense, axis=1)
+                zero = norms == 0.0
+                norms[zero] = 1.0
+                similarities = (dense / norms[:, np.newaxis]) @ topic_matrix.T
+                # Articles with zero vectors are not similar to any topic
+                similarities[zero] = -np.inf
+                for ix, tix in zip(*np.nonzero(similarities >= thresholds)):
+                    topic_rows.append(
+                        dict(article_id=article_ids[ix], topic_id=topic_ids[tix])
+                    )
+                    if self._verbose:
+                        print(
+                            "{0} : {1}\n   Similarity to topic {2} is {3:.3f}".format(
+                                article_ids[ix],
+                                articles[ix][1],
+                                self._topics[topic_ids[tix]]["name"],
+                                similarities[ix, tix],
+                            )
+                        )
+            # Delete previous topics of the articles in the chunk...
+            session.execute(
+                ArticleTopic.table()
+                .delete()
+                .where(ArticleTopic.article_id.in_(article_ids))
+            )
+            # ...and add the new ones in bulk
+            if topic_rows:
+                session.execute(ArticleTopic.table().insert(), topic_rows)
+            # Update the indexed timestamp and the article topic vectors in bulk
+            now = _now()
+            atab = Article.table()
+            session.execute(
+                atab.update()
+                .where(atab.c.id == bindparam("a_id"))
+                .values(indexed=bindparam("a_indexed"), topic_vector=bindparam("a_tv")),
+                [
+                    dict(
+                        a_id=article_id,
+                        a_indexed=now,
+                        # Store a pure list of floats
+                        a_tv=json.dumps([t[1] for t in vec]) if vec else None,
+                    )
+                    for article_id, vec in zip(article_ids, article_vectors)
+                ],
+            )
+        if not process_all:
+            print(
+                "Tagged {0} articles with {1} topic assignments".format(
+                    len(article_ids), len(topic_rows)
+                )
+            )
+
+    def assign_topics(
+        self, limit=None, process_all=False, uuid=None, batch=False, num_workers=None
+    ):
         """Assign topics to all articles that have no such assignment yet"""
         with SessionContext(commit=True) as session:
             # Fetch articles that haven't been indexed (or have been parsed since),
@@ -558,8 +683,80 @@ class ReynirCorpus:
                 q = q.yield_per(2000)
             else:
                 q = q[0:limit]
-        for article_id, heading in q:
-            self.assign_article_topics(article_id, heading, process_all=process_all)
+        if batch and not uuid:
+            self._assign_topics_batch(q, process_all, num_workers)
+        else:
+            for article_id, heading in q:
+                self.assign_article_topics(article_id, heading, process_all=process_all)
+        if process_all and uuid is None and limit is None:
+            # All topic vectors have been recalculated:
+            # write a fresh snapshot for the similarity server
+            self.write_topic_snapshot()
+
+    def _assign_topics_batch(self, q, process_all, num_workers):
+        """Assign topics to the given articles in chunks,
+        spread across a pool of worker processes"""
+        articles = [(article_id, heading) for article_id, heading in q]
+        chunks = [
+            (articles[i : i + self._BATCH_SIZE], process_all)
+            for i in range(0, len(articles), self._BATCH_SIZE)
+        ]
+        print(
+            "Tagging {0} articles in {1} chunks".format(len(articles), len(chunks))
+        )
+        # Close the database connections of this process before forking;
+        # the workers open their own
+        SessionContext.cleanup()
+        with Pool(
+            num_workers,
+            initializer=_init_batch_worker,
+            initargs=(self._verbose, self._dimensions),
+        ) as pool:
+            for _ in pool.imap_unordered(_assign_batch_chunk, chunks):
+                pass
+            pool.close()
+            pool.join()
+
+    def write_topic_snapshot(self):
+        """Write a binary snapshot of all article topic vectors, which is
+        memory-mapped by the similarity server upon startup"""
+        tm = TopicMatrix(self._dimensions)
+        with SessionContext(commit=True, read_only=True) as session:
+            # Articles indexed after this time point are not
+            # guaranteed to be included in the snapshot
+            ts = _now()
+            q = (
+                session.query(Article)
+                .join(Root)
+                .filter(Root.visible)
+                .with_entities(Article.id, Article.topic_vector)
+            )
+            for a in q.yield_per(2000):
+                if a.topic_vector:
+                    vec = json.loads(a.topic_vector)
+                    if isinstance(vec, list):
+                        tm.add(a.id, vec)
+        tm.save(ts)
+        print("Topic vector snapshot of {0} articles written".format(len(tm)))
+
+
+# ReynirCorpus instance of a batch tagging worker process
+_batch_corpus = None
+
+
+def _init_batch_worker(verbose, dimensions):
+    """Initialize a worker process for batch topic assignment"""
+    global _batch_corpus
+    # Make sure that the worker creates its own database engine
+    SessionContext.cleanup()
+    _batch_corpus = ReynirCorpus(verbose=verbose, dimensions=dimensions)
+
+
+def _assign_batch_chunk(args):
+    """Assign topics to a chunk of articles within a worker process"""
+    articles, process_all = args
+    _batch_corpus.assign_articles_batch(articles, process_all=process_all)
+    sys.stdout.flush()
 
 
 def build_model(verbose=False):
@@ -602,7 +799,9 @@ def calculate_topics(verbose=False):
     print("------ Greynir recalculation complete -------")
 
 
-def tag_articles(limit, verbose=False, process_all=False, uuid=None):
+def tag_articles(
+    limit, verbose=False, process_all=False, uuid=None, batch=False, num_workers=None
+):
     """Tag all untagged articles or articles that
     have been parsed since they were tagged"""
 
@@ -620,7 +819,7 @@ def tag_articles(limit, verbose=False, process_all=False, uuid=None):
 
     rc = ReynirCorpus(verbose=verbose)
     rc.load_lsi_model()
-    rc.assign_topics(limit, process_all, uuid)
+    rc.assign_topics(limit, process_all, uuid, batch=batch, num_workers=num_workers)
 
     t1 = time.time()
 
@@ -630,6 +829,17 @@ def tag_articles(limit, verbose=False, process_all=False, uuid=None):
     print("Time: {0}\n".format(ts))
 
 
+def write_snapshot(verbose=False):
+    """Write a snapshot of article topic vectors for the similarity server"""
+
+    print("------ Greynir writing topic vector snapshot -------")
+    t0 = time.time()
+    rc = ReynirCorpus(verbose=verbose)
+    rc.write_topic_snapshot()
+    t1 = time.time()
+    print("------ Snapshot completed in {0:.2f} seconds -------".format(t1 - t0))
+
+
 def notify_similarity_server():
     """Notify the similarity server - if running - that article tags have been updated"""
     try:
@@ -659,11 +869,16 @@ __doc__ = """
         -l N, --limit=N  : Limit processing to N articles
         -a, --all        : Process all articles
         -v, --verbose    : Show diagnostics while processing
+        -b, --batch      : Tag articles in chunks, using worker processes
+        -w N, --workers=N: Use N worker processes in batch mode
+                           (default: number of CPUs)
 
     Commands:
         tag [uuid] : tag any untagged articles (or the article with the given uuid)
         topics     : recalculate topic vectors from keywords
         model      : rebuild dictionary and model from parsed articles
+        snapshot   : write a snapshot of article topic vectors for simserver
+                     (this is also done automatically after tag --all)
 
 """
 
@@ -675,7 +890,9 @@ def _main(argv=None):
     try:
         try:
             opts, args = getopt.getopt(
-                argv[1:], "hl:van", ["help", "limit=", "verbose", "all", "notify"]
+                argv[1:],
+                "hl:vanbw:",
+                ["help", "limit=", "verbose", "all", "notify", "batch", "workers="],
             )
         except getopt.error as msg:
             raise Usage(msg)
@@ -685,6 +902,8 @@ def _main(argv=None):
         verbose = False
         process_all = False
         notify = False
+        batch = False
+        num_workers = None
 
         # Process options
         for o, a in opts:
@@ -704,6 +923,14 @@ def _main(argv=None):
                 process_all = True
             elif o in ("-n", "--notify"):
                 notify = True
+            elif o in ("-b", "--batch"):
+                batch = True
+            elif o in ("-w", "--workers"):
+                # Number of worker processes in batch mode
+                try:
+                    num_workers = int(a) or None
+                except ValueError:
+                    raise Usage("Number of workers must be an integer")
 
         # if process_all and limit_specified:
         #    raise Usage("--all and --limit cannot be used together")
@@ -729,7 +956,12 @@ def _main(argv=None):
             if process_all and not limit_specified:
                 limit = None
             tag_articles(
-                limit=limit, verbose=verbose, process_all=process_all, uuid=uuid
+                limit=limit,
+                verbose=verbose,
+                process_all=process_all,
+                uuid=uuid,
+                batch=batch,
+                num_workers=num_workers,
             )
             if notify:
                 # Inform the similarity server that we have new article tags
@@ -744,6 +976,11 @@ def _main(argv=None):
             if la > 1:
                 raise Usage("Too many arguments")
             build_model(verbose=verbose)
+        elif arg == "snapshot":
+            # Write a topic vector snapshot
+            if la > 1:
+                raise Usage("Too many arguments")
+            write_snapshot(verbose=verbose)
         else:
             raise Usage("Unknown command: '{0}'".format(arg))
 
@@ -266,6 +266,14 @@ class Settings:
             f"Invalid environment variable value: SIMSERVER_PORT = {SIMSERVER_PORT}"
         )
 
+    # Similarity server index type: 'exact' (brute force) or 'ivf'
+    # (approximate nearest neighbours via an inverted file index)
+    SIMSERVER_INDEX = "exact"
+    # Number of IVF clusters (inverted lists); 0 means sqrt(number of articles)
+    SIMSERVER_IVF_LISTS = 0
+    # Number of IVF clusters searched per query
+    SIMSERVER_IVF_PROBES = 8
+
     # Configuration settings from the Greynir.conf file
 
     @staticmethod
@@ -293,6 +301,16 @@ class Settings:
                 Settings.SIMSERVER_HOST = val
             elif par == "simserver_port":
                 Settings.SIMSERVER_PORT = int(val)
+            elif par == "simserver_index":
+                if val not in ("exact", "ivf"):
+                    raise ConfigError(
+                        f"simserver_index must be 'exact' or 'ivf', not '{val}'"
+                    )
+                Settings.SIMSERVER_INDEX = val
+            elif par == "simserver_ivf_lists":
+                Settings.SIMSERVER_IVF_LISTS = int(val)
+            elif par == "simserver_ivf_probes":
+                Settings.SIMSERVER_IVF_PROBES = int(val)
             elif par == "debug":
                 Settings.DEBUG = bool(val)
             else:
@@ -63,12 +63,10 @@
 
 """
 
+import os
 import json
 import time
-import math
-import heapq
 import sys
-import operator
 
 import numpy as np
 
@@ -81,6 +79,7 @@ from settings import Settings, ConfigError
 from db import SessionContext, desc
 from db.models import Article, Root
 from builder import ReynirCorpus
+from topicmatrix import TopicMatrix
 
 
 class InternalError(RuntimeError):
@@ -90,27 +89,236 @@ class InternalError(RuntimeError):
         super().__init__(s)
 
 
+class IVFIndex:
+
+    """An approximate nearest neighbour index on top of a TopicMatrix,
+    using an inverted file (IVF) layout: the (unit length) topic vectors
+    are clustered by spherical k-means, and each query is only compared
+    with the rows in the few clusters whose centroids are closest to it.
+    The centroids are saved next to the LSI model so that they need
+    not be retrained upon each server start."""
+
+    _IVF_INDEX_FILE = "./models/ivf-{0}.npy"
+
+    # Minimum number of topic vectors before an index is worth training
+    _MIN_ROWS = 2000
+    # Maximum number of training rows per cluster
+    _TRAINING_ROWS_PER_LIST = 256
+    # Number of k-means iterations
+    _ITERATIONS = 15
+    # Number of rows assigned to clusters in each matrix product
+    _CHUNK_SIZE = 65536
+
+    def __init__(self, atopics, lists=0, probes=8):
+        self._atopics = atopics
+        self._lists = lists
+        self._probes = max(1, probes)
+        self._centroids = None
+        # Cluster number of each row in the topic matrix
+        self._assignment = np.zeros(0, dtype=np.int32)
+        # Inverted lists: row indices for each cluster, and
+        # cached numpy arrays of the same, invalidated upon change
+        self._inverted = []
+        self._arrays = []
+
+    @property
+    def trained(self):
+        return self._centroids is not None
+
+    def _file_name(self):
+        return self._IVF_INDEX_FILE.format(self._atopics.dimensions)
+
+    def _train_centroids(self, matrix, lists):
+        """Run spherical k-means on a sample of the matrix rows"""
+        rng = np.random.default_rng(42)
+        count = matrix.shape[0]
+        sample_size = min(count, lists * self._TRAINING_ROWS_PER_LIST)
+        sample = matrix[rng.choice(count, size=sample_size, replace=False)]
+        centroids = sample[rng.choice(sample_size, size=lists, replace=False)]
+        for _ in range(self._ITERATIONS):
+            assignment = np.argmax(sample @ centroids.T, axis=1)
+            sums = np.zeros_like(centroids)
+            np.add.at(sums, assignment, sample)
+            norms = np.linalg.norm(sums, axis=1)
+            empty = norms < 1.0e-6
+            if empty.any():
+                # Re-seed empty clusters with random sample rows
+                sums[empty] = sample[rng.choice(sample_size, size=int(empty.sum()))]
+                norms[empty] = 1.0
+            centroids = (sums / norms[:, np.newaxis]).astype(np.float32)
+        return centroids
+
+    def build(self):
+        """Load or train the cluster centroids and assign all
+        rows of the topic matrix to clusters"""
+        matrix, _ = self._atopics.snapshot()
+        count = matrix.shape[0]
+        centroids = None
+        fname = self._file_name()
+        if os.path.exists(fname):
+            centroids = np.load(fname)
+            if centroids.ndim != 2 or centroids.shape[1] != self._atopics.dimensions:
+                print("Ignoring IVF index file {0} of wrong shape".format(fname))
+                centroids = None
+            elif self._lists and centroids.shape[0] != self._lists:
+                # The configured number of clusters has changed: retrain
+                centroids = None
+        if centroids is None:
+            if count < self._MIN_ROWS:
+                print(
+                    "IVF index not trained: only {0} topic vectors".format(count)
+                )
+                return
+            lists = self._lists or int(np.sqrt(count))
+            lists = max(1, min(lists, count // 16))
+            print("Training IVF index with {0} clusters".format(lists))
+            t0 = time.time()
+            centroids = self._train_centroids(matrix, lists)
+            np.save(fname, centroids)
+            print(
+                "IVF index trained and saved in {0:.2f} seconds".format(
+                    time.time() - t0
+                )
+            )
+        self._centroids = centroids
+        lists = centroids.shape[0]
+        self._assignment = np.zeros(count, dtype=np.int32)
+        for start in range(0, count, self._CHUNK_SIZE):
+            chunk = matrix[start : start + self._CHUNK_SIZE]
+            self._assignment[start : start + chunk.shape[0]] = np.argmax(
+                chunk @ centroids.T, axis=1
+            )
+        self._inverted = [[] for _ in range(lists)]
+        for row, cluster in enumerate(self._assignment.tolist()):
+            self._inverted[cluster].append(row)
+        self._arrays = [None] * lists
+
+    def update(self, row):
+        """Assign a new or modified topic matrix row to its cluster"""
+        if self._centroids is None:
+            return
+        vector = self._atopics.row(row)
+        cluster = int(np.argmax(self._centroids @ vector))
+        if row < len(self._assignment):
+            old = int(self._assignment[row])
+            if old == cluster:
+                return
+            # The article was re-tagged and changed clusters
+            self._inverted[old].remove(row)
+            self._arrays[old] = None
+        else:
+            assert row == len(self._assignment)
+            self._assignment = np.append(self._assignment, np.int32(cluster))
+        self._assignment[row] = cluster
+        self._inverted[cluster].append(row)
+        self._arrays[cluster] = None
+
+    def _rows(self, cluster):
+        """Return a numpy array of the rows belonging to a cluster"""
+        rows = self._arrays[cluster]
+        if rows is None:
+            rows = self._arrays[cluster] = np.array(
+                self._inverted[cluster], dtype=np.int64
+            )
+        return rows
+
+    def find_similar(self, n, base):
+        """Return the approximate top N articles most similar to the unit
+        vector base, or None if the index is unable to answer the query"""
+        if self._centroids is None:
+            return None
+        probes = min(self._probes, self._centroids.shape[0])
+        closest = np.argpartition(-(self._centroids @ base), probes - 1)[0:probes]
+        rows = np.concatenate([self._rows(c) for c in closest])
+        if len(rows) < n:
+            # Not enough candidates: let the caller fall back to exact search
+            return None
+        matrix, ids = self._atopics.snapshot()
+        return TopicMatrix.top_n(matrix[rows], ids[rows], n, base)
+
+    def recall(self, n=10, samples=200):
+        """Measure the recall@N of the index against an exact search,
+        using a random sample of the stored topic vectors as queries"""
+        matrix, ids = self._atopics.snapshot()
+        count = matrix.shape[0]
+        if self._centroids is None or count == 0:
+            return None
+        rng = np.random.default_rng()
+        total = 0.0
+        queries = rng.choice(count, size=min(samples, count), replace=False)
+        for row in queries:
+            base = matrix[row]
+            exact = {aid for aid, _ in TopicMatrix.top_n(matrix, ids, n, base)}
+            approx = self.find_similar(n, base)
+            if approx is None:
+                # Fallback to exact search has full recall
+                total += 1.0
+            else:
+                total += len(exact.intersection(aid for aid, _ in approx)) / len(exact)
+        return total / len(queries)
+
+
 class SimilarityServer:
 
-    """A class that manages an in-memory dictionary of articles
+    """A class that manages an in-memory matrix of articles
     and their topic vectors, and allows similarity queries of that
-    dictionary. The dictionary is refreshed upon request from the
+    matrix. The matrix is refreshed upon request from the
     articles database table.
     """
 
+    # Minimum interval, in seconds, between snapshots
+    # written after refreshes of the topic vectors
+    SNAPSHOT_INTERVAL = 86400.0
+
     def __init__(self):
         # Do an initial load of all article topic vectors
         self._lock = Lock()
         self._timestamp = None
-        self._atopics = {}
+        self._snapshot_time = None
+        self._atopics = None
+        self._index = None
         self._corpus = None
 
-    def _load_topics(self):
-        """Load all article topics into the self._atopics dictionary"""
-        self._atopics = {}
+    def _add_topic_vectors(self, atopics, q, index=None):
+        """Add the topic vectors from a query result to the given
+        TopicMatrix, and optionally to an index on top of it,
+        returning the number of vectors added"""
+        count = 0
+        for a in q:
+            if a.topic_vector:
+                # Load topic vector in to the topic matrix
+                vec = json.loads(a.topic_vector)
+                row = atopics.add(a.id, vec) if isinstance(vec, list) else None
+                if row is not None:
+                    if index is not None:
+                        index.update(row)
+                    count += 1
+                else:
+                    print("Warning: faulty topic vector for article {0}".format(a.id))
+        return count
+
+    def _load_topics(self, use_snapshot=False):
+        """Load all article topics into the self._atopics matrix, optionally
+        starting from a snapshot file and only loading newer topic vectors
+        from the database"""
+        atopics, since = None, None
+        self._snapshot_time = None
+        t0 = time.time()
+        if use_snapshot:
+            atopics, since = TopicMatrix.load(self._corpus.dimensions)
+            if atopics is not None:
+                print(
+                    "Mapped snapshot of {0} topic vectors from {1}".format(
+                        len(atopics), since
+                    )
+                )
+        if atopics is None:
+            atopics = TopicMatrix(self._corpus.dimensions)
         with SessionContext(commit=True, read_only=True) as session:
-            print("Starting load of all article topic vectors")
-            t0 = time.time()
+            if since is None:
+                print("Starting load of all article topic vectors")
+            else:
+                print("Starting load of article topic vectors since snapshot")
             # Do the next refresh from this time point
             self._timestamp = datetime.now(timezone.utc)
             q = (
@@ -119,25 +327,65 @@ class SimilarityServer:
                 .filter(Root.visible)
                 .with_entities(Article.id, Article.topic_vector)
             )
-
-            for a in q.yield_per(2000):
-                if a.topic_vector:
-                    # Load topic vector in to a numpy array
-                    vec = json.loads(a.topic_vector)
-                    if isinstance(vec, list) and len(vec) == self._corpus.dimensions:
-                        self._atopics[a.id] = np.array(vec)
-                    else:
-                        print(
-                            "Warning: faulty topic vector for article {0}".format(a.id)
-                        )
+            if since is not None:
+                q = q.filter(Article.indexed >= since)
+            count = self._add_topic_vectors(atopics, q.yield_per(2000))
+            if since is not None:
+                # Drop the vectors of articles that have been deleted, or
+                # whose roots have been made invisible, since the snapshot
+                eligible = set(
+                    aid
+                    for (aid,) in session.query(Article.id)
+                    .join(Root)
+                    .filter(Root.visible)
+                    .filter(Article.topic_vector != None)
+                    .yield_per(10000)
+                )
+                removed = atopics.retain(eligible)
+                if removed:
+                    print(
+                        "Removed {0} topic vectors of articles no longer "
+                        "eligible".format(removed)
+                    )
+                if not count and not removed:
+                    # The snapshot is up to date: no need to rewrite it
+                    self._snapshot_time = time.monotonic()
 
             t1 = time.time()
             print(
                 "Loading of {0} topic vectors completed in {1:.2f} seconds".format(
-                    len(self._atopics), t1 - t0
+                    count, t1 - t0
                 )
             )
 
+        if self._snapshot_time is None:
+            # Save a snapshot to speed up the next server start, including
+            # the vectors loaded since the previous snapshot, if any, so
+            # that the next start doesn't load an ever-growing delta
+            self._save_snapshot(atopics)
+
+        index = None
+        if Settings.SIMSERVER_INDEX == "ivf":
+            index = IVFIndex(
+                atopics,
+                lists=Settings.SIMSERVER_IVF_LISTS,
+                probes=Settings.SIMSERVER_IVF_PROBES,
+            )
+            index.build()
+            if index.trained:
+                recall = index.recall()
+                print("IVF index recall@10 is {0:.3f}".format(recall))
+        self._atopics = atopics
+        self._index = index
+
+    def _save_snapshot(self, atopics):
+        """Save a snapshot of the topic vectors loaded so far"""
+        try:
+            atopics.save(self._timestamp)
+        except OSError as e:
+            print("Unable to save topic vector snapshot: {0}".format(e))
+        self._snapshot_time = time.monotonic()
+
     def article_topic(self, article_id):
         """Return the topic vector of the article having the given uuid,
         or None if no such article exists"""
@@ -150,7 +398,7 @@ class SimilarityServer:
             self._load_topics()
 
     def refresh_topics(self):
-        """Load any new article topics into the _atopics dict"""
+        """Load any new article topics into the _atopics matrix"""
         with self._lock:
             with SessionContext(commit=True, read_only=True) as session:
                 # Do the next refresh from this time point
@@ -163,65 +411,45 @@ class SimilarityServer:
                     .with_entities(Article.id, Article.topic_vector)
                 )
                 self._timestamp = ts
-                count = 0
-                for a in q.yield_per(100):
-                    if a.topic_vector:
-                        # Load topic vector in to a numpy array
-                        vec = json.loads(a.topic_vector)
-                        if (
-                            isinstance(vec, list)
-                            and len(vec) == self._corpus.dimensions
-                        ):
-                            self._atopics[a.id] = np.array(vec)
-                            count += 1
-                        else:
-                            print(
-                                "Warning: faulty topic vector for article {0}".format(
-                                    a.id
-                                )
-                            )
-                print(
-                    "Completed refresh_topics, {0} article vectors added".format(count)
+                count = self._add_topic_vectors(
+                    self._atopics, q.yield_per(100), self._index
                 )
-
-    def _iter_similarities(self, vector):
-        """Generator of (id, similarity) tuples for all articles to the given vector"""
-        base = np.array(vector)
-        norm_base = np.dot(base, base)  # This is faster than linalg.norm()
-        if norm_base < 1.0e-6:
-            # No data to search by
-            return
-
-        def cosine_similarity(v):
-            """Compute cosine similarity of v1 to v2: (v1 dot v2)/(|v1|*|v2|)"""
-            norm_v = np.dot(v, v)  # This is faster than linalg.norm()
-            dot_product = np.dot(v, base)
-            return float(dot_product / math.sqrt(norm_v * norm_base))
-
-        for article_id, topic_vector in self._atopics.items():
-            try:
-                cs = cosine_similarity(topic_vector)
-                yield article_id, cs
-            except Exception as ex:
-                # If there is an error in the calculations, probably
-                # due to a faulty topic vector, simply don't include
-                # the article
                 print(
-                    "Error in cosine similarity for article {0}: {1}".format(
-                        article_id, ex
-                    )
+                    "Completed refresh_topics, {0} article vectors added".format(count)
                 )
-                pass
+                if time.monotonic() - self._snapshot_time >= self.SNAPSHOT_INTERVAL:
+                    self._save_snapshot(self._atopics)
 
     def find_similar(self, n, vector):
         """Return the N articles with the highest similarity score to the given vector,
         as a list of tuples (article_uuid, similarity)"""
-        if vector is None or len(vector) == 0 or all(e == 0.0 for e in vector):
+        if vector is None or len(vector) == 0:
+            return []
+        base = TopicMatrix.normalize(vector)
+        if base is None:
+            # No data to search by
+            return []
+        if base.shape[0] != self._atopics.dimensions:
             return []
         with self._lock:
-            return heapq.nlargest(
-                n, self._iter_similarities(vector), key=operator.itemgetter(1)
-            )
+            if self._index is not None:
+                # Approximate search in the IVF index, which is
+                # mutated by refreshes and thus needs the lock
+                result = self._index.find_similar(n, base)
+                if result is not None:
+                    return result
+            # Only hold the lock while obtaining a consistent view of the matrix
+            matrix, ids = self._atopics.snapshot()
+        # Exact search as a fallback
+        return TopicMatrix.top_n(matrix, ids, n, base)
+
+    def index_recall(self, n):
+        """Return the recall@N of the approximate index, if any,
+        against the exact search"""
+        with self._lock:
+            if self._index is None:
+                return None
+            return self._index.recall(n)
 
     def run(self, host, port):
         """Run a similarity server serving requests that come in at the given port"""
@@ -247,7 +475,7 @@ class SimilarityServer:
 
         with Listener(address, authkey=secret_password) as listener:
             self._corpus = ReynirCorpus()
-            self._load_topics()
+            self._load_topics(use_snapshot=True)
             while True:
                 try:
                     conn = listener.accept()
@@ -330,6 +558,15 @@ class SimilarityServer:
                         result["articles"] = self.find_similar(n, topic)
                         t1 = time.time()
                         conn.send(result)
+                    elif cmd == "recall":
+                        # Report the recall@N of the approximate index, if any
+                        try:
+                            n = int(request.get("n", 10))
+                        except:
+                            n = 10
+                        recall = self.index_recall(n)
+                        print("Index recall@{0} is {1}".format(n, recall))
+                        conn.send(dict(recall=recall))
                     elif cmd == "refresh":
                         # Load any new article topic vectors from the articles table
                         self.refresh_topics()
@@ -0,0 +1,244 @@
+# type: ignore
+"""
+    Greynir: Natural language processing for Icelandic
+
+    Topic matrix module
+
+    Copyright (C) 2023 Miðeind ehf.
+
+       This program is free software: you can redistribute it and/or modify
+       it under the terms of the GNU General Public License as published by
+       the Free Software Foundation, either version 3 of the License, or
+       (at your option) any later version.
+       This program is distributed in the hope that it will be useful,
+       but WITHOUT ANY WARRANTY; without even the implied warranty of
+       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+       GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see http://www.gnu.org/licenses/.
+
+
+    This module contains the TopicMatrix class, an in-memory matrix of
+    article topic vectors used by the similarity server (simserver.py).
+
+    A TopicMatrix can be saved as a binary snapshot, consisting of a
+    float32 .npy matrix file and a .json file containing the article ids
+    and the snapshot timestamp. The snapshot is written by
+    'python builder.py snapshot' (and after 'python builder.py tag --all'),
+    and memory-mapped copy-on-write by the similarity server upon startup,
+    which then only needs to load topic vectors that have been assigned
+    since the snapshot timestamp.
+
+"""
+
+import os
+import json
+
+import numpy as np
+
+from datetime import datetime
+
+
+class TopicMatrix:
+
+    """A contiguous float32 matrix of unit-length article topic vectors,
+    one row per article, with a parallel array of article ids. Rows are
+    appended in place into spare capacity, so refreshes do not require
+    the matrix to be rebuilt. Similarity queries are computed as a single
+    matrix-vector product followed by a partial (argpartition) top-N
+    selection."""
+
+    # Initial row capacity of the matrix
+    _INITIAL_CAPACITY = 1024
+    # Fraction of spare row capacity to reserve in saved snapshots,
+    # allowing refreshes to append rows without copying the matrix
+    _SNAPSHOT_SPARE = 0.05
+
+    # Snapshot file names
+    _SNAPSHOT_MATRIX_FILE = "./models/topics-{0}.npy"
+    _SNAPSHOT_INDEX_FILE = "./models/topics-{0}.json"
+
+    def __init__(self, dimensions):
+        self._dimensions = dimensions
+        self._count = 0
+        self._matrix = np.zeros(
+            (self._INITIAL_CAPACITY, dimensions), dtype=np.float32
+        )
+        self._ids = np.empty(self._INITIAL_CAPACITY, dtype=object)
+        # Dictionary of article id: row index
+        self._rows = {}
+
+    def __len__(self):
+        return self._count
+
+    @property
+    def dimensions(self):
+        return self._dimensions
+
+    @staticmethod
+    def normalize(vector):
+        """Return the given vector as a unit-length float32 numpy array,
+        or None if it has no length or contains invalid numbers"""
+        v = np.asarray(vector, dtype=np.float32)
+        norm = float(np.dot(v, v))  # This is faster than linalg.norm()
+        if not (norm >= 1.0e-6 and np.isfinite(norm)):
+            # Zero vector, NaN or infinity: no data to compare by
+            return None
+        return v / np.float32(np.sqrt(norm))
+
+    def _grow(self):
+        """Double the row capacity of the matrix"""
+        capacity = 2 * len(self._ids)
+        matrix = np.zeros((capacity, self._dimensions), dtype=np.float32)
+        matrix[0 : self._count] = self._matrix[0 : self._count]
+        ids = np.empty(capacity, dtype=object)
+        ids[0 : self._count] = self._ids[0 : self._count]
+        # Assign the new arrays as a whole so that concurrent readers
+        # that hold references to the old ones are not disturbed
+        self._matrix, self._ids = matrix, ids
+
+    def add(self, article_id, vector):
+        """Add or update the topic vector of an article. Returns the
+        index of the row, or None if the vector is invalid and was not stored."""
+        if len(vector) != self._dimensions:
+            return None
+        v = self.normalize(vector)
+        if v is None:
+            return None
+        row = self._rows.get(article_id)
+        if row is None:
+            if self._count >= len(self._ids):
+                self._grow()
+            row = self._count
+            self._ids[row] = article_id
+            self._matrix[row] = v
+            self._rows[article_id] = row
+            # Only make the new row visible once it has been filled
+            self._count += 1
+        else:
+            self._matrix[row] = v
+        return row
+
+    def retain(self, article_ids):
+        """Remove the rows of articles that are not in the given set,
+        returning the number of rows removed. Each removed row is replaced
+        by the last row, in place, so that only the moved rows are written
+        and the other pages of a memory-mapped matrix stay shared. The
+        matrix must not be in use by readers while this is done."""
+        removed = [
+            row for row in range(self._count) if self._ids[row] not in article_ids
+        ]
+        # In descending order, so that the rows after each removed
+        # row are all kept, and the last one can be moved into it
+        for row in reversed(removed):
+            last = self._count - 1
+            del self._rows[self._ids[row]]
+            if row != last:
+                moved = self._ids[last]
+                self._matrix[row] = self._matrix[last]
+                self._ids[row] = moved
+                self._rows[moved] = row
+            self._ids[last] = None
+            self._count = last
+        return len(removed)
+
+    def row(self, row):
+        """Return the (normalized) topic vector at the given row index"""
+        return self._matrix[row]
+
+    def get(self, article_id):
+        """Return the (normalized) topic vector of the given article,
+        or None if it is not found"""
+        row = self._rows.get(article_id)
+        if row is None:
+            return None
+        return self._matrix[row].copy()
+
+    def snapshot(self):
+        """Return a (matrix, ids) tuple of views onto the currently
+        stored rows, safe to use for queries without holding a lock"""
+        count = self._count
+        return self._matrix[0:count], self._ids[0:count]
+
+    def save(self, timestamp):
+        """Save a snapshot of the matrix, representing the topic vectors
+        of all articles indexed before the given timestamp"""
+        count = self._count
+        spare = max(self._INITIAL_CAPACITY, int(count * self._SNAPSHOT_SPARE))
+        capacity = count + spare
+        mname = self._SNAPSHOT_MATRIX_FILE.format(self._dimensions)
+        iname = self._SNAPSHOT_INDEX_FILE.format(self._dimensions)
+        # Write to temporary files and rename them into place, so that a
+        # similarity server that has the old snapshot mapped is unaffected
+        m = np.lib.format.open_memmap(
+            mname + ".tmp",
+            mode="w+",
+            dtype=np.float32,
+            shape=(capacity, self._dimensions),
+        )
+        m[0:count] = self._matrix[0:count]
+        m.flush()
+        del m
+        with open(iname + ".tmp", "w") as f:
+            json.dump(
+                dict(
+                    timestamp=timestamp.isoformat(),
+                    ids=[str(aid) for aid in self._ids[0:count]],
+                ),
+                f,
+            )
+        # Replace the index file last, since it determines
+        # how many matrix rows are valid
+        os.replace(mname + ".tmp", mname)
+        os.replace(iname + ".tmp", iname)
+
+    @classmethod
+    def load(cls, dimensions):
+        """Memory-map a previously saved snapshot, returning a
+        (TopicMatrix, timestamp) tuple, or (None, None) if no valid
+        snapshot is found. The mapping is copy-on-write, so pages that
+        are not modified by refreshes stay shared with the OS page cache."""
+        mname = cls._SNAPSHOT_MATRIX_FILE.format(dimensions)
+        iname = cls._SNAPSHOT_INDEX_FILE.format(dimensions)
+        try:
+            with open(iname, "r") as f:
+                index = json.load(f)
+            matrix = np.load(mname, mmap_mode="c")
+        except (OSError, ValueError):
+            return None, None
+        ids = index["ids"]
+        count = len(ids)
+        if (
+            matrix.dtype != np.float32
+            or matrix.ndim != 2
+            or matrix.shape[1] != dimensions
+            or matrix.shape[0] < count
+        ):
+            print("Ignoring topic snapshot {0} of wrong shape".format(mname))
+            return None, None
+        tm = cls(dimensions)
+        tm._matrix = matrix
+        tm._ids = np.empty(matrix.shape[0], dtype=object)
+        tm._ids[0:count] = ids
+        tm._rows = {aid: row for row, aid in enumerate(ids)}
+        tm._count = count
+        return tm, datetime.fromisoformat(index["timestamp"])
+
+    @staticmethod
+    def top_n(matrix, ids, n, base):
+        """Return the N rows of the matrix with the highest cosine similarity
+        to the unit vector base, as a list of (article_id, similarity) tuples,
+        sorted by descending similarity"""
+        count = len(ids)
+        if n <= 0 or count == 0:
+            return []
+        sims = matrix @ base
+        if n < count:
+            # Partial selection of the N largest similarities, in O(count) time
+            top = np.argpartition(-sims, n - 1)[0:n]
+        else:
+            top = np.arange(count)
+        # Sort the (few) selected rows by descending similarity
+        top = top[np.argsort(-sims[top], kind="stable")]
+        return [(ids[ix], float(sims[ix])) for ix in top]